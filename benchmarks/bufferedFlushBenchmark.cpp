@@ -0,0 +1,65 @@
+#include "gqf.h"
+#include "bufferedMQF.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <thread>
+
+/* Ingest throughput of bufferedMQF, dominated by the flushes of the memory
+ * buffer to the disk filter. With several threads the buffer has two shards
+ * per thread and the threads insert with lock=true.
+ * Usage: bufferedFlushBenchmark [disk qbits] [buffer qbits] [load factor] [path] [threads]
+ */
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+	uint64_t qbits = argc > 1 ? strtoull(argv[1], NULL, 10) : 20;
+	uint64_t bufferQbits = argc > 2 ? strtoull(argv[2], NULL, 10) : 16;
+	double loadFactor = argc > 3 ? atof(argv[3]) : 0.7;
+	const char *path = argc > 4 ? argv[4] : "bufferedFlushBenchmark.ser";
+	uint64_t nthreads = argc > 5 ? strtoull(argv[5], NULL, 10) : 1;
+	uint64_t nshards = 1;
+	while (nthreads > 1 && nshards < 2 * nthreads)
+		nshards *= 2;
+
+	bufferedMQF *qf = new bufferedMQF();
+	bufferedMQF_init(qf, 1ULL << bufferQbits, 1ULL << qbits, qbits + 8, 0, 3, path, nshards);
+
+	mt19937_64 rng(42);
+	uint64_t n = (uint64_t)(loadFactor * (1ULL << qbits) * 0.8);
+	vector<uint64_t> keys(n);
+	for (uint64_t i = 0; i < n; i++)
+		keys[i] = rng() % qf->disk->metadata->range;
+
+	vector<double> maxInsertUs(nthreads, 0);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector<thread> threads;
+	for (uint64_t t = 0; t < nthreads; t++)
+		threads.push_back(thread([&, t]() {
+			for (uint64_t i = t; i < n; i += nthreads) {
+				chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+				bufferedMQF_insert(qf, keys[i], 1 + (keys[i] & 3), nthreads > 1, true);
+				chrono::duration<double, micro> d = chrono::steady_clock::now() - begin;
+				maxInsertUs[t] = max(maxInsertUs[t], d.count());
+			}
+		}));
+	for (uint64_t t = 0; t < nthreads; t++)
+		threads[t].join();
+	bufferedMQF_syncBuffer(qf);
+	chrono::duration<double, nano> d = chrono::steady_clock::now() - start;
+
+	uint64_t checksum = 0;
+	for (uint64_t i = 0; i < n; i += 97)
+		checksum += bufferedMQF_count_key(qf, keys[i]);
+
+	printf("qbits=%lu bufferQbits=%lu threads=%lu items=%lu ingest=%.1f ns/op total=%.2f s maxInsert=%.0f us (%lu)\n",
+				 qbits, bufferQbits, nthreads, n, d.count() / n, d.count() / 1e9,
+				 *max_element(maxInsertUs.begin(), maxInsertUs.end()), checksum % 10);
+	delete qf;
+	return 0;
+}
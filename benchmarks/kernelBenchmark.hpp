@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <random>
+
+/* Microbenchmarks of the low level kernels of gqf.cpp. This file is
+ * compiled inside gqf.cpp with -DKERNEL_BENCHMARK so that it sees the static
+ * functions. Every kernel runs over precomputed random inputs and the
+ * results are folded in a checksum, so the loops are not optimized away.
+ * Usage: kernelBenchmark [iterations]
+ */
+
+using namespace std;
+
+static volatile uint64_t kernelSink;
+
+static void reportKernel(const char *kernel, uint64_t bits_per_slot,
+												 uint64_t nops, chrono::steady_clock::time_point start)
+{
+	chrono::duration<double, nano> d = chrono::steady_clock::now() - start;
+	printf("%-24s %4lu %10.2f\n", kernel, bits_per_slot, d.count() / nops);
+}
+
+static void initKernelFilter(QF *qf, uint64_t qbits, uint64_t bits_per_slot)
+{
+	uint64_t remainder_bits = std::min(bits_per_slot - 1, (uint64_t)56);
+	qf_init(qf, (1ULL << qbits), qbits + remainder_bits,
+					bits_per_slot - 1 - remainder_bits, 1, 0, true, "", 2038074761);
+}
+
+static void benchWordKernels(uint64_t n, mt19937_64 &rng)
+{
+	vector<uint64_t> words(1 << 16), positions(1 << 16);
+	for (size_t i = 0; i < words.size(); i++) {
+		words[i] = rng() | 1;
+		positions[i] = rng() % 64;
+	}
+	uint64_t mask = words.size() - 1, sum = 0;
+
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += bitrank(words[i & mask], positions[i & mask]);
+	reportKernel("bitrank", 0, n, start);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += bitselect(words[i & mask], positions[i & mask] % popcnt(words[i & mask]));
+	reportKernel("bitselect", 0, n, start);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += _select64(words[i & mask], positions[i & mask] % popcnt(words[i & mask]));
+	reportKernel("_select64", 0, n, start);
+	kernelSink += sum;
+}
+
+/* run_end, offset_lower_bound and find_first_empty_slot on a filter filled
+ * to 90% of its slots. */
+static void benchRunKernels(uint64_t n, mt19937_64 &rng)
+{
+	QF qf;
+	uint64_t qbits = 20;
+	qf_init(&qf, (1ULL << qbits), qbits + 8, 0, 2, 0, true, "", 2038074761);
+	while (qf.metadata->noccupied_slots < 0.9 * qf.metadata->nslots)
+		qf_insert(&qf, rng() % (1ULL << (qbits + 8)), rng() % 8 == 0 ? rng() % 100 + 1 : 1);
+
+	vector<uint64_t> slots(1 << 16);
+	for (size_t i = 0; i < slots.size(); i++)
+		slots[i] = rng() % qf.metadata->nslots;
+	uint64_t mask = slots.size() - 1, sum = 0;
+
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += run_end(&qf, slots[i & mask]);
+	reportKernel("run_end", qf.metadata->bits_per_slot, n, start);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += offset_lower_bound(&qf, slots[i & mask]);
+	reportKernel("offset_lower_bound", qf.metadata->bits_per_slot, n, start);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += find_first_empty_slot(&qf, slots[i & mask]);
+	reportKernel("find_first_empty_slot", qf.metadata->bits_per_slot, n, start);
+	kernelSink += sum;
+	qf_destroy(&qf);
+}
+
+/* _get_slot, _set_slot and shift_remainders at one slot size. The shifts
+ * move runs of up to 64 slots, the usual length of a shift on insert. */
+static void benchSlotKernels(uint64_t n, uint64_t bits_per_slot, mt19937_64 &rng)
+{
+	QF qf;
+	initKernelFilter(&qf, 16, bits_per_slot);
+	uint64_t xnslots = qf.metadata->xnslots;
+	vector<uint64_t> slots(1 << 16), lengths(1 << 16);
+	for (size_t i = 0; i < slots.size(); i++) {
+		slots[i] = rng() % (xnslots - 65);
+		lengths[i] = rng() % 64 + 1;
+	}
+	uint64_t mask = slots.size() - 1, sum = 0;
+	uint64_t value_mask = BITMASK(bits_per_slot);
+
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		_set_slot(&qf, slots[i & mask], (i * 0x9E3779B97F4A7C15ULL) & value_mask);
+	reportKernel("_set_slot", bits_per_slot, n, start);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += _get_slot(&qf, slots[i & mask]);
+	reportKernel("_get_slot", bits_per_slot, n, start);
+
+	uint64_t shifts = n / 16;
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < shifts; i++)
+		shift_remainders(&qf, slots[i & mask], slots[i & mask] + lengths[i & mask]);
+	reportKernel("shift_remainders", bits_per_slot, shifts, start);
+	kernelSink += sum;
+	qf_destroy(&qf);
+}
+
+static void benchShiftRunends(uint64_t n, mt19937_64 &rng)
+{
+	QF qf;
+	initKernelFilter(&qf, 16, 8);
+	uint64_t xnslots = qf.metadata->xnslots;
+	vector<uint64_t> firsts(1 << 16), lengths(1 << 16), distances(1 << 16);
+	for (size_t i = 0; i < firsts.size(); i++) {
+		firsts[i] = rng() % (xnslots - 130);
+		lengths[i] = rng() % 64;
+		distances[i] = rng() % 3 + 1;
+	}
+	uint64_t mask = firsts.size() - 1;
+	uint64_t shifts = n / 16;
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < shifts; i++)
+		shift_runends(&qf, firsts[i & mask], firsts[i & mask] + lengths[i & mask],
+									distances[i & mask]);
+	reportKernel("shift_runends", 8, shifts, start);
+	qf_destroy(&qf);
+}
+
+/* encode_counter and decode_counter of counts up to 2^20 with a 2 bits
+ * fixed counter and 8 bits remainders. */
+static void benchCounterKernels(uint64_t n, mt19937_64 &rng)
+{
+	QF qf;
+	qf_init(&qf, (1ULL << 20), 20 + 8, 0, 2, 0, true, "", 2038074761);
+	vector<uint64_t> counts(1 << 16);
+	for (size_t i = 0; i < counts.size(); i++)
+		counts[i] = 1 + (rng() % (1ULL << 20) >> (rng() % 20));
+	uint64_t mask = counts.size() - 1, sum = 0;
+	uint64_t values[67], fcounters[67];
+
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		sum += *encode_counter(&qf, i & 0xff, counts[i & mask], &values[67], &fcounters[67]);
+	reportKernel("encode_counter", qf.metadata->bits_per_slot, n, start);
+
+	// one encoded counter every 8 slots
+	for (uint64_t i = 0; i < counts.size(); i++) {
+		uint64_t *p = encode_counter(&qf, i & 0xff, counts[i] % 1000 + 1, &values[67], &fcounters[67]);
+		uint64_t length = &values[67] - p;
+		for (uint64_t j = 0; j < length; j++)
+			super_set(&qf, i * 8 + j, p[j], fcounters[67 - length + j]);
+	}
+	uint64_t remainder, count;
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++) {
+		decode_counter(&qf, (i & mask) * 8, &remainder, &count);
+		sum += count;
+	}
+	reportKernel("decode_counter", qf.metadata->bits_per_slot, n, start);
+	kernelSink += sum;
+	qf_destroy(&qf);
+}
+
+/* The find_remainder kernels against the decode_counter loop they replace,
+ * on runs of about 2^spread counters (r in the name), a few of them of
+ * several slots. */
+static void benchFindRemainder(uint64_t n, uint64_t spread, mt19937_64 &rng)
+{
+	QF qf;
+	uint64_t qbits = 16;
+	qf_init(&qf, (1ULL << qbits), qbits + 8, 0, 2, 0, true, "", 2038074761);
+	// one quotient every 2^spread
+	while (qf.metadata->noccupied_slots < 0.9 * qf.metadata->nslots)
+		qf_insert(&qf, ((rng() % (1ULL << (qbits - spread))) << (8 + spread)) | (rng() & BITMASK(8)),
+							rng() % 8 == 0 ? rng() % 100 + 1 : 1);
+
+	vector<uint64_t> runstarts(1 << 16), runends(1 << 16), targets(1 << 16);
+	for (size_t i = 0; i < runstarts.size(); i++) {
+		uint64_t bucket;
+		do
+			bucket = rng() % qf.metadata->nslots;
+		while (!is_occupied(&qf, bucket));
+		runstarts[i] = bucket == 0 ? 0 : std::max(bucket, run_end(&qf, bucket - 1) + 1);
+		runends[i] = run_end(&qf, bucket);
+		targets[i] = rng() & BITMASK(8);
+	}
+	uint64_t mask = runstarts.size() - 1, sum = 0;
+	string runs = " r" + to_string(1UL << spread);
+
+	auto start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t index = runstarts[i & mask], remainder, count, end;
+		do {
+			end = decode_counter(&qf, index, &remainder, &count);
+			if (remainder >= targets[i & mask])
+				break;
+			index = end + 1;
+		} while (end != runends[i & mask]);
+		sum += index;
+	}
+	reportKernel(("scan decode_counter" + runs).c_str(), qf.metadata->bits_per_slot, n, start);
+
+	vector<pair<const char *, find_remainder_kernel>> kernels;
+	kernels.push_back(make_pair("scalar", find_remainder_scalar));
+#ifdef QF_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		kernels.push_back(make_pair("avx2", find_remainder_avx2));
+	if (__builtin_cpu_supports("avx512f"))
+		kernels.push_back(make_pair("avx512", find_remainder_avx512));
+#endif
+	for (auto &kernel : kernels) {
+		start = chrono::steady_clock::now();
+		for (uint64_t i = 0; i < n; i++)
+			sum += kernel.second(&qf, runstarts[i & mask], runends[i & mask], targets[i & mask]);
+		reportKernel(("scan " + string(kernel.first) + runs).c_str(),
+								 qf.metadata->bits_per_slot, n, start);
+	}
+	kernelSink += sum;
+	qf_destroy(&qf);
+}
+
+/* qf_insert and qf_remove of counters of 1 to 6 slots in a filter filled to
+ * 80% of its slots, where the shifts move whole clusters of counters. */
+static void benchCounterShifts(uint64_t n, mt19937_64 &rng)
+{
+	QF qf;
+	uint64_t qbits = 16;
+	qf_init(&qf, (1ULL << qbits), qbits + 8, 0, 2, 0, true, "", 2038074761);
+	while (qf.metadata->noccupied_slots < 0.8 * qf.metadata->nslots)
+		qf_insert(&qf, rng() % (1ULL << (qbits + 8)), 1);
+
+	vector<uint64_t> keys(1 << 12);
+	uint64_t mask = keys.size() - 1;
+	uint64_t values[67], fcounters[67];
+	uint64_t ops = n / 64;
+	printf("%-24s %6s %10s\n", "kernel", "digits", "ns/op");
+	for (uint64_t digits = 1; digits <= 6; digits++) {
+		// smallest count encoded in digits slots
+		uint64_t count = 1;
+		while (&values[67] - encode_counter(&qf, 0xff, count, &values[67], &fcounters[67]) < (int64_t)digits)
+			count = count * 2 + 1;
+		for (size_t i = 0; i < keys.size(); i++)
+			keys[i] = rng() % (1ULL << (qbits + 8));
+
+		auto start = chrono::steady_clock::now();
+		for (uint64_t i = 0; i < ops; i++) {
+			qf_insert(&qf, keys[i & mask], count);
+			qf_remove(&qf, keys[i & mask], count);
+		}
+		chrono::duration<double, nano> d = chrono::steady_clock::now() - start;
+		printf("%-24s %6lu %10.2f\n", "qf_insert+qf_remove", digits, d.count() / ops);
+	}
+	qf_destroy(&qf);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+	mt19937_64 rng(2038074761);
+	printf("%-24s %4s %10s\n", "kernel", "bps", "ns/op");
+	benchWordKernels(n, rng);
+	benchRunKernels(n, rng);
+	benchShiftRunends(n, rng);
+	benchCounterKernels(n, rng);
+	for (uint64_t spread = 1; spread <= 5; spread += 2)
+		benchFindRemainder(n, spread, rng);
+	for (uint64_t bits = 2; bits <= 64; bits++)
+		benchSlotKernels(n, bits, rng);
+	benchCounterShifts(n, rng);
+	return 0;
+}
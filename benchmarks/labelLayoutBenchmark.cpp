@@ -0,0 +1,105 @@
+#include "gqf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <string>
+
+/* Compares the packed label layout (labels in the high bits of each slot)
+ * against the separate per-block label array across label widths.
+ * Usage: labelLayoutBenchmark [qbits] [load factor]
+ */
+
+using namespace std;
+
+static double elapsedNs(chrono::steady_clock::time_point start, uint64_t nops)
+{
+	chrono::duration<double, nano> d = chrono::steady_clock::now() - start;
+	return d.count() / nops;
+}
+
+static void run(bool separate, uint64_t qbits, uint64_t label_bits,
+								double loadFactor, const vector<uint64_t>& keys,
+								const vector<uint64_t>& misses)
+{
+	QF qf;
+	uint64_t key_bits = qbits + 8;
+	if (separate)
+		qf_init_separate_labels(&qf, 1ULL << qbits, key_bits, label_bits, 2, 0, true, "", 2038074761);
+	else
+		qf_init(&qf, 1ULL << qbits, key_bits, label_bits, 2, 0, true, "", 2038074761);
+
+	uint64_t labelMask = label_bits == 64 ? ~0ULL : (1ULL << label_bits) - 1;
+	uint64_t n = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (n < keys.size() &&
+				 qf.metadata->noccupied_slots < loadFactor * qf.metadata->nslots) {
+		qf_insert(&qf, keys[n] % qf.metadata->range, 1 + (keys[n] & 3));
+		n++;
+	}
+	double insertNs = elapsedNs(start, n);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		qf_add_label(&qf, keys[i] % qf.metadata->range, keys[i] & labelMask);
+	double addLabelNs = elapsedNs(start, n);
+
+	uint64_t checksum = 0;
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		checksum += qf_count_key(&qf, keys[i] % qf.metadata->range);
+	double countNs = elapsedNs(start, n);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		checksum += qf_count_key(&qf, misses[i] % qf.metadata->range);
+	double missNs = elapsedNs(start, n);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		checksum += qf_get_label(&qf, keys[i] % qf.metadata->range);
+	double getLabelNs = elapsedNs(start, n);
+
+	QFi qfi;
+	uint64_t key, value, count, items = 0;
+	start = chrono::steady_clock::now();
+	if (qf_iterator(&qf, &qfi, 0)) {
+		do {
+			qfi_get(&qfi, &key, &value, &count);
+			checksum += value;
+			items++;
+		} while (!qfi_next(&qfi));
+	}
+	double iterateNs = elapsedNs(start, items);
+
+	printf("%-9s %6lu %9lu %9lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f   (%lu)\n",
+				 separate ? "separate" : "packed", label_bits,
+				 qf.metadata->bits_per_slot, qf.metadata->size / 1024, insertNs,
+				 addLabelNs, countNs, missNs, getLabelNs, iterateNs, checksum % 10);
+	qf_destroy(&qf);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t qbits = argc > 1 ? strtoull(argv[1], NULL, 10) : 20;
+	double loadFactor = argc > 2 ? atof(argv[2]) : 0.85;
+
+	mt19937_64 rng(42);
+	vector<uint64_t> keys(1ULL << qbits), misses(1ULL << qbits);
+	for (uint64_t i = 0; i < keys.size(); i++) {
+		keys[i] = rng();
+		misses[i] = rng();
+	}
+
+	printf("qbits=%lu load factor=%.2f, times in ns/op\n", qbits, loadFactor);
+	printf("%-9s %6s %9s %9s %9s %9s %9s %9s %9s %9s\n", "layout", "label",
+				 "bits/slot", "KB", "insert", "addLabel", "countHit", "countMiss",
+				 "getLabel", "iterate");
+	uint64_t widths[] = {8, 16, 24, 32};
+	for (uint64_t w : widths) {
+		run(false, qbits, w, loadFactor, keys, misses);
+		run(true, qbits, w, loadFactor, keys, misses);
+	}
+	return 0;
+}
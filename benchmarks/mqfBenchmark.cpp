@@ -0,0 +1,473 @@
+#include "gqf.h"
+#include "bufferedMQF.h"
+#include "onDiskMQF.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <atomic>
+
+/* Throughput of the MQF API over filter sizes, load factors, fixed counter
+ * sizes, label widths, key distributions and thread counts. Every
+ * measurement is one object of a JSON array written to stdout or to out.
+ * Usage: mqfBenchmark [qbits=16,18] [load=0.5,0.9] [fcs=1,3] [labels=0,8]
+ *                     [dist=uniform,zipf,kmer] [threads=1,2] [ops=all]
+ *                     [out=results.json] [path=mqfBenchmark]
+ * ops is all or a list of insert,count,remove,label,iterate,merge,
+ * multimerge,invertablemerge,resize,serialize,buffered,ondisk.
+ */
+
+using namespace std;
+using namespace onDiskMQF_Namespace;
+
+typedef struct benchConfig {
+	uint64_t qbits;
+	double load;
+	uint64_t fcs;
+	uint64_t labelBits;
+	string dist;
+	uint64_t threads;
+} benchConfig;
+
+static FILE *out = stdout;
+static bool firstResult = true;
+static string path = "mqfBenchmark";
+static vector<string> ops;
+
+static bool enabled(const char *op)
+{
+	return find(ops.begin(), ops.end(), "all") != ops.end() ||
+				 find(ops.begin(), ops.end(), op) != ops.end();
+}
+
+static double elapsedNs(chrono::steady_clock::time_point start)
+{
+	chrono::duration<double, nano> d = chrono::steady_clock::now() - start;
+	return d.count();
+}
+
+static void report(const benchConfig &c, const char *op, uint64_t nops,
+									 double ns, double achievedLoad, uint64_t bytes)
+{
+	double nsPerOp = nops ? ns / nops : 0;
+	fprintf(out, "%s  {\"op\": \"%s\", \"qbits\": %lu, \"load\": %.2f, "
+					"\"achieved_load\": %.4f, \"fixed_counter_size\": %lu, "
+					"\"label_bits\": %lu, \"distribution\": \"%s\", \"threads\": %lu, "
+					"\"nops\": %lu, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f, "
+					"\"bytes\": %lu}",
+					firstResult ? "" : ",\n", op, c.qbits, c.load, achievedLoad, c.fcs,
+					c.labelBits, c.dist.c_str(), c.threads, nops, nsPerOp,
+					nsPerOp > 0 ? 1e9 / nsPerOp : 0, bytes);
+	firstResult = false;
+	fflush(out);
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* n inserts of keys in [0, range). uniform keys are distinct, zipf keys
+ * follow a Zipf law of exponent 1 over 4*n keys, kmer keys are 80% seen
+ * once with the rest repeated a geometric number of times, like k-mers of
+ * sequencing reads. */
+static void generateKeys(const string &dist, uint64_t n, uint64_t range,
+												 vector<uint64_t> &keys, vector<uint64_t> &misses)
+{
+	mt19937_64 rng(42);
+	keys.resize(n);
+	misses.resize(n);
+	if (dist == "zipf") {
+		uint64_t universe = 4 * n;
+		vector<double> cdf(universe);
+		double sum = 0;
+		for (uint64_t i = 0; i < universe; i++) {
+			sum += 1.0 / (i + 1);
+			cdf[i] = sum;
+		}
+		uniform_real_distribution<double> u(0, sum);
+		for (uint64_t i = 0; i < n; i++) {
+			uint64_t id = lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+			keys[i] = mix(id) % range;
+		}
+	} else if (dist == "kmer") {
+		uint64_t i = 0;
+		geometric_distribution<uint64_t> repeats(0.2);
+		while (i < n) {
+			uint64_t key = rng() % range;
+			uint64_t times = rng() % 5 == 0 ? 2 + repeats(rng) : 1;
+			for (uint64_t j = 0; j < times && i < n; j++)
+				keys[i++] = key;
+		}
+		shuffle(keys.begin(), keys.end(), rng);
+	} else if (dist == "uniform") {
+		for (uint64_t i = 0; i < n; i++)
+			keys[i] = rng() % range;
+	} else {
+		fprintf(stderr, "Unknown distribution %s\n", dist.c_str());
+		exit(EXIT_FAILURE);
+	}
+	for (uint64_t i = 0; i < n; i++)
+		misses[i] = rng() % range;
+}
+
+static void initQF(QF *qf, const benchConfig &c, uint64_t qbits)
+{
+	qf_init(qf, 1ULL << qbits, c.qbits + 8, c.labelBits, c.fcs, 0, true, "", 2038074761);
+}
+
+static double loadOf(const QF *qf)
+{
+	return (double)qf->metadata->noccupied_slots / qf->metadata->nslots;
+}
+
+/* Insert keys until the load is reached, returns the number inserted. */
+static uint64_t fill(QF *qf, const benchConfig &c, const vector<uint64_t> &keys)
+{
+	uint64_t n = 0;
+	try {
+		while (n < keys.size() && loadOf(qf) < c.load)
+			qf_insert(qf, keys[n++], 1);
+	} catch (std::exception &e) {
+		// the filter is full before the target load
+	}
+	return n;
+}
+
+/* Run f(begin, end) on nthreads slices of [0, n). */
+template <typename F>
+static double parallel(uint64_t nthreads, uint64_t n, F f)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector<thread> threads;
+	for (uint64_t t = 0; t < nthreads; t++)
+		threads.push_back(thread(f, n * t / nthreads, n * (t + 1) / nthreads));
+	for (uint64_t t = 0; t < nthreads; t++)
+		threads[t].join();
+	return elapsedNs(start);
+}
+
+static volatile uint64_t checksum = 0;
+
+static void benchQF(const benchConfig &c, const vector<uint64_t> &keys,
+										const vector<uint64_t> &misses)
+{
+	QF qf;
+	initQF(&qf, c, c.qbits);
+	uint64_t n = 0;
+	double ns;
+	if (c.threads == 1) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		n = fill(&qf, c, keys);
+		ns = elapsedNs(start);
+	} else {
+		// the number of inserts reaching the load is found single threaded
+		QF probe;
+		initQF(&probe, c, c.qbits);
+		n = fill(&probe, c, keys);
+		qf_destroy(&probe);
+		ns = parallel(c.threads, n, [&](uint64_t begin, uint64_t end) {
+			for (uint64_t i = begin; i < end; i++)
+				qf_insert(&qf, keys[i], 1, true, true);
+		});
+	}
+	double load = loadOf(&qf);
+	if (enabled("insert"))
+		report(c, "insert", n, ns, load, qf.metadata->size);
+
+	if (enabled("count")) {
+		ns = parallel(c.threads, n, [&](uint64_t begin, uint64_t end) {
+			uint64_t sum = 0;
+			for (uint64_t i = begin; i < end; i++)
+				sum += qf_count_key(&qf, keys[i]);
+			checksum += sum;
+		});
+		report(c, "count_hit", n, ns, load, qf.metadata->size);
+		ns = parallel(c.threads, n, [&](uint64_t begin, uint64_t end) {
+			uint64_t sum = 0;
+			for (uint64_t i = begin; i < end; i++)
+				sum += qf_count_key(&qf, misses[i]);
+			checksum += sum;
+		});
+		report(c, "count_miss", n, ns, load, qf.metadata->size);
+	}
+
+	if (enabled("label") && c.labelBits > 0) {
+		uint64_t mask = (1ULL << c.labelBits) - 1;
+		ns = parallel(c.threads, n, [&](uint64_t begin, uint64_t end) {
+			for (uint64_t i = begin; i < end; i++)
+				qf_add_label(&qf, keys[i], (keys[i] & mask) | 1, c.threads > 1, true);
+		});
+		report(c, "add_label", n, ns, load, qf.metadata->size);
+		ns = parallel(c.threads, n, [&](uint64_t begin, uint64_t end) {
+			uint64_t sum = 0;
+			for (uint64_t i = begin; i < end; i++)
+				sum += qf_get_label(&qf, keys[i]);
+			checksum += sum;
+		});
+		report(c, "get_label", n, ns, load, qf.metadata->size);
+	}
+
+	// the remaining operations are single threaded
+	if (c.threads > 1) {
+		qf_destroy(&qf);
+		return;
+	}
+
+	if (enabled("iterate")) {
+		QFi qfi;
+		uint64_t key, value, count, items = 0;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		if (qf_iterator(&qf, &qfi, 0)) {
+			do {
+				qfi_get(&qfi, &key, &value, &count);
+				checksum += count;
+				items++;
+			} while (!qfi_next(&qfi));
+		}
+		report(c, "iterate", items, elapsedNs(start), load, qf.metadata->size);
+	}
+
+	if (enabled("merge") || enabled("multimerge") || enabled("invertablemerge")) {
+		// unlabeled inputs, the invertable merge reads their labels as colors
+		QF copies[3];
+		for (int i = 0; i < 3; i++) {
+			initQF(&copies[i], c, c.qbits);
+			fill(&copies[i], c, keys);
+		}
+		QF *inputs[3] = {&copies[0], &copies[1], &copies[2]};
+		if (enabled("merge")) {
+			QF merged;
+			initQF(&merged, c, c.qbits + 1);
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			qf_merge(&copies[0], &copies[1], &merged);
+			report(c, "merge", 2 * n, elapsedNs(start), loadOf(&merged), merged.metadata->size);
+			qf_destroy(&merged);
+		}
+		if (enabled("multimerge")) {
+			QF merged;
+			initQF(&merged, c, c.qbits + 2);
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			qf_multi_merge(inputs, 3, &merged);
+			report(c, "multi_merge", 3 * n, elapsedNs(start), loadOf(&merged), merged.metadata->size);
+			qf_destroy(&merged);
+		}
+		if (enabled("invertablemerge")) {
+			QF merged;
+			qf_init(&merged, 1ULL << (c.qbits + 2), c.qbits + 8, 8, c.fcs, 0, true, "", 2038074761);
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			qf_invertable_merge(inputs, 3, &merged);
+			report(c, "invertable_merge", 3 * n, elapsedNs(start), loadOf(&merged), merged.metadata->size);
+			qf_destroy(&merged);
+		}
+		for (int i = 0; i < 3; i++)
+			qf_destroy(&copies[i]);
+	}
+
+	if (enabled("resize")) {
+		QF copy;
+		initQF(&copy, c, c.qbits);
+		fill(&copy, c, keys);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		QF *resized = qf_resize(&copy, c.qbits + 1);
+		report(c, "resize", n, elapsedNs(start), loadOf(resized), resized->metadata->size);
+		qf_destroy(resized);
+		free(resized);
+	}
+
+	if (enabled("serialize")) {
+		string filename = path + ".qf";
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		qf_serialize(&qf, filename.c_str());
+		report(c, "serialize", 1, elapsedNs(start), load, qf.metadata->size);
+		QF loaded;
+		start = chrono::steady_clock::now();
+		qf_deserialize(&loaded, filename.c_str());
+		report(c, "deserialize", 1, elapsedNs(start), load, loaded.metadata->size);
+		qf_destroy(&loaded);
+		start = chrono::steady_clock::now();
+		qf_read(&loaded, filename.c_str());
+		// touch every page of the mapped filter
+		for (uint64_t i = 0; i < n; i += 64)
+			checksum += qf_count_key(&loaded, keys[i]);
+		report(c, "mmap_load", 1, elapsedNs(start), load, loaded.metadata->size);
+		qf_destroy(&loaded);
+		unlink(filename.c_str());
+	}
+
+	if (enabled("remove")) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		uint64_t removed = 0;
+		try {
+			for (; removed < n; removed++)
+				qf_remove(&qf, keys[removed], 1);
+		} catch (std::exception &e) {
+		}
+		report(c, "remove", removed, elapsedNs(start), load, qf.metadata->size);
+	}
+	qf_destroy(&qf);
+}
+
+static void benchBuffered(const benchConfig &c, const vector<uint64_t> &keys,
+													uint64_t n)
+{
+	uint64_t nshards = 1;
+	while (c.threads > 1 && nshards < 2 * c.threads)
+		nshards *= 2;
+	string filename = path + ".buffered";
+	bufferedMQF *qf = new bufferedMQF();
+	bufferedMQF_init(qf, 1ULL << (c.qbits - 4), 1ULL << c.qbits, c.qbits + 8,
+									 c.labelBits, c.fcs, filename.c_str(), nshards);
+	atomic<uint64_t> inserted(0);
+	double ns = parallel(c.threads, n, [&](uint64_t begin, uint64_t end) {
+		uint64_t i = begin;
+		// the buffered filter reserves the slots of the buffered items too,
+		// so it is full before the in memory filter at high loads
+		try {
+			for (; i < end; i++)
+				bufferedMQF_insert(qf, keys[i], 1, c.threads > 1, true);
+		} catch (std::overflow_error &) {
+		}
+		inserted += i - begin;
+	});
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	bufferedMQF_syncBuffer(qf);
+	ns += elapsedNs(start);
+	double load = (double)qf->disk->metadata->noccupied_slots / qf->disk->metadata->nslots;
+	report(c, "buffered_insert", inserted, ns, load, qf->disk->metadata->size);
+	ns = parallel(c.threads, n, [&](uint64_t begin, uint64_t end) {
+		uint64_t sum = 0;
+		for (uint64_t i = begin; i < end; i++)
+			sum += bufferedMQF_count_key(qf, keys[i]);
+		checksum += sum;
+	});
+	report(c, "buffered_count", n, ns, load, qf->disk->metadata->size);
+	delete qf;
+	unlink(filename.c_str());
+}
+
+static void benchOnDisk(const benchConfig &c, const vector<uint64_t> &keys,
+												uint64_t n)
+{
+	string filename = path + ".ondisk";
+	onDiskMQF *qf;
+	onDiskMQF::init(qf, 1ULL << c.qbits, c.qbits + 8, c.labelBits, c.fcs, filename.c_str());
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		qf->insert(keys[i], 1);
+	double load = (double)qf->metadata->noccupied_slots / qf->metadata->nslots;
+	report(c, "ondisk_insert", n, elapsedNs(start), load, qf->metadata->size);
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		checksum += qf->count_key(keys[i]);
+	report(c, "ondisk_count", n, elapsedNs(start), load, qf->metadata->size);
+	delete qf;
+	unlink(filename.c_str());
+}
+
+static vector<string> splitArg(const string &value)
+{
+	vector<string> res;
+	size_t start = 0, end;
+	while ((end = value.find(',', start)) != string::npos) {
+		res.push_back(value.substr(start, end - start));
+		start = end + 1;
+	}
+	res.push_back(value.substr(start));
+	return res;
+}
+
+template <typename T, typename F>
+static vector<T> parseList(const string &value, F parse)
+{
+	vector<T> res;
+	for (const string &s : splitArg(value))
+		res.push_back(parse(s));
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	string qbitsArg = "16,18", loadArg = "0.5,0.9", fcsArg = "1,3", labelsArg = "0,8",
+				 distArg = "uniform,zipf,kmer", threadsArg = "1,2", opsArg = "all", outArg;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (eq == string::npos) {
+			fprintf(stderr, "Arguments are name=value, see the top of mqfBenchmark.cpp\n");
+			return EXIT_FAILURE;
+		}
+		string name = arg.substr(0, eq), value = arg.substr(eq + 1);
+		if (name == "qbits") qbitsArg = value;
+		else if (name == "load") loadArg = value;
+		else if (name == "fcs") fcsArg = value;
+		else if (name == "labels") labelsArg = value;
+		else if (name == "dist") distArg = value;
+		else if (name == "threads") threadsArg = value;
+		else if (name == "ops") opsArg = value;
+		else if (name == "out") outArg = value;
+		else if (name == "path") path = value;
+		else {
+			fprintf(stderr, "Unknown argument %s\n", name.c_str());
+			return EXIT_FAILURE;
+		}
+	}
+	auto toInt = [](const string &s) { return (uint64_t)strtoull(s.c_str(), NULL, 10); };
+	auto toDouble = [](const string &s) { return atof(s.c_str()); };
+	vector<uint64_t> qbitsList = parseList<uint64_t>(qbitsArg, toInt);
+	vector<double> loads = parseList<double>(loadArg, toDouble);
+	vector<uint64_t> fcsList = parseList<uint64_t>(fcsArg, toInt);
+	vector<uint64_t> labelsList = parseList<uint64_t>(labelsArg, toInt);
+	vector<uint64_t> threadsList = parseList<uint64_t>(threadsArg, toInt);
+	vector<string> dists = splitArg(distArg);
+	ops = splitArg(opsArg);
+
+	if (!outArg.empty()) {
+		out = fopen(outArg.c_str(), "w");
+		if (out == NULL) {
+			perror("Error opening the output file");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fprintf(out, "[\n");
+	for (uint64_t qbits : qbitsList)
+		for (const string &dist : dists) {
+			vector<uint64_t> keys, misses;
+			generateKeys(dist, 2 * (1ULL << qbits), 1ULL << (qbits + 8), keys, misses);
+			for (double load : loads)
+				for (uint64_t fcs : fcsList)
+					for (uint64_t labelBits : labelsList)
+						for (uint64_t threads : threadsList) {
+							benchConfig c = {qbits, load, fcs, labelBits, dist, threads};
+							benchQF(c, keys, misses);
+							if (!enabled("buffered") && !enabled("ondisk"))
+								continue;
+							// the disk filters get the inserts reaching the load in memory
+							QF qf;
+							initQF(&qf, c, qbits);
+							uint64_t n = fill(&qf, c, keys);
+							qf_destroy(&qf);
+							if (enabled("buffered"))
+								benchBuffered(c, keys, n);
+							if (enabled("ondisk") && threads == 1)
+								benchOnDisk(c, keys, n);
+						}
+		}
+	fprintf(out, "\n]\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
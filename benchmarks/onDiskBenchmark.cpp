@@ -0,0 +1,80 @@
+#include "gqf.h"
+#include "onDiskMQF.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <random>
+
+/* Insert, count and iterate throughput of onDiskMQF.
+ * Usage: onDiskBenchmark [qbits] [load factor] [path] [memory budget MB]
+ * Without a memory budget the stxxl backend is used, otherwise the
+ * pread/pwrite backend with a page cache of that size.
+ */
+
+using namespace std;
+using namespace onDiskMQF_Namespace;
+
+static double elapsedNs(chrono::steady_clock::time_point start, uint64_t nops)
+{
+	chrono::duration<double, nano> d = chrono::steady_clock::now() - start;
+	return d.count() / nops;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t qbits = argc > 1 ? strtoull(argv[1], NULL, 10) : 18;
+	double loadFactor = argc > 2 ? atof(argv[2]) : 0.7;
+	const char *path = argc > 3 ? argv[3] : "onDiskBenchmark.ser";
+	uint64_t budgetMB = argc > 4 ? strtoull(argv[4], NULL, 10) : 0;
+
+	pageCache *cache = budgetMB ? new pageCache(budgetMB << 20) : NULL;
+	onDiskMQF *qf;
+	onDiskMQF::init(qf, 1ULL << qbits, qbits + 8, 0, 3, path, cache);
+
+	mt19937_64 rng(42);
+	uint64_t n = (uint64_t)(loadFactor * (1ULL << qbits) * 0.8);
+	vector<uint64_t> keys(n);
+	for (uint64_t i = 0; i < n; i++)
+		keys[i] = rng() % qf->metadata->range;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		qf->insert(keys[i], 1 + (keys[i] & 3));
+	double insertNs = elapsedNs(start, n);
+
+	uint64_t checksum = 0;
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		checksum += qf->count_key(keys[i]);
+	double countNs = elapsedNs(start, n);
+
+	start = chrono::steady_clock::now();
+	for (uint64_t i = 0; i < n; i++)
+		checksum += qf->count_key(rng() % qf->metadata->range);
+	double missNs = elapsedNs(start, n);
+
+	onDiskMQFIterator it;
+	uint64_t key, value, count, items = 0;
+	start = chrono::steady_clock::now();
+	if (qf->getIterator(&it, 0)) {
+		do {
+			it.get(&key, &value, &count);
+			checksum += count;
+			items++;
+		} while (!it.next());
+	}
+	double iterateNs = elapsedNs(start, items);
+
+	printf("qbits=%lu items=%lu insert=%.1f countHit=%.1f countMiss=%.1f iterate=%.1f ns/op (%lu)\n",
+				 qbits, n, insertNs, countNs, missNs, iterateNs, checksum % 10);
+	delete qf;
+	if (cache) {
+		pageCacheStats stats = cache->getStats();
+		printf("cache budget=%luMB hit rate=%.4f read=%luMB written=%luMB evictions=%lu\n",
+					 budgetMB, cache->hitRate(), stats.bytesRead >> 20,
+					 stats.bytesWritten >> 20, stats.evictions);
+		delete cache;
+	}
+	return 0;
+}
@@ -28,12 +28,23 @@ extern "C" {
 
 
 
+	/* Iterator over the keys of both layers in key order. It holds the
+	 * iterators of the layers and allocates nothing, so it can live on the
+	 * stack. */
 	typedef struct layeredMQFIterator {
 		QFi firstLayerIterator;
 		QFi secondLayerIterator;
-	} layeredMQF_iterator;
+	} layeredMQFIterator;
 
 
+	/*!
+	@breif initialize the layered filter.
+
+	@param uint64_t nslots_singletons: Number of slots of the first layer, which holds the keys seen once. It has no fixed counters, so a key takes key_bits-log2(nslots_singletons)+value_bits bits.
+	@param uint64_t nslots: Number of slots of the second layer, which holds the keys seen more than once.
+	@param uint64_t fixed_counter_size: Fixed counter size of the second layer.
+	@param bool mem: Flag to create the layers on memory. If false, they are mmaped from path+".singletons" and path.
+	*/
 	void layeredMQF_init(layeredMQF *qf, uint64_t nslots_singletons ,uint64_t nslots, uint64_t key_bits, uint64_t value_bits,uint64_t fixed_counter_size, bool mem, const char *path, uint32_t seed);
 
 	void layeredMQF_reset(layeredMQF *qf);
@@ -46,8 +57,21 @@ extern "C" {
 	bool layeredMQF_insert(layeredMQF *qf, uint64_t key, uint64_t count,
 								 bool lock, bool spin);
 
+	/* Keys ahead of the current one whose blocks are prefetched by layeredMQF_insert_batch. */
+#define LAYERED_PREFETCH_DISTANCE (8)
+
+	/*!
+	@breif Insert n keys, prefetching the blocks of both layers for the keys LAYERED_PREFETCH_DISTANCE positions ahead, so the probes of a key do not wait for memory.
+
+	@param const uint64_t* counts: count of every key. NULL inserts every key once.
+
+	@return uint64_t: number of keys inserted. It is smaller than n only when locks could not be taken.
+	*/
+	uint64_t layeredMQF_insert_batch(layeredMQF *qf, const uint64_t *keys, const uint64_t *counts,
+								 uint64_t n, bool lock=false, bool spin=false);
+
 	/* Remove count instances of this key/value combination. */
-	bool layeredMQF_remove(QF *qf, uint64_t hash, uint64_t count,  bool lock=false, bool spin=false);
+	bool layeredMQF_remove(layeredMQF *qf, uint64_t hash, uint64_t count,  bool lock=false, bool spin=false);
 
 
 		/*!
@@ -61,7 +85,7 @@ extern "C" {
 
 			@return bool: True if the item is inserted correctly.
 		 */
-		uint64_t layeredMQF_add_tag(const QF *qf, uint64_t key, uint64_t tag, bool lock=false, bool spin=false);
+		uint64_t layeredMQF_add_tag(const layeredMQF *qf, uint64_t key, uint64_t tag, bool lock=false, bool spin=false);
 		/*!
 		@breif Return the tag associated with a given item.
 
@@ -70,7 +94,7 @@ extern "C" {
 
 		@return uint64_t the tag associated with the input key.
 				*/
-		uint64_t layeredMQF_get_tag(const QF *qf, uint64_t key);
+		uint64_t layeredMQF_get_tag(const layeredMQF *qf, uint64_t key);
 		/*!
 		@breif delete the tag associated with a given item.
 
@@ -79,7 +103,7 @@ extern "C" {
 
 		@return bool: Returns true if the item is removed successfully.
 				*/
-		uint64_t layeredMQF_remove_tag(const QF *qf, uint64_t key, bool lock=false, bool spin=false);
+		uint64_t layeredMQF_remove_tag(const layeredMQF *qf, uint64_t key, bool lock=false, bool spin=false);
 
 
 
@@ -89,7 +113,8 @@ extern "C" {
 
 
 
-	/* Initialize an iterator */
+	/* Initialize an iterator at the first key >= position<<key_remainder_bits
+		 of the second layer. Returns false if there is no such key. */
 	bool layeredMQF_qf_iterator(layeredMQF *qf, layeredMQFIterator *qfi, uint64_t position);
 
 	/* Returns 0 if the iterator is still valid (i.e. has not reached the
@@ -106,17 +131,33 @@ extern "C" {
 	/* For debugging */
 	void layeredMQF_dump(const layeredMQF *);
 
-	/* write data structure of to the disk */
+	/* write both layers to one file. Each layer starts at a page boundary, as
+		 written by qf_serialize, after a header page with their offsets. */
 	void layeredMQF_serialize(const layeredMQF *qf, const char *filename);
 
 	/* read data structure off the disk */
 	void layeredMQF_deserialize(layeredMQF *qf, const char *filename);
 
-	/* mmap the QF from disk. */
+	/* mmap both layers from a file written by layeredMQF_serialize. */
 	void layeredMQF_read(layeredMQF *qf, const char *path);
 
-	/* merge two QFs into the third one. */
-	//void layeredMQF_merge(layeredMQF *layeredMQFa, layeredMQF *layeredMQFb, QF *qfc);
+	/*!
+	@breif Merge two layered filters into the third one, summing the counts of equal keys.
+
+	The filters are read in key order, so the keys are inserted in order and
+	only ever appended to the runs of qfc. qfc keeps the layer rule: keys
+	with a count of one go to the singletons.
+	*/
+	void layeredMQF_merge(layeredMQF *qfa, layeredMQF *qfb, layeredMQF *qfc);
+
+	/*!
+	@breif Give the layers new sizes, moving all the items to them in key order.
+
+	@param uint64_t nslots_singletons: new number of slots of the first layer.
+	@param uint64_t nslots: new number of slots of the second layer.
+	@param string newFilename(optional): the new layers are mmaped from newFilename+".singletons" and newFilename, which must not be the files of qf. By default they are created on memory. The files of a mmaped qf are synced and closed, and stay on disk with the items before the resize.
+	*/
+	void layeredMQF_resize(layeredMQF *qf, uint64_t nslots_singletons, uint64_t nslots, const char *newFilename=NULL);
 
 	/* merge multiple QFs into the final QF one. */
 	//void qf_multi_merge(QF *qf_arr[], int nqf, QF *qfr);
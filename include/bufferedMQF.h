@@ -4,27 +4,51 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
 #include "gqf.h"
 #include "onDiskMQF.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+class bufferedMQF;
 
+/*!
+@breif Iterator over the merged items of the disk filter and the memory buffer shards.
+
+Every source is positioned at the first key not smaller than the start key,
+and the sources are merged with a heap of their current keys, so the counts
+of a key found in several of them are summed. The filter must not be
+modified while the iterator is used.
+*/
 typedef class bufferedMQFIterator {
 public:
     onDiskMQF_Namespace::onDiskMQFIterator* diskIt;
-	QFi* bufferIt;
+	/* one iterator per memory buffer shard */
+	std::vector<QFi*> bufferIts;
 	uint64_t currentKey;
 	uint64_t currentLabel;
 	uint64_t currentCount;
+	/* last key of a range scan */
+	uint64_t endKey;
+	bufferedMQF* qf;
 	bool finished;
     bufferedMQFIterator(){
     	diskIt=new onDiskMQF_Namespace::onDiskMQFIterator();
-    	bufferIt=new QFi();
+    	endKey=~0ULL;
+    	qf=NULL;
+    	finished=true;
     };
-	bufferedMQFIterator(QFi* bit,onDiskMQF_Namespace::onDiskMQFIterator* dit);
 
+	/* Position every source at the first key >= startKey and load the first item. */
+	void seek(bufferedMQF* qf, uint64_t startKey, uint64_t endKey=~0ULL);
 
 	int get(uint64_t *key, uint64_t *value, uint64_t *count);
 
@@ -35,48 +59,87 @@ public:
 	/* Check to see if the if the end of the QF */
 	int end();
 
-	void update();
-	~bufferedMQFIterator(){
-		delete diskIt;
-		delete bufferIt;
-	}
+	~bufferedMQFIterator();
+private:
+	/* current keys of the sources. Source bufferIts.size() is the disk. */
+	std::priority_queue<std::pair<uint64_t,uint64_t>,
+		std::vector<std::pair<uint64_t,uint64_t> >,
+		std::greater<std::pair<uint64_t,uint64_t> > > heads;
+	void push(uint64_t source);
+	void clear();
+} bufferedMQFIterator;
 
 
-} bufferedMQFIterator;
+/*!
+@breif Counting filter with a memory buffer in front of an on disk filter.
 
+Inserts go to memoryBuffer. When it fills up it is swapped with flushBuffer,
+which a background thread then writes to the disk filter while inserts
+continue in the other buffer. Inserts only wait when both buffers are full.
+Queries see the disk filter and flushBuffer together under diskLock, so an
+item is counted exactly once while it moves to disk.
 
+Each buffer can be split in shards by the low bits of the keys, so that
+threads inserting with lock=true mostly lock different shards. memoryBuffer
+and flushBuffer are the first shards. Inserting threads hold the barrier
+shared; swapping the buffers holds it exclusively. The occupied slots of the
+buffers and of the disk are counted with atomics, so the capacity check
+needs no lock.
+
+Labels are buffered the same way: the label updates since the last flush
+are kept by shard and merged into the disk filter by the flush rewrite, so
+the disk is never written for a single label.
+*/
 typedef class bufferedMQF {
 	public:
 		QF* memoryBuffer;
+		QF* flushBuffer;
+		std::vector<QF*> memoryShards;
+		std::vector<QF*> flushShards;
+		/* labels set since the last flush, by shard. They are swapped with the shards. */
+		std::vector<std::unordered_map<uint64_t,uint64_t> > memoryLabels;
+		std::vector<std::unordered_map<uint64_t,uint64_t> > flushLabels;
+		mutable std::vector<std::mutex> shardLocks;
+		mutable pthread_rwlock_t barrier;
+		/* incremented every time the buffers are swapped */
+		uint64_t flushGeneration;
+		std::atomic<uint64_t> bufferSlots;
+		std::atomic<uint64_t> flushSlots;
+		std::atomic<uint64_t> diskSlots;
+		/* flushBuffer holds items that are not on disk yet */
+		std::atomic<bool> flushPending;
+		std::thread flushThread;
+		std::exception_ptr flushError;
+		mutable std::mutex diskLock;
 		onDiskMQF_Namespace::onDiskMQF* disk;
 		string filename;
-		bufferedMQF(){
-			memoryBuffer=new QF();
-			//disk=new onDiskMQF_Namespace::onDiskMQF();
-		}
-		~bufferedMQF()
-		{
-		    if(memoryBuffer!=NULL)
-            {
-                qf_destroy(memoryBuffer);
-                delete memoryBuffer;
-            }
-
-			delete disk;
-		}
+		bufferedMQF();
+		~bufferedMQF();
 	} bufferedMQF;
 
     void bufferedMQF_deleteMemoryBuffer(bufferedMQF *qf);
-	void bufferedMQF_init(bufferedMQF *qf, uint64_t nslots_buffer ,uint64_t nslots, uint64_t key_bits, uint64_t value_bits,uint64_t fixed_counter_size,const char *path);
+	/*!
+	@breif initialize the buffered filter.
+
+	@param uint64_t nslots_buffer: Number of slots of the memory buffer, 0 for no buffer.
+	@param uint64_t nslots: Number of slots of the disk filter.
+	@param uint64_t nshards: Number of shards of the memory buffer, a power of 2. Use about two per inserting thread.
+	*/
+	void bufferedMQF_init(bufferedMQF *qf, uint64_t nslots_buffer ,uint64_t nslots, uint64_t key_bits, uint64_t value_bits,uint64_t fixed_counter_size,const char *path,uint64_t nshards=1);
 
 	void bufferedMQF_reset(bufferedMQF *qf);
 
 	void bufferedMQF_destroy(bufferedMQF *qf);
 
 	void bufferedMQF_copy(bufferedMQF *dest, bufferedMQF *src);
+	/* Write all the buffered items to disk and wait until they are there. */
 	void bufferedMQF_syncBuffer(bufferedMQF *qf);
+	/* Wait for the background flush, rethrowing its error if it failed. */
+	void bufferedMQF_waitForFlush(bufferedMQF *qf);
 
-	/* Increment the counter for this key/value pair by count. */
+	/* Increment the counter for this key/value pair by count. With lock=true
+	 * it can be called by several threads at the same time, also while
+	 * others count keys. The other functions must not run concurrently with it. */
 	bool bufferedMQF_insert(bufferedMQF *qf, uint64_t key, uint64_t count,
 								 bool lock, bool spin);
 
@@ -85,35 +148,35 @@ typedef class bufferedMQF {
 
 
 		/*!
-			@breif Add label to item.
+			@breif Add label to item. The label is kept in memory with the buffered items and written to disk by the next flush, in the same pass as the counts.
 
-			@param Qf* qf : pointer to the Filter
-			@param uint64_t key : hash of the item to be insertedItems
+			@param bufferedMQF* qf : pointer to the Filter
+			@param uint64_t key : hash of the item
 			@param uint64_t label: label to be added
-			@param bool lock: For Multithreading, Lock the slot used by the current thread so that other threads can't change the value
-			@param bool spin: For Multithreading, If there is a lock on the target slot. wait until the lock is freed and insert the count.
+			@param bool lock: For Multithreading, like in bufferedMQF_insert.
+			@param bool spin: For Multithreading, like in bufferedMQF_insert.
 
-			@return bool: True if the item is inserted correctly.
+			@return uint64_t: 1 if the label is recorded. It is dropped at the flush if the key is not in the filter then.
 		 */
-		uint64_t bufferedMQF_add_label(const QF *qf, uint64_t key, uint64_t label, bool lock=false, bool spin=false);
+		uint64_t bufferedMQF_add_label(bufferedMQF *qf, uint64_t key, uint64_t label, bool lock=false, bool spin=false);
 		/*!
-		@breif Return the label associated with a given item.
+		@breif Return the label associated with a given item, including the labels not flushed yet.
 
-		@param Qf* qf : pointer to the Filter.
+		@param bufferedMQF* qf : pointer to the Filter.
 		@param uint64_t key : hash of the item.
 
 		@return uint64_t the label associated with the input key.
 				*/
-		uint64_t bufferedMQF_get_label(const QF *qf, uint64_t key);
+		uint64_t bufferedMQF_get_label(const bufferedMQF *qf, uint64_t key);
 		/*!
-		@breif delete the label associated with a given item.
+		@breif delete the label associated with a given item. Like labels, the deletion is written to disk by the next flush.
 
-		@param Qf* qf : pointer to the Filter.
+		@param bufferedMQF* qf : pointer to the Filter.
 		@param uint64_t key : hash of the item.
 
-		@return bool: Returns true if the item is removed successfully.
+		@return uint64_t: 1 if the deletion is recorded.
 				*/
-		uint64_t bufferedMQF_remove_label(const QF *qf, uint64_t key, bool lock=false, bool spin=false);
+		uint64_t bufferedMQF_remove_label(bufferedMQF *qf, uint64_t key, bool lock=false, bool spin=false);
 
 
 
@@ -121,6 +184,13 @@ typedef class bufferedMQF {
 		 into qf. */
 	uint64_t bufferedMQF_count_key(const bufferedMQF *qf, uint64_t key);
 
+	/*! @breif Keep an in memory summary of the keys on disk, so that count_key does not read the disk for most of the keys that are only in the buffers or nowhere. The summary is updated by every flush and migrate. See onDiskMQF::enableSummary.
+
+	@param uint64_t bitsPerSlot: memory of the summary in bits per slot of the disk filter. Must be a power of 2, 0 disables the summary.
+	*/
+	void bufferedMQF_enableSummary(bufferedMQF *qf, uint64_t bitsPerSlot);
+	onDiskMQF_Namespace::onDiskMQFSummaryStats bufferedMQF_getSummaryStats(const bufferedMQF *qf);
+
 
 	void bufferedMQF_BatchQuery( bufferedMQF* qf,QF* input);
 
@@ -151,11 +221,28 @@ typedef class bufferedMQF {
 
 	int bufferedMQF_space(bufferedMQF *qf);
 
-	void bufferedMQF_migrate(bufferedMQF* source, bufferedMQF* destination);
+	/*! @breif Add the items and labels of source to destination, which can have any size.
+
+	Both buffers are written to their disk first, then the disk of source is merged into the disk of destination by onDiskMQF::migrateFromDisk. Neither filter can be modified during the migrate.
+
+	@param uint64_t nthreads: number of threads encoding the merged items.
+	@param onDiskMQFProgress progress: if set, called after every range of keys written to the disk of destination.
+	*/
+	void bufferedMQF_migrate(bufferedMQF* source, bufferedMQF* destination, uint64_t nthreads=1,
+		onDiskMQF_Namespace::onDiskMQFProgress progress=onDiskMQF_Namespace::onDiskMQFProgress());
 
+	/*! @breif Position the iterator at key, or at the first larger key if the filter does not have it. The buffers are not flushed, only a flush already running is waited for.
+
+	@return bool: true if the filter has the key.
+	*/
     bool bufferedMQF_find(bufferedMQF*,bufferedMQFIterator *qfi, uint64_t key);
 
+	/* Initialize an iterator over the merged items, starting at the items
+	 * of the slot position of the disk filter. */
     bufferedMQFIterator*  bufferedMQF_iterator(bufferedMQF *qf, uint64_t position);
+
+	/*! @breif Initialize an iterator over the keys between startKey and endKey, both included. */
+    bufferedMQFIterator*  bufferedMQF_rangeIterator(bufferedMQF *qf, uint64_t startKey, uint64_t endKey);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,81 @@
+#ifndef expandableMQF_H
+#define expandableMQF_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "gqf.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+@breif Counting filter that grows as it fills.
+
+When current reaches maxLoad it becomes old and an empty filter with twice
+the slots and the same key bits takes its place, so each doubling uses one
+remainder bit and the false positive rate does not change. The items of old
+are moved to current in key order, migrationStep of them per insert, so no
+insert waits for the whole filter to be copied. During the migration the
+keys from migrationKey onwards are counted in both filters.
+
+The filter is not thread safe.
+*/
+typedef class expandableMQF {
+	public:
+		QF* current;
+		/* filter being moved to current, NULL when no expansion is in progress */
+		QF* old;
+		QFi migrationIt;
+		/* keys smaller than migrationKey are only in current */
+		uint64_t migrationKey;
+		double maxLoad;
+		uint64_t migrationStep;
+		uint64_t nexpansions;
+		expandableMQF(){
+			current=new QF();
+			old=NULL;
+			migrationKey=0;
+			nexpansions=0;
+		}
+		~expandableMQF();
+	} expandableMQF;
+
+	/*!
+	@breif initialize the expandable filter.
+
+	@param expandableMQF* qf : pointer to the Filter.
+	@param uint64_t nslots : Initial number of slots. It doubles every time the load reaches maxLoad.
+	@param uint64_t key_bits: Number of bits in the hash values. The filter can grow until it has 2^(key_bits-2) slots.
+	@param uint64_t label_bits: Number of bits in label value.
+	@param uint64_t fixed_counter_size: Fixed counter size.
+	@param double maxLoad: Load factor that starts an expansion. It must leave room for the inserts done during the migration.
+	@param uint64_t migrationStep: Number of items moved to the new filter by every insert during an expansion.
+	*/
+	void expandableMQF_init(expandableMQF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,
+		uint64_t fixed_counter_size, double maxLoad=0.75, uint64_t migrationStep=4);
+
+	/* Increment the counter for this key by count. Throws overflow_error if
+	 * the filter is full and has no remainder bit left to grow. */
+	bool expandableMQF_insert(expandableMQF *qf, uint64_t key, uint64_t count);
+
+	/* Return the number of times key has been inserted into qf. */
+	uint64_t expandableMQF_count_key(const expandableMQF *qf, uint64_t key);
+
+	/* Decrement the counter for this key by count. */
+	bool expandableMQF_remove(expandableMQF *qf, uint64_t key, uint64_t count);
+
+	uint64_t expandableMQF_add_label(expandableMQF *qf, uint64_t key, uint64_t label);
+	uint64_t expandableMQF_get_label(const expandableMQF *qf, uint64_t key);
+
+	/* Move all the remaining items of old to current. The filter can then
+	 * be iterated through current. */
+	void expandableMQF_finishExpansion(expandableMQF *qf);
+
+	/* Number of slots of the filter taking the inserts. */
+	uint64_t expandableMQF_nslots(const expandableMQF *qf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* expandableMQF_H */
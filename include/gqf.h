@@ -23,19 +23,72 @@ extern "C" {
 
 	uint64_t shift_into_b2(uint64_t a, uint64_t b, int bstart, int bend, int amount);
 
+	/* Lock counters of one lock region. They are only updated while the
+		 runtime statistics are enabled, see qf_enable_runtime_stats. */
 	typedef struct {
-		uint64_t total_time_single;
-		uint64_t total_time_spinning;
 		uint64_t locks_taken;
 		uint64_t locks_acquired_single_attempt;
+		/* failed test-and-set rounds before the lock was taken */
+		uint64_t spins;
+		/* nanoseconds spent spinning */
+		uint64_t total_time_spinning;
+		/* lock calls without spin that found the lock taken */
+		uint64_t failed_attempts;
 	} wait_time_data;
 
+	struct qf_stats_shard;
+	struct qf_stats_delta;
+	struct qf_latency_shard;
+
+	/* Operations timed by the latency histograms. */
+	typedef enum {
+		QF_OP_INSERT,
+		QF_OP_COUNT,
+		QF_OP_REMOVE,
+		/* qf_add_label, qf_get_label and qf_remove_label */
+		QF_OP_LABEL,
+		/* qfi_next */
+		QF_OP_NEXT,
+		QF_NOPS
+	} qf_op;
+
+	/* An operation slower than the threshold of qf_set_slow_op_callback. */
+	typedef struct {
+		qf_op op;
+		/* 0 for QF_OP_NEXT */
+		uint64_t key;
+		uint64_t quotient;
+		uint64_t latency_ns;
+		/* slots from the quotient to the end of its cluster after the operation */
+		uint64_t cluster_length;
+		/* slots moved by an insert or a remove */
+		uint64_t shifted_slots;
+	} qf_slow_op;
+
+	typedef void (*qf_slow_op_callback)(const qf_slow_op *op, void *arg);
+
 	typedef struct quotient_filter_mem {
 		int fd;
 		volatile int general_lock;
 		volatile int metadata_lock;
 		volatile int *locks;
+		/* num_locks+1 entries, the last one is the general lock */
 		wait_time_data *wait_times;
+		volatile bool collect_stats;
+		struct qf_stats_shard *stats;
+		/* per thread changes of the numbers reported by qf_stats. They are
+		 * recounted by the first qf_stats after the blocks were loaded or
+		 * copied instead of built by inserts. */
+		struct qf_stats_delta *deltas;
+		bool deltas_valid;
+		/* set while the latency histograms or the slow operation callback
+		 * are on */
+		volatile bool time_ops;
+		volatile bool collect_latency;
+		struct qf_latency_shard *latency;
+		uint64_t slow_op_threshold;
+		qf_slow_op_callback slow_op_callback;
+		void *slow_op_arg;
 	} quotient_filter_mem;
 
 	typedef quotient_filter_mem qfmem;
@@ -61,6 +114,7 @@ extern "C" {
 		uint64_t num_locks;
 		uint64_t maximum_count;
 		bool mem;
+		bool separate_labels;
 		std::map<uint64_t, std::vector<int> > * labels_map;
 	} quotient_filter_metadata;
 
@@ -98,13 +152,21 @@ extern "C" {
 	@param uint64_t nslots : Number of slots in the filter. Maximum number of items to be inserted depends on this number.
 	@param uint64_t key_bits: Number of bits in the hash values. This number should equal log2(nslots) +r. Accuracy depends on r.
 	@param uint64_t label_bits: Number of bits in label value.
-	@param uint64_t fixed_counter_size: Fixed counter size. must be > 0.
+	@param uint64_t fixed_counter_size: Fixed counter size. 0 makes a presence only filter: every key takes one slot and counts as 1.
 	@param bool mem: Flag to create the filter on memeory. IF false, mmap is used.
 	@param const char * path: In case of mmap. Path of the file used to pack the filter.
 	@param uint32_t seed: useless value. To be removed
 		  */
 	void qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,uint64_t blocksLabelSize, bool mem, const char *path, uint32_t seed);
 
+	/*!
+	@breif initialize mqf with the labels kept in a separate bit array per block
+	instead of being packed in the high bits of each slot. Slots only hold the
+	remainder and the fixed counter, so run scans touch fewer cache lines when
+	labels are wide. Parameters are the same as qf_init.
+		  */
+	void qf_init_separate_labels(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,uint64_t blocksLabelSize, bool mem, const char *path, uint32_t seed);
+
 	void qf_reset(QF *qf);
 
 	void qf_destroy(QF *qf);
@@ -156,6 +218,54 @@ extern "C" {
 		  */
 	uint64_t qf_count_key(const QF *qf, uint64_t key);
 
+	/* Where qf_probe found a key, or where its counter would be inserted. */
+	typedef struct quotient_filter_probe {
+		uint64_t key;
+		uint64_t count;
+		uint64_t label;
+		/* the bucket of the key has a run, from runstart to runend */
+		bool occupied;
+		uint64_t runstart;
+		uint64_t runend;
+		/* first and last slot of the counter of the key. If the key is not
+		 * in the run, index is where its counter would start and end is index-1. */
+		uint64_t index;
+		uint64_t end;
+	} qfprobe;
+
+	/* Prefetch the block of the bucket of key, so that a probe issued a
+		 little later does not wait for memory. */
+	void qf_prefetch(const QF *qf, uint64_t key);
+
+	/*!
+	@breif Locate key with one search of its run.
+
+	@param qfprobe* p : filled with the count, the label and the position of the key. It stays valid until the filter is modified.
+
+	@return uint64_t the count associated with the key, 0 if it is not in the filter.
+		  */
+	uint64_t qf_probe(const QF *qf, uint64_t key, qfprobe *p);
+
+	/*!
+	@breif Set the counter of a probed key, reusing the positions found by qf_probe instead of searching the run again.
+
+	@param uint64_t count: new count. 0 removes the key.
+	@param bool lock: For Multithreading. The key is probed again under the lock, since other threads may have moved it. count is still set as given, so a count computed from p->count can overwrite updates of other threads; take qf_lock_key around the probe and the update instead.
+
+	@return bool: False if the lock could not be taken.
+	 */
+	bool qf_set_probed(QF *qf, const qfprobe *p, uint64_t count, bool lock=false, bool spin=false);
+
+	/*!
+	@breif Take the lock of the bucket of key, so that several probes and updates of the key are done as one operation. The probes and updates are then called with lock=false.
+
+	@return bool: False if the lock could not be taken.
+	 */
+	bool qf_lock_key(const QF *qf, uint64_t key, bool spin=false);
+
+	/* Release the lock taken by qf_lock_key. */
+	void qf_unlock_key(const QF *qf, uint64_t key);
+
 	/*!
 	@breif Decrement the counter for this item by count.
 
@@ -206,7 +316,21 @@ extern "C" {
 	uint64_t qf_remove_label(const QF *qf, uint64_t key, bool lock=false, bool spin=false);
 
 
-	void qf_setCounter(QF* qf,uint64_t key, uint64_t count, bool lock=false, bool spin=false);
+	/*!
+	@breif Set the counter of an item with one search of its run. A counter that keeps its number of slots is rewritten in place.
+
+	@param uint64_t count: new count. 0 removes the item.
+	@param bool lock: For Multithreading. The search and the update are done under the same lock.
+
+	@return bool: False if the lock could not be taken.
+	 */
+	bool qf_setCounter(QF* qf,uint64_t key, uint64_t count, bool lock=false, bool spin=false);
+	/*!
+	@breif Add delta to the counter of an item, or remove -delta if delta is negative. The counter does not go below 0.
+
+	@return bool: False if the lock could not be taken.
+	 */
+	bool qf_add_to_counter(QF* qf,uint64_t key, int64_t delta, bool lock=false, bool spin=false);
 	/* Initialize an iterator */
 	bool qf_iterator(QF *qf, QFi *qfi, uint64_t position);
 	bool qfi_find(QF *qf,QFi *qfi, uint64_t key);
@@ -229,11 +353,12 @@ extern "C" {
 	/*! write data structure of to the disk */
 	void qf_serialize(const QF *qf, const char *filename);
 
-	/* read data structure off the disk */
-	void qf_deserialize(QF *qf, const char *filename);
+	/* read data structure off the disk. offset is where qf_serialize's data
+		 starts in the file, for files holding several filters. */
+	void qf_deserialize(QF *qf, const char *filename, uint64_t offset=0);
 
-	/* mmap the QF from disk. */
-	void qf_read(QF *qf, const char *path);
+	/* mmap the QF from disk. offset must be a multiple of the page size. */
+	void qf_read(QF *qf, const char *path, uint64_t offset=0);
 
 	/* merge two QFs into the third one. */
 	void qf_merge(QF *qfa, QF *qfb, QF *qfc);
@@ -279,6 +404,112 @@ extern "C" {
 	bool qf_general_lock(QF* qf, bool spin);
 	void qf_general_unlock(QF* qf);
 
+#define QF_STATS_BUCKETS 32
+
+	/* Totals of the runtime statistics. The length histograms have log2
+		 buckets: bucket 0 counts zeros and bucket b counts values in
+		 [2^(b-1), 2^b). counter_slots is linear, the last bucket holds all
+		 the longer counters. */
+	typedef struct {
+		uint64_t lock_acquisitions;
+		uint64_t lock_single_attempt;
+		uint64_t lock_spins;
+		uint64_t lock_wait_ns;
+		uint64_t lock_failures;
+		/* operations that returned false because the general lock was taken */
+		uint64_t general_lock_failures;
+		uint64_t inserts;
+		/* slots of the run of the inserted key, 0 if its bucket was empty */
+		uint64_t run_length[QF_STATS_BUCKETS];
+		/* slots from the bucket of the inserted key to the empty slot that
+			 ended its cluster */
+		uint64_t cluster_length[QF_STATS_BUCKETS];
+		uint64_t shifted_slots[QF_STATS_BUCKETS];
+		/* slots of the counters written by inserts */
+		uint64_t counter_slots[QF_STATS_BUCKETS];
+	} qf_runtime_stats;
+
+	/*!
+	@breif Start or stop collecting the runtime statistics of qf.
+
+	Threads count into their own cache line and the totals are summed by
+	qf_get_runtime_stats, so the collection costs a few increments per operation.
+	Lock counters are kept per lock region in qf->mem->wait_times.
+	While disabled the only cost is one flag test per operation.
+	*/
+	void qf_enable_runtime_stats(QF *qf, bool enable);
+
+	/* Sum the statistics collected since they were enabled or reset. */
+	void qf_get_runtime_stats(const QF *qf, qf_runtime_stats *stats);
+
+	void qf_reset_runtime_stats(QF *qf);
+
+#define QF_COUNT_BUCKETS 64
+
+	typedef struct {
+		uint64_t nslots;
+		uint64_t distinct_items;
+		uint64_t total_count;
+		/* occupied_slots = remainder_slots + counter_slots. Every item has
+			 one remainder slot, counter_slots hold the digits of the counts
+			 that do not fit in the fixed counters. */
+		uint64_t occupied_slots;
+		uint64_t remainder_slots;
+		uint64_t counter_slots;
+		/* longest cluster seen by an insert, counted from the home bucket
+			 of the inserted item. Removes do not shorten it. */
+		uint64_t largest_cluster;
+		/* bucket b counts the items with a count in [2^b, 2^(b+1)) */
+		uint64_t count_histogram[QF_COUNT_BUCKETS];
+	} qf_stats_data;
+
+	/*!
+	@breif Report the fullness and counter overhead of the filter in O(1).
+
+	The inserts and removes keep the numbers in per thread deltas, which
+	qf_stats sums, so it is cheap enough to be polled while other threads
+	insert. The first call after qf_read, qf_deserialize or qf_copy counts
+	them with one scan of the filter, which must not be modified meanwhile.
+	*/
+	void qf_stats(const QF *qf, qf_stats_data *stats);
+
+/* Latency buckets: exact below 16ns, then 8 buckets per power of two up to
+ * 2^40ns, so a bucket is at most 12.5% wide. The last bucket holds
+ * everything from 2^40ns. */
+#define QF_LATENCY_BUCKETS 305
+
+	typedef struct {
+		uint64_t count;
+		uint64_t total_ns;
+		uint64_t max_ns;
+		uint64_t buckets[QF_LATENCY_BUCKETS];
+	} qf_latency_histogram;
+
+	/*!
+	@breif Start or stop timing the operations of qf into latency histograms.
+
+	Threads record into their own shard. While off, and without a slow
+	operation callback, an operation only tests one flag.
+	*/
+	void qf_enable_latency(QF *qf, bool enable);
+
+	/* Sum the latencies of op recorded since they were enabled or reset. */
+	void qf_get_latency(const QF *qf, qf_op op, qf_latency_histogram *histogram);
+
+	/* Upper bound in ns of the q quantile (0 to 1) of the histogram. */
+	uint64_t qf_latency_quantile(const qf_latency_histogram *histogram, double q);
+
+	void qf_reset_latency(QF *qf);
+
+	/*!
+	@breif Call callback after every operation taking at least threshold_ns.
+
+	The callback runs on the thread of the operation, after the filter locks
+	are released, and must not throw. NULL removes the callback.
+	*/
+	void qf_set_slow_op_callback(QF *qf, uint64_t threshold_ns,
+		qf_slow_op_callback callback, void *arg=NULL);
+
 	void qf_migrate(QF* source, QF* destination);
 	double slotsUsedInCounting(QF* qf);
 
@@ -0,0 +1,90 @@
+#ifndef _kmerPipeline_H
+#define _kmerPipeline_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include "gqf.h"
+#include "bufferedMQF.h"
+
+namespace MQF {
+
+    /* 2-bit encoding of the k-mers: A=0, C=1, G=2, T=3. */
+    uint64_t encodeKmer(const std::string &kmer);
+    std::string decodeKmer(uint64_t kmer, uint64_t k);
+    /* Smaller of the k-mer and its reverse complement. */
+    uint64_t canonicalKmer(uint64_t kmer, uint64_t k);
+
+    /* Invertible hash of the 2k bits of a k-mer. The pipeline inserts
+     * kmerHash(kmer,k) % range, which kmerHashInverse turns back into the
+     * k-mer when the filter has at least 2k key bits. */
+    uint64_t kmerHash(uint64_t kmer, uint64_t k);
+    uint64_t kmerHashInverse(uint64_t hash, uint64_t k);
+
+    typedef struct kmerPipelineOptions {
+        /* k-mer size, at most 32 */
+        uint64_t k;
+        /* threads reading and decompressing the files, one file each at a time */
+        uint64_t readers;
+        /* threads extracting and hashing the k-mers of the chunks */
+        uint64_t parsers;
+        /* threads inserting the batches in the filter */
+        uint64_t inserters;
+        /* bytes of sequence file in a chunk */
+        uint64_t chunkSize;
+        /* k-mers hashed before a batch is sorted and sent to the inserters */
+        uint64_t batchSize;
+        /* capacity of the queues between the stages */
+        uint64_t queueSize;
+        kmerPipelineOptions(uint64_t k=31, uint64_t nthreads=4);
+    } kmerPipelineOptions;
+
+    /* Per stage counters. The times are the busy time of the threads of the
+     * stage summed, without the time waiting on the queues, so for example
+     * bytes/readNs is the throughput of one reader. */
+    typedef struct kmerPipelineStats {
+        uint64_t files;
+        /* bytes of the files after decompression */
+        uint64_t bytes;
+        uint64_t chunks;
+        uint64_t records;
+        uint64_t kmers;
+        uint64_t batches;
+        /* one insert per distinct k-mer of a batch */
+        uint64_t inserts;
+        uint64_t readNs;
+        uint64_t parseNs;
+        uint64_t insertNs;
+        /* times a stage waited on a full output queue or an empty input queue */
+        uint64_t readStalls;
+        uint64_t parseStalls;
+        uint64_t insertStalls;
+        uint64_t elapsedNs;
+    } kmerPipelineStats;
+
+    /*!
+    @breif Count the canonical k-mers of FASTA or FASTQ files, plain or gzip compressed.
+
+    The readers cut the files in chunks of whole records, the parsers extract
+    the k-mers of the chunks with a rolling 2-bit encoding, skipping k-mers
+    with other bases than ACGT, and hash them into the range of the filter.
+    The hashes are sorted and counted by batch, and the inserters insert every
+    distinct hash once with its count. The stages are connected by lock-free
+    queues. Throws the first error of a stage, for example overflow_error when
+    the filter is full or runtime_error when a file cannot be opened, after
+    stopping the other threads.
+
+    @return kmerPipelineStats: counters of the stages.
+    */
+    kmerPipelineStats countKmers(const std::vector<std::string> &files, QF *qf,
+                                 const kmerPipelineOptions &options=kmerPipelineOptions());
+    kmerPipelineStats countKmers(const std::vector<std::string> &files, bufferedMQF *qf,
+                                 const kmerPipelineOptions &options=kmerPipelineOptions());
+    /* The k-mers are sharded by the low bits of their hashes, like the
+     * shards of bufferedMQF. The number of shards must be a power of 2, and
+     * the shards must have the same range. */
+    kmerPipelineStats countKmers(const std::vector<std::string> &files, const std::vector<QF*> &shards,
+                                 const kmerPipelineOptions &options=kmerPipelineOptions());
+
+};
+#endif /* _kmerPipeline_H */
@@ -0,0 +1,148 @@
+#ifndef lsmMQF_H
+#define lsmMQF_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include "gqf.h"
+#include "onDiskMQF.h"
+#include "pageCache.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+@breif Immutable on disk filter holding part of the items of an lsmMQF.
+
+The summary of disk is written together with the run, so a query for a key
+that the summary does not have skips the run without reading it.
+*/
+typedef struct lsmMQFRun {
+	onDiskMQF_Namespace::onDiskMQF* disk;
+	string filename;
+} lsmMQFRun;
+
+typedef struct lsmMQFStats {
+	uint64_t nflushes;
+	uint64_t ncompactions;
+	/* slots written to level 0 by the flushes */
+	uint64_t slotsFlushed;
+	/* slots written by the flushes and the compactions */
+	uint64_t slotsWritten;
+	/* runs read by queries, and runs skipped because of their summary */
+	uint64_t diskProbes;
+	uint64_t summaryNegatives;
+} lsmMQFStats;
+
+/*!
+@breif Counting filter organized as a log structured merge tree of on disk runs.
+
+Inserts go to memoryBuffer. When it fills up it is swapped with flushBuffer
+and a background thread writes it to a new run of level 0. When level 0
+has fanout runs, they are merged with the following levels into the first
+level i whose run of nslots_buffer*fanout^i slots can hold them, so the
+levels grow geometrically and every item is rewritten O(fanout) times per
+level, O(log(N)) times in total.
+
+Runs are never modified. Compactions read them through their own handles
+and write the merged run to a new file, so queries only wait for the swap
+of the runs under levelsLock. Queries check the buffers and then the runs
+from the newest to the oldest, skipping the runs whose summary does not
+have the key. The run files are deleted with the filter.
+*/
+typedef class lsmMQF {
+	public:
+		QF* memoryBuffer;
+		QF* flushBuffer;
+		/* flushBuffer holds items that are not in a run yet */
+		std::atomic<bool> flushPending;
+		std::thread flushThread;
+		std::exception_ptr flushError;
+		/* levels[0] holds the runs written by the flushes, oldest first. The
+		 * other levels hold at most one run. */
+		std::vector<std::vector<lsmMQFRun*> > levels;
+		mutable std::mutex levelsLock;
+		mutable lsmMQFStats stats;
+		string filename;
+		uint64_t fanout;
+		uint64_t summaryBitsPerSlot;
+		uint64_t nextRunId;
+		onDiskMQF_Namespace::pageCache* cache;
+		lsmMQF(){
+			memoryBuffer=new QF();
+			flushBuffer=new QF();
+			flushPending=false;
+			memset(&stats,0,sizeof(lsmMQFStats));
+		}
+		~lsmMQF();
+	} lsmMQF;
+
+	typedef class lsmMQFIterator {
+	public:
+		/* sources from the newest to the oldest */
+		std::vector<QFi*> bufferIts;
+		std::vector<onDiskMQF_Namespace::onDiskMQFScanner*> runIts;
+		uint64_t currentKey;
+		uint64_t currentLabel;
+		uint64_t currentCount;
+		bool finished;
+		lsmMQFIterator(lsmMQF* qf);
+
+		int get(uint64_t *key, uint64_t *value, uint64_t *count);
+
+		/* Advance to next entry.  Returns whether or not another entry is
+	         found.  */
+		int next();
+
+		/* Check to see if the if the end of the QF */
+		int end();
+		~lsmMQFIterator();
+	} lsmMQFIterator;
+
+	/*!
+	@breif initialize the lsm filter.
+
+	@param lsmMQF* qf : pointer to the Filter.
+	@param uint64_t nslots_buffer : Number of slots of the memory buffer and of the runs of level 0.
+	@param uint64_t key_bits: Number of bits in the hash values. It bounds the size of the largest level.
+	@param uint64_t label_bits: Number of bits in label value.
+	@param uint64_t fixed_counter_size: Fixed counter size. must be > 0.
+	@param const char * path: Prefix of the run files.
+	@param uint64_t fanout: Size ratio between consecutive levels and number of runs of level 0. Must be a power of 2.
+	@param uint64_t summaryBitsPerSlot: Memory used by the summaries, in bits per slot of the runs. Must be a power of 2, 0 disables the summaries. A run at 75% load still reads the disk for about 1-exp(-0.75/summaryBitsPerSlot) of the queries for keys it does not have.
+	@param pageCache* cache: if not NULL, all the runs are accessed through it.
+	*/
+	void lsmMQF_init(lsmMQF *qf, uint64_t nslots_buffer, uint64_t key_bits, uint64_t label_bits,
+		uint64_t fixed_counter_size, const char *path, uint64_t fanout=4,
+		uint64_t summaryBitsPerSlot=4, onDiskMQF_Namespace::pageCache* cache=NULL);
+
+	/* Increment the counter for this key/value pair by count. */
+	bool lsmMQF_insert(lsmMQF *qf, uint64_t key, uint64_t count,
+								 bool lock=false, bool spin=false);
+
+	/* Return the number of times key has been inserted, with any value,
+		 into qf. */
+	uint64_t lsmMQF_count_key(const lsmMQF *qf, uint64_t key);
+
+	/* Write the buffered items to level 0 and wait for the compactions. */
+	void lsmMQF_syncBuffer(lsmMQF *qf);
+	/* Wait for the background flush and compaction, rethrowing their error if they failed. */
+	void lsmMQF_waitForCompaction(lsmMQF *qf);
+
+	/* Initialize an iterator over the merged levels. The filter must not be modified while it is used. */
+	lsmMQFIterator* lsmMQF_iterator(lsmMQF *qf);
+
+	lsmMQFStats lsmMQF_getStats(const lsmMQF *qf);
+	/* Slots written to disk per slot flushed. */
+	double lsmMQF_writeAmplification(const lsmMQF *qf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* lsmMQF_H */
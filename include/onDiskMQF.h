@@ -3,10 +3,14 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <string.h>
 #include <pthread.h>
 #include <map>
 #include <vector>
+#include <deque>
+#include <functional>
 #include "gqf.h"
+#include "pageCache.h"
 #include <fstream>
 
 #include <iostream>
@@ -114,6 +118,66 @@ namespace onDiskMQF_Namespace{
 
 	};
 
+	typedef struct onDiskMQFItem {
+		uint64_t key;
+		uint64_t label;
+		uint64_t count;
+	} onDiskMQFItem;
+
+	/* Position of a sequential scan over the slots of a filter. runs holds
+	 * the quotients before index whose runs are not finished yet. */
+	typedef struct onDiskMQFCursor {
+		uint64_t index;
+		std::deque<uint64_t> runs;
+		onDiskMQFCursor():index(0){}
+	} onDiskMQFCursor;
+
+	/*!
+	@breif Reads all the items of a filter in key order.
+
+	Items are decoded in batches with onDiskMQF::scan, so the filter is read
+	sequentially and its pages are pinned once per batch instead of once per
+	item. The filter must not be modified while it is scanned.
+	*/
+	class onDiskMQFScanner {
+	public:
+		onDiskMQFScanner(onDiskMQF* qf, uint64_t batchSize=1024);
+		/* Returns true when all the items were read. */
+		bool end();
+		const onDiskMQFItem& get();
+		void next();
+	private:
+		onDiskMQF* qf;
+		onDiskMQFCursor cursor;
+		std::vector<onDiskMQFItem> batch;
+		uint64_t nitems;
+		uint64_t pos;
+		void fill();
+	};
+
+	/* Progress of migrateFromDisk, reported after every range of keys written
+	 * to the new file. */
+	typedef struct onDiskMQFMigrateProgress {
+		/* items read from the sources and from the destination */
+		uint64_t itemsRead;
+		/* estimate of the items to read, from ndistinct_elts of the filters */
+		uint64_t totalItems;
+		uint64_t itemsWritten;
+		uint64_t slotsWritten;
+	} onDiskMQFMigrateProgress;
+	typedef std::function<void(const onDiskMQFMigrateProgress&)> onDiskMQFProgress;
+
+	/* Label updates applied by a merge, (key,label) pairs sorted by key. */
+	typedef std::vector<std::pair<uint64_t,uint64_t> > onDiskMQFLabels;
+
+	typedef struct onDiskMQFSummaryStats {
+		/* queries answered from the summary without reading the disk */
+		uint64_t negatives;
+		/* queries that read the disk, and those of them that did not find the key */
+		uint64_t probes;
+		uint64_t falsePositives;
+	} onDiskMQFSummaryStats;
+
     static bool isDiskInitialized=false;
 	class onDiskMQF {
 	public:
@@ -126,8 +190,13 @@ namespace onDiskMQF_Namespace{
 		std::fstream diskMQFStream;
 		qfblock **blocksPointers;
 		diskParameters* diskParams;
-		static void init( onDiskMQF *&qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size ,const char * path);
-        static void load(onDiskMQF*& qff,const char *filename);
+		/*!
+		@breif Create an on disk filter at path.
+
+		@param pageCache* cache: if NULL the blocks are kept in an stxxl vector. Otherwise the file is accessed with pread/pwrite through cache, which can be shared between filters to keep them all in the cache's memory budget.
+		*/
+		static void init( onDiskMQF *&qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size ,const char * path, pageCache* cache=NULL);
+        static void load(onDiskMQF*& qff,const char *filename, pageCache* cache=NULL);
         virtual ~onDiskMQF(){};
 	/*!
 	@breif initialize mqf .
@@ -303,15 +372,83 @@ namespace onDiskMQF_Namespace{
 	virtual void general_unlock()=0;
 
 	//void onDiskMQF_migrate(onDiskMQF* source, onDiskMQF* destination);
-	virtual void migrateFromQF(QF* source)=0;
+	void migrateFromQF(QF* source){
+		migrateFromQF(&source,1);
+	}
 
-	//void onDiskMQF_migrate(onDiskMQF* source, onDiskMQF* destination);
-    void migrate(onDiskMQF* dist);
+	/*! @breif Merge the items of several memory filters into this one, summing the counts of equal keys.
+
+	@param QF** sources: filters to merge. When several of them have a key, its label is taken from the first one, and a label other than 0 of the sources replaces the label of this filter.
+	@param int nsources: number of sources.
+	@param onDiskMQFLabels* labels: labels to set in the same pass, they take precedence over the labels of the sources. Labels of keys that are neither in the sources nor in this filter are dropped.
+	*/
+	virtual void migrateFromQF(QF** sources, int nsources, const onDiskMQFLabels* labels=NULL)=0;
+
+	/*! @breif Merge the items of other on disk filters into this one, summing the counts of equal keys.
+
+	The sources are read sequentially and, unless they are much smaller than this filter, the file is rewritten in one pass like in migrateFromQF. The sources are not modified and can have any size, but their key bits must be the same as this filter's.
+
+	The rewrite is a pipeline: a thread reads the sources and this filter ahead and merges them into ranges of consecutive keys, nthreads threads encode the slots of the ranges, and the calling thread places them in the new file, which is written front to back.
+
+	@param onDiskMQF** sources: filters to merge. When several of them have a key, its label is taken from the first one, and a label other than 0 of the sources replaces the label of this filter.
+	@param int nsources: number of sources.
+	@param uint64_t nthreads: number of threads encoding the ranges.
+	@param onDiskMQFProgress progress: if set, called by the calling thread after every range written, and once at the end.
+	*/
+	virtual void migrateFromDisk(onDiskMQF** sources, int nsources, uint64_t nthreads=1,
+		onDiskMQFProgress progress=onDiskMQFProgress())=0;
+
+	/*! @breif Decode the next items of a sequential scan. Use onDiskMQFScanner to read all the items of a filter.
+
+	@param onDiskMQFCursor* cursor: position of the scan. A new cursor starts at the beginning of the filter.
+	@param onDiskMQFItem* items: output array.
+	@param uint64_t n: maximum number of items to decode.
+
+	@return uint64_t: number of decoded items, 0 at the end of the filter.
+	*/
+	virtual uint64_t scan(onDiskMQFCursor* cursor, onDiskMQFItem* items, uint64_t n)=0;
+
+	/*! @breif Keep an in memory summary of the keys so that count_key returns 0 without reading the disk for most of the absent keys.
+
+	The summary has a bit per group of 2^summaryShift consecutive keys, set if any of them is in the filter. It is built with one scan of the filter and then kept up to date by insert and by the rewrites of migrateFromQF and migrateFromDisk. Removals leave the bits set, so the summary never hides a key. It is not saved by serialize and has to be enabled again after load.
+
+	@param uint64_t bitsPerSlot: memory of the summary in bits per slot of the filter. Must be a power of 2, 0 disables the summary. At a load of 75% the disk is still read for about 1-exp(-0.75/bitsPerSlot) of the queries for absent keys.
+	*/
+	void enableSummary(uint64_t bitsPerSlot);
+	void disableSummary();
+	/*! @breif Return false if the key is certainly not in the filter. */
+	inline bool summaryHas(uint64_t key) const {
+		if(summary.empty())
+			return true;
+		uint64_t i=summaryIndex(key);
+		return (summary[i/64]>>(i%64))&1;
+	}
+	onDiskMQFSummaryStats getSummaryStats() const { return summaryStats; }
+	void resetSummaryStats(){ memset(&summaryStats,0,sizeof(summaryStats)); }
+
+	/*! @breif Add the items of this filter to dist, which can have any size. See migrateFromDisk. */
+    void migrate(onDiskMQF* dist, uint64_t nthreads=1, onDiskMQFProgress progress=onDiskMQFProgress());
 
 
     virtual  bool getForIterator(onDiskMQFIterator* qfi,uint64_t *key, uint64_t *value, uint64_t *count)=0;
 	virtual int nextForIterator(onDiskMQFIterator *qfi)=0;
 	virtual bool findIterator(onDiskMQFIterator  *qfi, uint64_t key)=0;
+
+	protected:
+	std::vector<uint64_t> summary;
+	uint64_t summaryShift=0;
+	uint64_t summaryMask=0;
+	uint64_t summaryBitsPerSlot=0;
+	onDiskMQFSummaryStats summaryStats={0,0,0};
+	inline uint64_t summaryIndex(uint64_t key) const {
+		return (key & summaryMask)>>summaryShift;
+	}
+	inline void summaryAdd(uint64_t key){
+		if(!summary.empty()){
+			uint64_t i=summaryIndex(key);
+			summary[i/64]|=1ULL<<(i%64);
+		}
+	}
 	};
 
 
@@ -0,0 +1,121 @@
+#ifndef pageCache_H
+#define pageCache_H
+
+#include <inttypes.h>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+namespace onDiskMQF_Namespace{
+
+	typedef struct pageCacheStats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		uint64_t bytesRead;
+		uint64_t bytesWritten;
+		uint64_t bytesCached;
+	} pageCacheStats;
+
+	/*!
+	@breif Page cache for disk backed filters built on pread/pwrite.
+
+	The cache holds at most memoryBudget bytes of pages. Pages are
+	distributed over independently locked shards, each one evicting with the
+	CLOCK algorithm. Several files, possibly with different page sizes, can
+	share the same cache so that a group of filters fits in one memory limit.
+	A pinned page is never evicted; its pointer stays valid until it is
+	unpinned.
+	*/
+	class pageCache {
+	public:
+		/*!
+		@breif Create a cache.
+
+		@param uint64_t memoryBudget: maximum number of bytes used by the cached pages.
+		@param uint64_t nshards: number of shards. It is reduced for small budgets so that every shard keeps at least 1MB.
+		*/
+		pageCache(uint64_t memoryBudget, uint64_t nshards=16);
+		~pageCache();
+
+		/*! @breif Largest page size that keeps at least 8 pages in every shard. */
+		uint64_t maxPageSize();
+
+		/*!
+		@breif Register an open file. The caller keeps the ownership of fd.
+
+		@param int fd: file descriptor opened for reading and writing.
+		@param uint64_t pageSize: size in bytes of the pages of this file.
+		@param uint64_t fileSize: size in bytes of the file. Pages are never written past it.
+
+		@return int: id of the file to be used in the other calls.
+		*/
+		int addFile(int fd, uint64_t pageSize, uint64_t fileSize);
+
+		/*!
+		@breif Drop all the pages of the file. The pages must be unpinned.
+
+		@param bool writeBack: write the dirty pages back first. Pass false when the file is going to be replaced.
+		*/
+		void removeFile(int fileId, bool writeBack=true);
+
+		/*!
+		@breif Pin a page and return a pointer to its content.
+
+		@param bool dirty: the caller is going to modify the page.
+		*/
+		char* pin(int fileId, uint64_t pageNo, bool dirty);
+		void unpin(int fileId, uint64_t pageNo);
+		/*! @breif Mark an already pinned page as modified. */
+		void markDirty(int fileId, uint64_t pageNo);
+
+		/*! @breif Write back the dirty pages of the file, or of all files if fileId is -1. */
+		void flush(int fileId=-1);
+
+		pageCacheStats getStats();
+		double hitRate();
+		void resetStats();
+
+		uint64_t memoryBudget;
+		uint64_t nshards;
+
+	private:
+		typedef struct frame {
+			int fileId;
+			uint64_t pageNo;
+			char* data;
+			uint64_t size;
+			uint32_t pinCount;
+			bool referenced;
+			bool dirty;
+		} frame;
+
+		typedef struct cachedFile {
+			int fd;
+			uint64_t pageSize;
+			uint64_t fileSize;
+		} cachedFile;
+
+		typedef struct shard {
+			std::mutex lock;
+			std::vector<frame> frames;
+			std::unordered_map<uint64_t, uint64_t> index;
+			std::vector<uint64_t> freeFrames;
+			uint64_t hand;
+			uint64_t bytesCached;
+			uint64_t budget;
+			pageCacheStats stats;
+		} shard;
+
+		std::vector<cachedFile> files;
+		std::mutex filesLock;
+		shard* shards;
+
+		shard* getShard(int fileId, uint64_t pageNo);
+		cachedFile getFile(int fileId);
+		void writeBack(shard* s, frame* f);
+		uint64_t evict(shard* s, uint64_t size);
+	};
+
+}
+#endif /* pageCache_H */
@@ -5,6 +5,9 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <unordered_map>
+#include <limits>
+#include "gqf.h"
 
 namespace MQF {
 
@@ -21,11 +24,92 @@ namespace MQF {
         return f.good();
     }
 
-    uint64_t estimateMemory(uint64_t nslots, uint64_t slotSize, uint64_t fcounter, uint64_t tagSize) ;
+    /* Number of slots taken by a counter, following encode_counter. */
+    uint64_t counterSlots(uint64_t count, uint64_t fixedSizeCounter, uint64_t slotSize);
+
+    /* Memory of a filter in KB. blockLabelSize is in bytes per block of 64 slots. */
+    uint64_t estimateMemory(uint64_t nslots, uint64_t slotSize, uint64_t fcounter, uint64_t tagSize, uint64_t blockLabelSize=0) ;
     bool isEnough(std::vector<uint64_t>& histogram, uint64_t noSlots, uint64_t fixedSizeCounter, uint64_t slotSize) ;
     void estimateMemRequirement(std::vector<uint64_t>& histogram,
                                 uint64_t numHashBits, uint64_t tagSize,
-                                uint64_t *res_noSlots, uint64_t *res_fixedSizeCounter, uint64_t *res_memory) ;
+                                uint64_t *res_noSlots, uint64_t *res_fixedSizeCounter, uint64_t *res_memory,
+                                uint64_t blockLabelSize=0) ;
+
+    /*!
+    @breif Streaming estimate of the number of distinct keys and of their abundance histogram.
+
+    Distinct keys are counted with a HyperLogLog of 2^hllBits one byte registers.
+    The abundances are exact for a sample of the keys chosen by their hash: when
+    the sample grows over maxSamples, the sampling rate is halved and the keys
+    that are no longer sampled are dropped, so the memory stays bounded for any
+    input. Sketches of parts of the input, for example one per thread, can be
+    merged.
+    */
+    class abundanceSketch {
+    public:
+        abundanceSketch(uint64_t hllBits=14, uint64_t maxSamples=(1ULL<<16));
+
+        void add(uint64_t hash, uint64_t count=1);
+        /* Both sketches must have the same hllBits. */
+        void merge(const abundanceSketch &other);
+
+        uint64_t distinct() const;
+        /* Sum of the counts added. */
+        uint64_t total() const;
+        /* Estimated number of keys of each abundance. */
+        std::map<uint64_t,uint64_t> abundances() const;
+        /* Same as abundances, in the format of ntcard. The keys more abundant
+         * than nbins-1 are counted in the last bin. */
+        std::vector<uint64_t> histogram(uint64_t nbins=1000) const;
+
+        uint64_t hllBits;
+        uint64_t maxSamples;
+        /* a key is sampled if the low samplingLevel bits of its mixed hash are 0 */
+        uint64_t samplingLevel;
+    private:
+        std::vector<uint8_t> registers;
+        std::unordered_map<uint64_t,uint64_t> samples;
+        uint64_t totalCount;
+        void prune();
+    };
+
+    typedef struct qfParameters {
+        uint64_t nslots;
+        uint64_t key_bits;
+        uint64_t fixed_counter_size;
+        uint64_t label_bits;
+        uint64_t blockLabelSize;
+        /* size of the blocks in bytes */
+        uint64_t memory;
+        /* expected number of occupied slots and false positive rate of a query */
+        uint64_t slotsNeeded;
+        double fpr;
+    } qfParameters;
+
+    /*!
+    @breif Find the filter parameters with the least memory for a key distribution.
+
+    key_bits is the smallest number of hash bits giving a false positive rate
+    of at most fpr, then every nslots and fixed counter size that can hold the
+    counters is tried. A fixed counter size of 0 is only chosen when all the
+    keys are seen once.
+
+    @param std::map<uint64_t,uint64_t>& abundances: number of keys of each abundance.
+    @param double headroom: the expected slots are multiplied by it to cover the estimation error.
+    @return qfParameters: Throws overflow_error if no configuration fits in memoryCap bytes, and domain_error if fpr needs more than 64 hash bits.
+    */
+    qfParameters optimizeParameters(const std::map<uint64_t,uint64_t> &abundances, double fpr,
+                                    uint64_t memoryCap=std::numeric_limits<uint64_t>::max(),
+                                    uint64_t label_bits=0, uint64_t blockLabelSize=0, double headroom=1.1);
+
+    /*!
+    @breif Initialize qf with the parameters optimized for the keys observed by sketch.
+
+    The keys inserted in qf must be hashes of the returned key_bits bits.
+    */
+    qfParameters autoConfigure(QF *qf, const abundanceSketch &sketch, double fpr,
+                               uint64_t memoryCap=std::numeric_limits<uint64_t>::max(),
+                               uint64_t label_bits=0, bool mem=true, const char *path="");
 
 };
  #endif /* _utils_H */
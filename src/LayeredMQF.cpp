@@ -4,6 +4,12 @@
 #include "gqf.h"
 #include "LayeredMQF.h"
 #include <iostream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
 
 using namespace std;
 void layeredMQF_init(layeredMQF *qf, uint64_t nslots_singletons ,uint64_t nslots
@@ -15,7 +21,8 @@ void layeredMQF_init(layeredMQF *qf, uint64_t nslots_singletons ,uint64_t nslots
 			qf= new layeredMQF();
 		}
 
-		qf_init(qf->firstLayer_singletons,nslots_singletons,key_bits,value_bits,1,0,mem,path,seed);
+		string singletonsPath=string(path)+".singletons";
+		qf_init(qf->firstLayer_singletons,nslots_singletons,key_bits,value_bits,0,0,mem,singletonsPath.c_str(),seed);
 		qf_init(qf->secondLayer,nslots,key_bits,value_bits,fixed_counter_size,0,mem,path,seed);
 }
 
@@ -34,52 +41,125 @@ void layeredMQF_copy(layeredMQF *dest, layeredMQF *src){
 	qf_copy(dest->secondLayer,src->secondLayer);
 }
 
-/* Increment the counter for this key/value pair by count. */
-
-bool layeredMQF_insert(layeredMQF *qf, uint64_t key, uint64_t count,
-							 bool lock, bool spin){
-	if(count==0)
-		return true;
-	bool inSecondLayer=qf_count_key(qf->secondLayer,key)>0;
-	if(inSecondLayer)
+/* Both layers are probed once. A key is first looked up in the second layer,
+ * so a counted key never reaches the singletons. A singleton that is
+ * inserted again is moved to the second layer with the positions found by
+ * the probes, so the move does not search the runs again.
+ * With lock, the buckets of the key are locked in both layers, second layer
+ * first, before the probes. The new count is then computed from counts no
+ * other thread can change, and no thread sees the key between the layers
+ * while it is moved.
+ */
+static inline void layeredMQF_insert_locked(layeredMQF *qf, uint64_t key, uint64_t count)
+{
+	qfprobe second, first;
+	if(qf_probe(qf->secondLayer,key,&second)>0)
 	{
-		return qf_insert(qf->secondLayer,key,count,lock,spin);
+		qf_set_probed(qf->secondLayer,&second,second.count+count);
+		return;
 	}
-	uint64_t CountinFirstLayer=qf_count_key(qf->firstLayer_singletons,key);
-	if(CountinFirstLayer>1)
+	if(qf_probe(qf->firstLayer_singletons,key,&first)>0)
 	{
-		cerr<<"First Layer has items > 1"<<endl;
+		if(first.count>1)
+		{
+			cerr<<"First Layer has items > 1"<<endl;
+		}
+		qf_set_probed(qf->firstLayer_singletons,&first,0);
+		// the second layer did not change since it was probed
+		qf_set_probed(qf->secondLayer,&second,first.count+count);
+		if(first.label!=0)
+			qf_add_label(qf->secondLayer,key,first.label);
+		return;
 	}
-	if(CountinFirstLayer>0)
+	if(count==1)
+		qf_set_probed(qf->firstLayer_singletons,&first,count);
+	else
+		qf_set_probed(qf->secondLayer,&second,count);
+}
+
+static inline bool layeredMQF_insert_probed(layeredMQF *qf, uint64_t key, uint64_t count,
+							 bool lock, bool spin)
+{
+	if(lock)
 	{
-		if(qf_remove(qf->firstLayer_singletons,key,CountinFirstLayer,lock,spin))
-			return qf_insert(qf->secondLayer,key,count+1,lock,spin);
-		else{
+		if(!qf_lock_key(qf->secondLayer,key,spin))
+			return false;
+		if(!qf_lock_key(qf->firstLayer_singletons,key,spin))
+		{
+			qf_unlock_key(qf->secondLayer,key);
 			return false;
 		}
 	}
-	if(count==1)
-		return qf_insert(qf->firstLayer_singletons,key,count,lock,spin);
-	else
-		return qf_insert(qf->secondLayer,key,count,lock,spin);
+	layeredMQF_insert_locked(qf,key,count);
+	if(lock)
+	{
+		qf_unlock_key(qf->firstLayer_singletons,key);
+		qf_unlock_key(qf->secondLayer,key);
+	}
+	return true;
+}
 
+bool layeredMQF_insert(layeredMQF *qf, uint64_t key, uint64_t count,
+							 bool lock, bool spin){
+	if(count==0)
+		return true;
+	qf_prefetch(qf->secondLayer,key);
+	qf_prefetch(qf->firstLayer_singletons,key);
+	return layeredMQF_insert_probed(qf,key,count,lock,spin);
+}
 
+uint64_t layeredMQF_insert_batch(layeredMQF *qf, const uint64_t *keys, const uint64_t *counts,
+							 uint64_t n, bool lock, bool spin){
+	uint64_t ninserted=0;
+	for(uint64_t i=0;i<n && i<LAYERED_PREFETCH_DISTANCE;i++){
+		qf_prefetch(qf->secondLayer,keys[i]);
+		qf_prefetch(qf->firstLayer_singletons,keys[i]);
+	}
+	for(uint64_t i=0;i<n;i++){
+		if(i+LAYERED_PREFETCH_DISTANCE<n){
+			qf_prefetch(qf->secondLayer,keys[i+LAYERED_PREFETCH_DISTANCE]);
+			qf_prefetch(qf->firstLayer_singletons,keys[i+LAYERED_PREFETCH_DISTANCE]);
+		}
+		uint64_t count= counts==NULL ? 1 : counts[i];
+		if(count==0 || layeredMQF_insert_probed(qf,keys[i],count,lock,spin))
+			ninserted++;
+	}
+	return ninserted;
 }
 
 /* Remove count instances of this key/value combination. */
-bool LayeredMQF_remove(layeredMQF *qf, uint64_t hash, uint64_t count,  bool lock, bool spin){
+bool layeredMQF_remove(layeredMQF *qf, uint64_t hash, uint64_t count,  bool lock, bool spin){
 	bool res=false;
 	res|=qf_remove(qf->firstLayer_singletons,hash,count,lock,spin);
 	res|=qf_remove(qf->secondLayer,hash,count,lock,spin);
 	return res;
 }
 
+/* A key is in at most one layer, so the tags go to the layer that has it. */
+static inline QF* layeredMQF_layerOf(const layeredMQF *qf, uint64_t key)
+{
+	if(qf_count_key(qf->secondLayer,key)>0)
+		return qf->secondLayer;
+	return qf->firstLayer_singletons;
+}
 
+uint64_t layeredMQF_add_tag(const layeredMQF *qf, uint64_t key, uint64_t tag, bool lock, bool spin){
+	return qf_add_label(layeredMQF_layerOf(qf,key),key,tag,lock,spin);
+}
+
+uint64_t layeredMQF_get_tag(const layeredMQF *qf, uint64_t key){
+	return qf_get_label(layeredMQF_layerOf(qf,key),key);
+}
 
+uint64_t layeredMQF_remove_tag(const layeredMQF *qf, uint64_t key, bool lock, bool spin){
+	return qf_remove_label(layeredMQF_layerOf(qf,key),key,lock,spin);
+}
 
 /* Return the number of times key has been inserted, with any value,
 	 into qf. */
 uint64_t layeredMQF_count_key(const layeredMQF *qf, uint64_t key){
+	qf_prefetch(qf->secondLayer,key);
+	qf_prefetch(qf->firstLayer_singletons,key);
 	uint64_t res=qf_count_key(qf->secondLayer,key);
 	if(res==0)
 	{
@@ -91,50 +171,208 @@ uint64_t layeredMQF_count_key(const layeredMQF *qf, uint64_t key){
 int layeredMQF_space(layeredMQF *qf){
 	return max(qf_space(qf->firstLayer_singletons),qf_space(qf->secondLayer));
 }
-//
-// /* Initialize an iterator */
-// bool layeredMQF_iterator(layeredMQF *qf, layeredMQFIterator* qfi, uint64_t position){
-// 	if(qfi ==NULL)
-// 		qfi=new layeredMQFIterator();
-// 	bool res=false;
-// 	res|=qf_iterator(qf->firstLayer_singletons,qfi->firstLayerIterator,position);
-// 	res|=qf_iterator(qf->secondLayer,qfi->secondLayerIterator,position);
-// 	return res;
-// }
-//
-// /* Returns 0 if the iterator is still valid (i.e. has not reached the
-// 	 end of the QF. */
-// int layeredMQF_qfi_get(layeredMQFIterator*qfi, uint64_t *key, uint64_t *value, uint64_t *count){
-//
-// }
-//
-// /* Advance to next entry.  Returns whether or not another entry is
-// 	 found.  */
-// int layeredMQF_qfi_next(layeredMQFIterator*qfi);
-//
-// /* Check to see if the if the end of the QF */
-// int layeredMQF_qfi_end(layeredMQFIterator*qfi);
-//
-// /* For debugging */
-// void layeredMQF_dump(const layeredMQF *);
-//
-// /* write data structure of to the disk */
-// void layeredMQF_serialize(const layeredMQF *qf, const char *filename);
-//
-// /* read data structure off the disk */
-// void layeredMQF_deserialize(layeredMQF *qf, const char *filename);
-//
-// /* mmap the QF from disk. */
-// void layeredMQF_read(layeredMQF *qf, const char *path);
-
-/* merge two QFs into the third one. */
-//void layeredMQF_merge(layeredMQF *layeredMQFa, layeredMQF *layeredMQFb, QF *qfc);
-
-/* merge multiple QFs into the final QF one. */
-//void qf_multi_merge(QF *qf_arr[], int nqf, QF *qfr);
-
-/* find cosine similarity between two QFs. */
-//	uint64_t qf_inner_product(QF *qfa, QF *qfb);
-
-/* magnitude of a QF. */
-//uint64_t qf_magnitude(QF *qf);
+
+/* Move the iterator of a layer to the first key >= key. */
+static void layeredMQF_seekLayer(QF* layer, QFi* it, uint64_t key)
+{
+	if(qfi_find(layer,it,key))
+		return;
+	qf_iterator(layer,it,key>>layer->metadata->key_remainder_bits);
+	// no occupied quotient after the key
+	if(it->run>=layer->metadata->nslots){
+		it->current=layer->metadata->xnslots;
+		return;
+	}
+	uint64_t current, label, count;
+	while(!qfi_end(it)){
+		qfi_get(it,&current,&label,&count);
+		if(current>=key)
+			break;
+		qfi_next(it);
+	}
+}
+
+bool layeredMQF_qf_iterator(layeredMQF *qf, layeredMQFIterator *qfi, uint64_t position){
+	uint64_t key=position<<qf->secondLayer->metadata->key_remainder_bits;
+	layeredMQF_seekLayer(qf->firstLayer_singletons,&qfi->firstLayerIterator,key);
+	layeredMQF_seekLayer(qf->secondLayer,&qfi->secondLayerIterator,key);
+	return !layeredMQF_qfi_end(qfi);
+}
+
+/* The layer iterator at the smallest key, NULL at the end. The layers have no
+ * key in common. */
+static inline QFi* layeredMQF_qfi_current(layeredMQFIterator *qfi)
+{
+	QFi* first=&qfi->firstLayerIterator;
+	QFi* second=&qfi->secondLayerIterator;
+	if(qfi_end(first))
+		return qfi_end(second) ? NULL : second;
+	if(qfi_end(second))
+		return first;
+	uint64_t firstKey, secondKey, label, count;
+	qfi_get(first,&firstKey,&label,&count);
+	qfi_get(second,&secondKey,&label,&count);
+	return firstKey<secondKey ? first : second;
+}
+
+int layeredMQF_qfi_get(layeredMQFIterator *qfi, uint64_t *key, uint64_t *value, uint64_t *count){
+	QFi* it=layeredMQF_qfi_current(qfi);
+	if(it==NULL)
+		return 1;
+	return qfi_get(it,key,value,count);
+}
+
+int layeredMQF_qfi_next(layeredMQFIterator *qfi){
+	QFi* it=layeredMQF_qfi_current(qfi);
+	if(it==NULL)
+		return 1;
+	qfi_next(it);
+	return layeredMQF_qfi_end(qfi);
+}
+
+int layeredMQF_qfi_end(layeredMQFIterator *qfi){
+	return qfi_end(&qfi->firstLayerIterator) && qfi_end(&qfi->secondLayerIterator);
+}
+
+void layeredMQF_dump(const layeredMQF *qf){
+	printf("First layer (singletons)\n");
+	qf_dump(qf->firstLayer_singletons);
+	printf("Second layer\n");
+	qf_dump(qf->secondLayer);
+}
+
+/* Header page of the file of layeredMQF_serialize. */
+typedef struct layeredMQFFileHeader {
+	char magic[8];
+	uint64_t firstLayerOffset;
+	uint64_t secondLayerOffset;
+} layeredMQFFileHeader;
+
+static const char layeredMQFMagic[8]={'L','A','Y','E','R','M','Q','F'};
+
+static void layeredMQF_writeLayer(const QF *layer, FILE *fout, uint64_t offset)
+{
+	if (fseek(fout, offset, SEEK_SET) != 0) {
+		perror("Error seeking the file for serializing\n");
+		exit(EXIT_FAILURE);
+	}
+	fwrite(layer->metadata, sizeof(qfmetadata), 1, fout);
+	fwrite(layer->blocks, layer->metadata->size, 1, fout);
+}
+
+void layeredMQF_serialize(const layeredMQF *qf, const char *filename){
+	uint64_t pageSize=sysconf(_SC_PAGESIZE);
+	layeredMQFFileHeader header;
+	memcpy(header.magic,layeredMQFMagic,sizeof(header.magic));
+	header.firstLayerOffset=pageSize;
+	uint64_t firstLayerSize=sizeof(qfmetadata)+qf->firstLayer_singletons->metadata->size;
+	header.secondLayerOffset=header.firstLayerOffset+
+		(firstLayerSize+pageSize-1)/pageSize*pageSize;
+
+	FILE *fout;
+	fout = fopen(filename, "wb+");
+	if (fout == NULL) {
+		perror("Error opening file for serializing\n");
+		exit(EXIT_FAILURE);
+	}
+	fwrite(&header, sizeof(header), 1, fout);
+	layeredMQF_writeLayer(qf->firstLayer_singletons, fout, header.firstLayerOffset);
+	layeredMQF_writeLayer(qf->secondLayer, fout, header.secondLayerOffset);
+	fclose(fout);
+}
+
+static layeredMQFFileHeader layeredMQF_readHeader(const char *filename)
+{
+	layeredMQFFileHeader header;
+	FILE *fin;
+	fin = fopen(filename, "rb");
+	if (fin == NULL) {
+		perror("Error opening file for deserializing\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fread(&header, sizeof(header), 1, fin) != 1 ||
+			memcmp(header.magic,layeredMQFMagic,sizeof(header.magic)) != 0) {
+		fclose(fin);
+		throw std::runtime_error(string(filename)+" is not a layered filter file");
+	}
+	fclose(fin);
+	return header;
+}
+
+void layeredMQF_deserialize(layeredMQF *qf, const char *filename){
+	layeredMQFFileHeader header=layeredMQF_readHeader(filename);
+	qf_deserialize(qf->firstLayer_singletons,filename,header.firstLayerOffset);
+	qf_deserialize(qf->secondLayer,filename,header.secondLayerOffset);
+}
+
+void layeredMQF_read(layeredMQF *qf, const char *path){
+	layeredMQFFileHeader header=layeredMQF_readHeader(path);
+	qf_read(qf->firstLayer_singletons,path,header.firstLayerOffset);
+	qf_read(qf->secondLayer,path,header.secondLayerOffset);
+}
+
+/* Add the items of an iterator, which come in key order, to qf. */
+static void layeredMQF_insertSorted(layeredMQF *qf, uint64_t key, uint64_t label, uint64_t count)
+{
+	layeredMQF_insert(qf,key,count,false,false);
+	if(label!=0)
+		layeredMQF_add_tag(qf,key,label);
+}
+
+void layeredMQF_merge(layeredMQF *qfa, layeredMQF *qfb, layeredMQF *qfc){
+	if(qfa->secondLayer->metadata->range != qfb->secondLayer->metadata->range ||
+	qfb->secondLayer->metadata->range != qfc->secondLayer->metadata->range )
+	{
+		throw std::logic_error("Merging non compatible filters");
+	}
+	layeredMQFIterator qfia, qfib;
+	layeredMQF_qf_iterator(qfa,&qfia,0);
+	layeredMQF_qf_iterator(qfb,&qfib,0);
+	uint64_t keya, labela, counta, keyb, labelb, countb;
+	while(!layeredMQF_qfi_end(&qfia) || !layeredMQF_qfi_end(&qfib)){
+		if(layeredMQF_qfi_end(&qfib)){
+			layeredMQF_qfi_get(&qfia,&keya,&labela,&counta);
+			layeredMQF_insertSorted(qfc,keya,labela,counta);
+			layeredMQF_qfi_next(&qfia);
+			continue;
+		}
+		layeredMQF_qfi_get(&qfib,&keyb,&labelb,&countb);
+		if(layeredMQF_qfi_end(&qfia)){
+			layeredMQF_insertSorted(qfc,keyb,labelb,countb);
+			layeredMQF_qfi_next(&qfib);
+			continue;
+		}
+		layeredMQF_qfi_get(&qfia,&keya,&labela,&counta);
+		if(keya<keyb){
+			layeredMQF_insertSorted(qfc,keya,labela,counta);
+			layeredMQF_qfi_next(&qfia);
+		}
+		else if(keya>keyb){
+			layeredMQF_insertSorted(qfc,keyb,labelb,countb);
+			layeredMQF_qfi_next(&qfib);
+		}
+		else{
+			layeredMQF_insertSorted(qfc,keya,labela!=0 ? labela : labelb,counta+countb);
+			layeredMQF_qfi_next(&qfia);
+			layeredMQF_qfi_next(&qfib);
+		}
+	}
+}
+
+void layeredMQF_resize(layeredMQF *qf, uint64_t nslots_singletons, uint64_t nslots, const char *newFilename){
+	qfmetadata* metadata=qf->secondLayer->metadata;
+	layeredMQF resized;
+	layeredMQF_init(&resized,nslots_singletons,nslots,metadata->key_bits,
+		metadata->label_bits,metadata->fixed_counter_size,newFilename==NULL,
+		newFilename==NULL ? "" : newFilename,metadata->seed);
+	layeredMQFIterator qfi;
+	layeredMQF_qf_iterator(qf,&qfi,0);
+	for(;!layeredMQF_qfi_end(&qfi);layeredMQF_qfi_next(&qfi)){
+		uint64_t key, label, count;
+		layeredMQF_qfi_get(&qfi,&key,&label,&count);
+		layeredMQF_insertSorted(&resized,key,label,count);
+	}
+	layeredMQF_destroy(qf);
+	std::swap(qf->firstLayer_singletons,resized.firstLayer_singletons);
+	std::swap(qf->secondLayer,resized.secondLayer);
+}
@@ -4,13 +4,93 @@
 #include "gqf.h"
 #include "bufferedMQF.h"
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 
 
-bufferedMQFIterator::bufferedMQFIterator(QFi* bit,onDiskMQF_Namespace::onDiskMQFIterator* dit){
-    bufferIt=bit;
-    diskIt=dit;
+bufferedMQFIterator::~bufferedMQFIterator(){
+    clear();
+    delete diskIt;
+}
+
+void bufferedMQFIterator::clear(){
+    for(uint64_t i=0;i<bufferIts.size();i++)
+        delete bufferIts[i];
+    bufferIts.clear();
+    while(!heads.empty())
+        heads.pop();
+}
+
+/* Add the current key of the source to the heads if it has one in the range. */
+void bufferedMQFIterator::push(uint64_t source){
+    uint64_t key, label, count;
+    if(source==bufferIts.size()){
+        if(diskIt->end())
+            return;
+        diskIt->get(&key,&label,&count);
+    }
+    else{
+        if(qfi_end(bufferIts[source]))
+            return;
+        qfi_get(bufferIts[source],&key,&label,&count);
+    }
+    if(key<=endKey)
+        heads.push(std::make_pair(key,source));
+}
+
+/* Move the iterator to the first key >= key. The quotient filter iterators
+ * start at a run at or before the run of the key, so at most a few runs are
+ * skipped. */
+static void bufferedMQF_seekBuffer(QF* buffer, QFi* it, uint64_t key)
+{
+    if(qfi_find(buffer,it,key))
+        return;
+    qf_iterator(buffer,it,key>>buffer->metadata->key_remainder_bits);
+    // no occupied quotient after the key
+    if(it->run>=buffer->metadata->nslots){
+        it->current=buffer->metadata->xnslots;
+        return;
+    }
+    uint64_t current, label, count;
+    while(!qfi_end(it)){
+        qfi_get(it,&current,&label,&count);
+        if(current>=key)
+            break;
+        qfi_next(it);
+    }
+}
+
+static void bufferedMQF_seekDisk(onDiskMQF_Namespace::onDiskMQF* disk,
+    onDiskMQF_Namespace::onDiskMQFIterator* it, uint64_t key)
+{
+    if(disk->findIterator(it,key))
+        return;
+    disk->getIterator(it,key>>disk->metadata->key_remainder_bits);
+    if(it->run>=disk->metadata->nslots){
+        it->current=disk->metadata->xnslots;
+        return;
+    }
+    uint64_t current, label, count;
+    while(!it->end()){
+        it->get(&current,&label,&count);
+        if(current>=key)
+            break;
+        it->next();
+    }
+}
+
+void bufferedMQFIterator::seek(bufferedMQF* qf, uint64_t startKey, uint64_t endKey){
+    clear();
+    this->qf=qf;
+    this->endKey=endKey;
+    for(uint64_t i=0;i<qf->memoryShards.size();i++){
+        bufferIts.push_back(new QFi());
+        bufferedMQF_seekBuffer(qf->memoryShards[i],bufferIts[i],startKey);
+        push(i);
+    }
+    bufferedMQF_seekDisk(qf->disk,diskIt,startKey);
+    push(bufferIts.size());
     finished=false;
     next();
 }
@@ -19,70 +99,51 @@ int bufferedMQFIterator::get(uint64_t *key, uint64_t *value, uint64_t *count){
     *key=currentKey;
     *value=currentLabel;
     *count=currentCount;
+    return 0;
 }
 
-void bufferedMQFIterator::update(){
-    uint64_t diskKey, diskLabel, diskCount, memoryKey, memoryLabel, memoryCount;
-    diskIt->get(&diskKey,&diskLabel,&diskCount);
-    if(!qfi_end(bufferIt))
-        qfi_get(bufferIt,&memoryKey,&memoryLabel,&memoryCount);
-    currentKey=diskKey;
-    currentLabel=diskLabel;
-    currentCount=diskCount;
-    if(diskKey == memoryKey)
-        currentCount+=memoryCount;
-}
-
-
-
 /* Advance to next entry.  Returns whether or not another entry is
      found.  */
 int bufferedMQFIterator::next()
 {
-    if(diskIt->end() && (bufferIt==NULL ||qfi_end(bufferIt)) ){
+    if(heads.empty()){
         finished=true;
         return 1;
-    };
-    if(diskIt->end())
-    {
-        qfi_get(bufferIt,&currentKey,&currentLabel,&currentCount);
-        qfi_next(bufferIt);
-        return 0;
-    }
-
-    if((bufferIt==NULL ||qfi_end(bufferIt)))
-    {
-        diskIt->get(&currentKey,&currentLabel,&currentCount);
-        diskIt->next();
-        return 0;
     }
-    uint64_t diskKey, diskLabel, diskCount, memoryKey, memoryLabel, memoryCount;
-    diskIt->get(&diskKey,&diskLabel,&diskCount);
-    qfi_get(bufferIt,&memoryKey,&memoryLabel,&memoryCount);
-    if(diskKey < memoryKey)
-    {
-		currentKey=diskKey;
-		currentLabel=diskLabel;
-		currentCount=diskCount;
-		diskIt->next();
-        return 0;
+    currentKey=heads.top().first;
+    currentLabel=0;
+    currentCount=0;
+    // the label of the disk takes precedence over the labels of the buffers
+    bool diskLabel=false;
+    while(!heads.empty() && heads.top().first==currentKey){
+        uint64_t source=heads.top().second;
+        heads.pop();
+        uint64_t key, label, count;
+        if(source==bufferIts.size()){
+            diskIt->get(&key,&label,&count);
+            diskIt->next();
+            currentLabel=label;
+            diskLabel=true;
+        }
+        else{
+            qfi_get(bufferIts[source],&key,&label,&count);
+            qfi_next(bufferIts[source]);
+            if(!diskLabel && currentLabel==0)
+                currentLabel=label;
+        }
+        currentCount+=count;
+        push(source);
     }
-    else if(diskKey > memoryKey){
-        currentKey=memoryKey;
-        currentLabel=memoryLabel;
-        currentCount=memoryCount;
-        qfi_next(bufferIt);
-        return 0;
-    } else{
-        currentKey=diskKey;
-        currentLabel=diskLabel;
-        currentCount=diskCount+memoryCount;
-
-        qfi_next(bufferIt);
-        diskIt->next();
-        return 0;
+    // labels not flushed yet replace the others
+    if(!qf->memoryLabels.empty()){
+        std::unordered_map<uint64_t,uint64_t>& labels=qf->memoryLabels[currentKey&(qf->memoryLabels.size()-1)];
+        if(!labels.empty()){
+            auto it=labels.find(currentKey);
+            if(it!=labels.end())
+                currentLabel=it->second;
+        }
     }
-
+    return 0;
 }
 
 /* Check to see if the if the end of the QF */
@@ -92,22 +153,182 @@ int bufferedMQFIterator::end(){
 }
 
 
+bufferedMQF::bufferedMQF(){
+    memoryBuffer=NULL;
+    flushBuffer=NULL;
+    disk=NULL;
+    flushGeneration=0;
+    bufferSlots=0;
+    flushSlots=0;
+    diskSlots=0;
+    flushPending=false;
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // the thread swapping the buffers must not wait behind a stream of inserts
+    pthread_rwlockattr_setkind_np(&attr,PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&barrier,&attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+static void bufferedMQF_freeShards(bufferedMQF *qf)
+{
+    for(uint64_t i=0;i<qf->memoryShards.size();i++){
+        qf_destroy(qf->memoryShards[i]);
+        delete qf->memoryShards[i];
+        qf_destroy(qf->flushShards[i]);
+        delete qf->flushShards[i];
+    }
+    qf->memoryShards.clear();
+    qf->flushShards.clear();
+    qf->memoryLabels.clear();
+    qf->flushLabels.clear();
+    qf->shardLocks.clear();
+    qf->memoryBuffer=NULL;
+    qf->flushBuffer=NULL;
+    qf->bufferSlots=0;
+    qf->flushSlots=0;
+}
+
+bufferedMQF::~bufferedMQF()
+{
+    if(flushThread.joinable())
+        flushThread.join();
+    bufferedMQF_freeShards(this);
+    delete disk;
+    pthread_rwlock_destroy(&barrier);
+}
+
+/* Create nshards memory and flush shards that hold nslots_buffer slots together. */
+static void bufferedMQF_initShards(bufferedMQF *qf, uint64_t nslots_buffer, uint64_t key_bits,
+    uint64_t value_bits, uint64_t fixed_counter_size, uint64_t nshards)
+{
+    if(nshards==0 || __builtin_popcountll(nshards)!=1 || nshards>nslots_buffer)
+        throw std::domain_error("nshards must be a power of 2 smaller than nslots_buffer");
+    bufferedMQF_freeShards(qf);
+    qf->shardLocks=std::vector<std::mutex>(nshards);
+    qf->memoryLabels.resize(nshards);
+    qf->flushLabels.resize(nshards);
+    for(uint64_t i=0;i<nshards;i++){
+        qf->memoryShards.push_back(new QF());
+        qf_init(qf->memoryShards[i],nslots_buffer/nshards,key_bits,value_bits,fixed_counter_size,0,true,"",2038074761);
+        qf->flushShards.push_back(new QF());
+        qf_init(qf->flushShards[i],nslots_buffer/nshards,key_bits,value_bits,fixed_counter_size,0,true,"",2038074761);
+    }
+    qf->memoryBuffer=qf->memoryShards[0];
+    qf->flushBuffer=qf->flushShards[0];
+}
+
 void bufferedMQF_init(bufferedMQF *qf, uint64_t nslots_buffer ,uint64_t nslots
-	, uint64_t key_bits, uint64_t value_bits,uint64_t fixed_counter_size, const char *path){
+	, uint64_t key_bits, uint64_t value_bits,uint64_t fixed_counter_size, const char *path,
+	uint64_t nshards){
 
 		if(qf==NULL)
 		{
 			qf= new bufferedMQF();
 		}
         qf->filename=path;
-		if(nslots_buffer!=0)
-		    qf_init(qf->memoryBuffer,nslots_buffer,key_bits,value_bits,fixed_counter_size,0,true,"",2038074761);
+		if(nslots_buffer!=0){
+		    bufferedMQF_initShards(qf,nslots_buffer,key_bits,value_bits,fixed_counter_size,nshards);
+		}
 		else{
-		    delete qf-> memoryBuffer;
-		    qf->memoryBuffer=NULL;
+		    bufferedMQF_freeShards(qf);
 		}
 
 		onDiskMQF_Namespace::onDiskMQF::init(qf->disk,nslots,key_bits,value_bits,fixed_counter_size,path);
+		qf->diskSlots=0;
+}
+
+/* Write the shards and their labels to disk in one pass and empty them. */
+static void bufferedMQF_writeShards(bufferedMQF *qf, std::vector<QF*>& shards,
+    std::vector<std::unordered_map<uint64_t,uint64_t> >& labels)
+{
+    onDiskMQF_Namespace::onDiskMQFLabels sortedLabels;
+    for(uint64_t i=0;i<labels.size();i++)
+        sortedLabels.insert(sortedLabels.end(),labels[i].begin(),labels[i].end());
+    std::sort(sortedLabels.begin(),sortedLabels.end());
+    qf->disk->migrateFromQF(&shards[0],shards.size(),&sortedLabels);
+    for(uint64_t i=0;i<shards.size();i++){
+        qf_reset(shards[i]);
+        labels[i].clear();
+    }
+}
+
+/* Write flushBuffer to disk. diskLock must be held. */
+static void bufferedMQF_writeFlushShards(bufferedMQF *qf)
+{
+    bufferedMQF_writeShards(qf,qf->flushShards,qf->flushLabels);
+    qf->diskSlots=qf->disk->metadata->noccupied_slots;
+    qf->flushSlots=0;
+    qf->flushPending=false;
+}
+
+/* Body of the flush thread. */
+static void bufferedMQF_flush(bufferedMQF *qf)
+{
+    std::lock_guard<std::mutex> guard(qf->diskLock);
+    try {
+        bufferedMQF_writeFlushShards(qf);
+    }
+    catch (exception& e)
+    {
+        // the items stay in flushBuffer
+        qf->flushError=std::current_exception();
+    }
+}
+
+void bufferedMQF_waitForFlush(bufferedMQF *qf)
+{
+    if(qf->flushThread.joinable())
+        qf->flushThread.join();
+    if(qf->flushError)
+    {
+        std::exception_ptr error=qf->flushError;
+        qf->flushError=nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+/* Wait for the background flush and write flushBuffer to disk if it failed. */
+static void bufferedMQF_finishFlush(bufferedMQF *qf)
+{
+    bufferedMQF_waitForFlush(qf);
+    if(qf->flushPending) {
+        std::lock_guard<std::mutex> guard(qf->diskLock);
+        bufferedMQF_writeFlushShards(qf);
+    }
+}
+
+/* Hand the memory buffer to the flush thread and continue in the other one.
+ * Nothing is done if the buffers were swapped since generation, by another
+ * thread that found the same buffer full. */
+static void bufferedMQF_startFlush(bufferedMQF *qf, uint64_t generation, bool lock)
+{
+    if(lock)
+        pthread_rwlock_wrlock(&qf->barrier);
+    try {
+        if(qf->flushGeneration==generation) {
+            bufferedMQF_finishFlush(qf);
+            std::swap(qf->memoryShards,qf->flushShards);
+            std::swap(qf->memoryLabels,qf->flushLabels);
+            qf->memoryBuffer=qf->memoryShards[0];
+            qf->flushBuffer=qf->flushShards[0];
+            qf->flushSlots=qf->bufferSlots.load();
+            qf->bufferSlots=0;
+            qf->flushGeneration++;
+            qf->flushPending=true;
+            qf->flushThread=std::thread(bufferedMQF_flush,qf);
+        }
+    }
+    catch (exception& e)
+    {
+        if(lock)
+            pthread_rwlock_unlock(&qf->barrier);
+        throw;
+    }
+    if(lock)
+        pthread_rwlock_unlock(&qf->barrier);
 }
 
 void bufferedMQF_deleteMemoryBuffer(bufferedMQF *qf)
@@ -115,29 +336,51 @@ void bufferedMQF_deleteMemoryBuffer(bufferedMQF *qf)
     if(qf->memoryBuffer!=NULL)
     {
         bufferedMQF_syncBuffer(qf);
-        qf_destroy(qf->memoryBuffer);
-        delete qf->memoryBuffer;
-        qf->memoryBuffer=NULL;
+        bufferedMQF_freeShards(qf);
     }
 }
 
 void bufferedMQF_reset(bufferedMQF *qf){
-    if(qf-> memoryBuffer!=NULL)
-	    qf_reset(qf->memoryBuffer);
+    if(qf-> memoryBuffer!=NULL) {
+        if(qf->flushThread.joinable())
+            qf->flushThread.join();
+        qf->flushError=nullptr;
+        qf->flushPending=false;
+        for(uint64_t i=0;i<qf->memoryShards.size();i++){
+	        qf_reset(qf->memoryShards[i]);
+	        qf_reset(qf->flushShards[i]);
+	        qf->memoryLabels[i].clear();
+	        qf->flushLabels[i].clear();
+        }
+        qf->bufferSlots=0;
+        qf->flushSlots=0;
+    }
 	//onDiskMQF_reset(qf->disk);
 	qf->disk->reset();
+	qf->diskSlots=0;
 }
 
 void bufferedMQF_destroy(bufferedMQF *qf){
-    if(qf-> memoryBuffer!=NULL)
-	    qf_destroy(qf->memoryBuffer);
+    if(qf->flushThread.joinable())
+        qf->flushThread.join();
+    bufferedMQF_freeShards(qf);
 	delete qf->disk;
+	qf->disk=NULL;
 }
 
 void bufferedMQF_copy(bufferedMQF *dest, bufferedMQF *src){
-    if(src-> memoryBuffer!=NULL && dest-> memoryBuffer!=NULL)
-	    qf_copy(dest->memoryBuffer,src->memoryBuffer);
+    if(src-> memoryBuffer!=NULL && dest-> memoryBuffer!=NULL) {
+        bufferedMQF_finishFlush(src);
+        bufferedMQF_finishFlush(dest);
+        if(src->memoryShards.size()!=dest->memoryShards.size())
+            throw std::logic_error("Buffered filters with different numbers of shards can't be copied");
+        for(uint64_t i=0;i<src->memoryShards.size();i++)
+	        qf_copy(dest->memoryShards[i],src->memoryShards[i]);
+        dest->memoryLabels=src->memoryLabels;
+        dest->bufferSlots=src->bufferSlots.load();
+    }
 	src->disk->copy(dest->disk);
+	dest->diskSlots=dest->disk->metadata->noccupied_slots;
 }
 
 /* Increment the counter for this key/value pair by count. */
@@ -145,41 +388,82 @@ void bufferedMQF_copy(bufferedMQF *dest, bufferedMQF *src){
 bool bufferedMQF_insert(bufferedMQF *qf, uint64_t key, uint64_t count,
 							 bool lock, bool spin){
 
-  key=key%qf->memoryBuffer->metadata->range;
-    if(qf-> memoryBuffer==NULL)
-    {
-        return qf->disk->insert(key,count,lock,spin);
-    }
-    if(qf->memoryBuffer->metadata->noccupied_slots+ qf->disk->metadata->noccupied_slots >=
-       qf->disk->metadata->maximum_occupied_slots)
+    // the buffers can be swapped by other threads, their shared data is read
+    // from the disk filter and the locks
+    if(qf->shardLocks.empty())
     {
-        throw std::overflow_error("Buffered QF is 95% full, cannot insert more items.");
+        bool res=qf->disk->insert(key%qf->disk->metadata->range,count,lock,spin);
+        qf->diskSlots=qf->disk->metadata->noccupied_slots;
+        return res;
     }
-    try {
-        qf_insert(qf->memoryBuffer, key, count, lock, spin);
-    }
-    catch (exception& e)
-    {
-        bufferedMQF_syncBuffer(qf);
-        qf_insert(qf->memoryBuffer, key, count, lock, spin);
+    key=key%qf->disk->metadata->range;
+    uint64_t shard=key&(qf->shardLocks.size()-1);
+    std::exception_ptr insertError;
+    while(true){
+        if(lock)
+            pthread_rwlock_rdlock(&qf->barrier);
+        if(qf->bufferSlots+qf->flushSlots+qf->diskSlots >= qf->disk->metadata->maximum_occupied_slots)
+        {
+            if(lock)
+                pthread_rwlock_unlock(&qf->barrier);
+            throw std::overflow_error("Buffered QF is 95% full, cannot insert more items.");
+        }
+        uint64_t generation=qf->flushGeneration;
+        bool inserted=true;
+        bool full;
+        {
+            std::unique_lock<std::mutex> guard(qf->shardLocks[shard],std::defer_lock);
+            if(lock)
+                guard.lock();
+            QF* buffer=qf->memoryShards[shard];
+            uint64_t noccupied_slots=buffer->metadata->noccupied_slots;
+            try {
+                qf_insert(buffer, key, count, false, false);
+            }
+            catch (exception& e)
+            {
+                inserted=false;
+                if(insertError){
+                    // it does not fit in a freshly swapped buffer either
+                    if(lock){
+                        guard.unlock();
+                        pthread_rwlock_unlock(&qf->barrier);
+                    }
+                    throw;
+                }
+                insertError=std::current_exception();
+            }
+            qf->bufferSlots+=buffer->metadata->noccupied_slots-noccupied_slots;
+            full=!inserted || qf_space(buffer)>75;
+        }
+        if(lock)
+            pthread_rwlock_unlock(&qf->barrier);
+        if(full)
+            bufferedMQF_startFlush(qf,generation,lock);
+        if(inserted)
+            return true;
     }
-	if(qf_space(qf->memoryBuffer)>75)
-	{
-		bufferedMQF_syncBuffer(qf);
-	}
-
-	return true;
-
-
-
 }
 
 /* Remove count instances of this key/value combination. */
 bool bufferedMQF_remove(bufferedMQF *qf, uint64_t hash, uint64_t count,  bool lock, bool spin){
 	bool res=false;
-    if(qf-> memoryBuffer!=NULL)
-	    res|=qf_remove(qf->memoryBuffer,hash,count,lock,spin);
+    if(qf-> memoryBuffer!=NULL) {
+        bufferedMQF_waitForFlush(qf);
+        uint64_t shard=hash&(qf->memoryShards.size()-1);
+        QF* buffer=qf->memoryShards[shard];
+        uint64_t noccupied_slots=buffer->metadata->noccupied_slots;
+	    res|=qf_remove(buffer,hash,count,lock,spin);
+        qf->bufferSlots-=noccupied_slots-buffer->metadata->noccupied_slots;
+        if(qf->flushPending){
+            buffer=qf->flushShards[shard];
+            noccupied_slots=buffer->metadata->noccupied_slots;
+	        res|=qf_remove(buffer,hash,count,lock,spin);
+            qf->flushSlots-=noccupied_slots-buffer->metadata->noccupied_slots;
+        }
+    }
 	res|=qf->disk->remove(hash,count,lock,spin);
+	qf->diskSlots=qf->disk->metadata->noccupied_slots;
 	return res;
 }
 
@@ -189,16 +473,105 @@ bool bufferedMQF_remove(bufferedMQF *qf, uint64_t hash, uint64_t count,  bool lo
 /* Return the number of times key has been inserted, with any value,
 	 into qf. */
 uint64_t bufferedMQF_count_key(const bufferedMQF *qf, uint64_t key){
-    uint64_t  res=qf->disk->count_key(key);
-    if(qf-> memoryBuffer!=NULL)
-        res+=qf_count_key(qf->memoryBuffer,key);
+    uint64_t  res;
+    pthread_rwlock_rdlock(&qf->barrier);
+    uint64_t shard=key&(qf->shardLocks.size()-1);
+    {
+        std::lock_guard<std::mutex> guard(qf->diskLock);
+        res=qf->disk->count_key(key);
+        if(qf->flushPending)
+            res+=qf_count_key(qf->flushShards[shard],key);
+    }
+    if(qf-> memoryBuffer!=NULL) {
+        std::lock_guard<std::mutex> guard(qf->shardLocks[shard]);
+        res+=qf_count_key(qf->memoryShards[shard],key);
+    }
+    pthread_rwlock_unlock(&qf->barrier);
 	return res;
 }
 
+/* Record the label of the key in the memory buffer. Like inserts, label
+ * updates trigger a flush when a shard has as many of them as slots. */
+static uint64_t bufferedMQF_setLabel(bufferedMQF *qf, uint64_t key, uint64_t label,
+    bool lock, bool spin)
+{
+    if(qf->disk->metadata->label_bits==0)
+        return 0;
+    key=key%qf->disk->metadata->range;
+    if(qf->shardLocks.empty())
+    {
+        std::lock_guard<std::mutex> guard(qf->diskLock);
+        return qf->disk->add_label(key,label,lock,spin);
+    }
+    label&=(1ULL<<qf->disk->metadata->label_bits)-1;
+    uint64_t shard=key&(qf->shardLocks.size()-1);
+    if(lock)
+        pthread_rwlock_rdlock(&qf->barrier);
+    uint64_t generation=qf->flushGeneration;
+    bool full;
+    {
+        std::unique_lock<std::mutex> guard(qf->shardLocks[shard],std::defer_lock);
+        if(lock)
+            guard.lock();
+        qf->memoryLabels[shard][key]=label;
+        full=qf->memoryLabels[shard].size()>=qf->memoryShards[shard]->metadata->nslots;
+    }
+    if(lock)
+        pthread_rwlock_unlock(&qf->barrier);
+    if(full)
+        bufferedMQF_startFlush(qf,generation,lock);
+    return 1;
+}
+
+uint64_t bufferedMQF_add_label(bufferedMQF *qf, uint64_t key, uint64_t label, bool lock, bool spin){
+    return bufferedMQF_setLabel(qf,key,label,lock,spin);
+}
+
+uint64_t bufferedMQF_remove_label(bufferedMQF *qf, uint64_t key, bool lock, bool spin){
+    return bufferedMQF_setLabel(qf,key,0,lock,spin);
+}
+
+uint64_t bufferedMQF_get_label(const bufferedMQF *qf, uint64_t key){
+    key=key%qf->disk->metadata->range;
+    uint64_t res;
+    pthread_rwlock_rdlock(&qf->barrier);
+    uint64_t shard=key&(qf->shardLocks.size()-1);
+    if(qf-> memoryBuffer!=NULL) {
+        std::lock_guard<std::mutex> guard(qf->shardLocks[shard]);
+        auto it=qf->memoryLabels[shard].find(key);
+        if(it!=qf->memoryLabels[shard].end()){
+            pthread_rwlock_unlock(&qf->barrier);
+            return it->second;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(qf->diskLock);
+        bool pending=false;
+        if(qf->flushPending){
+            auto it=qf->flushLabels[shard].find(key);
+            pending= it!=qf->flushLabels[shard].end();
+            if(pending)
+                res=it->second;
+        }
+        if(!pending)
+            res=qf->disk->get_label(key);
+    }
+    pthread_rwlock_unlock(&qf->barrier);
+    return res;
+}
+
+void bufferedMQF_enableSummary(bufferedMQF *qf, uint64_t bitsPerSlot){
+    std::lock_guard<std::mutex> guard(qf->diskLock);
+    qf->disk->enableSummary(bitsPerSlot);
+}
+
+onDiskMQF_Namespace::onDiskMQFSummaryStats bufferedMQF_getSummaryStats(const bufferedMQF *qf){
+    std::lock_guard<std::mutex> guard(qf->diskLock);
+    return qf->disk->getSummaryStats();
+}
+
 int bufferedMQF_space(bufferedMQF *qf){
-	uint64_t occupied_slots=qf->disk->metadata->noccupied_slots;
-    if(qf-> memoryBuffer!=NULL)
-        occupied_slots+=qf->memoryBuffer->metadata->noccupied_slots;
+	uint64_t occupied_slots=qf->bufferSlots+qf->flushSlots+qf->diskSlots;
 	return (int)(((double)occupied_slots/
 							 (double)qf->disk->metadata->xnslots
 						 )* 100.0);
@@ -206,8 +579,11 @@ int bufferedMQF_space(bufferedMQF *qf){
 }
 void bufferedMQF_syncBuffer(bufferedMQF *qf){
     if(qf-> memoryBuffer!=NULL) {
-        qf->disk->migrateFromQF(qf->memoryBuffer);
-        qf_reset(qf->memoryBuffer);
+        bufferedMQF_finishFlush(qf);
+        std::lock_guard<std::mutex> guard(qf->diskLock);
+        bufferedMQF_writeShards(qf,qf->memoryShards,qf->memoryLabels);
+        qf->bufferSlots=0;
+        qf->diskSlots=qf->disk->metadata->noccupied_slots;
     }
 }
 
@@ -217,66 +593,42 @@ void bufferedMQF_BatchQuery( bufferedMQF* qf,QF* Batch){
 		do {
 			uint64_t key = 0, value = 0, count = 0;
 			qfi_get(&source_i, &key, &value, &count);
-			uint64_t diskCount=qf->disk->count_key(key);
-            uint64_t memCount=0;
-            if(qf-> memoryBuffer!=NULL)
-			    memCount=qf_count_key(qf->memoryBuffer,key);
-			qf_setCounter(Batch,key,diskCount+memCount);
+			qf_setCounter(Batch,key,bufferedMQF_count_key(qf,key));
 		} while (!qfi_next(&source_i));
 	}
 }
 
 bool bufferedMQF_find(bufferedMQF* qf,bufferedMQFIterator *qfi, uint64_t key)
 {
-    bufferedMQF_syncBuffer(qf);
-    bool res=qf->disk->findIterator(qfi->diskIt,key);
-    if(qf-> memoryBuffer!=NULL) {
-        qf_iterator(qf->memoryBuffer, qfi->bufferIt, 0);
-        qfi->bufferIt->current = qf->memoryBuffer->metadata->xnslots + 1;
-        qfi->update();
-    }
-    return res;
+    // a running flush changes the disk and the flush buffer
+    bufferedMQF_finishFlush(qf);
+    qfi->seek(qf,key);
+    return !qfi->end() && qfi->currentKey==key;
 }
-//
-// /* Initialize an iterator */
-bufferedMQFIterator* bufferedMQF_iterator(bufferedMQF *qf, uint64_t position){
-// 	if(qfi !=NULL)
-// 		delete qfi;
- 	bool res=false;
- 	onDiskMQF_Namespace::onDiskMQFIterator* dit=new onDiskMQF_Namespace::onDiskMQFIterator();
- 	QFi* bit=new QFi();
-    if(qf-> memoryBuffer!=NULL)
- 	    res|=qf_iterator(qf->memoryBuffer,bit,position);
-    else{
-        delete bit;
-        bit=NULL;
-    }
- 	res|=qf->disk->getIterator(dit,position);
-	return new bufferedMQFIterator(bit,dit);
-
- }
-
-void bufferedMQF_migrate(bufferedMQF* source, bufferedMQF* dest){
-    bufferedMQFIterator* source_i=bufferedMQF_iterator(source,0);
-    while(!source_i->end()) {
-        uint64_t key = 0, value = 0, count = 0;
-        source_i->get(&key, &value, &count);
-        try {
-            bufferedMQF_insert(dest, key, count, false, false);
-        }
-        catch(exception& e)
-        {
-            cout << e.what() << '\n';
-        }
 
+bufferedMQFIterator* bufferedMQF_iterator(bufferedMQF *qf, uint64_t position){
+    bufferedMQF_finishFlush(qf);
+    bufferedMQFIterator* qfi=new bufferedMQFIterator();
+    qfi->seek(qf,position<<qf->disk->metadata->key_remainder_bits);
+    return qfi;
+}
 
-        uint64_t  tmpcount=bufferedMQF_count_key(dest,key);
-        tmpcount++;
-        source_i->next();
-//        bufferedMQF_add_label((const bufferedMQF*)dest,key,value);
+bufferedMQFIterator* bufferedMQF_rangeIterator(bufferedMQF *qf, uint64_t startKey, uint64_t endKey){
+    bufferedMQF_finishFlush(qf);
+    bufferedMQFIterator* qfi=new bufferedMQFIterator();
+    qfi->seek(qf,startKey,endKey);
+    return qfi;
+}
 
-    } ;
-    delete source_i;
+void bufferedMQF_migrate(bufferedMQF* source, bufferedMQF* dest, uint64_t nthreads,
+    onDiskMQF_Namespace::onDiskMQFProgress progress){
+    bufferedMQF_syncBuffer(source);
+    bufferedMQF_syncBuffer(dest);
+    std::unique_lock<std::mutex> sourceGuard(source->diskLock, std::defer_lock);
+    std::unique_lock<std::mutex> destGuard(dest->diskLock, std::defer_lock);
+    std::lock(sourceGuard,destGuard);
+    dest->disk->migrateFromDisk(&source->disk,1,nthreads,progress);
+    dest->diskSlots=dest->disk->metadata->noccupied_slots;
 }
 
 
@@ -292,8 +644,11 @@ void bufferedMQF_serialize(bufferedMQF *qf)
         perror("Error opening file for serializing\n");
         exit(EXIT_FAILURE);
     }
-    if(qf-> memoryBuffer!=NULL)
+    if(qf-> memoryBuffer!=NULL) {
         fwrite(qf->memoryBuffer->metadata, sizeof(qfmetadata), 1, fout);
+        uint64_t nshards=qf->memoryShards.size();
+        fwrite(&nshards, sizeof(uint64_t), 1, fout);
+    }
     /* we don't serialize the locks */
     //fwrite(qf->blocks, qf->metadata->size, 1, fout);
     fclose(fout);
@@ -311,13 +666,18 @@ void bufferedMQF_deserialize(bufferedMQF *qf, const char *filename){
     }
     qfmetadata* metadata = new qfmetadata ();
     fread(metadata, sizeof(qfmetadata), 1, fin);
+    // files written before the buffers had shards end after the metadata
+    uint64_t nshards=1;
+    fread(&nshards, sizeof(uint64_t), 1, fin);
+    fclose(fin);
 
 
-    qf_init(qf->memoryBuffer,metadata->nslots,metadata->key_bits,metadata->label_bits,metadata->fixed_counter_size,0,true,"",2038074761);
+    bufferedMQF_initShards(qf,metadata->nslots*nshards,metadata->key_bits,metadata->label_bits,metadata->fixed_counter_size,nshards);
     delete metadata;
 
 
     onDiskMQF_Namespace::onDiskMQF::load(qf->disk,filename);
+    qf->diskSlots=qf->disk->metadata->noccupied_slots;
 }
 //
 // /* Returns 0 if the iterator is still valid (i.e. has not reached the
@@ -0,0 +1,143 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdexcept>
+#include "gqf.h"
+#include "expandableMQF.h"
+
+using namespace std;
+
+
+expandableMQF::~expandableMQF()
+{
+    qf_destroy(current);
+    delete current;
+    if(old!=NULL){
+        qf_destroy(old);
+        delete old;
+    }
+}
+
+void expandableMQF_init(expandableMQF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,
+    uint64_t fixed_counter_size, double maxLoad, uint64_t migrationStep)
+{
+    if(maxLoad<=0 || maxLoad>=0.95)
+        throw std::domain_error("maxLoad must be between 0 and 0.95");
+    if(migrationStep==0)
+        throw std::domain_error("migrationStep must be > 0");
+    qf_init(qf->current,nslots,key_bits,label_bits,fixed_counter_size,0,true,"",2038074761);
+    qf->maxLoad=maxLoad;
+    qf->migrationStep=migrationStep;
+}
+
+static void expandableMQF_endMigration(expandableMQF *qf)
+{
+    qf_destroy(qf->old);
+    delete qf->old;
+    qf->old=NULL;
+    qf->migrationKey=0;
+}
+
+/* Move up to nitems items of old to current. */
+static void expandableMQF_migrate(expandableMQF *qf, uint64_t nitems)
+{
+    uint64_t key, label, count;
+    for(uint64_t i=0;i<nitems && !qfi_end(&qf->migrationIt);i++){
+        qfi_get(&qf->migrationIt,&key,&label,&count);
+        qf_insert(qf->current,key,count,false,false);
+        if(label!=0 && qf_get_label(qf->current,key)==0)
+            qf_add_label(qf->current,key,label);
+        qfi_next(&qf->migrationIt);
+    }
+    if(qfi_end(&qf->migrationIt)){
+        expandableMQF_endMigration(qf);
+        return;
+    }
+    qfi_get(&qf->migrationIt,&qf->migrationKey,&label,&count);
+}
+
+static void expandableMQF_expand(expandableMQF *qf)
+{
+    qfmetadata* metadata=qf->current->metadata;
+    if(metadata->key_remainder_bits<=2)
+        throw std::overflow_error("The filter is full and has no remainder bit left to grow.");
+    QF* expanded=new QF();
+    qf_init(expanded,metadata->nslots*2,metadata->key_bits,metadata->label_bits,
+        metadata->fixed_counter_size,metadata->BlockLabel_bits,true,"",metadata->seed);
+    qf->old=qf->current;
+    qf->current=expanded;
+    qf->nexpansions++;
+    qf_iterator(qf->old,&qf->migrationIt,0);
+    // no occupied quotient, the filter is empty
+    if(qf->migrationIt.run>=qf->old->metadata->nslots){
+        expandableMQF_endMigration(qf);
+        return;
+    }
+    uint64_t label, count;
+    qfi_get(&qf->migrationIt,&qf->migrationKey,&label,&count);
+}
+
+bool expandableMQF_insert(expandableMQF *qf, uint64_t key, uint64_t count)
+{
+    if(qf->old!=NULL)
+        expandableMQF_migrate(qf,qf->migrationStep);
+    // the previous expansion must be over before the next one, which only
+    // happens if migrationStep is too small for maxLoad
+    if(qf->current->metadata->noccupied_slots >=
+        qf->maxLoad*qf->current->metadata->nslots){
+        if(qf->old!=NULL)
+            expandableMQF_finishExpansion(qf);
+        expandableMQF_expand(qf);
+    }
+    return qf_insert(qf->current,key,count,false,false);
+}
+
+uint64_t expandableMQF_count_key(const expandableMQF *qf, uint64_t key)
+{
+    uint64_t res=qf_count_key(qf->current,key);
+    if(qf->old!=NULL && key>=qf->migrationKey)
+        res+=qf_count_key(qf->old,key);
+    return res;
+}
+
+bool expandableMQF_remove(expandableMQF *qf, uint64_t key, uint64_t count)
+{
+    // removing the item under the migration iterator would move the iterator
+    if(qf->old!=NULL && key==qf->migrationKey)
+        expandableMQF_migrate(qf,1);
+    uint64_t inCurrent=qf_count_key(qf->current,key);
+    bool res=false;
+    if(inCurrent>0){
+        res=qf_remove(qf->current,key,min(count,inCurrent),false,false);
+        count-=min(count,inCurrent);
+    }
+    if(count>0 && qf->old!=NULL && key>qf->migrationKey)
+        res|=qf_remove(qf->old,key,count,false,false);
+    return res;
+}
+
+uint64_t expandableMQF_add_label(expandableMQF *qf, uint64_t key, uint64_t label)
+{
+    uint64_t res=qf_add_label(qf->current,key,label);
+    if(qf->old!=NULL && key>=qf->migrationKey)
+        res|=qf_add_label(qf->old,key,label);
+    return res;
+}
+
+uint64_t expandableMQF_get_label(const expandableMQF *qf, uint64_t key)
+{
+    uint64_t res=qf_get_label(qf->current,key);
+    if(res==0 && qf->old!=NULL && key>=qf->migrationKey)
+        res=qf_get_label(qf->old,key);
+    return res;
+}
+
+void expandableMQF_finishExpansion(expandableMQF *qf)
+{
+    while(qf->old!=NULL)
+        expandableMQF_migrate(qf,qf->migrationStep);
+}
+
+uint64_t expandableMQF_nslots(const expandableMQF *qf)
+{
+    return qf->current->metadata->nslots;
+}
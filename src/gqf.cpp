@@ -7,6 +7,7 @@
 # define assert(x)
 #endif
 #include <string.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -22,6 +23,10 @@
 #include <iostream>
 #include <map>
 #include "utils.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define QF_X86_SIMD 1
+#endif
 
 
 
@@ -89,67 +94,234 @@ static __inline__ unsigned long long rdtsc(void)
 	return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
-#ifdef LOG_WAIT_TIME
-static inline bool qf_spin_lock(QF *cf, volatile int *lock, uint64_t idx, bool
-																flag_spin)
+/* Statistics counters. Each thread counts into one of QF_STATS_SHARDS cache
+ * lines, picked the first time it records anything, and the readers sum
+ * them. The first QF_STATS_SHARDS-1 threads own their line and add without
+ * a locked instruction, the later ones share the last line and add
+ * atomically. */
+#define QF_STATS_SHARDS 64
+
+struct __attribute__ ((aligned (64))) qf_stats_shard {
+	uint64_t general_lock_failures;
+	uint64_t inserts;
+	uint64_t run_length[QF_STATS_BUCKETS];
+	uint64_t cluster_length[QF_STATS_BUCKETS];
+	uint64_t shifted_slots[QF_STATS_BUCKETS];
+	uint64_t counter_slots[QF_STATS_BUCKETS];
+};
+
+/* Changes of the numbers of qf_stats. Decrements wrap around and cancel
+ * out in the sum. */
+struct __attribute__ ((aligned (64))) qf_stats_delta {
+	uint64_t distinct_items;
+	uint64_t total_count;
+	uint64_t counter_slots;
+	uint64_t largest_cluster;
+	uint64_t count_histogram[QF_COUNT_BUCKETS];
+};
+
+struct __attribute__ ((aligned (64))) qf_latency_shard {
+	uint64_t count[QF_NOPS];
+	uint64_t total_ns[QF_NOPS];
+	uint64_t max_ns[QF_NOPS];
+	uint64_t buckets[QF_NOPS][QF_LATENCY_BUCKETS];
+};
+
+static uint64_t stats_nthreads = 0;
+static thread_local int64_t stats_thread_shard = -1;
+/* slots moved by the operation being timed on this thread */
+static thread_local uint64_t op_shifted_slots = 0;
+
+static inline uint64_t stats_thread_index()
 {
-	struct timespec start, end;
-	bool ret;
+	if (stats_thread_shard < 0)
+		stats_thread_shard = std::min(__sync_fetch_and_add(&stats_nthreads, 1),
+			(uint64_t)QF_STATS_SHARDS - 1);
+	return stats_thread_shard;
+}
 
-	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
-	if (!flag_spin) {
-		ret = !__sync_lock_test_and_set(lock, 1);
-		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
-		cf->mem->wait_times[idx].locks_acquired_single_attempt++;
-		cf->mem->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
-																												start.tv_sec) +
-			end.tv_nsec - start.tv_nsec;
-	} else {
-		if (!__sync_lock_test_and_set(lock, 1)) {
-			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
-			cf->mem->wait_times[idx].locks_acquired_single_attempt++;
-			cf->mem->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
-																													start.tv_sec) +
-			end.tv_nsec - start.tv_nsec;
-		} else {
-			while (__sync_lock_test_and_set(lock, 1))
-				while (*lock);
-			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
-			cf->mem->wait_times[idx].total_time_spinning += BILLION * (end.tv_sec -
-																														start.tv_sec) +
-				end.tv_nsec - start.tv_nsec;
+/* Add to a counter of the shard of the calling thread. */
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+	if (stats_thread_shard < QF_STATS_SHARDS - 1)
+		__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+			__ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/* Add to a counter that all the threads update. */
+static inline void stats_add_shared(uint64_t *counter, uint64_t value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline void stats_max(uint64_t *counter, uint64_t value)
+{
+	uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	while (current < value && !__atomic_compare_exchange_n(counter, &current,
+				value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline uint64_t stats_bucket(uint64_t value)
+{
+	if (value == 0)
+		return 0;
+	return std::min((uint64_t)(64 - __builtin_clzll(value)), (uint64_t)QF_STATS_BUCKETS - 1);
+}
+
+static inline qf_stats_shard *stats_shard(const QF *qf)
+{
+	return &qf->mem->stats[stats_thread_index()];
+}
+
+/* The counter of one item changed from old_count in old_slots slots to
+ * new_count in new_slots slots. A count of 0 is an absent item. */
+static inline void stats_record_count(const QF *qf, uint64_t old_count,
+																			uint64_t old_slots, uint64_t new_count,
+																			uint64_t new_slots)
+{
+	qf_stats_delta *delta = &qf->mem->deltas[stats_thread_index()];
+	stats_add(&delta->distinct_items, (new_count > 0) - (old_count > 0));
+	stats_add(&delta->total_count, new_count - old_count);
+	stats_add(&delta->counter_slots, (new_slots - (new_count > 0)) -
+		(old_slots - (old_count > 0)));
+	if (old_count > 0)
+		stats_add(&delta->count_histogram[63 - __builtin_clzll(old_count)], -1);
+	if (new_count > 0)
+		stats_add(&delta->count_histogram[63 - __builtin_clzll(new_count)], 1);
+}
+
+static inline void stats_record_cluster(const QF *qf, uint64_t cluster_length)
+{
+	stats_max(&qf->mem->deltas[stats_thread_index()].largest_cluster, cluster_length);
+}
+
+static void *stats_alloc_shards(uint64_t size)
+{
+	void *shards;
+	if (posix_memalign(&shards, 64, QF_STATS_SHARDS * size))
+		throw std::bad_alloc();
+	memset(shards, 0, QF_STATS_SHARDS * size);
+	return shards;
+}
+
+/* valid is false when the blocks do not come from the inserts of this QF. */
+static void stats_init_deltas(QF *qf, bool valid)
+{
+	qf->mem->deltas = (qf_stats_delta *)stats_alloc_shards(sizeof(qf_stats_delta));
+	qf->mem->deltas_valid = valid;
+}
+
+/* Called once per insert with the length of the run of the key. */
+static inline void stats_record_run(const QF *qf, uint64_t run_length)
+{
+	if (!qf->mem->collect_stats)
+		return;
+	qf_stats_shard *shard = stats_shard(qf);
+	stats_add(&shard->inserts, 1);
+	stats_add(&shard->run_length[stats_bucket(run_length)], 1);
+}
+
+static inline void stats_record_shift(const QF *qf, uint64_t cluster_length,
+																			uint64_t shifted_slots)
+{
+	if (qf->mem->time_ops)
+		op_shifted_slots = shifted_slots;
+	if (!qf->mem->collect_stats)
+		return;
+	qf_stats_shard *shard = stats_shard(qf);
+	stats_add(&shard->cluster_length[stats_bucket(cluster_length)], 1);
+	stats_add(&shard->shifted_slots[stats_bucket(shifted_slots)], 1);
+}
+
+static inline void stats_record_counter(const QF *qf, uint64_t counter_slots)
+{
+	if (!qf->mem->collect_stats)
+		return;
+	stats_add(&stats_shard(qf)->counter_slots[std::min(counter_slots,
+		(uint64_t)QF_STATS_BUCKETS - 1)], 1);
+}
+
+/* Return true if the general lock is taken, operations fail in that case. */
+static inline bool qf_general_locked(const QF *qf)
+{
+	if (!qf->mem->general_lock)
+		return false;
+	if (qf->mem->collect_stats)
+		stats_add(&stats_shard(qf)->general_lock_failures, 1);
+	return true;
+}
+
+static inline uint64_t stats_now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return BILLION * now.tv_sec + now.tv_nsec;
+}
+
+static void op_finish(const QF *qf, qf_op op, uint64_t key, uint64_t start);
+
+/* Times the operation of its scope when qf->mem->time_ops is set. key is
+ * the quotient for QF_OP_NEXT. */
+class op_timer {
+	const QF *qf;
+	qf_op op;
+	uint64_t key;
+	uint64_t start;
+public:
+	op_timer(const QF *qf, qf_op op, uint64_t key) : qf(qf), op(op), key(key), start(0)
+	{
+		if (qf->mem->time_ops) {
+			op_shifted_slots = 0;
+			start = stats_now_ns();
 		}
-		ret = true;
-	}
-	cf->mem->wait_times[idx].locks_taken++;
-
-	return ret;
-
-	/*start = rdtsc();*/
-	/*if (!__sync_lock_test_and_set(lock, 1)) {*/
-		/*clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);*/
-		/*cf->mem->wait_times[idx].locks_acquired_single_attempt++;*/
-		/*cf->mem->wait_times[idx].total_time_single += BILLION * (end.tv_sec -
-		 * start.tv_sec) + end.tv_nsec - start.tv_nsec;*/
-	/*} else {*/
-		/*while (__sync_lock_test_and_set(lock, 1))*/
-			/*while (*lock);*/
-		/*clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);*/
-		/*cf->mem->wait_times[idx].total_time_spinning += BILLION * (end.tv_sec -
-		 * start.tv_sec) + end.tv_nsec - start.tv_nsec;*/
-	/*}*/
-
-	/*end = rdtsc();*/
-	/*cf->mem->wait_times[idx].locks_taken++;*/
-	/*return;*/
+	}
+	~op_timer()
+	{
+		if (start != 0)
+			op_finish(qf, op, key, start);
+	}
+};
+
+/* qf_spin_lock with the counters of lock region idx. Only the lock calls
+ * that have to wait read the clock. */
+static bool qf_spin_lock_logged(const QF *cf, volatile int *lock, uint64_t idx,
+																bool flag_spin)
+{
+	wait_time_data *wait = &cf->mem->wait_times[idx];
+	if (!__sync_lock_test_and_set(lock, 1)) {
+		stats_add_shared(&wait->locks_taken, 1);
+		stats_add_shared(&wait->locks_acquired_single_attempt, 1);
+		return true;
+	}
+	if (!flag_spin) {
+		stats_add_shared(&wait->failed_attempts, 1);
+		return false;
+	}
+	uint64_t start = stats_now_ns();
+	uint64_t spins = 1;
+	while (*lock);
+	while (__sync_lock_test_and_set(lock, 1)) {
+		spins++;
+		while (*lock);
+	}
+	stats_add_shared(&wait->total_time_spinning, stats_now_ns() - start);
+	stats_add_shared(&wait->spins, spins);
+	stats_add_shared(&wait->locks_taken, 1);
+	return true;
 }
-#else
+
 /**
  * Try to acquire a lock once and return even if the lock is busy.
  * If spin flag is set, then spin until the lock is available.
+ * idx is the lock region, used by the runtime statistics.
  */
-static inline bool qf_spin_lock(volatile int *lock, bool flag_spin)
+static inline bool qf_spin_lock(const QF *cf, volatile int *lock, uint64_t idx,
+																bool flag_spin)
 {
+	if (cf->mem->collect_stats)
+		return qf_spin_lock_logged(cf, lock, idx, flag_spin);
 	if (!flag_spin) {
 		return !__sync_lock_test_and_set(lock, 1);
 	} else {
@@ -160,7 +332,6 @@ static inline bool qf_spin_lock(volatile int *lock, bool flag_spin)
 
 	return false;
 }
-#endif
 
 static inline void qf_spin_unlock(volatile int *lock)
 {
@@ -171,74 +342,37 @@ static inline void qf_spin_unlock(volatile int *lock)
 static bool qf_lock(const QF *cf, uint64_t hash_bucket_index, bool spin, bool flag)
 {
 	uint64_t hash_bucket_lock_offset  = hash_bucket_index % NUM_SLOTS_TO_LOCK;
+	uint64_t region = hash_bucket_index/NUM_SLOTS_TO_LOCK;
 	if (flag) {
-#ifdef LOG_WAIT_TIME
-		if (!qf_spin_lock(cf, &cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK],
-											hash_bucket_index/NUM_SLOTS_TO_LOCK, spin))
-			return false;
-		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			if (!qf_spin_lock(cf, &cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-												hash_bucket_index/NUM_SLOTS_TO_LOCK+1, spin)) {
-				qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-				return false;
-			}
-		}
-#else
-		if (!qf_spin_lock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK], spin))
+		if (!qf_spin_lock(cf, &cf->mem->locks[region], region, spin))
 			return false;
 		if (NUM_SLOTS_TO_LOCK - hash_bucket_lock_offset <= CLUSTER_SIZE) {
-			if (!qf_spin_lock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-												spin)) {
-				qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
+			if (!qf_spin_lock(cf, &cf->mem->locks[region+1], region+1, spin)) {
+				qf_spin_unlock(&cf->mem->locks[region]);
 				return false;
 			}
 		}
-#endif
 	} else {
 		/* take the lock for two lock-blocks; the lock-block in which the
 		 * hash_bucket_index falls and the next lock-block */
-
-#ifdef LOG_WAIT_TIME
 		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
 				CLUSTER_SIZE) {
-			if (!qf_spin_lock(cf, &cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1], spin))
+			if (!qf_spin_lock(cf, &cf->mem->locks[region-1], region-1, spin))
 				return false;
 		}
-		if (!qf_spin_lock(cf, &cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK], spin)) {
+		if (!qf_spin_lock(cf, &cf->mem->locks[region], region, spin)) {
 			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
 					CLUSTER_SIZE)
-				qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+				qf_spin_unlock(&cf->mem->locks[region-1]);
 			return false;
 		}
-		if (!qf_spin_lock(cf, &cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-											spin)) {
-			qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
+		if (!qf_spin_lock(cf, &cf->mem->locks[region+1], region+1, spin)) {
+			qf_spin_unlock(&cf->mem->locks[region]);
 			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
 					CLUSTER_SIZE)
-				qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
+				qf_spin_unlock(&cf->mem->locks[region-1]);
 			return false;
 		}
-#else
-		if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-				CLUSTER_SIZE) {
-			if (!qf_spin_lock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1], spin))
-				return false;
-		}
-		if (!qf_spin_lock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK], spin)) {
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
-			return false;
-		}
-		if (!qf_spin_lock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK+1],
-											spin)) {
-			qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK]);
-			if (hash_bucket_index >= NUM_SLOTS_TO_LOCK && hash_bucket_lock_offset <=
-					CLUSTER_SIZE)
-				qf_spin_unlock(&cf->mem->locks[hash_bucket_index/NUM_SLOTS_TO_LOCK-1]);
-			return false;
-		}
-#endif
 	}
 	return true;
 }
@@ -262,11 +396,7 @@ static void qf_unlock(const QF *cf, uint64_t hash_bucket_index, bool flag)
 
 static void modify_metadata(QF *cf, uint64_t *metadata, int cnt)
 {
-#ifdef LOG_WAIT_TIME
-	qf_spin_lock(cf, &cf->mem->metadata_lock,cf->num_locks, true);
-#else
 	//qf_spin_lock(&cf->mem->metadata_lock, true);
-#endif
 	*metadata = *metadata + cnt;
 	//qf_spin_unlock(&cf->mem->metadata_lock);
 	return;
@@ -547,15 +677,18 @@ static inline uint64_t _get_slot(const QF *qf, uint64_t index)
 {
 	assert(index < qf->metadata->xnslots);
 	/* Should use __uint128_t to support up to 64-bit remainders, but gcc seems
-	 * to generate buggy code.  :/  */
+	 * to generate buggy code.  :/  A slot of more than 57 bits can end in the
+	 * byte after the word, which is read separately. */
 
 	uint64_t *p = (uint64_t *)&get_block(qf, index /
 																			 SLOTS_PER_BLOCK)->slots[(index %
 																																SLOTS_PER_BLOCK)
 																			 * qf->metadata->bits_per_slot / 8];
-	return (uint64_t)(((*p) >> (((index % SLOTS_PER_BLOCK) *
-															 qf->metadata->bits_per_slot) % 8)) &
-										BITMASK(qf->metadata->bits_per_slot));
+	int shift = ((index % SLOTS_PER_BLOCK) * qf->metadata->bits_per_slot) % 8;
+	uint64_t value = (*p) >> shift;
+	if (shift + qf->metadata->bits_per_slot > 64)
+		value |= (uint64_t)((uint8_t *)p)[8] << (64 - shift);
+	return value & BITMASK(qf->metadata->bits_per_slot);
 }
 
 static inline void _set_slot(const QF *qf, uint64_t index, uint64_t value)
@@ -571,6 +704,11 @@ static inline void _set_slot(const QF *qf, uint64_t index, uint64_t value)
 
 	int shift = ((index % SLOTS_PER_BLOCK) * qf->metadata->bits_per_slot) % 8;
 	uint64_t mask = BITMASK(qf->metadata->bits_per_slot)<< shift;
+	if (shift + qf->metadata->bits_per_slot > 64) {
+		uint8_t *q = (uint8_t *)p + 8;
+		uint8_t high_mask = BITMASK(shift + qf->metadata->bits_per_slot - 64);
+		*q = *q ^ ((*q ^ (value >> (64 - shift))) & high_mask);
+	}
 	value <<= shift;
 	*p=*p ^ ((*p ^ value) & mask);
 
@@ -623,15 +761,49 @@ static inline uint64_t get_fixed_counter(const QF *qf, uint64_t index)
 	_set_slot(qf,index,tvalue);
 }
 
+/* When separate_labels is set, the labels of a block are kept in their own
+ * bit array (SLOTS_PER_BLOCK*label_bits bits) right after the slots. */
+static inline uint8_t * get_labels_array(const QF *qf, uint64_t block_index)
+{
+	return get_block(qf, block_index)->slots + 8 * qf->metadata->bits_per_slot;
+}
+
+/* A label of the separate array is read and written through the 64-bit
+ * words of the array of its block, so that it can span two words and the
+ * access never goes past the end of the array. */
 static inline uint64_t get_label(const QF *qf, uint64_t index)
 {
 	uint64_t mask=BITMASK(qf->metadata->label_bits);
+	if(qf->metadata->separate_labels){
+		uint64_t *words = (uint64_t *)get_labels_array(qf, index / SLOTS_PER_BLOCK);
+		uint64_t bit = (index % SLOTS_PER_BLOCK) * qf->metadata->label_bits;
+		uint64_t shift = bit % 64;
+		uint64_t value = words[bit / 64] >> shift;
+		if (shift + qf->metadata->label_bits > 64)
+			value |= words[bit / 64 + 1] << (64 - shift);
+		return value & mask;
+	}
 	uint64_t t=_get_slot(qf,index);
 	t >>= (qf->metadata->fixed_counter_size+qf->metadata->key_remainder_bits);
 	return t&mask;
 }
 static inline void set_label(const QF *qf, uint64_t index,uint64_t value)
 {
+	if(qf->metadata->separate_labels){
+		uint64_t *words = (uint64_t *)get_labels_array(qf, index / SLOTS_PER_BLOCK);
+		uint64_t bit = (index % SLOTS_PER_BLOCK) * qf->metadata->label_bits;
+		uint64_t shift = bit % 64;
+		uint64_t mask = BITMASK(qf->metadata->label_bits);
+		value &= mask;
+		uint64_t *p = &words[bit / 64];
+		*p = *p ^ ((*p ^ (value << shift)) & (mask << shift));
+		if (shift + qf->metadata->label_bits > 64) {
+			p++;
+			uint64_t high_mask = mask >> (64 - shift);
+			*p = *p ^ ((*p ^ (value >> (64 - shift))) & high_mask);
+		}
+		return;
+	}
 	uint64_t original_value=_get_slot(qf,index);
 	value<<=(qf->metadata->fixed_counter_size+qf->metadata->key_remainder_bits);
 	uint64_t mask=BITMASK(qf->metadata->fixed_counter_size+qf->metadata->key_remainder_bits);
@@ -795,13 +967,51 @@ static inline uint64_t find_first_empty_slot(QF *qf, uint64_t from)
 	return from;
 }
 
+static inline uint64_t latency_bucket(uint64_t ns)
+{
+	if (ns < 16)
+		return ns;
+	uint64_t e = 63 - __builtin_clzll(ns);
+	if (e >= 40)
+		return QF_LATENCY_BUCKETS - 1;
+	return 16 + (e - 4) * 8 + ((ns >> (e - 3)) & 7);
+}
+
+static void op_finish(const QF *qf, qf_op op, uint64_t key, uint64_t start)
+{
+	uint64_t ns = stats_now_ns() - start;
+	if (qf->mem->collect_latency) {
+		qf_latency_shard *shard = &qf->mem->latency[stats_thread_index()];
+		stats_add(&shard->count[op], 1);
+		stats_add(&shard->total_ns[op], ns);
+		stats_max(&shard->max_ns[op], ns);
+		stats_add(&shard->buckets[op][latency_bucket(ns)], 1);
+	}
+	qf_slow_op_callback callback = qf->mem->slow_op_callback;
+	if (callback == NULL || ns < qf->mem->slow_op_threshold)
+		return;
+	qf_slow_op slow;
+	slow.op = op;
+	slow.key = op == QF_OP_NEXT ? 0 : key;
+	slow.quotient = op == QF_OP_NEXT ? key : key >> qf->metadata->key_remainder_bits;
+	slow.latency_ns = ns;
+	slow.cluster_length = slow.quotient < qf->metadata->xnslots ?
+		find_first_empty_slot((QF *)qf, slow.quotient) - slow.quotient : 0;
+	slow.shifted_slots = op_shifted_slots;
+	callback(&slow, qf->mem->slow_op_arg);
+}
+
 static inline uint64_t shift_into_b(const uint64_t a, const uint64_t b,
 																		const int bstart, const int bend,
 																		const int amount)
 {
-	const uint64_t a_component = bstart == 0 ? (a >> (64 - amount)) : 0;
 	const uint64_t b_shifted_mask = BITMASK(bend - bstart) << bstart;
-	const uint64_t b_shifted = ((b_shifted_mask & b) << amount) & b_shifted_mask;
+	// the bits of a shifted past bend belong to the slot after the range
+	const uint64_t a_component = bstart == 0 ?
+		(a >> (64 - amount)) & b_shifted_mask : 0;
+	// shifting a word by 64 is undefined, and moves all of b out of the range
+	const uint64_t b_shifted = amount == 64 ? 0 :
+		((b_shifted_mask & b) << amount) & b_shifted_mask;
 	const uint64_t b_mask = ~b_shifted_mask;
 	return a_component | b_shifted | (b & b_mask);
 }
@@ -860,6 +1070,105 @@ static inline void shift_remainders(QF *qf, const uint64_t start_index, const
 
 #endif
 
+#define LABEL_WORD(qf, i) ((uint64_t *)&(get_labels_array(qf, (i)/qf->metadata->label_bits)[8 * ((i) % qf->metadata->label_bits)]))
+
+/* Same as shift_remainders but on the separate label arrays. */
+static inline void shift_labels(QF *qf, const uint64_t start_index, const
+																uint64_t empty_index)
+{
+	uint64_t last_word = (empty_index + 1) * qf->metadata->label_bits / 64;
+	const uint64_t first_word = start_index * qf->metadata->label_bits / 64;
+	int bend = ((empty_index + 1) * qf->metadata->label_bits) % 64;
+	const int bstart = (start_index * qf->metadata->label_bits) % 64;
+
+	while (last_word != first_word) {
+		*LABEL_WORD(qf, last_word) = shift_into_b(*LABEL_WORD(qf, last_word-1),
+																							*LABEL_WORD(qf, last_word),
+																							0, bend, qf->metadata->label_bits);
+		last_word--;
+		bend = 64;
+	}
+	*LABEL_WORD(qf, last_word) = shift_into_b(0, *LABEL_WORD(qf, last_word),
+																						bstart, bend,
+																						qf->metadata->label_bits);
+}
+
+typedef uint64_t *(*bit_array_word)(const QF *qf, uint64_t word);
+
+static inline uint64_t *remainder_word(const QF *qf, uint64_t word)
+{
+	return REMAINDER_WORD(qf, word);
+}
+
+static inline uint64_t *label_word(const QF *qf, uint64_t word)
+{
+	return LABEL_WORD(qf, word);
+}
+
+static inline uint64_t *runend_word(const QF *qf, uint64_t word)
+{
+	return (uint64_t *)((uint8_t *)get_block(qf, word) + offsetof(qfblock, runends));
+}
+
+/* The 64 bits of a bit array of nwords words from bit pos, which is
+ * negative for the bits before the array. These are 0, like the bits after
+ * the array. */
+static inline uint64_t get_bits64(const QF *qf, bit_array_word word,
+																	uint64_t nwords, int64_t pos)
+{
+	const int offset = pos & 63;
+	const int64_t w = (pos - offset) / 64;
+	const uint64_t lo = w >= 0 ? *word(qf, w) : 0;
+	if (offset == 0)
+		return lo;
+	const uint64_t hi = (uint64_t)(w + 1) < nwords ? *word(qf, w + 1) : 0;
+	return (uint64_t)(((((__uint128_t)hi) << 64) | lo) >> offset);
+}
+
+/* Move the bits [first, last) of a bit array distance bits up, or down if
+ * distance is negative, with one funnel shift per destination word. The
+ * words are written from the end of the move, so every bit is read before
+ * it is overwritten. The bits uncovered by the move are left as they are. */
+static inline void move_bits(const QF *qf, bit_array_word word, uint64_t nwords,
+														 uint64_t first, uint64_t last, int64_t distance)
+{
+	if (first >= last || distance == 0)
+		return;
+	const uint64_t dst_first = first + distance;
+	const uint64_t dst_last = last + distance;
+	const uint64_t first_word = dst_first / 64;
+	const uint64_t last_word = (dst_last - 1) / 64;
+	for (uint64_t i = 0; i <= last_word - first_word; i++) {
+		const uint64_t w = distance > 0 ? last_word - i : first_word + i;
+		uint64_t mask = ~0ULL;
+		if (w == first_word)
+			mask &= ~0ULL << (dst_first % 64);
+		if (w == last_word)
+			mask &= BITMASK(dst_last - 64 * w);
+		const uint64_t value = get_bits64(qf, word, nwords, (int64_t)(64 * w) - distance);
+		uint64_t *p = word(qf, w);
+		*p ^= (*p ^ value) & mask;
+	}
+}
+
+/* Move the slots [first, last) distance slots up, or down if distance is
+ * negative, with their labels and runends. */
+static inline void move_slots(QF *qf, uint64_t first, uint64_t last,
+															int64_t distance, bool runends)
+{
+	const uint64_t bits = qf->metadata->bits_per_slot;
+	const uint64_t nblocks = qf->metadata->nblocks;
+	move_bits(qf, remainder_word, nblocks * bits, first * bits, last * bits,
+						distance * (int64_t)bits);
+	if (qf->metadata->separate_labels && qf->metadata->label_bits > 0) {
+		const uint64_t label_bits = qf->metadata->label_bits;
+		move_bits(qf, label_word, nblocks * label_bits, first * label_bits,
+							last * label_bits, distance * (int64_t)label_bits);
+	}
+	if (runends)
+		move_bits(qf, runend_word, nblocks, first, last, distance);
+}
+
 static inline void qf_dump_block(const QF *qf, uint64_t i)
 {
 	uint64_t j;
@@ -946,12 +1255,14 @@ static inline void find_next_n_empty_slots(QF *qf, uint64_t from, uint64_t n,
 static inline void shift_slots(QF *qf, int64_t first, uint64_t last, uint64_t
 															 distance)
 {
-	int64_t i;
-	if (distance == 1)
+	bool shiftLabels = qf->metadata->separate_labels && qf->metadata->label_bits > 0;
+	if (distance == 1){
 		shift_remainders(qf, first, last+1);
-	else
-		for (i = last; i >= first; i--)
-			_set_slot(qf, i + distance, _get_slot(qf, i));
+		if (shiftLabels)
+			shift_labels(qf, first, last+1);
+	}
+	else if ((int64_t)last >= first)
+		move_slots(qf, first, last + 1, distance, false);
 }
 
 static inline void shift_runends(QF *qf, int64_t first, uint64_t last,
@@ -1077,6 +1388,9 @@ static inline void insert_replace_slots_and_shift_remainders_and_runends_and_off
 		//printf("shift %lu, ninserts=%lu\n",insert_index,ninserts );
 
 		find_next_n_empty_slots(qf, insert_index, ninserts, empties);
+		stats_record_shift(qf, empties[0] - bucket_index,
+			empties[0] + 1 - insert_index - ninserts);
+		stats_record_cluster(qf, empties[0] - bucket_index + 1);
 
 		for (i = 0; i < ninserts - 1; i++){
 			if(empties[i]>=qf->metadata->xnslots||empties[i+1]>=qf->metadata->xnslots)
@@ -1159,6 +1473,13 @@ static inline void insert_replace_slots_and_shift_remainders_and_runends_and_off
 		super_set(qf,overwrite_index+i,remainders[i],fixed_size_counters[i]);
 //		printf("fixed counter = %lu\n",fixed_size_counters[i] );
 	}
+	if (ninserts <= 0)
+		stats_record_shift(qf, 0, 0);
+	stats_record_counter(qf, total_remainders);
+	/* the inserted slots still hold the labels of the slots shifted out of them */
+	if(qf->metadata->label_bits>0)
+		for (i = noverwrites; i < total_remainders; i++)
+			set_label(qf, overwrite_index + i, 0);
 
 	modify_metadata(qf, &qf->metadata->noccupied_slots, ninserts);
 }
@@ -1174,12 +1495,13 @@ static inline void remove_replace_slots_and_shift_remainders_and_runends_and_off
 {
 	uint64_t i;
 
-	// Update the slots
+	// Update the slots, the label of the counter stays in its first slot
+	uint64_t label = qf->metadata->label_bits>0 ? get_label(qf, overwrite_index) : 0;
 	for (i = 0; i < total_remainders; i++){
 		set_slot(qf, overwrite_index + i, remainders[i]);
 		set_fixed_counter(qf, overwrite_index + i, fcounters[i]);
 		if(qf->metadata->label_bits>0)
-			set_label(qf, overwrite_index + i, 0);
+			set_label(qf, overwrite_index + i, i == 0 ? label : 0);
 	}
 
 
@@ -1196,11 +1518,16 @@ static inline void remove_replace_slots_and_shift_remainders_and_runends_and_off
 	  }
 	}
 
-	// shift slots back one run at a time
+	// shift slots back one run at a time. The slots that move by the same
+	// distance are only counted here, and moved together when the distance
+	// changes. The runends read by the loop are all after the moved slots.
 	uint64_t original_bucket = bucket_index;
 	uint64_t current_bucket = bucket_index;
 	uint64_t current_slot = overwrite_index + total_remainders;
 	uint64_t current_distance = old_length - total_remainders;
+	uint64_t moved_slots = 0;
+	uint64_t moved_from = current_slot;
+	uint64_t shift_end = current_slot + current_distance;
 
 	while (current_distance > 0) {
 		if (is_runend(qf, current_slot + current_distance - 1)) {
@@ -1211,17 +1538,15 @@ static inline void remove_replace_slots_and_shift_remainders_and_runends_and_off
 		}
 
 		if (current_bucket <= current_slot) {
-			set_slot(qf, current_slot, get_slot(qf, current_slot + current_distance));
-			set_fixed_counter(qf, current_slot, get_fixed_counter(qf, current_slot + current_distance));
-			if(qf->metadata->label_bits>0)
-				set_label(qf, current_slot, get_label(qf, current_slot + current_distance));
-
-			if (is_runend(qf, current_slot) !=
-					is_runend(qf, current_slot + current_distance))
-				METADATA_WORD(qf, runends, current_slot) ^= 1ULL << (current_slot % 64);
+			moved_slots++;
 			current_slot++;
+			continue;
+		}
+		move_slots(qf, moved_from + current_distance, current_slot + current_distance,
+							 -(int64_t)current_distance, true);
+		shift_end = current_slot + current_distance;
 
-		} else if (current_bucket <= current_slot + current_distance) {
+		if (current_bucket <= current_slot + current_distance) {
 			uint64_t i;
 			for (i = current_slot; i < current_slot + current_distance; i++) {
 				set_slot(qf, i, 0);
@@ -1233,52 +1558,32 @@ static inline void remove_replace_slots_and_shift_remainders_and_runends_and_off
 
 			current_distance = current_slot + current_distance - current_bucket;
 			current_slot = current_bucket;
+			moved_from = current_slot;
 		} else {
 			current_distance = 0;
 		}
 	}
 
+	if (qf->mem->time_ops)
+		op_shifted_slots = moved_slots;
+
 	// reset the occupied bit of the hash bucket index if the hash is the
 	// only item in the run and is removed completely.
 	if (operation && !total_remainders)
 		METADATA_WORD(qf, occupieds, bucket_index) &= ~(1ULL << (bucket_index % 64));
 
-	// update the offset bits.
-	// find the number of occupied slots in the original_bucket block.
-	// Then find the runend slot corresponding to the last run in the
-	// original_bucket block.
-	// Update the offset of the block to which it belongs.
-	uint64_t original_block = original_bucket / SLOTS_PER_BLOCK;
-	while (1 && old_length > total_remainders) {	// we only update offsets if we shift/delete anything
-		int32_t last_occupieds_bit = bitscanreverse(get_block(qf, original_block)->occupieds[0]);
-		// there is nothing in the block
-		if (last_occupieds_bit == -1) {
-			if (get_block(qf, original_block + 1)->offset == 0)
-				break;
-			get_block(qf, original_block + 1)->offset = 0;
-		} else {
-			uint64_t last_occupieds_hash_index = SLOTS_PER_BLOCK * original_block + last_occupieds_bit;
-			uint64_t runend_index = run_end(qf, last_occupieds_hash_index);
-			// runend spans across the block
-			// update the offset of the next block
-			if (runend_index / SLOTS_PER_BLOCK == original_block) { // if the run ends in the same block
-				if (get_block(qf, original_block + 1)->offset == 0)
-					break;
-				get_block(qf, original_block + 1)->offset = 0;
-			} else if (runend_index / SLOTS_PER_BLOCK == original_block + 1) { // if the last run spans across one block
-				if (get_block(qf, original_block + 1)->offset == (runend_index % SLOTS_PER_BLOCK) + 1)
-					break;
-				get_block(qf, original_block + 1)->offset = (runend_index % SLOTS_PER_BLOCK) + 1;
-			} else { // if the last run spans across multiple blocks
-				uint64_t i;
-				for (i = original_block + 1; i < runend_index / SLOTS_PER_BLOCK - 1; i++)
-					get_block(qf, i)->offset = SLOTS_PER_BLOCK;
-				if (get_block(qf, runend_index / SLOTS_PER_BLOCK)->offset == (runend_index % SLOTS_PER_BLOCK) + 1)
-					break;
-				get_block(qf, runend_index / SLOTS_PER_BLOCK)->offset = (runend_index % SLOTS_PER_BLOCK) + 1;
-			}
+	// update the offsets of the blocks starting in the shifted slots. The
+	// offset of a block is where the last run of the buckets before it ends,
+	// which run_end finds from the offset of the previous block.
+	if (old_length > total_remainders) {
+		uint64_t last_block = std::min((uint64_t)(shift_end / SLOTS_PER_BLOCK + 1),
+																	 qf->metadata->nblocks - 1);
+		for (uint64_t block = original_bucket / SLOTS_PER_BLOCK + 1; block <= last_block; block++) {
+			uint64_t runend_index = run_end(qf, SLOTS_PER_BLOCK * block - 1);
+			uint64_t offset = runend_index < SLOTS_PER_BLOCK * block ? 0 :
+				runend_index - SLOTS_PER_BLOCK * block + 1;
+			get_block(qf, block)->offset = std::min(offset, (uint64_t)BITMASK(8 * sizeof(qf->blocks[0].offset)));
 		}
-		original_block++;
 	}
 
 	int num_slots_freed = old_length - total_remainders;
@@ -1304,6 +1609,10 @@ static inline void remove_replace_slots_and_shift_remainders_and_runends_and_off
 	 Slots :           [Remaining] [first digit] [second digit] ... [last digit]
 	 Fixed counters :  [Maximum]     [Maximum]   [Maximum]      ... [up to Maximum -1]
 
+	 3- fixed counter size = 0 (presence only)
+	 Slots :           [Remaining]
+	 Every key takes one slot and counts as 1.
+
  */
 static inline uint64_t *encode_counter(QF *qf, uint64_t remainder, uint64_t
 																			 counter, uint64_t *slots, uint64_t *fixed_size_counters)
@@ -1316,6 +1625,11 @@ static inline uint64_t *encode_counter(QF *qf, uint64_t remainder, uint64_t
 
 	if (counter == 0)
 	 	return p;
+	if (qf->metadata->fixed_counter_size == 0) {
+		*--p = remainder;
+		*--pf = 0;
+		return p;
+	}
 
 	counter--;
 	uint64_t fcounter_first=std::min(counter,fixed_counter_max);
@@ -1349,6 +1663,11 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 
 	// *remainder  = get_slot(qf, index);
 	// uint64_t fcount=get_fixed_counter(qf,index);
+	if (qf->metadata->fixed_counter_size == 0) {
+		*remainder = get_slot(qf, index);
+		*count = 1;
+		return index;
+	}
 	uint64_t fcount;
 	super_get(qf,index,remainder,&fcount);
 	uint64_t tmp_count= fcount+1;
@@ -1378,6 +1697,166 @@ static inline uint64_t decode_counter(const QF *qf, uint64_t index, uint64_t
 
 }
 
+/* Remainder search in a run. The counters of a run are sorted by remainder,
+ * and a counter goes on in the next slot while its fixed counter is at the
+ * maximum, so a slot starts a counter iff the slot before it in the run ends
+ * one. The kernels return the first slot of the first counter from index to
+ * runend with a remainder >= remainder, or runend + 1. index must be the
+ * first slot of a counter. Without fixed counters every slot is a counter. */
+static inline uint64_t fixed_count_end(const QF *qf)
+{
+	return qf->metadata->fixed_counter_size == 0 ? 1 :
+		BITMASK(qf->metadata->fixed_counter_size);
+}
+
+static uint64_t find_remainder_scalar(const QF *qf, uint64_t index,
+																			uint64_t runend, uint64_t remainder)
+{
+	const uint64_t fixed_count_max = fixed_count_end(qf);
+	bool start = true;
+	for (; index <= runend; index++) {
+		uint64_t slot, fcount;
+		super_get(qf, index, &slot, &fcount);
+		if (start && slot >= remainder)
+			return index;
+		start = fcount != fixed_count_max;
+	}
+	return runend + 1;
+}
+
+#ifdef QF_X86_SIMD
+/* The SIMD kernels load the slots of a window of the run, never crossing a
+ * block, with one gather of the 8 bytes holding each slot, which needs slots
+ * of at most 57 bits. Then starts has a bit per lane starting a counter,
+ * from the fixed counters of the lanes before it, and the first start with
+ * a remainder >= remainder ends the search. */
+__attribute__((target("avx2")))
+static uint64_t find_remainder_avx2(const QF *qf, uint64_t index,
+																		uint64_t runend, uint64_t remainder)
+{
+	const uint64_t bits = qf->metadata->bits_per_slot;
+	const __m256i lane_bits = _mm256_set_epi64x(3 * bits, 2 * bits, bits, 0);
+	const __m128i fixed_bits = _mm_cvtsi64_si128(qf->metadata->fixed_counter_size);
+	const __m256i remainder_mask = _mm256_set1_epi64x(BITMASK(qf->metadata->key_remainder_bits));
+	const __m256i fixed_mask = _mm256_set1_epi64x(BITMASK(qf->metadata->fixed_counter_size));
+	const __m256i fixed_max = _mm256_set1_epi64x(fixed_count_end(qf));
+	const __m256i target = _mm256_set1_epi64x(remainder);
+	const __m256i seven = _mm256_set1_epi64x(7);
+	uint64_t carry = 1;
+	while (index <= runend) {
+		uint64_t in_block = index % SLOTS_PER_BLOCK;
+		uint64_t lanes = std::min(std::min(runend - index + 1, (uint64_t)4),
+															(uint64_t)(SLOTS_PER_BLOCK - in_block));
+		const long long *slots = (const long long *)get_block(qf, index / SLOTS_PER_BLOCK)->slots;
+		__m256i bit = _mm256_add_epi64(_mm256_set1_epi64x(in_block * bits), lane_bits);
+		__m256i valid = _mm256_cmpgt_epi64(_mm256_set1_epi64x(lanes),
+																			 _mm256_set_epi64x(3, 2, 1, 0));
+		__m256i words = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), slots,
+																								_mm256_srli_epi64(bit, 3), valid, 1);
+		words = _mm256_srlv_epi64(words, _mm256_and_si256(bit, seven));
+		__m256i remainders = _mm256_and_si256(_mm256_srl_epi64(words, fixed_bits), remainder_mask);
+		__m256i fcounts = _mm256_and_si256(words, fixed_mask);
+		uint64_t less = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, remainders)));
+		uint64_t full = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(fcounts, fixed_max)));
+		uint64_t ends = ~full & BITMASK(lanes);
+		uint64_t starts = ((ends << 1) | carry) & BITMASK(lanes);
+		uint64_t hits = starts & ~less;
+		if (hits)
+			return index + __builtin_ctzll(hits);
+		carry = (ends >> (lanes - 1)) & 1;
+		index += lanes;
+	}
+	return runend + 1;
+}
+
+__attribute__((target("avx512f")))
+static uint64_t find_remainder_avx512(const QF *qf, uint64_t index,
+																			uint64_t runend, uint64_t remainder)
+{
+	const uint64_t bits = qf->metadata->bits_per_slot;
+	const __m512i lane_bits = _mm512_set_epi64(7 * bits, 6 * bits, 5 * bits, 4 * bits,
+																						 3 * bits, 2 * bits, bits, 0);
+	const __m128i fixed_bits = _mm_cvtsi64_si128(qf->metadata->fixed_counter_size);
+	const __m512i remainder_mask = _mm512_set1_epi64(BITMASK(qf->metadata->key_remainder_bits));
+	const __m512i fixed_mask = _mm512_set1_epi64(BITMASK(qf->metadata->fixed_counter_size));
+	const __m512i fixed_max = _mm512_set1_epi64(fixed_count_end(qf));
+	const __m512i target = _mm512_set1_epi64(remainder);
+	const __m512i seven = _mm512_set1_epi64(7);
+	uint64_t carry = 1;
+	while (index <= runend) {
+		uint64_t in_block = index % SLOTS_PER_BLOCK;
+		uint64_t lanes = std::min(std::min(runend - index + 1, (uint64_t)8),
+															(uint64_t)(SLOTS_PER_BLOCK - in_block));
+		const void *slots = get_block(qf, index / SLOTS_PER_BLOCK)->slots;
+		__mmask8 valid = BITMASK(lanes);
+		__m512i bit = _mm512_add_epi64(_mm512_set1_epi64(in_block * bits), lane_bits);
+		__m512i words = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), valid,
+																								_mm512_srli_epi64(bit, 3), slots, 1);
+		words = _mm512_srlv_epi64(words, _mm512_and_si512(bit, seven));
+		__m512i remainders = _mm512_and_si512(_mm512_srl_epi64(words, fixed_bits), remainder_mask);
+		__m512i fcounts = _mm512_and_si512(words, fixed_mask);
+		uint64_t ends = _mm512_mask_cmpneq_epu64_mask(valid, fcounts, fixed_max);
+		uint64_t starts = ((ends << 1) | carry) & valid;
+		uint64_t hits = starts & _mm512_cmpge_epu64_mask(remainders, target);
+		if (hits)
+			return index + __builtin_ctzll(hits);
+		carry = (ends >> (lanes - 1)) & 1;
+		index += lanes;
+	}
+	return runend + 1;
+}
+#endif
+
+typedef uint64_t (*find_remainder_kernel)(const QF *qf, uint64_t index,
+																					uint64_t runend, uint64_t remainder);
+
+static find_remainder_kernel select_find_remainder(void)
+{
+#ifdef QF_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return find_remainder_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return find_remainder_avx2;
+#endif
+	return find_remainder_scalar;
+}
+
+static const find_remainder_kernel find_remainder_simd = select_find_remainder();
+
+static inline uint64_t find_remainder(const QF *qf, uint64_t index,
+																			uint64_t runend, uint64_t remainder)
+{
+	// a short run is faster to scan than to load in a vector
+	if (qf->metadata->bits_per_slot > 57 || runend - index < 4)
+		return find_remainder_scalar(qf, index, runend, remainder);
+	return find_remainder_simd(qf, index, runend, remainder);
+}
+
+/* Find the first slot of the counter of key. Returns false if key is not in
+ * the filter. */
+static inline bool find_counter(const QF *qf, uint64_t key, uint64_t *index)
+{
+	uint64_t hash_remainder    = key & BITMASK(qf->metadata->key_remainder_bits);
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
+	if (!is_occupied(qf, hash_bucket_index))
+		return false;
+	uint64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
+																		hash_bucket_index-1) + 1;
+	if (runstart_index < hash_bucket_index)
+		runstart_index = hash_bucket_index;
+	// the run ends at the first runend from its start
+	uint64_t runend_index = runstart_index;
+	uint64_t runends = METADATA_WORD(qf, runends, runend_index) >> (runend_index % 64);
+	while (runends == 0) {
+		runend_index += 64 - runend_index % 64;
+		runends = METADATA_WORD(qf, runends, runend_index);
+	}
+	runend_index += __builtin_ctzll(runends);
+	*index = find_remainder(qf, runstart_index, runend_index, hash_remainder);
+	return *index <= runend_index && get_slot(qf, *index) == hash_remainder;
+}
+
 /* return the next slot which corresponds to a
  * different element
  * */
@@ -1401,7 +1880,7 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 	uint64_t fixed_count_max=((1ULL)<<qf->metadata->fixed_counter_size)-1;
 
 	if (lock) {
-		if(qf->mem->general_lock)
+		if(qf_general_locked(qf))
 			return false;
 		if (!qf_lock(qf, hash_bucket_index, spin, true))
 			return false;
@@ -1419,6 +1898,10 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 		modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
 		modify_metadata(qf, &qf->metadata->noccupied_slots, 1);
 		/*modify_metadata(qf, &qf->metadata->nelts, 1);*/
+		stats_record_run(qf, 0);
+		stats_record_shift(qf, 0, 0);
+		stats_record_counter(qf, 1);
+		stats_record_count(qf, 0, 0, 1, 1);
 	} else {
 		uint64_t runend_index= run_end(qf, hash_bucket_index);
 		int operation = 0; /* Insert into empty bucket */
@@ -1431,6 +1914,10 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 																																	 hash_bucket_index
 																																	 - 1) + 1;
 
+		uint64_t counter_slots = 1;
+		uint64_t old_count = 0, old_slots = 0;
+		stats_record_run(qf, is_occupied(qf, hash_bucket_index) ?
+			runend_index - runstart_index + 1 : 0);
 		if (is_occupied(qf, hash_bucket_index)) {
 
 			/* Find the counter for this remainder if it exists. */
@@ -1477,6 +1964,8 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 
 				/* If there's exactly one instance of this remainder. */
 			} else if (current_fixed_counter<fixed_count_max) {
+				old_count = current_fixed_counter + 1;
+				old_slots = 1;
 				set_fixed_counter(qf,runstart_index,current_fixed_counter+1);
 				if(current_fixed_counter+1<fixed_count_max){
 					operation=-1;
@@ -1484,6 +1973,7 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 				else{
 
 					operation =runstart_index==runend_index? 1:2 ; /* Insert */
+					counter_slots = 2;
 
 					insert_index = runstart_index+1;
 					new_value = 0;
@@ -1501,6 +1991,10 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 
 
 				uint64_t endCounterIndex=insert_index;
+				counter_slots = endCounterIndex - runstart_index + 1;
+				old_slots = counter_slots;
+				decode_counter(qf, runstart_index, &current_remainder, &old_count);
+				super_get(qf,insert_index,&current_remainder,&current_fixed_counter);
 
 				uint64_t digit=current_remainder, carry;
 
@@ -1525,6 +2019,7 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 					}
 					else{
 						operation=2;
+						counter_slots++;
 						insert_index=runstart_index+1;
 						new_value=fixed_count_max;
 						new_fixedCounter=fixed_count_max;
@@ -1538,8 +2033,15 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
             modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
 		}
 
+		stats_record_counter(qf, counter_slots);
+		stats_record_count(qf, old_count, old_slots, old_count + 1, counter_slots);
+		if (operation < 0)
+			stats_record_shift(qf, 0, 0);
 		if (operation >= 0) {
 			uint64_t empty_slot_index = find_first_empty_slot(qf, runend_index+1);
+			stats_record_shift(qf, empty_slot_index - hash_bucket_index,
+				empty_slot_index - insert_index);
+			stats_record_cluster(qf, empty_slot_index - hash_bucket_index + 1);
 
 			shift_slots(qf, insert_index, empty_slot_index-1,1);
 
@@ -1601,9 +2103,94 @@ static inline bool insert1(QF *qf, __uint128_t hash, bool lock, bool spin)
 	return true;
 }
 
+/* Insert for filters without fixed counters. A key takes one slot, so the
+ * run is scanned and shifted slot by slot without encoding any counter. */
+static inline bool insert_presence(QF *qf, __uint128_t hash, bool lock, bool spin)
+{
+	uint64_t hash_remainder           = hash & BITMASK(qf->metadata->key_remainder_bits);
+	uint64_t hash_bucket_index        = hash >> qf->metadata->key_remainder_bits;
+	uint64_t hash_bucket_block_offset = hash_bucket_index % SLOTS_PER_BLOCK;
+	if(hash_bucket_index > qf->metadata->xnslots){
+		throw std::out_of_range("Insert is called with hash index out of range");
+	}
+	if (lock) {
+		if(qf_general_locked(qf))
+			return false;
+		if (!qf_lock(qf, hash_bucket_index, spin, false))
+			return false;
+	}
+
+	if (is_empty2(qf, hash_bucket_index)) {
+		METADATA_WORD(qf, runends, hash_bucket_index) |= 1ULL <<
+			(hash_bucket_block_offset % 64);
+		super_set(qf,hash_bucket_index,hash_remainder,0);
+		if(qf->metadata->label_bits>0)
+			set_label(qf,hash_bucket_index,0);
+		METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL <<
+			(hash_bucket_block_offset % 64);
+		modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
+		modify_metadata(qf, &qf->metadata->noccupied_slots, 1);
+		stats_record_run(qf, 0);
+		stats_record_shift(qf, 0, 0);
+		stats_record_counter(qf, 1);
+		stats_record_count(qf, 0, 0, 1, 1);
+	} else {
+		uint64_t runend_index = run_end(qf, hash_bucket_index);
+		uint64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
+			hash_bucket_index - 1) + 1;
+		if (runstart_index < hash_bucket_index)
+			runstart_index = hash_bucket_index;
+		uint64_t zero = 0;
+		stats_record_run(qf, is_occupied(qf, hash_bucket_index) ?
+			runend_index - runstart_index + 1 : 0);
+
+		if (!is_occupied(qf, hash_bucket_index)) {
+			insert_replace_slots_and_shift_remainders_and_runends_and_offsets(qf, 0,
+				hash_bucket_index, runstart_index, &hash_remainder, &zero, 1, 0);
+			modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
+			stats_record_count(qf, 0, 0, 1, 1);
+		} else {
+			uint64_t current_remainder = get_slot(qf, runstart_index);
+			while (current_remainder < hash_remainder && runstart_index != runend_index)
+				current_remainder = get_slot(qf, ++runstart_index);
+
+			if (current_remainder != hash_remainder) {
+				bool append = current_remainder < hash_remainder;
+				insert_replace_slots_and_shift_remainders_and_runends_and_offsets(qf,
+					append ? 1 : 2, hash_bucket_index,
+					append ? runend_index + 1 : runstart_index,
+					&hash_remainder, &zero, 1, 0);
+				modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
+				stats_record_count(qf, 0, 0, 1, 1);
+			}
+		}
+		METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL << (hash_bucket_block_offset % 64);
+	}
+
+	if (lock) {
+		qf_unlock(qf, hash_bucket_index, false);
+	}
+	return true;
+}
+
+/* Rewrite a counter with a new encoding of the same number of slots. Nothing
+ * is shifted, and the runends, the offsets and the label of the counter stay. */
+static inline void replace_counter_in_place(QF *qf, uint64_t index,
+																						const uint64_t *remainders,
+																						const uint64_t *fcounters,
+																						uint64_t length)
+{
+	for (uint64_t i = 0; i < length; i++)
+		super_set(qf, index + i, remainders[i], fcounters[i]);
+	stats_record_shift(qf, 0, 0);
+	stats_record_counter(qf, length);
+}
+
 static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=false,
 													bool spin=false)
 {
+	if(qf->metadata->fixed_counter_size==0)
+		return insert_presence(qf, hash, lock, spin);
 	if(qf->metadata->maximum_count!=0){
 		count=std::min(count,qf->metadata->maximum_count);
 	}
@@ -1616,7 +2203,7 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 		throw std::out_of_range("Insert is called with hash index out of range");
 	}
 	if (lock) {
-		if(qf->mem->general_lock)
+		if(qf_general_locked(qf))
 			return false;
 		if (!qf_lock(qf, hash_bucket_index, spin, false))
 			return false;
@@ -1638,6 +2225,10 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 		modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
 		modify_metadata(qf, &qf->metadata->noccupied_slots, 1);
 		/*modify_metadata(qf, &qf->metadata->nelts, 1);*/
+		stats_record_run(qf, 0);
+		stats_record_shift(qf, 0, 0);
+		stats_record_counter(qf, 1);
+		stats_record_count(qf, 0, 0, 1, 1);
 		/* This trick will, I hope, keep the fast case fast. */
 		if (count > 1) {
 			insert(qf, hash, count - 1, false, false);
@@ -1649,6 +2240,8 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 		int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
 																																	hash_bucket_index
 																																	- 1) + 1;
+		stats_record_run(qf, is_occupied(qf, hash_bucket_index) ?
+			runend_index - runstart_index + 1 : 0);
 
 		if (!is_occupied(qf, hash_bucket_index)) { /* Empty bucket, but its slot is occupied. */
 			uint64_t *p = encode_counter(qf, hash_remainder, count, &new_values[67],&new_fcounters[67]);
@@ -1662,6 +2255,7 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 																																				&new_values[67] - p,
 																																				0);
 			modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
+			stats_record_count(qf, 0, 0, count, total_remainders);
 		} else { /* Non-empty bucket */
 
 			uint64_t current_remainder, current_count, current_end;
@@ -1689,6 +2283,7 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 																																					&new_values[67] - p,
 																																					0);
 				modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
+				stats_record_count(qf, 0, 0, count, total_remainders);
 				/* Found a counter for this remainder.  Add in the new count. */
 			} else if (current_remainder == hash_remainder) {
 				uint64_t tmp= current_count + count;
@@ -1698,14 +2293,20 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 
 				uint64_t *p = encode_counter(qf, hash_remainder, tmp, &new_values[67],&new_fcounters[67]);
 				total_remainders=&new_values[67] - p;
-				insert_replace_slots_and_shift_remainders_and_runends_and_offsets(qf,
-																																					current_end==runend_index ? 1 : 2,
-																																					hash_bucket_index,
-																																					runstart_index,
-																																					p,
-																																					&new_fcounters[67]-total_remainders,
-																																					&new_values[67] - p,
-																																					current_end - runstart_index + 1);
+				if (total_remainders == current_end - runstart_index + 1)
+					replace_counter_in_place(qf, runstart_index, p,
+																	 &new_fcounters[67]-total_remainders, total_remainders);
+				else
+					insert_replace_slots_and_shift_remainders_and_runends_and_offsets(qf,
+																																						current_end==runend_index ? 1 : 2,
+																																						hash_bucket_index,
+																																						runstart_index,
+																																						p,
+																																						&new_fcounters[67]-total_remainders,
+																																						&new_values[67] - p,
+																																						current_end - runstart_index + 1);
+				stats_record_count(qf, current_count, current_end - runstart_index + 1,
+					tmp, total_remainders);
 				/* No counter for this remainder, but there are larger
 					 remainders, so we're not appending to the bucket. */
 			} else {
@@ -1720,6 +2321,7 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 																																					&new_values[67] - p,
 																																					0);
 				modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
+				stats_record_count(qf, 0, 0, count, total_remainders);
 			}
 		}
 		METADATA_WORD(qf, occupieds, hash_bucket_index) |= 1ULL << (hash_bucket_block_offset % 64);
@@ -1736,6 +2338,7 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 
  bool qf_remove(QF *qf, uint64_t hash, uint64_t count , bool lock, bool spin)
 {
+	op_timer timer(qf, QF_OP_REMOVE, hash);
 	uint64_t hash_remainder           = hash & BITMASK(qf->metadata->key_remainder_bits);
 	uint64_t hash_bucket_index        = hash >> qf->metadata->key_remainder_bits;
 	uint64_t current_remainder, current_count, current_end;
@@ -1746,9 +2349,19 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 		throw std::out_of_range("Remove function is called with hash index out of range");
 	}
 
+	/* The run is searched under the lock, so that the counter does not move
+		 between the search and the update. */
+	if (lock) {
+		if(qf_general_locked(qf))
+			return false;
+		if (!qf_lock(qf, hash_bucket_index, spin, false))
+			return false;
+	}
 
 	/* Empty bucket */
 	if (!is_occupied(qf, hash_bucket_index)){
+		if (lock)
+			qf_unlock(qf, hash_bucket_index, false);
 		return true;
 	}
 
@@ -1764,6 +2377,8 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 	}
 	/* remainder not found in the given run */
 	if (current_remainder != hash_remainder){
+		if (lock)
+			qf_unlock(qf, hash_bucket_index, false);
 		return true;
 	}
 
@@ -1777,29 +2392,29 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
 															 &new_values[67],&new_fcounters[67]);
 
 	uint64_t total_reminders=&new_values[67] - p;
+	uint64_t old_length=current_end - runstart_index + 1;
 	// if(fcounter==0 && newcount==0){
 	// 	total_reminders=0;
 	// 	p=&new_values[67];
 	// }
-	if (lock) {
-		if(qf->mem->general_lock)
-			return false;
-		if (!qf_lock(qf, hash_bucket_index, spin, false))
-		return false;
-	}
-
-	remove_replace_slots_and_shift_remainders_and_runends_and_offsets(qf,
-																																		only_item_in_the_run,
-																																		hash_bucket_index,
-																																		runstart_index,
-																																		p,
-																																		&new_fcounters[67]-total_reminders,
-																																		total_reminders,
-																																		current_end - runstart_index + 1);
+	if (total_reminders == old_length)
+		replace_counter_in_place(qf, runstart_index, p,
+														 &new_fcounters[67]-total_reminders, total_reminders);
+	else
+		remove_replace_slots_and_shift_remainders_and_runends_and_offsets(qf,
+																																			only_item_in_the_run,
+																																			hash_bucket_index,
+																																			runstart_index,
+																																			p,
+																																			&new_fcounters[67]-total_reminders,
+																																			total_reminders,
+																																			old_length);
+	stats_record_count(qf, current_count, old_length,
+		count>current_count? 0 : current_count-count, total_reminders);
 
 
   if (lock) {
-  qf_unlock(qf, hash_bucket_index, true);
+  qf_unlock(qf, hash_bucket_index, false);
   }
 
 	return true;
@@ -1812,8 +2427,8 @@ static inline bool insert(QF *qf, __uint128_t hash, uint64_t count, bool lock=fa
  * Code that uses the above to implement key-value-counter operations. *
  ***********************************************************************/
 
-void qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,uint64_t blocksLabelSize,
-						 bool mem, const char * path, uint32_t seed)
+static void _qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,uint64_t blocksLabelSize,
+						 bool mem, const char * path, uint32_t seed, bool separate_labels)
 {
 	//qf=(QF*)calloc(sizeof(QF),1);
 	uint64_t num_slots, xnslots, nblocks;
@@ -1836,7 +2451,9 @@ void qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uin
 		nslots >>= 1;
 	}
 
-	bits_per_slot = key_remainder_bits+fixed_counter_size+label_bits ;
+	bits_per_slot = key_remainder_bits+fixed_counter_size;
+	if(!separate_labels)
+		bits_per_slot+=label_bits;
 	//assert (BITS_PER_SLOT == 0 || BITS_PER_SLOT == qf->metadata->bits_per_slot);
 	//assert(bits_per_slot > 1);
 // #if BITS_PER_SLOT == 8 || BITS_PER_SLOT == 16 || BITS_PER_SLOT == 32 || BITS_PER_SLOT == 64
@@ -1848,13 +2465,17 @@ void qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uin
 //printf("bits per slot =%lu,key remainder bits =%lu, fixed counter =%lu, label_bits=%lu\n",
 //bits_per_slot,key_remainder_bits,fixed_counter_size,label_bits );
 uint64_t blockSize=sizeof(qfblock) + (8 * bits_per_slot )+blocksLabelSize;
+if(separate_labels)
+	blockSize+=8*label_bits;
 size = nblocks * (blockSize) ;
 
 qf->mem = (qfmem *)calloc(sizeof(qfmem), 1);
+stats_init_deltas(qf, true);
 
 	if (mem) {
 		qf->metadata = (qfmetadata *)calloc(sizeof(qfmetadata), 1);
 		qf->metadata->mem=mem;
+		qf->metadata->separate_labels=separate_labels;
 		qf->metadata->size = size;
 		qf->metadata->seed = seed;
 		qf->metadata->nslots = num_slots;
@@ -1911,6 +2532,7 @@ qf->mem = (qfmem *)calloc(sizeof(qfmem), 1);
 		qf->metadata = (qfmetadata *)mmap(NULL, size+sizeof(qfmetadata), PROT_READ |
 																			PROT_WRITE, MAP_SHARED, qf->mem->fd, 0);
 		qf->metadata->mem=mem;
+		qf->metadata->separate_labels=separate_labels;
 		qf->metadata->size = size;
 		qf->metadata->seed = seed;
 		qf->metadata->nslots = num_slots;
@@ -1944,46 +2566,37 @@ qf->mem = (qfmem *)calloc(sizeof(qfmem), 1);
 																					sizeof(volatile int));
 
 
-#ifdef LOG_WAIT_TIME
-	qf->mem->wait_times = (wait_time_data* )calloc(qf->metadata->num_locks+1,
-																						sizeof(wait_time_data));
-#endif
 }
-char* qf_getBlockLabel_pointer_byBlock(const QF *qf, uint64_t index){
 
-	return (char*)&get_block(qf, index )->slots+(8 * qf->metadata->bits_per_slot );
+void qf_init(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,uint64_t blocksLabelSize,
+						 bool mem, const char * path, uint32_t seed)
+{
+	_qf_init(qf, nslots, key_bits, label_bits, fixed_counter_size, blocksLabelSize,
+					 mem, path, seed, false);
+}
+
+void qf_init_separate_labels(QF *qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,uint64_t blocksLabelSize,
+						 bool mem, const char * path, uint32_t seed)
+{
+	_qf_init(qf, nslots, key_bits, label_bits, fixed_counter_size, blocksLabelSize,
+					 mem, path, seed, true);
+}
+
+char* qf_getBlockLabel_pointer_byBlock(const QF *qf, uint64_t index){
+	uint64_t labelsSize = qf->metadata->separate_labels ? 8 * qf->metadata->label_bits : 0;
+	return (char*)&get_block(qf, index )->slots+(8 * qf->metadata->bits_per_slot )+labelsSize;
 }
 
 bool qf_getBlockLabel_pointer_byItem(const QF *qf, uint64_t key,char *&res){
-	__uint128_t hash = key;
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
-	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
 	if(hash_bucket_index > qf->metadata->xnslots){
 			throw std::out_of_range("qf_getBlockLabel_pointer_byItem is called with hash index out of range");
 		}
-	if (!is_occupied(qf, hash_bucket_index))
+	uint64_t index;
+	if (!find_counter(qf, key, &index))
 		return false;
-
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
-
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
-
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder){
-			res=qf_getBlockLabel_pointer_byBlock(qf,runstart_index/64);
-			return true;
-		}
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
-
-	return false;
+	res=qf_getBlockLabel_pointer_byBlock(qf,index/64);
+	return true;
 
 }
 
@@ -1992,9 +2605,10 @@ bool qf_getBlockLabel_pointer_byItem(const QF *qf, uint64_t key,char *&res){
  */
 void qf_copy(QF *dest, const QF *src)
 {
-	memcpy(dest->mem, src->mem, sizeof(qfmem));
+	/* dest keeps its own locks and statistics */
 	memcpy(dest->metadata, src->metadata, sizeof(qfmetadata));
 	memcpy(dest->blocks, src->blocks, src->metadata->size);
+	dest->mem->deltas_valid = false;
 
 	if(src->metadata->labels_map!=NULL){
 		dest->metadata->labels_map=
@@ -2017,6 +2631,18 @@ void qf_destroy(QF *qf)
 		qf->metadata->labels_map=NULL;
 	}
 	free(qf->mem->locks);
+	free(qf->mem->wait_times);
+	free(qf->mem->stats);
+	free(qf->mem->deltas);
+	free(qf->mem->latency);
+	qf->mem->latency = NULL;
+	qf->mem->collect_latency = false;
+	qf->mem->slow_op_callback = NULL;
+	qf->mem->time_ops = false;
+	qf->mem->wait_times = NULL;
+	qf->mem->stats = NULL;
+	qf->mem->deltas = NULL;
+	qf->mem->collect_stats = false;
 	if (qf->metadata->mem) {
 		free(qf->mem);
 		free(qf->metadata);
@@ -2042,12 +2668,14 @@ void qf_close(QF *qf)
  * Data won't be copied in memory.
  *
  */
- void qf_read(QF *qf, const char *path)
+ void qf_read(QF *qf, const char *path, uint64_t offset)
  {
 	 struct stat sb;
 	 int ret;
+	 qfmetadata header;
 
 	 qf->mem = (qfmem *)calloc(sizeof(qfmem), 1);
+	 stats_init_deltas(qf, false);
 	 qf->mem->fd = open(path, O_RDWR, S_IRWXU);
 	 if (qf->mem->fd < 0) {
 		 perror("Couldn't open file:\n");
@@ -2065,9 +2693,19 @@ void qf_close(QF *qf)
 		 exit(EXIT_FAILURE);
 	 }
 
-	 qf->metadata = (qfmetadata *)mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-	 qf->mem->fd, 0);
+	 // map only this filter, qf_destroy unmaps the same length
+	 if (pread(qf->mem->fd, &header, sizeof(qfmetadata), offset) != sizeof(qfmetadata)) {
+		 fprintf (stderr, "%s has no filter at offset %lu\n", path, offset);
+		 exit(EXIT_FAILURE);
+	 }
+	 qf->metadata = (qfmetadata *)mmap(NULL, header.size + sizeof(qfmetadata),
+	 PROT_READ | PROT_WRITE, MAP_SHARED, qf->mem->fd, offset);
+	 if (qf->metadata == MAP_FAILED) {
+		 perror("Couldn't mmap metadata.");
+		 exit(EXIT_FAILURE);
+	 }
 	 qf->metadata->mem=false;
+	 qf->metadata->labels_map=NULL;
 		 qf->blocks = (qfblock *)(qf->metadata + 1);
 		 qf->metadata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
 		 qf->mem->metadata_lock = 0;
@@ -2090,15 +2728,10 @@ void qf_reset(QF *qf)
 	qf->metadata->noccupied_slots = 0;
 	if(qf->metadata->labels_map!=NULL)
 		qf->metadata->labels_map->clear();
-#ifdef LOG_WAIT_TIME
-	memset(qf->wait_times, 0, (qf->metadata->num_locks+1)*sizeof(wait_time_data));
-#endif
-#if BITS_PER_SLOT == 8 || BITS_PER_SLOT == 16 || BITS_PER_SLOT == 32 || BITS_PER_SLOT == 64
-	memset(qf->blocks, 0, qf->metadata->nblocks* sizeof(qfblock));
-#else
-	memset(qf->blocks, 0, qf->metadata->nblocks*(sizeof(qfblock) + SLOTS_PER_BLOCK *
-																		 qf->metadata->bits_per_slot / 8));
-#endif
+	qf_reset_runtime_stats(qf);
+	memset(qf->mem->deltas, 0, QF_STATS_SHARDS * sizeof(qf_stats_delta));
+	qf->mem->deltas_valid = true;
+	memset(qf->blocks, 0, qf->metadata->size);
 }
 
 void qf_serialize(const QF *qf, const char *filename)
@@ -2123,7 +2756,7 @@ void qf_serialize(const QF *qf, const char *filename)
 
 
 
-void qf_deserialize(QF *qf, const char *filename)
+void qf_deserialize(QF *qf, const char *filename, uint64_t offset)
 {
 	FILE *fin;
 	fin = fopen(filename, "rb");
@@ -2131,11 +2764,18 @@ void qf_deserialize(QF *qf, const char *filename)
 		perror("Error opening file for deserializing\n");
 		exit(EXIT_FAILURE);
 	}
+	if (fseek(fin, offset, SEEK_SET) != 0) {
+		perror("Error seeking the file for deserializing\n");
+		exit(EXIT_FAILURE);
+	}
 
 	qf->mem = (qfmem *)calloc(sizeof(qfmem), 1);
+	stats_init_deltas(qf, false);
 	qf->metadata = (qfmetadata *)calloc(sizeof(qfmetadata), 1);
 
 	fread(qf->metadata, sizeof(qfmetadata), 1, fin);
+	qf->metadata->labels_map=NULL;
+	qf->metadata->mem=true;
 
 	/* initlialize the locks in the QF */
 	qf->metadata->num_locks = (qf->metadata->xnslots/NUM_SLOTS_TO_LOCK)+2;
@@ -2156,146 +2796,95 @@ void qf_deserialize(QF *qf, const char *filename)
 }
 uint64_t qf_add_label(const QF *qf, uint64_t key, uint64_t label, bool lock, bool spin)
 {
+	op_timer timer(qf, QF_OP_LABEL, key);
 	if(qf->metadata->label_bits==0){
 		return 0;
 	}
-	__uint128_t hash = key;
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
-	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
-
-
-	if (!is_occupied(qf, hash_bucket_index)){
+	uint64_t index;
+	if (!find_counter(qf, key, &index))
+		return 0;
+	if (lock) {
+		if(qf_general_locked(qf))
+			return false;
+		if (!qf_lock(qf, index, spin, false))
 		return 0;
 	}
 
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
-
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
-
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder){
-			if (lock) {
-				if(qf->mem->general_lock)
-					return false;
-				if (!qf_lock(qf, runstart_index, spin, false))
-				return 0;
-			}
-
-			set_label(qf,runstart_index,label);
-			if (lock) {
-				qf_unlock(qf, runstart_index, true);
-			}
-
-
-			return 1;
-		}
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
-
-
-	return 0;
+	set_label(qf,index,label);
+	if (lock) {
+		qf_unlock(qf, index, false);
+	}
+	return 1;
 }
 
 uint64_t qf_remove_label(const QF *qf, uint64_t key ,bool lock, bool spin)
 {
+	op_timer timer(qf, QF_OP_LABEL, key);
 
 	if(qf->metadata->label_bits==0){
 		return 0;
 	}
 
-	__uint128_t hash = key;
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
-	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
 	if(hash_bucket_index > qf->metadata->xnslots){
 			throw std::out_of_range("qf_remove_label is called with hash index out of range");
 		}
-
-	if (!is_occupied(qf, hash_bucket_index)){
+	uint64_t index;
+	if (!find_counter(qf, key, &index))
 		return 0;
-	}
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
-
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
-
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder){
-			if (lock) {
-				if(qf->mem->general_lock)
-					return false;
-				if (!qf_lock(qf, runstart_index, spin, false))
-					return false;
-				}
-			set_label(qf,runstart_index,0);
-			if (lock)
-				qf_unlock(qf, runstart_index, true);
-			return 1;
+	if (lock) {
+		if(qf_general_locked(qf))
+			return false;
+		if (!qf_lock(qf, index, spin, false))
+			return false;
 		}
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
-
-
-	return 0;
+	set_label(qf,index,0);
+	if (lock)
+		qf_unlock(qf, index, false);
+	return 1;
 }
 
 uint64_t qf_get_label(const QF *qf, uint64_t key)
 {
+	op_timer timer(qf, QF_OP_LABEL, key);
 	if(qf->metadata->label_bits==0){
 		return 0;
 	}
-	__uint128_t hash = key;
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
-	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
 	if(hash_bucket_index > qf->metadata->xnslots){
 			throw std::out_of_range("qf_get_label is called with hash index out of range");
 		}
-	if (!is_occupied(qf, hash_bucket_index))
+	uint64_t index;
+	if (!find_counter(qf, key, &index))
 		return 0;
+	return get_label(qf,index);
+}
 
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
-
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
 
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder){
-			return get_label(qf,runstart_index);
-		}
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
-
-	return 0;
+/* Runs are shifted at most up to the end of the table, which is reached
+ * only by a long cluster at the last quotients. Fail before changing the
+ * filter if the slots an insert can need there are used: one for the
+ * remainder and the rest for a counter of up to 64 bits. */
+static inline void check_tail_slots(QF *qf)
+{
+	uint64_t tail_slots=std::min(3+64/std::max(qf->metadata->key_remainder_bits,(uint64_t)1),
+		qf->metadata->xnslots-qf->metadata->nslots);
+	if(!is_empty2(qf, qf->metadata->xnslots-tail_slots))
+		throw std::overflow_error("The last slots of the QF are used, cannot insert more items.");
 }
 
-
 bool qf_insert(QF *qf, uint64_t key, uint64_t count, bool
 							 lock, bool spin)
 {
+	op_timer timer(qf, QF_OP_INSERT, key);
 	if(count==0)
 	{
 		return true;
 	}
+	check_tail_slots(qf);
 	/*uint64_t hash = (key << qf->metadata->label_bits) | (value & BITMASK(qf->metadata->label_bits));*/
+	if (qf->metadata->fixed_counter_size == 0)
+	 return insert_presence(qf, key, lock, spin);
 	if (count == 1)
 	 return insert1(qf, key, lock, spin);
 	else
@@ -2304,45 +2893,177 @@ bool qf_insert(QF *qf, uint64_t key, uint64_t count, bool
 
 uint64_t qf_count_key(const QF *qf, uint64_t key)
 {
-	__uint128_t hash = key;
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
-	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
+	op_timer timer(qf, QF_OP_COUNT, key);
+	uint64_t index, remainder, count;
+	if (!find_counter(qf, key, &index))
+		return 0;
+	decode_counter(qf, index, &remainder, &count);
+	return count;
+}
 
-	if (!is_occupied(qf, hash_bucket_index))
+void qf_prefetch(const QF *qf, uint64_t key)
+{
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
+	if(hash_bucket_index >= qf->metadata->xnslots)
+		return;
+	// the metadata words and the first slots, then the slot of the bucket
+	qfblock* block=get_block(qf, hash_bucket_index / SLOTS_PER_BLOCK);
+	__builtin_prefetch(block);
+	__builtin_prefetch((const char*)block->slots +
+		(hash_bucket_index % SLOTS_PER_BLOCK) * qf->metadata->bits_per_slot / 8);
+}
+
+uint64_t qf_probe(const QF *qf, uint64_t key, qfprobe *p)
+{
+	uint64_t hash_remainder   = key & BITMASK(qf->metadata->key_remainder_bits);
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
+	p->key=key;
+	p->count=0;
+	p->label=0;
+	p->occupied=is_occupied(qf, hash_bucket_index);
+	if (!p->occupied)
 		return 0;
 
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
+	uint64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
+																		hash_bucket_index-1) + 1;
 	if (runstart_index < hash_bucket_index)
 		runstart_index = hash_bucket_index;
+	p->runstart=runstart_index;
+	p->runend=run_end(qf, hash_bucket_index);
+
+	// a new counter goes after the last one of the run, or before the larger remainder
+	p->index=find_remainder(qf, runstart_index, p->runend, hash_remainder);
+	p->end=p->index-1;
+	uint64_t current_remainder;
+	if (p->index<=p->runend && get_slot(qf, p->index)==hash_remainder){
+		p->end=decode_counter(qf, p->index, &current_remainder, &p->count);
+		if(qf->metadata->label_bits>0)
+			p->label=get_label(qf, p->index);
+	}
+	return p->count;
+}
 
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
-
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder){
-			return current_count;
-		}
+/* Same as insert and qf_remove for a key already located by qf_probe. */
+static inline void set_probed(QF *qf, const qfprobe *p, uint64_t count)
+{
+	uint64_t hash_remainder    = p->key & BITMASK(qf->metadata->key_remainder_bits);
+	uint64_t hash_bucket_index = p->key >> qf->metadata->key_remainder_bits;
+	if(count==p->count)
+		return;
+	if(!p->occupied){
+		// the bucket has no run, so insert does not search for the key
+		insert(qf, p->key, count, false, false);
+		return;
+	}
+	uint64_t new_values[67];
+	uint64_t new_fcounters[67];
+	uint64_t *pv = encode_counter(qf, hash_remainder, count, &new_values[67],&new_fcounters[67]);
+	uint64_t total_remainders=&new_values[67] - pv;
+	uint64_t old_length= p->count==0 ? 0 : p->end - p->index + 1;
+	if(total_remainders==old_length){
+		replace_counter_in_place(qf, p->index, pv,
+			&new_fcounters[67]-total_remainders, total_remainders);
+	}
+	else if(count > p->count){
+		int operation;
+		if(p->count==0)
+			operation= p->index==p->runend+1 ? 1 : 2;
+		else
+			operation= p->end==p->runend ? 1 : 2;
+		insert_replace_slots_and_shift_remainders_and_runends_and_offsets(qf,
+			operation, hash_bucket_index, p->index, pv,
+			&new_fcounters[67]-total_remainders, total_remainders, old_length);
+		if(p->count==0)
+			modify_metadata(qf, &qf->metadata->ndistinct_elts, 1);
+	}
+	else{
+		remove_replace_slots_and_shift_remainders_and_runends_and_offsets(qf,
+			p->index==p->runstart && p->end==p->runend,
+			hash_bucket_index, p->index, pv,
+			&new_fcounters[67]-total_remainders, total_remainders, old_length);
+	}
+	stats_record_count(qf, p->count, old_length, count, total_remainders);
+}
 
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
-	return 0;
+bool qf_set_probed(QF *qf, const qfprobe *p, uint64_t count, bool lock, bool spin)
+{
+	uint64_t hash_bucket_index = p->key >> qf->metadata->key_remainder_bits;
+	if(hash_bucket_index > qf->metadata->xnslots){
+		throw std::out_of_range("qf_set_probed is called with hash index out of range");
+	}
+	if(qf->metadata->maximum_count!=0)
+		count=std::min(count,qf->metadata->maximum_count);
+	if(count > p->count)
+		check_tail_slots(qf);
+	if (lock) {
+		if(qf_general_locked(qf))
+			return false;
+		if (!qf_lock(qf, hash_bucket_index, spin, false))
+			return false;
+		// other threads may have moved the key since it was probed
+		qfprobe current;
+		qf_probe(qf, p->key, &current);
+		set_probed(qf, &current, count);
+		qf_unlock(qf, hash_bucket_index, false);
+	}
+	else
+		set_probed(qf, p, count);
+	return true;
 }
 
-void qf_setCounter(QF* qf,uint64_t key, uint64_t count, bool lock, bool spin )
+bool qf_lock_key(const QF *qf, uint64_t key, bool spin)
 {
-	uint64_t currentCounter=qf_count_key(qf,key);
-	if(currentCounter<count)
-		qf_insert(qf,key,count-currentCounter,lock,spin);
-	else if(currentCounter > count )
-		qf_remove(qf,key,currentCounter-count,lock,spin);
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
+	if(hash_bucket_index > qf->metadata->xnslots){
+		throw std::out_of_range("qf_lock_key is called with hash index out of range");
+	}
+	if(qf_general_locked(qf))
+		return false;
+	return qf_lock(qf, hash_bucket_index, spin, false);
 }
 
+void qf_unlock_key(const QF *qf, uint64_t key)
+{
+	qf_unlock(qf, key >> qf->metadata->key_remainder_bits, false);
+}
 
+bool qf_setCounter(QF* qf,uint64_t key, uint64_t count, bool lock, bool spin )
+{
+	uint64_t hash_bucket_index = key >> qf->metadata->key_remainder_bits;
+	if(hash_bucket_index > qf->metadata->xnslots){
+		throw std::out_of_range("qf_setCounter is called with hash index out of range");
+	}
+	if (qf->metadata->fixed_counter_size == 0) {
+		/* a key is present or not */
+		if (count > 0)
+			return qf_insert(qf, key, 1, lock, spin);
+		return qf_remove(qf, key, 1, lock, spin);
+	}
+	if(qf->metadata->maximum_count!=0)
+		count=std::min(count,qf->metadata->maximum_count);
+	if(count > 0)
+		check_tail_slots(qf);
+	/* one search of the run, under the same lock as the update */
+	if (lock) {
+		if(qf_general_locked(qf))
+			return false;
+		if (!qf_lock(qf, hash_bucket_index, spin, false))
+			return false;
+	}
+	qfprobe p;
+	qf_probe(qf, key, &p);
+	set_probed(qf, &p, count);
+	if (lock)
+		qf_unlock(qf, hash_bucket_index, false);
+	return true;
+}
 
+bool qf_add_to_counter(QF* qf,uint64_t key, int64_t delta, bool lock, bool spin )
+{
+	if (delta >= 0)
+		return qf_insert(qf, key, delta, lock, spin);
+	return qf_remove(qf, key, -(uint64_t)delta, lock, spin);
+}
 
 /* initialize the iterator at the run corresponding
  * to the position index
@@ -2432,44 +3153,14 @@ bool qfi_firstInBlock(QF* qf,QFi *it, QFi * res){
 
 bool qfi_find(QF *qf,QFi *qfi, uint64_t key)
 {
-	__uint128_t hash = key;
-	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
-	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
-
-	if (!is_occupied(qf, hash_bucket_index))
-		return 0;
-
-	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(qf,
-																																hash_bucket_index-1)
-		+ 1;
-	if (runstart_index < hash_bucket_index)
-		runstart_index = hash_bucket_index;
-
-	/* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index, runend_index); */
-
-	uint64_t current_remainder, current_count, current_end;
-	do {
-		current_end = decode_counter(qf, runstart_index, &current_remainder,
-																 &current_count);
-		if (current_remainder == hash_remainder){
-			// qf_iterator(qf,qfi,runstart_index/64);
-			// uint64_t ckey,count,value;
-			// qfi_get(qfi,&ckey,&value,&count);
-			// while(ckey!=key){
-			// 	qfi_next(qfi);
-			// 	qfi_get(qfi,&ckey,&value,&count);
-			// }
-		//	uint64_t position=runstart_index;
-			qfi->qf = qf;
-			qfi->num_clusters = 0;
-			qfi->run = hash_bucket_index;
-			qfi->current=runstart_index;
-			return true;
-		}
-
-		runstart_index = current_end + 1;
-	} while (!is_runend(qf, current_end));
-	return false;
+	uint64_t index;
+	if (!find_counter(qf, key, &index))
+		return false;
+	qfi->qf = qf;
+	qfi->num_clusters = 0;
+	qfi->run = key >> qf->metadata->key_remainder_bits;
+	qfi->current=index;
+	return true;
 }
 
 int qfi_get(QFi *qfi, uint64_t *key, uint64_t *value, uint64_t *count)
@@ -2479,7 +3170,12 @@ int qfi_get(QFi *qfi, uint64_t *key, uint64_t *value, uint64_t *count)
 		throw std::out_of_range("qfi_get is called with hash index out of range");
 	}
 	uint64_t current_remainder, current_count;
-	decode_counter(qfi->qf, qfi->current, &current_remainder, &current_count);
+	if (qfi->qf->metadata->fixed_counter_size == 0) {
+		current_remainder = get_slot(qfi->qf, qfi->current);
+		current_count = 1;
+	}
+	else
+		decode_counter(qfi->qf, qfi->current, &current_remainder, &current_count);
 	*key = (qfi->run << qfi->qf->metadata->key_remainder_bits) | current_remainder;
 	*value = get_label(qfi->qf,qfi->current);   // for now we are not using value
 	*count = current_count;
@@ -2494,13 +3190,15 @@ int qfi_get(QFi *qfi, uint64_t *key, uint64_t *value, uint64_t *count)
 
 int qfi_next(QFi *qfi)
 {
+	op_timer timer(qfi->qf, QF_OP_NEXT, qfi->run);
 	if (qfi_end(qfi))
 		return 1;
 	else {
 		/* move to the end of the current counter*/
 		uint64_t current_remainder, current_count;
-		qfi->current = decode_counter(qfi->qf, qfi->current, &current_remainder,
-																	&current_count);
+		if (qfi->qf->metadata->fixed_counter_size > 0)
+			qfi->current = decode_counter(qfi->qf, qfi->current, &current_remainder,
+																		&current_count);
 
 		if (!is_runend(qfi->qf, qfi->current)) {
 			qfi->current++;
@@ -3090,10 +3788,10 @@ QF* qf_resize(QF* qf, int newQ, const char * originalFilename, const char * newF
 	QF* newQF=(QF *)calloc(sizeof(QF), 1);
 	if(newFilename)
 	{
-		qf_init(newQF, (1ULL<<newQ),qf->metadata->key_bits, qf->metadata->label_bits,qf->metadata->fixed_counter_size,qf->metadata->BlockLabel_bits, false, newFilename, 2038074761);
+		_qf_init(newQF, (1ULL<<newQ),qf->metadata->key_bits, qf->metadata->label_bits,qf->metadata->fixed_counter_size,qf->metadata->BlockLabel_bits, false, newFilename, 2038074761,qf->metadata->separate_labels);
 	}
 	else{
-		qf_init(newQF, (1ULL<<newQ),qf->metadata->key_bits, qf->metadata->label_bits,qf->metadata->fixed_counter_size,qf->metadata->BlockLabel_bits, true, "" , 2038074761);
+		_qf_init(newQF, (1ULL<<newQ),qf->metadata->key_bits, qf->metadata->label_bits,qf->metadata->fixed_counter_size,qf->metadata->BlockLabel_bits, true, "" , 2038074761,qf->metadata->separate_labels);
 	}
 	QFi qfi;
 	qf_iterator(qf, &qfi, 0);
@@ -3184,13 +3882,174 @@ int qf_space(QF *qf)
 
 
 bool qf_general_lock(QF* qf, bool spin){
-	if (!qf_spin_lock(&qf->mem->general_lock, spin))
+	if (!qf_spin_lock(qf, &qf->mem->general_lock, qf->metadata->num_locks, spin))
 		return false;
 	return true;
 }
 void qf_general_unlock(QF* qf){
 	qf_spin_unlock(&qf->mem->general_lock);
 }
+
+void qf_enable_runtime_stats(QF *qf, bool enable)
+{
+	if (enable && qf->mem->stats == NULL) {
+		qf->mem->wait_times = (wait_time_data *)calloc(qf->metadata->num_locks + 1,
+			sizeof(wait_time_data));
+		qf->mem->stats = (qf_stats_shard *)stats_alloc_shards(sizeof(qf_stats_shard));
+		__sync_synchronize();
+	}
+	/* the counters stay allocated until qf_destroy, a thread may still be
+	 * recording when the collection is disabled */
+	qf->mem->collect_stats = enable;
+}
+
+void qf_get_runtime_stats(const QF *qf, qf_runtime_stats *stats)
+{
+	memset(stats, 0, sizeof(qf_runtime_stats));
+	if (qf->mem->stats == NULL)
+		return;
+	for (uint64_t i = 0; i <= qf->metadata->num_locks; i++) {
+		const wait_time_data *wait = &qf->mem->wait_times[i];
+		stats->lock_acquisitions += wait->locks_taken;
+		stats->lock_single_attempt += wait->locks_acquired_single_attempt;
+		stats->lock_spins += wait->spins;
+		stats->lock_wait_ns += wait->total_time_spinning;
+		stats->lock_failures += wait->failed_attempts;
+	}
+	for (uint64_t i = 0; i < QF_STATS_SHARDS; i++) {
+		const qf_stats_shard *shard = &qf->mem->stats[i];
+		stats->general_lock_failures += shard->general_lock_failures;
+		stats->inserts += shard->inserts;
+		for (uint64_t b = 0; b < QF_STATS_BUCKETS; b++) {
+			stats->run_length[b] += shard->run_length[b];
+			stats->cluster_length[b] += shard->cluster_length[b];
+			stats->shifted_slots[b] += shard->shifted_slots[b];
+			stats->counter_slots[b] += shard->counter_slots[b];
+		}
+	}
+}
+
+/* Count the numbers of qf_stats into the last delta. */
+static void stats_recount(const QF *qf)
+{
+	memset(qf->mem->deltas, 0, QF_STATS_SHARDS * sizeof(qf_stats_delta));
+	qf_stats_delta *base = &qf->mem->deltas[QF_STATS_SHARDS - 1];
+	QFi qfi;
+	qf_iterator((QF *)qf, &qfi, 0);
+	// an empty filter has no first run
+	if (qfi.run >= qf->metadata->nslots)
+		qfi.current = qf->metadata->xnslots;
+	for (; !qfi_end(&qfi); qfi_next(&qfi)) {
+		uint64_t remainder, count;
+		uint64_t end = decode_counter(qf, qfi.current, &remainder, &count);
+		base->distinct_items++;
+		base->total_count += count;
+		base->counter_slots += end - qfi.current;
+		base->count_histogram[63 - __builtin_clzll(count)]++;
+	}
+	uint64_t cluster = 0;
+	for (uint64_t i = 0; i < qf->metadata->xnslots; i++) {
+		cluster = is_empty2((QF *)qf, i) ? 0 : cluster + 1;
+		base->largest_cluster = std::max(base->largest_cluster, cluster);
+	}
+	qf->mem->deltas_valid = true;
+}
+
+void qf_stats(const QF *qf, qf_stats_data *stats)
+{
+	if (!qf->mem->deltas_valid)
+		stats_recount(qf);
+	memset(stats, 0, sizeof(qf_stats_data));
+	for (uint64_t i = 0; i < QF_STATS_SHARDS; i++) {
+		const qf_stats_delta *delta = &qf->mem->deltas[i];
+		stats->distinct_items += __atomic_load_n(&delta->distinct_items, __ATOMIC_RELAXED);
+		stats->total_count += __atomic_load_n(&delta->total_count, __ATOMIC_RELAXED);
+		stats->counter_slots += __atomic_load_n(&delta->counter_slots, __ATOMIC_RELAXED);
+		stats->largest_cluster = std::max(stats->largest_cluster,
+			__atomic_load_n(&delta->largest_cluster, __ATOMIC_RELAXED));
+		for (uint64_t b = 0; b < QF_COUNT_BUCKETS; b++)
+			stats->count_histogram[b] += __atomic_load_n(&delta->count_histogram[b],
+				__ATOMIC_RELAXED);
+	}
+	stats->nslots = qf->metadata->nslots;
+	stats->remainder_slots = stats->distinct_items;
+	stats->occupied_slots = stats->remainder_slots + stats->counter_slots;
+	if (stats->distinct_items > 0)
+		stats->largest_cluster = std::max(stats->largest_cluster, (uint64_t)1);
+}
+
+void qf_enable_latency(QF *qf, bool enable)
+{
+	if (enable && qf->mem->latency == NULL) {
+		qf->mem->latency = (qf_latency_shard *)stats_alloc_shards(sizeof(qf_latency_shard));
+		__sync_synchronize();
+	}
+	qf->mem->collect_latency = enable;
+	qf->mem->time_ops = enable || qf->mem->slow_op_callback != NULL;
+}
+
+void qf_get_latency(const QF *qf, qf_op op, qf_latency_histogram *histogram)
+{
+	memset(histogram, 0, sizeof(qf_latency_histogram));
+	if (qf->mem->latency == NULL)
+		return;
+	for (uint64_t i = 0; i < QF_STATS_SHARDS; i++) {
+		const qf_latency_shard *shard = &qf->mem->latency[i];
+		histogram->count += __atomic_load_n(&shard->count[op], __ATOMIC_RELAXED);
+		histogram->total_ns += __atomic_load_n(&shard->total_ns[op], __ATOMIC_RELAXED);
+		histogram->max_ns = std::max(histogram->max_ns,
+			__atomic_load_n(&shard->max_ns[op], __ATOMIC_RELAXED));
+		for (uint64_t b = 0; b < QF_LATENCY_BUCKETS; b++)
+			histogram->buckets[b] += __atomic_load_n(&shard->buckets[op][b],
+				__ATOMIC_RELAXED);
+	}
+}
+
+uint64_t qf_latency_quantile(const qf_latency_histogram *histogram, double q)
+{
+	if (histogram->count == 0)
+		return 0;
+	uint64_t rank = std::max((uint64_t)ceil(q * histogram->count), (uint64_t)1);
+	uint64_t seen = 0;
+	for (uint64_t b = 0; b < QF_LATENCY_BUCKETS - 1; b++) {
+		seen += histogram->buckets[b];
+		if (seen < rank)
+			continue;
+		if (b < 16)
+			return b;
+		uint64_t e = (b - 16) / 8 + 4;
+		uint64_t upper = ((9 + (b - 16) % 8) << (e - 3)) - 1;
+		return std::min(upper, histogram->max_ns);
+	}
+	return histogram->max_ns;
+}
+
+void qf_reset_latency(QF *qf)
+{
+	if (qf->mem->latency != NULL)
+		memset(qf->mem->latency, 0, QF_STATS_SHARDS * sizeof(qf_latency_shard));
+}
+
+void qf_set_slow_op_callback(QF *qf, uint64_t threshold_ns,
+	qf_slow_op_callback callback, void *arg)
+{
+	qf->mem->slow_op_callback = NULL;
+	__sync_synchronize();
+	qf->mem->slow_op_threshold = threshold_ns;
+	qf->mem->slow_op_arg = arg;
+	__sync_synchronize();
+	qf->mem->slow_op_callback = callback;
+	qf->mem->time_ops = qf->mem->collect_latency || callback != NULL;
+}
+
+void qf_reset_runtime_stats(QF *qf)
+{
+	if (qf->mem->stats == NULL)
+		return;
+	memset(qf->mem->wait_times, 0, (qf->metadata->num_locks + 1) *
+		sizeof(wait_time_data));
+	memset(qf->mem->stats, 0, QF_STATS_SHARDS * sizeof(qf_stats_shard));
+}
 void qf_migrate(QF* source, QF* dest){
 	QFi source_i;
 	if (qf_iterator(source, &source_i, 0)) {
@@ -3262,4 +4121,8 @@ uint64_t itemOrder(QF* qf,uint64_t item){
 
 #ifdef TEST
 	#include "tests/lowLevelTests.hpp"
+	#include "tests/kernelTests.hpp"
+#endif
+#ifdef KERNEL_BENCHMARK
+	#include "benchmarks/kernelBenchmark.hpp"
 #endif
@@ -0,0 +1,612 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include "kmerPipeline.h"
+
+using namespace std;
+using namespace MQF;
+
+static inline uint64_t kmerMask(uint64_t k) {
+  return k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+}
+
+/* A,C,G,T in both cases, 5 for the '\r' of the line ends, 4 for the rest. */
+static uint8_t baseCodes[256];
+
+static bool initBaseCodes() {
+  memset(baseCodes, 4, sizeof(baseCodes));
+  baseCodes[(uint8_t) 'A'] = baseCodes[(uint8_t) 'a'] = 0;
+  baseCodes[(uint8_t) 'C'] = baseCodes[(uint8_t) 'c'] = 1;
+  baseCodes[(uint8_t) 'G'] = baseCodes[(uint8_t) 'g'] = 2;
+  baseCodes[(uint8_t) 'T'] = baseCodes[(uint8_t) 't'] = 3;
+  baseCodes[(uint8_t) '\r'] = 5;
+  return true;
+}
+
+static bool baseCodesReady = initBaseCodes();
+
+uint64_t MQF::encodeKmer(const std::string &kmer) {
+  if (kmer.size() > 32)
+    throw std::domain_error("k-mers are at most 32 bases");
+  uint64_t res = 0;
+  for (size_t i = 0; i < kmer.size(); i++) {
+    uint8_t code = baseCodes[(uint8_t) kmer[i]];
+    if (code > 3)
+      throw std::domain_error("k-mers can only have A, C, G and T bases");
+    res = (res << 2) | code;
+  }
+  return res;
+}
+
+std::string MQF::decodeKmer(uint64_t kmer, uint64_t k) {
+  string res(k, 'A');
+  for (uint64_t i = 0; i < k; i++)
+    res[k - 1 - i] = "ACGT"[(kmer >> (2 * i)) & 3];
+  return res;
+}
+
+uint64_t MQF::canonicalKmer(uint64_t kmer, uint64_t k) {
+  uint64_t rc = 0, tmp = kmer;
+  for (uint64_t i = 0; i < k; i++) {
+    rc = (rc << 2) | (3 - (tmp & 3));
+    tmp >>= 2;
+  }
+  return min(kmer & kmerMask(k), rc);
+}
+
+/* Thomas Wang's 64 bit integer hash, every step is invertible modulo 2^(2k). */
+uint64_t MQF::kmerHash(uint64_t kmer, uint64_t k) {
+  uint64_t mask = kmerMask(k);
+  uint64_t key = kmer & mask;
+  key = (~key + (key << 21)) & mask;
+  key = key ^ key >> 24;
+  key = ((key + (key << 3)) + (key << 8)) & mask;
+  key = key ^ key >> 14;
+  key = ((key + (key << 2)) + (key << 4)) & mask;
+  key = key ^ key >> 28;
+  key = (key + (key << 31)) & mask;
+  return key;
+}
+
+uint64_t MQF::kmerHashInverse(uint64_t hash, uint64_t k) {
+  uint64_t mask = kmerMask(k);
+  uint64_t key = hash & mask, tmp;
+  // key = key + (key << 31)
+  tmp = key - (key << 31);
+  key = (key - (tmp << 31)) & mask;
+  // key = key ^ (key >> 28)
+  tmp = key ^ key >> 28;
+  key = key ^ tmp >> 28;
+  // key *= 21
+  key = (key * 14933078535860113213ULL) & mask;
+  // key = key ^ (key >> 14)
+  tmp = key ^ key >> 14;
+  tmp = key ^ tmp >> 14;
+  tmp = key ^ tmp >> 14;
+  key = key ^ tmp >> 14;
+  // key *= 265
+  key = (key * 15244667743933553977ULL) & mask;
+  // key = key ^ (key >> 24)
+  tmp = key ^ key >> 24;
+  key = key ^ tmp >> 24;
+  // key = ~key + (key << 21)
+  tmp = ~key;
+  tmp = ~(key - (tmp << 21));
+  tmp = ~(key - (tmp << 21));
+  key = ~(key - (tmp << 21)) & mask;
+  return key;
+}
+
+MQF::kmerPipelineOptions::kmerPipelineOptions(uint64_t k, uint64_t nthreads) {
+  this->k = k;
+  nthreads = max(nthreads, (uint64_t) 1);
+  readers = max(nthreads / 8, (uint64_t) 1);
+  parsers = max(nthreads / 2, (uint64_t) 1);
+  inserters = nthreads > readers + parsers ? nthreads - readers - parsers : 1;
+  chunkSize = 1ULL << 22;
+  batchSize = 1ULL << 16;
+  queueSize = 64;
+}
+
+/* Bounded multi producer multi consumer queue of D. Vyukov. Every cell has
+ * a sequence number saying if it can be written or read at a position, so
+ * the threads only compete on the positions, with one compare and swap. */
+template <typename T>
+class boundedQueue {
+public:
+  explicit boundedQueue(uint64_t size) {
+    uint64_t n = 2;
+    while (n < size)
+      n <<= 1;
+    cells = new cell[n];
+    mask = n - 1;
+    for (uint64_t i = 0; i < n; i++)
+      cells[i].sequence.store(i, memory_order_relaxed);
+    pushPosition.store(0, memory_order_relaxed);
+    popPosition.store(0, memory_order_relaxed);
+  }
+
+  ~boundedQueue() {
+    delete[] cells;
+  }
+
+  bool push(T value) {
+    uint64_t position = pushPosition.load(memory_order_relaxed);
+    cell *c;
+    while (true) {
+      c = &cells[position & mask];
+      int64_t diff = (int64_t) c->sequence.load(memory_order_acquire) - (int64_t) position;
+      if (diff == 0) {
+        if (pushPosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+          break;
+      } else if (diff < 0)
+        return false;
+      else
+        position = pushPosition.load(memory_order_relaxed);
+    }
+    c->value = value;
+    c->sequence.store(position + 1, memory_order_release);
+    return true;
+  }
+
+  bool pop(T &value) {
+    uint64_t position = popPosition.load(memory_order_relaxed);
+    cell *c;
+    while (true) {
+      c = &cells[position & mask];
+      int64_t diff = (int64_t) c->sequence.load(memory_order_acquire) - (int64_t) (position + 1);
+      if (diff == 0) {
+        if (popPosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+          break;
+      } else if (diff < 0)
+        return false;
+      else
+        position = popPosition.load(memory_order_relaxed);
+    }
+    value = c->value;
+    c->sequence.store(position + mask + 1, memory_order_release);
+    return true;
+  }
+
+private:
+  struct cell {
+    atomic<uint64_t> sequence;
+    T value;
+  };
+  cell *cells;
+  uint64_t mask;
+  alignas(64) atomic<uint64_t> pushPosition;
+  alignas(64) atomic<uint64_t> popPosition;
+};
+
+typedef struct sequenceChunk {
+  string data;
+  bool fastq;
+} sequenceChunk;
+
+/* Sorted distinct hashes of a shard with their counts. */
+typedef struct kmerBatch {
+  uint64_t shard;
+  vector<uint64_t> keys;
+  vector<uint64_t> counts;
+} kmerBatch;
+
+typedef struct pipelineTarget {
+  QF *qf;
+  bufferedMQF *buffered;
+  vector<QF *> shards;
+  /* the ranges are powers of 2 */
+  uint64_t keyMask;
+} pipelineTarget;
+
+static inline uint64_t keyMask(__uint128_t range) {
+  return range > ~0ULL ? ~0ULL : (uint64_t) range - 1;
+}
+
+typedef struct pipeline {
+  kmerPipelineOptions options;
+  pipelineTarget target;
+  const vector<string> *files;
+  atomic<uint64_t> nextFile;
+  boundedQueue<sequenceChunk *> chunks;
+  boundedQueue<kmerBatch *> batches;
+  atomic<uint64_t> activeReaders;
+  atomic<uint64_t> activeParsers;
+  atomic<bool> failed;
+  mutex errorLock;
+  exception_ptr error;
+  atomic<uint64_t> bytes, nchunks, records, kmers, nbatches, inserts;
+  atomic<uint64_t> readNs, parseNs, insertNs;
+  atomic<uint64_t> readStalls, parseStalls, insertStalls;
+
+  pipeline(const kmerPipelineOptions &options, const pipelineTarget &target,
+           const vector<string> *files)
+      : options(options), target(target), files(files), nextFile(0),
+        chunks(options.queueSize), batches(options.queueSize),
+        activeReaders(options.readers), activeParsers(options.parsers),
+        failed(false), bytes(0), nchunks(0), records(0), kmers(0), nbatches(0),
+        inserts(0), readNs(0), parseNs(0), insertNs(0), readStalls(0),
+        parseStalls(0), insertStalls(0) {}
+} pipeline;
+
+static inline uint64_t elapsedNs(chrono::steady_clock::time_point start) {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+static void fail(pipeline &p) {
+  lock_guard<mutex> guard(p.errorLock);
+  if (!p.error)
+    p.error = current_exception();
+  p.failed = true;
+}
+
+/* Push to a full queue by yielding until there is room. Returns false if
+ * another stage failed meanwhile. */
+template <typename T>
+static bool pushWaiting(pipeline &p, boundedQueue<T> &queue, T value, atomic<uint64_t> &stalls) {
+  while (!queue.push(value)) {
+    if (p.failed)
+      return false;
+    stalls++;
+    this_thread::yield();
+  }
+  return true;
+}
+
+/* End of the last complete 4 lines record of a chunk starting on a record. */
+static size_t fastqRecordsEnd(const string &data) {
+  size_t end = 0, position = 0;
+  uint64_t lines = 0;
+  while (true) {
+    const char *newline = (const char *) memchr(data.data() + position, '\n', data.size() - position);
+    if (newline == NULL)
+      return end;
+    position = newline - data.data() + 1;
+    if (++lines % 4 == 0)
+      end = position;
+  }
+}
+
+/* Last k-1 bases of the sequence that ends the FASTA chunk, written as a
+ * line in front of the next chunk so that the k-mers over the cut are kept. */
+static string fastaTail(const string &data, uint64_t k) {
+  string tail;
+  size_t lineEnd = data.size();
+  while (lineEnd > 0 && tail.size() < k - 1) {
+    size_t lineStart = data.rfind('\n', lineEnd - 1);
+    lineStart = lineStart == string::npos ? 0 : lineStart + 1;
+    if (lineStart < data.size() && data[lineStart] == '>')
+      break;
+    for (size_t i = lineEnd; i > lineStart && tail.size() < k - 1; i--)
+      if (data[i - 1] != '\n' && data[i - 1] != '\r')
+        tail.push_back(data[i - 1]);
+    lineEnd = lineStart == 0 ? 0 : lineStart - 1;
+  }
+  reverse(tail.begin(), tail.end());
+  return tail;
+}
+
+static void readFile(pipeline &p, const string &path) {
+  auto start = chrono::steady_clock::now();
+  uint64_t busyNs = 0;
+  // gzread reads plain files as they are
+  gzFile file = gzopen(path.c_str(), "rb");
+  if (file == NULL)
+    throw std::runtime_error("Couldn't open file: " + path);
+  gzbuffer(file, 1 << 17);
+  vector<char> buffer(p.options.chunkSize);
+  string carry, tail;
+  bool fastq = false, formatKnown = false, eof = false;
+  while (!eof && !p.failed) {
+    int n = gzread(file, buffer.data(), buffer.size());
+    if (n < 0) {
+      int errnum;
+      string message = gzerror(file, &errnum);
+      gzclose(file);
+      throw std::runtime_error("Error reading " + path + ": " + message);
+    }
+    eof = n == 0;
+    carry.append(buffer.data(), n);
+    p.bytes += n;
+    if (!formatKnown) {
+      size_t first = carry.find_first_not_of(" \t\r\n");
+      if (first == string::npos) {
+        if (eof)
+          break;
+        continue;
+      }
+      if (carry[first] != '>' && carry[first] != '@') {
+        gzclose(file);
+        throw std::domain_error(path + " is neither a FASTA nor a FASTQ file");
+      }
+      fastq = carry[first] == '@';
+      formatKnown = true;
+    }
+    size_t cut;
+    if (eof)
+      cut = carry.size();
+    else if (fastq)
+      cut = fastqRecordsEnd(carry);
+    else
+      cut = carry.rfind('\n') == string::npos ? 0 : carry.rfind('\n') + 1;
+    if (cut == 0)
+      continue;
+    sequenceChunk *chunk = new sequenceChunk();
+    chunk->fastq = fastq;
+    if (!tail.empty())
+      chunk->data = tail + "\n";
+    chunk->data.append(carry, 0, cut);
+    carry.erase(0, cut);
+    if (!fastq)
+      tail = fastaTail(chunk->data, p.options.k);
+    p.nchunks++;
+    busyNs += elapsedNs(start);
+    if (!pushWaiting(p, p.chunks, chunk, p.readStalls)) {
+      delete chunk;
+      break;
+    }
+    start = chrono::steady_clock::now();
+  }
+  gzclose(file);
+  p.readNs += busyNs + elapsedNs(start);
+}
+
+static void readStage(pipeline &p) {
+  try {
+    while (!p.failed) {
+      uint64_t file = p.nextFile++;
+      if (file >= p.files->size())
+        break;
+      readFile(p, (*p.files)[file]);
+    }
+  } catch (...) {
+    fail(p);
+  }
+  p.activeReaders--;
+}
+
+/* Sort and count the hashes of a shard and send them to the inserters. */
+static bool sendBatch(pipeline &p, vector<uint64_t> &hashes, uint64_t shard) {
+  if (hashes.empty())
+    return true;
+  sort(hashes.begin(), hashes.end());
+  kmerBatch *batch = new kmerBatch();
+  batch->shard = shard;
+  for (size_t i = 0; i < hashes.size();) {
+    size_t j = i + 1;
+    while (j < hashes.size() && hashes[j] == hashes[i])
+      j++;
+    batch->keys.push_back(hashes[i]);
+    batch->counts.push_back(j - i);
+    i = j;
+  }
+  hashes.clear();
+  p.nbatches++;
+  if (!pushWaiting(p, p.batches, batch, p.parseStalls)) {
+    delete batch;
+    return false;
+  }
+  return true;
+}
+
+static void parseChunk(pipeline &p, const sequenceChunk &chunk, vector<vector<uint64_t> > &hashes) {
+  const uint64_t k = p.options.k;
+  const uint64_t mask = kmerMask(k);
+  const uint64_t shardMask = hashes.size() - 1;
+  const uint64_t rcShift = 2 * (k - 1);
+  const char *data = chunk.data.data();
+  const size_t size = chunk.data.size();
+  uint64_t fw = 0, rc = 0, length = 0, records = 0, kmers = 0, line = 0;
+  size_t position = 0;
+  while (position < size) {
+    const char *newline = (const char *) memchr(data + position, '\n', size - position);
+    size_t end = newline == NULL ? size : newline - data;
+    bool sequence;
+    if (chunk.fastq) {
+      sequence = line % 4 == 1;
+      records += line % 4 == 0;
+      length = 0;
+    } else {
+      sequence = data[position] != '>';
+      if (!sequence) {
+        records++;
+        length = 0;
+      }
+    }
+    line++;
+    if (sequence) {
+      for (size_t i = position; i < end; i++) {
+        uint8_t code = baseCodes[(uint8_t) data[i]];
+        if (code == 5)
+          continue;
+        if (code == 4) {
+          length = 0;
+          continue;
+        }
+        fw = ((fw << 2) | code) & mask;
+        rc = (rc >> 2) | ((uint64_t) (3 - code) << rcShift);
+        if (++length < k)
+          continue;
+        uint64_t key = kmerHash(min(fw, rc), k) & p.target.keyMask;
+        vector<uint64_t> &shard = hashes[key & shardMask];
+        shard.push_back(key);
+        kmers++;
+        if (shard.size() >= p.options.batchSize && !sendBatch(p, shard, key & shardMask))
+          return;
+      }
+    }
+    position = end + 1;
+  }
+  p.records += records;
+  p.kmers += kmers;
+}
+
+static void parseStage(pipeline &p) {
+  uint64_t nshards = max(p.target.shards.size(), (size_t) 1);
+  vector<vector<uint64_t> > hashes(nshards);
+  uint64_t busyNs = 0;
+  try {
+    while (!p.failed) {
+      sequenceChunk *chunk;
+      // readers are checked before the pop, so that no chunk pushed before
+      // they finished is missed
+      bool readersDone = p.activeReaders == 0;
+      if (!p.chunks.pop(chunk)) {
+        if (readersDone)
+          break;
+        p.parseStalls++;
+        this_thread::yield();
+        continue;
+      }
+      auto start = chrono::steady_clock::now();
+      parseChunk(p, *chunk, hashes);
+      delete chunk;
+      busyNs += elapsedNs(start);
+    }
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < nshards && !p.failed; i++)
+      sendBatch(p, hashes[i], i);
+    busyNs += elapsedNs(start);
+  } catch (...) {
+    fail(p);
+  }
+  p.parseNs += busyNs;
+  p.activeParsers--;
+}
+
+static void insertBatch(pipeline &p, const kmerBatch &batch) {
+  const pipelineTarget &target = p.target;
+  for (size_t i = 0; i < batch.keys.size(); i++) {
+    if (target.qf != NULL)
+      qf_insert(target.qf, batch.keys[i], batch.counts[i], true, true);
+    else if (target.buffered != NULL)
+      bufferedMQF_insert(target.buffered, batch.keys[i], batch.counts[i], true, true);
+    else
+      qf_insert(target.shards[batch.shard], batch.keys[i], batch.counts[i], true, true);
+  }
+  p.inserts += batch.keys.size();
+}
+
+static void insertStage(pipeline &p) {
+  uint64_t busyNs = 0;
+  try {
+    while (!p.failed) {
+      kmerBatch *batch;
+      bool parsersDone = p.activeParsers == 0;
+      if (!p.batches.pop(batch)) {
+        if (parsersDone)
+          break;
+        p.insertStalls++;
+        this_thread::yield();
+        continue;
+      }
+      auto start = chrono::steady_clock::now();
+      try {
+        insertBatch(p, *batch);
+      } catch (...) {
+        delete batch;
+        throw;
+      }
+      delete batch;
+      busyNs += elapsedNs(start);
+    }
+  } catch (...) {
+    fail(p);
+  }
+  p.insertNs += busyNs;
+}
+
+static kmerPipelineStats runPipeline(const vector<string> &files, const pipelineTarget &target,
+                                     const kmerPipelineOptions &options) {
+  if (options.k == 0 || options.k > 32)
+    throw std::domain_error("k must be between 1 and 32");
+  if (options.readers == 0 || options.parsers == 0 || options.inserters == 0)
+    throw std::domain_error("Every stage needs at least one thread");
+  for (size_t i = 0; i < files.size(); i++)
+    if (access(files[i].c_str(), R_OK) != 0)
+      throw std::runtime_error("Couldn't open file: " + files[i]);
+  auto start = chrono::steady_clock::now();
+  pipeline p(options, target, &files);
+  vector<thread> threads;
+  for (uint64_t i = 0; i < options.readers; i++)
+    threads.push_back(thread(readStage, ref(p)));
+  for (uint64_t i = 0; i < options.parsers; i++)
+    threads.push_back(thread(parseStage, ref(p)));
+  for (uint64_t i = 0; i < options.inserters; i++)
+    threads.push_back(thread(insertStage, ref(p)));
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+
+  // left in the queues when a stage failed
+  sequenceChunk *chunk;
+  while (p.chunks.pop(chunk))
+    delete chunk;
+  kmerBatch *batch;
+  while (p.batches.pop(batch))
+    delete batch;
+  if (p.error)
+    rethrow_exception(p.error);
+
+  kmerPipelineStats stats;
+  stats.files = files.size();
+  stats.bytes = p.bytes;
+  stats.chunks = p.nchunks;
+  stats.records = p.records;
+  stats.kmers = p.kmers;
+  stats.batches = p.nbatches;
+  stats.inserts = p.inserts;
+  stats.readNs = p.readNs;
+  stats.parseNs = p.parseNs;
+  stats.insertNs = p.insertNs;
+  stats.readStalls = p.readStalls;
+  stats.parseStalls = p.parseStalls;
+  stats.insertStalls = p.insertStalls;
+  stats.elapsedNs = elapsedNs(start);
+  return stats;
+}
+
+kmerPipelineStats MQF::countKmers(const std::vector<std::string> &files, QF *qf,
+                                  const kmerPipelineOptions &options) {
+  pipelineTarget target;
+  target.qf = qf;
+  target.buffered = NULL;
+  target.keyMask = keyMask(qf->metadata->range);
+  return runPipeline(files, target, options);
+}
+
+kmerPipelineStats MQF::countKmers(const std::vector<std::string> &files, bufferedMQF *qf,
+                                  const kmerPipelineOptions &options) {
+  pipelineTarget target;
+  target.qf = NULL;
+  target.buffered = qf;
+  target.keyMask = keyMask(qf->disk->metadata->range);
+  return runPipeline(files, target, options);
+}
+
+kmerPipelineStats MQF::countKmers(const std::vector<std::string> &files, const std::vector<QF*> &shards,
+                                  const kmerPipelineOptions &options) {
+  if (shards.empty() || (shards.size() & (shards.size() - 1)) != 0)
+    throw std::domain_error("The number of shards must be a power of 2");
+  for (size_t i = 1; i < shards.size(); i++)
+    if (shards[i]->metadata->range != shards[0]->metadata->range)
+      throw std::domain_error("The shards must have the same range");
+  pipelineTarget target;
+  target.qf = NULL;
+  target.buffered = NULL;
+  target.shards = shards;
+  target.keyMask = keyMask(shards[0]->metadata->range);
+  return runPipeline(files, target, options);
+}
@@ -0,0 +1,368 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdexcept>
+#include "gqf.h"
+#include "lsmMQF.h"
+
+using namespace std;
+using namespace onDiskMQF_Namespace;
+
+
+/* Largest number of slots the run of a level can use, see onDiskMQF. */
+static uint64_t lsmMQF_levelCapacity(uint64_t nslots)
+{
+    return (uint64_t)((double)(nslots+10*sqrt((double)nslots))*0.85);
+}
+
+static lsmMQFRun* lsmMQF_newRun(lsmMQF *qf, uint64_t level, uint64_t nslots)
+{
+    lsmMQFRun* run=new lsmMQFRun();
+    run->filename=qf->filename+".L"+to_string(level)+"."+to_string(qf->nextRunId++);
+    onDiskMQF::init(run->disk,nslots,qf->memoryBuffer->metadata->key_bits,
+        qf->memoryBuffer->metadata->label_bits,qf->memoryBuffer->metadata->fixed_counter_size,
+        run->filename.c_str(),qf->cache);
+    // the run is empty, so the summary is built by the rewrite that fills it
+    run->disk->enableSummary(qf->summaryBitsPerSlot);
+    return run;
+}
+
+static void lsmMQF_deleteRun(lsmMQFRun* run)
+{
+    delete run->disk;
+    unlink(run->filename.c_str());
+    unlink((run->filename+".ondisk.metadata").c_str());
+    delete run;
+}
+
+lsmMQF::~lsmMQF()
+{
+    if(flushThread.joinable())
+        flushThread.join();
+    qf_destroy(memoryBuffer);
+    delete memoryBuffer;
+    qf_destroy(flushBuffer);
+    delete flushBuffer;
+    for(uint64_t i=0;i<levels.size();i++)
+        for(uint64_t j=0;j<levels[i].size();j++)
+            lsmMQF_deleteRun(levels[i][j]);
+}
+
+void lsmMQF_init(lsmMQF *qf, uint64_t nslots_buffer, uint64_t key_bits, uint64_t label_bits,
+    uint64_t fixed_counter_size, const char *path, uint64_t fanout,
+    uint64_t summaryBitsPerSlot, pageCache* cache)
+{
+    if(fanout<2 || __builtin_popcountll(fanout)!=1)
+        throw std::domain_error("fanout must be a power of 2");
+    if(summaryBitsPerSlot!=0 && __builtin_popcountll(summaryBitsPerSlot)!=1)
+        throw std::domain_error("summaryBitsPerSlot must be 0 or a power of 2");
+    qf->filename=path;
+    qf->fanout=fanout;
+    qf->summaryBitsPerSlot=summaryBitsPerSlot;
+    qf->nextRunId=0;
+    qf->cache=cache;
+    qf->levels.resize(1);
+    qf_init(qf->memoryBuffer,nslots_buffer,key_bits,label_bits,fixed_counter_size,0,true,"",2038074761);
+    qf_init(qf->flushBuffer,nslots_buffer,key_bits,label_bits,fixed_counter_size,0,true,"",2038074761);
+}
+
+/* Write flushBuffer to a new run of level 0. */
+static void lsmMQF_writeFlushBuffer(lsmMQF *qf)
+{
+    uint64_t nslots=qf->flushBuffer->metadata->nslots;
+    // a buffer that overflowed does not fit in a run of its size
+    if(qf->flushBuffer->metadata->noccupied_slots>=lsmMQF_levelCapacity(nslots))
+        nslots*=2;
+    lsmMQFRun* run=lsmMQF_newRun(qf,0,nslots);
+    try{
+        run->disk->migrateFromQF(qf->flushBuffer);
+        run->disk->serialize();
+    }
+    catch(exception& e){
+        lsmMQF_deleteRun(run);
+        throw;
+    }
+    std::lock_guard<std::mutex> guard(qf->levelsLock);
+    qf->levels[0].push_back(run);
+    qf->stats.nflushes++;
+    qf->stats.slotsFlushed+=run->disk->metadata->noccupied_slots;
+    qf->stats.slotsWritten+=run->disk->metadata->noccupied_slots;
+    qf_reset(qf->flushBuffer);
+    qf->flushPending=false;
+}
+
+/* Merge level 0 into the first level that can hold it together with the
+ * levels in between. Only the flush thread changes the levels, so they are
+ * read here without levelsLock. */
+static void lsmMQF_compact(lsmMQF *qf)
+{
+    if(qf->levels[0].size()<qf->fanout)
+        return;
+    uint64_t key_bits=qf->memoryBuffer->metadata->key_bits;
+    uint64_t nslots=qf->memoryBuffer->metadata->nslots;
+    uint64_t noccupied_slots=0;
+    for(uint64_t i=0;i<qf->levels[0].size();i++)
+        noccupied_slots+=qf->levels[0][i]->disk->metadata->noccupied_slots;
+    uint64_t level=0;
+    lsmMQFRun* run=NULL;
+    while(run==NULL){
+        level++;
+        nslots*=qf->fanout;
+        if(log2((double)nslots)>=key_bits)
+            throw std::overflow_error("LSM filter is full, the last level would have no remainder bits.");
+        if(level==qf->levels.size()){
+            std::lock_guard<std::mutex> guard(qf->levelsLock);
+            qf->levels.resize(level+1);
+        }
+        for(uint64_t i=0;i<qf->levels[level].size();i++)
+            noccupied_slots+=qf->levels[level][i]->disk->metadata->noccupied_slots;
+        if(noccupied_slots>=lsmMQF_levelCapacity(nslots))
+            continue;
+
+        // the runs are read through their own handles, so queries can use them meanwhile
+        std::vector<onDiskMQF*> sources;
+        for(uint64_t i=0;i<=level;i++)
+            for(uint64_t j=qf->levels[i].size();j>0;j--){
+                onDiskMQF* source;
+                onDiskMQF::load(source,qf->levels[i][j-1]->filename.c_str(),qf->cache);
+                sources.push_back(source);
+            }
+        run=lsmMQF_newRun(qf,level,nslots);
+        try{
+            run->disk->migrateFromDisk(&sources[0],sources.size());
+            run->disk->serialize();
+        }
+        catch(std::overflow_error& e){
+            // counters of the larger level need more slots, try the next one
+            lsmMQF_deleteRun(run);
+            run=NULL;
+        }
+        catch(exception& e){
+            lsmMQF_deleteRun(run);
+            for(uint64_t i=0;i<sources.size();i++)
+                delete sources[i];
+            throw;
+        }
+        for(uint64_t i=0;i<sources.size();i++)
+            delete sources[i];
+    }
+    std::vector<lsmMQFRun*> merged;
+    {
+        std::lock_guard<std::mutex> guard(qf->levelsLock);
+        for(uint64_t i=0;i<=level;i++){
+            merged.insert(merged.end(),qf->levels[i].begin(),qf->levels[i].end());
+            qf->levels[i].clear();
+        }
+        qf->levels[level].push_back(run);
+        qf->stats.ncompactions++;
+        qf->stats.slotsWritten+=run->disk->metadata->noccupied_slots;
+    }
+    for(uint64_t i=0;i<merged.size();i++)
+        lsmMQF_deleteRun(merged[i]);
+}
+
+/* Body of the flush thread. */
+static void lsmMQF_flush(lsmMQF *qf)
+{
+    try {
+        lsmMQF_writeFlushBuffer(qf);
+        lsmMQF_compact(qf);
+    }
+    catch (exception& e)
+    {
+        // if the run was not written the items stay in flushBuffer
+        qf->flushError=std::current_exception();
+    }
+}
+
+void lsmMQF_waitForCompaction(lsmMQF *qf)
+{
+    if(qf->flushThread.joinable())
+        qf->flushThread.join();
+    if(qf->flushError)
+    {
+        std::exception_ptr error=qf->flushError;
+        qf->flushError=nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+/* Wait for the flush thread and write flushBuffer if it failed. */
+static void lsmMQF_finishFlush(lsmMQF *qf)
+{
+    lsmMQF_waitForCompaction(qf);
+    if(qf->flushPending) {
+        lsmMQF_writeFlushBuffer(qf);
+        lsmMQF_compact(qf);
+    }
+}
+
+/* Hand the memory buffer to the flush thread and continue in the other one. */
+static void lsmMQF_startFlush(lsmMQF *qf)
+{
+    lsmMQF_finishFlush(qf);
+    std::swap(qf->memoryBuffer,qf->flushBuffer);
+    qf->flushPending=true;
+    qf->flushThread=std::thread(lsmMQF_flush,qf);
+}
+
+bool lsmMQF_insert(lsmMQF *qf, uint64_t key, uint64_t count,
+                             bool lock, bool spin)
+{
+    key=key%qf->memoryBuffer->metadata->range;
+    try {
+        qf_insert(qf->memoryBuffer, key, count, lock, spin);
+    }
+    catch (exception& e)
+    {
+        lsmMQF_startFlush(qf);
+        qf_insert(qf->memoryBuffer, key, count, lock, spin);
+    }
+    if(qf_space(qf->memoryBuffer)>75)
+    {
+        lsmMQF_startFlush(qf);
+    }
+    return true;
+}
+
+uint64_t lsmMQF_count_key(const lsmMQF *qf, uint64_t key)
+{
+    key=key%qf->memoryBuffer->metadata->range;
+    uint64_t res=qf_count_key(qf->memoryBuffer,key);
+    std::lock_guard<std::mutex> guard(qf->levelsLock);
+    if(qf->flushPending)
+        res+=qf_count_key(qf->flushBuffer,key);
+    for(uint64_t i=0;i<qf->levels.size();i++)
+        for(uint64_t j=qf->levels[i].size();j>0;j--){
+            lsmMQFRun* run=qf->levels[i][j-1];
+            if(!run->disk->summaryHas(key)){
+                qf->stats.summaryNegatives++;
+                continue;
+            }
+            qf->stats.diskProbes++;
+            res+=run->disk->count_key(key);
+        }
+    return res;
+}
+
+void lsmMQF_syncBuffer(lsmMQF *qf)
+{
+    lsmMQF_finishFlush(qf);
+    if(qf->memoryBuffer->metadata->noccupied_slots!=0){
+        std::swap(qf->memoryBuffer,qf->flushBuffer);
+        qf->flushPending=true;
+        lsmMQF_finishFlush(qf);
+    }
+}
+
+lsmMQFStats lsmMQF_getStats(const lsmMQF *qf)
+{
+    std::lock_guard<std::mutex> guard(qf->levelsLock);
+    return qf->stats;
+}
+
+double lsmMQF_writeAmplification(const lsmMQF *qf)
+{
+    lsmMQFStats stats=lsmMQF_getStats(qf);
+    if(stats.slotsFlushed==0)
+        return 0;
+    return (double)stats.slotsWritten/(double)stats.slotsFlushed;
+}
+
+lsmMQFIterator* lsmMQF_iterator(lsmMQF *qf)
+{
+    lsmMQF_finishFlush(qf);
+    return new lsmMQFIterator(qf);
+}
+
+lsmMQFIterator::lsmMQFIterator(lsmMQF* qf)
+{
+    QFi* bit=new QFi();
+    if(qf_iterator(qf->memoryBuffer,bit,0))
+        bufferIts.push_back(bit);
+    else
+        delete bit;
+    for(uint64_t i=0;i<qf->levels.size();i++)
+        for(uint64_t j=qf->levels[i].size();j>0;j--)
+            runIts.push_back(new onDiskMQFScanner(qf->levels[i][j-1]->disk));
+    finished=false;
+    next();
+}
+
+lsmMQFIterator::~lsmMQFIterator()
+{
+    for(uint64_t i=0;i<bufferIts.size();i++)
+        delete bufferIts[i];
+    for(uint64_t i=0;i<runIts.size();i++)
+        delete runIts[i];
+}
+
+int lsmMQFIterator::get(uint64_t *key, uint64_t *value, uint64_t *count)
+{
+    *key=currentKey;
+    *value=currentLabel;
+    *count=currentCount;
+    return 0;
+}
+
+/* The smallest key of all the sources is the next item. Its count is summed
+ * over the sources and its label comes from the newest one. */
+int lsmMQFIterator::next()
+{
+    bool found=false;
+    uint64_t key, label, count;
+    for(uint64_t i=0;i<bufferIts.size();i++){
+        if(qfi_end(bufferIts[i]))
+            continue;
+        qfi_get(bufferIts[i],&key,&label,&count);
+        if(!found || key<currentKey){
+            found=true;
+            currentKey=key;
+        }
+    }
+    for(uint64_t i=0;i<runIts.size();i++){
+        if(runIts[i]->end())
+            continue;
+        if(!found || runIts[i]->get().key<currentKey){
+            found=true;
+            currentKey=runIts[i]->get().key;
+        }
+    }
+    if(!found){
+        finished=true;
+        return 1;
+    }
+    bool labeled=false;
+    currentCount=0;
+    for(uint64_t i=0;i<bufferIts.size();i++){
+        if(qfi_end(bufferIts[i]))
+            continue;
+        qfi_get(bufferIts[i],&key,&label,&count);
+        if(key!=currentKey)
+            continue;
+        if(!labeled){
+            currentLabel=label;
+            labeled=true;
+        }
+        currentCount+=count;
+        qfi_next(bufferIts[i]);
+    }
+    for(uint64_t i=0;i<runIts.size();i++){
+        if(runIts[i]->end() || runIts[i]->get().key!=currentKey)
+            continue;
+        if(!labeled){
+            currentLabel=runIts[i]->get().label;
+            labeled=true;
+        }
+        currentCount+=runIts[i]->get().count;
+        runIts[i]->next();
+    }
+    return 0;
+}
+
+int lsmMQFIterator::end()
+{
+    if(finished ) return 1;
+    return 0;
+}
@@ -13,8 +13,15 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <fstream>
 #include <algorithm>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <stdexcept>
 #include "gqf.h"
 #include "onDiskMQF.h"
@@ -43,8 +50,27 @@ namespace onDiskMQF_Namespace{
 #define NUM_SLOTS_TO_LOCK (1ULL<<16)
 #define CLUSTER_SIZE (1ULL<<14)
 
+/* Target page size of the pread/pwrite backend. Pages hold a power of 2
+ * blocks, so a run or a cluster usually stays inside one page. */
+#define PAGED_BACKEND_PAGE_SIZE (64*1024)
+
+/* Number of blocks migrateFromQF builds in memory before writing them out. */
+#define MERGE_WINDOW_BLOCKS (4096)
+/* migrateFromQF rewrites the file when the source has at least
+ * 1/MERGE_REWRITE_RATIO of the occupied slots of the disk filter. Smaller
+ * sources are inserted item by item; they are sorted, so the inserts walk
+ * the file in order and touch less of it than a rewrite. */
+#define MERGE_REWRITE_RATIO (8)
+/* migrateFromDisk merges and encodes the items in ranges of this many keys,
+ * and reads at most MIGRATE_READ_AHEAD ranges per encoding thread ahead of
+ * the range being written. */
+#define MIGRATE_RANGE_ITEMS (4096)
+#define MIGRATE_READ_AHEAD (4)
+
 #define METADATA_WORD(field,slot_index) (get_block((slot_index) / \
 					SLOTS_PER_BLOCK)->field[((slot_index)  % SLOTS_PER_BLOCK) / 64])
+#define METADATA_WORD_CONST(field,slot_index) (get_block_const((slot_index) / \
+					SLOTS_PER_BLOCK)->field[((slot_index)  % SLOTS_PER_BLOCK) / 64])
 
 
 uint64_t bitmaskLookup[]={0,1, 3, 7, 15, 31, 63, 127, 255, 511, 1023,
@@ -57,6 +83,8 @@ uint64_t bitmaskLookup[]={0,1, 3, 7, 15, 31, 63, 127, 255, 511, 1023,
 
 
 
+void initializeDisk();
+
 template<uint64_t bitsPerSlot=64>
 class _onDiskMQF: public onDiskMQF {
 private:
@@ -122,8 +150,8 @@ public:
 @param uint32_t seed: useless value. To be removed
     */
 
-_onDiskMQF(uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,const char * path);
-_onDiskMQF(const char * path);
+_onDiskMQF(uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size,const char * path, pageCache* cache);
+_onDiskMQF(const char * path, pageCache* cache);
 
 void reset() override;
 
@@ -140,25 +168,393 @@ void reset() override;
 	free(qf->mem);
 	free(qf->metadata);
 
-	qf->blocks->flush();
-	delete blocks;
-	delete OutputFile;
+	unpin_all();
+	if(pages!=NULL){
+		pages->removeFile(pagesFileId);
+		close(pagesFd);
+	}
+	else{
+		qf->blocks->flush();
+		delete blocks;
+		delete OutputFile;
+	}
+
+}
+/* Blocks are handed out as raw pointers into the page cache. The groups of
+ * 2^pinnedGroupShift blocks (stxxl blocks, or pages of the pread/pwrite
+ * backend) touched by an operation are pinned in pinnedGroups and the
+ * pointers stay valid until the outermost operation returns (see pinScope).
+ * With stxxl, pinned pages are kept most recently used in the lru pager, so
+ * fetching another page never evicts them.
+ */
+static const int maxPinnedGroups=4;
+uint64_t pinnedGroupShift;
+pageCache* pages;
+int pagesFileId;
+int pagesFd;
+typedef struct pinnedGroup {
+	uint64_t group;
+	onDisk_qfblock<bitsPerSlot>* blocks;
+	bool writable;
+} pinnedGroup;
+pinnedGroup pinnedGroups[maxPinnedGroups];
+int npinnedGroups;
+int lastPinnedGroup;
+int nextPinnedVictim;
+int pinDepth;
+
+class pinScope{
+public:
+	_onDiskMQF<bitsPerSlot>* qf;
+	pinScope(_onDiskMQF<bitsPerSlot>* q):qf(q){
+		qf->pinDepth++;
+	}
+	~pinScope(){
+		if(--qf->pinDepth==0)
+			qf->unpin_all();
+	}
+};
+
+void unpin_all()
+{
+	if(pages!=NULL){
+		for(int i=0;i<npinnedGroups;i++)
+			if(pinnedGroups[i].group!=~0ULL)
+				pages->unpin(pagesFileId,pinnedGroups[i].group);
+	}
+	for(int i=0;i<maxPinnedGroups;i++)
+		pinnedGroups[i].group=~0ULL;
+	npinnedGroups=0;
+	lastPinnedGroup=0;
+	nextPinnedVictim=0;
+}
+
+pinnedGroup* pin_group(uint64_t group,bool writable)
+{
+	const stxxlVector* constBlocks=blocks;
+	for(int i=0;i<npinnedGroups;i++)
+	{
+		if(pinnedGroups[i].group==group)
+		{
+			if(writable && !pinnedGroups[i].writable){
+				// marks the page dirty, the page is resident so the pointer is the same
+				if(pages!=NULL)
+					pages->markDirty(pagesFileId,group);
+				else
+					pinnedGroups[i].blocks=&(*blocks)[group<<pinnedGroupShift];
+				pinnedGroups[i].writable=true;
+			}
+			lastPinnedGroup=i;
+			return &pinnedGroups[i];
+		}
+	}
+	int slot;
+	if(npinnedGroups<maxPinnedGroups)
+		slot=npinnedGroups++;
+	else{
+		slot=nextPinnedVictim;
+		nextPinnedVictim=(nextPinnedVictim+1)%maxPinnedGroups;
+		if(pages!=NULL)
+			pages->unpin(pagesFileId,pinnedGroups[slot].group);
+	}
+	pinnedGroups[slot].group=~0ULL;
+	if(pages!=NULL)
+		pinnedGroups[slot].blocks=(onDisk_qfblock<bitsPerSlot>*)pages->pin(pagesFileId,group,writable);
+	else{
+		for(int i=0;i<npinnedGroups;i++)
+		{
+			if(pinnedGroups[i].group!=~0ULL)
+				pinnedGroups[i].blocks=const_cast<onDisk_qfblock<bitsPerSlot>*>(
+					&(*constBlocks)[pinnedGroups[i].group<<pinnedGroupShift]);
+		}
+		if(writable)
+			pinnedGroups[slot].blocks=&(*blocks)[group<<pinnedGroupShift];
+		else
+			pinnedGroups[slot].blocks=const_cast<onDisk_qfblock<bitsPerSlot>*>(
+				&(*constBlocks)[group<<pinnedGroupShift]);
+	}
+	pinnedGroups[slot].group=group;
+	pinnedGroups[slot].writable=writable;
+	lastPinnedGroup=slot;
+	return &pinnedGroups[slot];
+}
+
+inline onDisk_qfblock<bitsPerSlot>* get_block(uint64_t block_index)
+{
+	uint64_t group=block_index>>pinnedGroupShift;
+	pinnedGroup* p=&pinnedGroups[lastPinnedGroup];
+	if(p->group!=group || !p->writable)
+		p=pin_group(group,true);
+	return p->blocks+(block_index&((1ULL<<pinnedGroupShift)-1));
+}
+inline const onDisk_qfblock<bitsPerSlot>* get_block_const( uint64_t block_index)
+{
+	uint64_t group=block_index>>pinnedGroupShift;
+	pinnedGroup* p=&pinnedGroups[lastPinnedGroup];
+	if(p->group!=group)
+		p=pin_group(group,false);
+	return p->blocks+(block_index&((1ULL<<pinnedGroupShift)-1));
+}
+
+/* Attach the open file pagesFd to the pread/pwrite backend. */
+void open_pages(pageCache* cache)
+{
+	uint64_t fileSize=metadata->nblocks*sizeof(onDisk_qfblock<bitsPerSlot>);
+	struct stat sb;
+	if(fstat(pagesFd,&sb)<0 || (uint64_t)sb.st_size<fileSize){
+		if(ftruncate(pagesFd,fileSize)<0){
+			perror("Couldn't resize file:\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	uint64_t maxPageSize=min(cache->maxPageSize(),(uint64_t)PAGED_BACKEND_PAGE_SIZE);
+	pinnedGroupShift=0;
+	while((2ULL<<pinnedGroupShift)*sizeof(onDisk_qfblock<bitsPerSlot>)<=maxPageSize &&
+				(1ULL<<pinnedGroupShift)<metadata->nblocks)
+		pinnedGroupShift++;
+	pages=cache;
+	pagesFileId=cache->addFile(pagesFd,
+		(1ULL<<pinnedGroupShift)*sizeof(onDisk_qfblock<bitsPerSlot>),fileSize);
+	blocks=NULL;
+	OutputFile=NULL;
+}
 
+/* Attach the file at path to the stxxl backend. */
+void open_stxxl(const char* path, bool create)
+{
+	using stxxl::file;
+	initializeDisk();
+	if(create){
+		file::unlink(path); // delete output file
+		OutputFile=new stxxl::syscall_file(path, file::RDWR | file::CREAT | file::DIRECT );
+	}
+	else
+		OutputFile= new stxxl::syscall_file(path, file::RDWR  | file::DIRECT );
+	// the pager must hold every pinned page plus the one being fetched
+	blocks=new stxxlVector (OutputFile, metadata->nblocks,
+		max(stxxlBufferSize/16,(uint64_t)maxPinnedGroups+1));
+	pinnedGroupShift=10;
 }
-inline typename stxxlVector::iterator  get_block(uint64_t block_index)
+
+/* Builds the blocks of a filter file front to back for migrateFromQF. Blocks
+ * are kept in a window until they are released, then written sequentially.
+ * The window has a spare block at its end because slots are accessed as
+ * 64 bit words that can go past the end of their block.
+ */
+class blockWriter{
+public:
+	int fd;
+	uint64_t nblocks;
+	uint64_t base;
+	uint64_t released;
+	std::vector<onDisk_qfblock<bitsPerSlot> > window;
+	blockWriter(int fd,uint64_t nblocks):fd(fd),nblocks(nblocks),base(0),released(0),
+		window(MERGE_WINDOW_BLOCKS+1){}
+
+	onDisk_qfblock<bitsPerSlot>* block(uint64_t block_index)
+	{
+		if(block_index-base>=window.size()-1){
+			write_released();
+			if(block_index-base>=window.size()-1)
+				window.resize(block_index-base+2);
+		}
+		return &window[block_index-base];
+	}
+	/* Blocks before block_index are not going to change anymore. */
+	void release(uint64_t block_index)
+	{
+		released=max(released,block_index);
+	}
+	void write_released()
+	{
+		uint64_t n=released-base;
+		if(n==0)
+			return;
+		write_blocks(n);
+		memmove(&window[0],&window[n],(window.size()-n)*sizeof(onDisk_qfblock<bitsPerSlot>));
+		memset((void*)&window[window.size()-n],0,n*sizeof(onDisk_qfblock<bitsPerSlot>));
+		base=released;
+	}
+	void finish()
+	{
+		write_blocks(min(window.size()-1,nblocks-base));
+		if(ftruncate(fd,nblocks*sizeof(onDisk_qfblock<bitsPerSlot>))<0)
+			throw std::runtime_error(string("Couldn't resize merged filter: ")+strerror(errno));
+	}
+	void write_blocks(uint64_t n)
+	{
+		const char* buf=(const char*)&window[0];
+		uint64_t size=n*sizeof(onDisk_qfblock<bitsPerSlot>);
+		uint64_t pos=base*sizeof(onDisk_qfblock<bitsPerSlot>);
+		while(size>0){
+			ssize_t written=pwrite(fd,buf,size,pos);
+			if(written<0){
+				if(errno==EINTR)
+					continue;
+				throw std::runtime_error(string("Error writing merged filter: ")+strerror(errno));
+			}
+			buf+=written;
+			pos+=written;
+			size-=written;
+		}
+	}
+};
+
+/* Decode the item at the cursor and move past it, scanning the slots in
+ * order instead of looking up run ends. Returns false at the end. */
+bool next_merge_item(onDiskMQFCursor* c,uint64_t* key,uint64_t* label,uint64_t* count)
 {
-    typename stxxlVector::iterator it = (this->blocks)->begin();
+	uint64_t index=c->index;
+	if(c->runs.empty()){
+		// skip the empty slots up to the next occupied quotient
+		uint64_t occupieds=0;
+		while(index<metadata->xnslots){
+			occupieds=get_block_const(index/SLOTS_PER_BLOCK)->occupieds[0]
+				& ~bitmaskLookup[index%SLOTS_PER_BLOCK];
+			if(occupieds!=0)
+				break;
+			index=(index/SLOTS_PER_BLOCK+1)*SLOTS_PER_BLOCK;
+		}
+		if(occupieds==0)
+			return false;
+		index=(index/SLOTS_PER_BLOCK)*SLOTS_PER_BLOCK+__builtin_ctzll(occupieds);
+	}
+	const uint64_t fixed_count_max=bitmaskLookup[metadata->fixed_counter_size];
+	if(is_occupied(index))
+		c->runs.push_back(index);
+	uint64_t t=_get_slot(index);
+	uint64_t fcount=t & fixed_count_max;
+	*key=(c->runs.front() << metadata->key_remainder_bits) |
+		((t >> metadata->fixed_counter_size) & bitmaskLookup[metadata->key_remainder_bits]);
+	*label=(t >> (metadata->fixed_counter_size+metadata->key_remainder_bits)) &
+		bitmaskLookup[metadata->label_bits];
+	*count=fcount+1;
+	if(fcount==fixed_count_max){
+		uint64_t digits=0, value=0;
+		do{
+			index++;
+			digits++;
+			if(is_occupied(index))
+				c->runs.push_back(index);
+			t=_get_slot(index);
+			value<<=metadata->key_remainder_bits;
+			value+=(t >> metadata->fixed_counter_size) & bitmaskLookup[metadata->key_remainder_bits];
+			fcount=t & fixed_count_max;
+		}while(fcount==fixed_count_max);
+		*count+=value+(fcount<<(digits*metadata->key_remainder_bits));
+	}
+	if(is_runend(index))
+		c->runs.pop_front();
+	c->index=index+1;
+	return true;
+}
 
-    it+=block_index;
-    return it;
+/* Same as _set_slot for a block that is not part of the filter. */
+inline void set_block_slot(onDisk_qfblock<bitsPerSlot>* b,uint64_t slot_index,uint64_t value)
+{
+	uint64_t *p = (uint64_t *)&b->slots[slot_index * metadata->bits_per_slot / 8];
+	int shift = (slot_index * metadata->bits_per_slot) % 8;
+	uint64_t mask = bitmaskLookup[metadata->bits_per_slot]<< shift;
+	value <<= shift;
+	*p=*p ^ ((*p ^ value) & mask);
 }
-inline typename stxxlVector::const_iterator get_block_const( uint64_t block_index)
+
+/* Slots of an item of a rewrite, with its fixed counters and its label on
+ * the first one. Returns the number of slots, 0 for a count of 0. */
+uint64_t encode_item(uint64_t key,uint64_t label,uint64_t count,uint64_t* slots)
 {
-    typename stxxlVector::const_iterator it = this->blocks->cbegin();
-    it+=block_index;
-    return it;
+	if(metadata->maximum_count!=0)
+		count=std::min(count,metadata->maximum_count);
+	uint64_t new_values[67], new_fcounters[67];
+	uint64_t *p=encode_counter(key & bitmaskLookup[metadata->key_remainder_bits], count,
+		&new_values[67], &new_fcounters[67]);
+	uint64_t n=&new_values[67]-p;
+	uint64_t *pf=&new_fcounters[67]-n;
+	for(uint64_t i=0;i<n;i++)
+		slots[i]=(p[i] << metadata->fixed_counter_size) | pf[i];
+	if(n>0)
+		slots[0]|=(label & bitmaskLookup[metadata->label_bits]) <<
+			(metadata->fixed_counter_size+metadata->key_remainder_bits);
+	return n;
 }
 
+/* Places the encoded items of a rewrite, which come in key order, in the
+ * file filename+".merge". The file is written front to back with
+ * blockWriter and then replaces the filter's file (see replace_file).
+ */
+class mergeWriter{
+public:
+	_onDiskMQF<bitsPerSlot>* qf;
+	string filename;
+	int fd;
+	blockWriter out;
+	uint64_t run;
+	uint64_t nextFree;
+	uint64_t nextOffsetBlock;
+	uint64_t noccupied_slots;
+	uint64_t ndistinct_elts;
+	// the summary of the merged file replaces the current one with it
+	std::vector<uint64_t> summary;
+	mergeWriter(_onDiskMQF<bitsPerSlot>* q):qf(q),filename(q->filename+".merge"),
+		fd(open_merged(filename)),out(fd,q->metadata->nblocks),run(~0ULL),nextFree(0),
+		nextOffsetBlock(1),noccupied_slots(0),ndistinct_elts(0),summary(q->summary.size(),0){}
+
+	static int open_merged(const string& filename)
+	{
+		int fd=open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't open file: " + filename);
+		return fd;
+	}
+	void add(uint64_t key,const uint64_t* slots,uint64_t n)
+	{
+		if(!summary.empty()){
+			uint64_t i=qf->summaryIndex(key);
+			summary[i/64]|=1ULL<<(i%64);
+		}
+		uint64_t quotient=key >> qf->metadata->key_remainder_bits;
+		if(quotient!=run){
+			if(run!=~0ULL)
+				out.block((nextFree-1)/SLOTS_PER_BLOCK)->runends[0]|=
+					1ULL<<((nextFree-1)%SLOTS_PER_BLOCK);
+			// the offset of a block counts the slots used by runs of earlier blocks
+			for(;nextOffsetBlock<=quotient/SLOTS_PER_BLOCK &&
+						nextOffsetBlock*SLOTS_PER_BLOCK<nextFree;nextOffsetBlock++)
+				out.block(nextOffsetBlock)->offset=(uint8_t)min(
+					nextFree-nextOffsetBlock*SLOTS_PER_BLOCK,(uint64_t)bitmaskLookup[8]);
+			nextOffsetBlock=max(nextOffsetBlock,quotient/SLOTS_PER_BLOCK+1);
+			out.release(quotient/SLOTS_PER_BLOCK);
+			out.block(quotient/SLOTS_PER_BLOCK)->occupieds[0]|=
+				1ULL<<(quotient%SLOTS_PER_BLOCK);
+			nextFree=max(nextFree,quotient);
+			run=quotient;
+		}
+		if(nextFree+n>qf->metadata->xnslots)
+			throw std::overflow_error("Buffered QF is 95% full, cannot insert more items.");
+		for(uint64_t i=0;i<n;i++,nextFree++)
+			qf->set_block_slot(out.block(nextFree/SLOTS_PER_BLOCK),
+				nextFree%SLOTS_PER_BLOCK, slots[i]);
+		noccupied_slots+=n;
+		ndistinct_elts++;
+	}
+	void finish()
+	{
+		if(run!=~0ULL)
+			out.block((nextFree-1)/SLOTS_PER_BLOCK)->runends[0]|=
+				1ULL<<((nextFree-1)%SLOTS_PER_BLOCK);
+		for(;nextOffsetBlock*SLOTS_PER_BLOCK<nextFree;nextOffsetBlock++)
+			out.block(nextOffsetBlock)->offset=(uint8_t)min(
+				nextFree-nextOffsetBlock*SLOTS_PER_BLOCK,(uint64_t)bitmaskLookup[8]);
+		out.finish();
+	}
+	/* Drop the merged file, the filter is left untouched. */
+	void abort()
+	{
+		close(fd);
+		unlink(filename.c_str());
+	}
+};
+
 void copy(onDiskMQF *dest)override;
 
 /*!
@@ -315,7 +711,17 @@ bool general_lock(bool spin)override;
 void general_unlock()override;
 
 //void onDiskMQF_migrate(onDiskMQF* source, onDiskMQF* destination);
-void migrateFromQF(QF* source) override;
+using onDiskMQF::migrateFromQF;
+void migrateFromQF(QF** sources, int nsources, const onDiskMQFLabels* labels=NULL) override;
+void migrateFromDisk(onDiskMQF** sources, int nsources, uint64_t nthreads=1,
+	onDiskMQFProgress progress=onDiskMQFProgress()) override;
+uint64_t scan(onDiskMQFCursor* cursor, onDiskMQFItem* items, uint64_t n) override;
+template<class itemSource>
+void rewrite(itemSource next);
+template<class itemSource>
+void rewrite_pipelined(itemSource next, const uint64_t* itemsRead, uint64_t totalItems,
+	uint64_t nthreads, onDiskMQFProgress progress);
+void replace_file(mergeWriter& merged);
 bool getForIterator(onDiskMQFIterator* qfi,uint64_t *key, uint64_t *value, uint64_t *count);
 int nextForIterator(onDiskMQFIterator *qfi);
 };
@@ -693,14 +1099,14 @@ inline void writeAndFreeBlocks(uint64_t memoryBufferIndex)
 template<uint64_t bitsPerSlot>
   inline int _onDiskMQF<bitsPerSlot>::is_runend(uint64_t index)
 {
-	return (METADATA_WORD( runends, index) >> ((index % SLOTS_PER_BLOCK) %
+	return (METADATA_WORD_CONST( runends, index) >> ((index % SLOTS_PER_BLOCK) %
 																								64)) & 1ULL;
 }
 
 template<uint64_t bitsPerSlot>
  inline int _onDiskMQF<bitsPerSlot>::is_occupied(uint64_t index)
 {
-	return (METADATA_WORD( occupieds, index) >> ((index % SLOTS_PER_BLOCK) %
+	return (METADATA_WORD_CONST( occupieds, index) >> ((index % SLOTS_PER_BLOCK) %
 																									64)) & 1ULL;
 }
 
@@ -862,8 +1268,8 @@ template<uint64_t bitsPerSlot>
 		 field, then we can safely ignore the possibility of overflowing
 		 that field. */
 	if (sizeof(qf->get_block(0)->offset) > 1 ||
-			qf->get_block( blockidx)->offset < BITMASK(8*sizeof(qf->get_block(0)->offset)))
-		return qf->get_block( blockidx)->offset;
+			qf->get_block_const( blockidx)->offset < BITMASK(8*sizeof(qf->get_block(0)->offset)))
+		return qf->get_block_const( blockidx)->offset;
 
 	return run_end( SLOTS_PER_BLOCK * blockidx - 1) - SLOTS_PER_BLOCK *
 		blockidx + 1;
@@ -877,7 +1283,7 @@ template<uint64_t bitsPerSlot>
 	uint64_t bucket_intrablock_offset = hash_bucket_index % SLOTS_PER_BLOCK;
 	uint64_t bucket_blocks_offset = block_offset( bucket_block_index);
 
-	uint64_t bucket_intrablock_rank   = bitrank(qf->get_block(
+	uint64_t bucket_intrablock_rank   = bitrank(qf->get_block_const(
 																				bucket_block_index)->occupieds[0],
 																				bucket_intrablock_offset);
 
@@ -892,7 +1298,7 @@ template<uint64_t bitsPerSlot>
 		SLOTS_PER_BLOCK;
 	uint64_t runend_ignore_bits  = bucket_blocks_offset % SLOTS_PER_BLOCK;
 	uint64_t runend_rank         = bucket_intrablock_rank - 1;
-	uint64_t runend_block_offset = bitselectv(qf->get_block(
+	uint64_t runend_block_offset = bitselectv(qf->get_block_const(
 																						runend_block_index)->runends[0],
 																						runend_ignore_bits, runend_rank);
 	if (runend_block_offset == SLOTS_PER_BLOCK) {
@@ -902,12 +1308,12 @@ template<uint64_t bitsPerSlot>
 			return hash_bucket_index;
 		} else {
 			do {
-				runend_rank        -= popcntv(qf->get_block(
+				runend_rank        -= popcntv(qf->get_block_const(
 																								runend_block_index)->runends[0],
 																			runend_ignore_bits);
 				runend_block_index++;
 				runend_ignore_bits  = 0;
-				runend_block_offset = bitselectv(qf->get_block(
+				runend_block_offset = bitselectv(qf->get_block_const(
 																									 runend_block_index)->runends[0],
 																				 runend_ignore_bits, runend_rank);
 			} while (runend_block_offset == SLOTS_PER_BLOCK);
@@ -942,7 +1348,7 @@ template<uint64_t bitsPerSlot>
   inline int _onDiskMQF<bitsPerSlot>::offset_lower_bound(uint64_t slot_index)
 {
 	_onDiskMQF<bitsPerSlot> *qf=this;
-	typename stxxlVector::const_iterator  b = qf->get_block_const( slot_index / SLOTS_PER_BLOCK);
+	const onDisk_qfblock<bitsPerSlot>* b = qf->get_block_const( slot_index / SLOTS_PER_BLOCK);
 	const uint64_t slot_offset = slot_index % SLOTS_PER_BLOCK;
 	const uint64_t boffset = b->offset;
 	const uint64_t occupieds = b->occupieds[0] & BITMASK(slot_offset+1);
@@ -1035,6 +1441,7 @@ template<uint64_t bitsPerSlot>
 template<uint64_t bitsPerSlot>
   inline void _onDiskMQF<bitsPerSlot>::dump_block(uint64_t i)
 {
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	uint64_t j;
  	printf("#Block %lu \n",i );
@@ -1092,6 +1499,7 @@ for(int j=0;j<64 && (j+64*i)<qf->metadata->xnslots;j++)
 template<uint64_t bitsPerSlot>
 void _onDiskMQF<bitsPerSlot>::dump()
 {
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	uint64_t i;
 
@@ -1931,6 +2339,7 @@ template<uint64_t bitsPerSlot>
 template<uint64_t bitsPerSlot>
 bool _onDiskMQF<bitsPerSlot>::remove(uint64_t hash, uint64_t count , bool lock, bool spin)
 {
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	uint64_t hash_remainder           = hash & BITMASK(qf->metadata->key_remainder_bits);
 	uint64_t hash_bucket_index        = hash >> qf->metadata->key_remainder_bits;
@@ -2007,208 +2416,210 @@ bool _onDiskMQF<bitsPerSlot>::remove(uint64_t hash, uint64_t count , bool lock,
 /***********************************************************************
  * Code that uses the above to implement key-value-counter operations. *
  ***********************************************************************/
- void onDiskMQF::init( onDiskMQF *&qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size ,const char * path){
+ void onDiskMQF::init( onDiskMQF *&qf, uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size ,const char * path, pageCache* cache){
 	 uint64_t qbits=(uint64_t)log2((double)nslots);
-	 uint64_t tmpslotsSize=key_bits-qbits+fixed_counter_size;
+	 uint64_t tmpslotsSize=key_bits-qbits+fixed_counter_size+label_bits;
 	 switch (tmpslotsSize) {
 		 case 1:
-		 		qf=new  onDiskMQF_Namespace::_onDiskMQF<1>(nslots,key_bits,label_bits,fixed_counter_size,path);
+		 		qf=new  onDiskMQF_Namespace::_onDiskMQF<1>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 	 			break;
 		 case 2:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<2>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<2>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 3:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<3>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<3>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 4:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<4>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<4>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 5:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<5>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<5>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 6:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<6>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<6>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 7:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<7>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<7>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 8:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<8>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<8>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 9:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<9>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<9>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 10:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<10>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<10>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 11:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<11>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<11>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 12:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<12>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<12>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 13:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<13>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<13>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 14:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<14>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<14>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 15:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<15>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<15>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 16:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<16>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<16>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 17:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<17>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<17>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 18:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<18>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<18>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 19:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<19>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<19>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 20:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<20>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<20>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 21:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<21>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<21>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 22:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<22>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<22>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 23:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<23>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<23>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 24:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<24>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<24>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 25:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<25>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<25>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 26:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<26>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<26>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 27:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<27>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<27>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 28:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<28>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<28>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 29:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<29>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<29>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 30:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<30>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<30>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 31:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<31>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<31>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 32:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<32>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<32>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 33:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<33>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<33>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 34:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<34>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<34>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 35:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<35>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<35>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 36:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<36>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<36>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 37:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<37>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<37>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 38:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<38>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<38>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 39:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<39>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<39>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 40:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<40>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<40>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 41:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<41>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<41>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 42:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<42>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<42>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 43:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<43>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<43>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 44:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<44>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<44>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 45:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<45>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<45>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 46:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<46>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<46>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 47:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<47>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<47>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 48:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<48>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<48>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 49:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<49>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<49>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 50:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<50>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<50>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 51:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<51>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<51>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 52:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<52>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<52>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 53:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<53>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<53>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 54:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<54>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<54>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 55:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<55>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<55>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 56:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<56>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<56>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 57:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<57>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<57>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 58:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<58>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<58>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 59:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<59>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<59>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 60:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<60>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<60>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 61:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<61>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<61>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 62:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<62>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<62>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 63:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<63>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<63>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
 		 case 64:
-			 qf=new  onDiskMQF_Namespace::_onDiskMQF<64>(nslots,key_bits,label_bits,fixed_counter_size,path);
+			 qf=new  onDiskMQF_Namespace::_onDiskMQF<64>(nslots,key_bits,label_bits,fixed_counter_size,path,cache);
 			 break;
+		 default:
+			 throw std::domain_error("Slot size of the on disk filter must be between 1 and 64 bits");
 
 	 }
 	 //qf->insert(100,1,false,false);
 	 //cout<<qf->count_key(100)<<endl;
  }
- void onDiskMQF::load(onDiskMQF*& qf,const char *filename){
+ void onDiskMQF::load(onDiskMQF*& qf,const char *filename, pageCache* cache){
 	 FILE *fin;
 	 string metadataFile=string(filename)+".ondisk.metadata";
 	 fin = fopen(metadataFile.c_str(), "rb");
@@ -2228,196 +2639,196 @@ bool _onDiskMQF<bitsPerSlot>::remove(uint64_t hash, uint64_t count , bool lock,
 	 free(metadata);
      switch (bitsPerslot) {
          case 1:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<1>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<1>(filename,cache);
              break;
          case 2:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<2>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<2>(filename,cache);
              break;
          case 3:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<3>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<3>(filename,cache);
              break;
          case 4:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<4>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<4>(filename,cache);
              break;
          case 5:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<5>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<5>(filename,cache);
              break;
          case 6:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<6>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<6>(filename,cache);
              break;
          case 7:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<7>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<7>(filename,cache);
              break;
          case 8:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<8>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<8>(filename,cache);
              break;
          case 9:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<9>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<9>(filename,cache);
              break;
          case 10:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<10>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<10>(filename,cache);
              break;
          case 11:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<11>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<11>(filename,cache);
              break;
          case 12:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<12>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<12>(filename,cache);
              break;
          case 13:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<13>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<13>(filename,cache);
              break;
          case 14:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<14>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<14>(filename,cache);
              break;
          case 15:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<15>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<15>(filename,cache);
              break;
          case 16:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<16>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<16>(filename,cache);
              break;
          case 17:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<17>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<17>(filename,cache);
              break;
          case 18:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<18>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<18>(filename,cache);
              break;
          case 19:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<19>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<19>(filename,cache);
              break;
          case 20:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<20>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<20>(filename,cache);
              break;
          case 21:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<21>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<21>(filename,cache);
              break;
          case 22:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<22>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<22>(filename,cache);
              break;
          case 23:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<23>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<23>(filename,cache);
              break;
          case 24:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<24>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<24>(filename,cache);
              break;
          case 25:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<25>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<25>(filename,cache);
              break;
          case 26:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<26>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<26>(filename,cache);
              break;
          case 27:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<27>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<27>(filename,cache);
              break;
          case 28:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<28>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<28>(filename,cache);
              break;
          case 29:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<29>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<29>(filename,cache);
              break;
          case 30:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<30>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<30>(filename,cache);
              break;
          case 31:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<31>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<31>(filename,cache);
              break;
          case 32:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<32>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<32>(filename,cache);
              break;
          case 33:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<33>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<33>(filename,cache);
              break;
          case 34:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<34>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<34>(filename,cache);
              break;
          case 35:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<35>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<35>(filename,cache);
              break;
          case 36:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<36>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<36>(filename,cache);
              break;
          case 37:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<37>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<37>(filename,cache);
              break;
          case 38:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<38>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<38>(filename,cache);
              break;
          case 39:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<39>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<39>(filename,cache);
              break;
          case 40:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<40>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<40>(filename,cache);
              break;
          case 41:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<41>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<41>(filename,cache);
              break;
          case 42:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<42>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<42>(filename,cache);
              break;
          case 43:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<43>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<43>(filename,cache);
              break;
          case 44:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<44>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<44>(filename,cache);
              break;
          case 45:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<45>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<45>(filename,cache);
              break;
          case 46:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<46>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<46>(filename,cache);
              break;
          case 47:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<47>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<47>(filename,cache);
              break;
          case 48:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<48>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<48>(filename,cache);
              break;
          case 49:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<49>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<49>(filename,cache);
              break;
          case 50:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<50>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<50>(filename,cache);
              break;
          case 51:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<51>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<51>(filename,cache);
              break;
          case 52:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<52>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<52>(filename,cache);
              break;
          case 53:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<53>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<53>(filename,cache);
              break;
          case 54:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<54>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<54>(filename,cache);
              break;
          case 55:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<55>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<55>(filename,cache);
              break;
          case 56:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<56>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<56>(filename,cache);
              break;
          case 57:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<57>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<57>(filename,cache);
              break;
          case 58:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<58>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<58>(filename,cache);
              break;
          case 59:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<59>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<59>(filename,cache);
              break;
          case 60:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<60>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<60>(filename,cache);
              break;
          case 61:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<61>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<61>(filename,cache);
              break;
          case 62:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<62>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<62>(filename,cache);
              break;
          case 63:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<63>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<63>(filename,cache);
              break;
          case 64:
-             qf=new  onDiskMQF_Namespace::_onDiskMQF<64>(filename);
+             qf=new  onDiskMQF_Namespace::_onDiskMQF<64>(filename,cache);
              break;
 
      }
@@ -2438,9 +2849,8 @@ bool _onDiskMQF<bitsPerSlot>::remove(uint64_t hash, uint64_t count , bool lock,
  }
 
 template<uint64_t bitsPerSlot>
-_onDiskMQF<bitsPerSlot>::_onDiskMQF( uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size ,const char * path)
+_onDiskMQF<bitsPerSlot>::_onDiskMQF( uint64_t nslots, uint64_t key_bits, uint64_t label_bits,uint64_t fixed_counter_size ,const char * path, pageCache* cache)
 {
-	initializeDisk();
     using stxxl::file;
 	//qf=(QF*)calloc(sizeof(QF),1);
 	uint64_t num_slots, xnslots, nblocks;
@@ -2505,9 +2915,20 @@ _onDiskMQF<bitsPerSlot>::_onDiskMQF( uint64_t nslots, uint64_t key_bits, uint64_
 	mem->general_lock = 0;
 	mem->locks = (volatile int *)calloc(metadata->num_locks,
 																					sizeof(volatile int));
-    file::unlink(path); // delete output file
-	OutputFile=new stxxl::syscall_file(path, file::RDWR | file::CREAT | file::DIRECT );
-	blocks=new stxxlVector (OutputFile, metadata->nblocks,stxxlBufferSize/16);
+	pinDepth=0;
+	npinnedGroups=0;
+	pages=NULL;
+	if(cache==NULL)
+		open_stxxl(path,true);
+	else{
+		pagesFd=open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+		if (pagesFd < 0) {
+			perror("Couldn't open file:\n");
+			exit(EXIT_FAILURE);
+		}
+		open_pages(cache);
+	}
+	unpin_all();
 
 
 
@@ -2703,7 +3124,10 @@ void _onDiskMQF<bitsPerSlot>::serialize()
 	/* we don't serialize the locks */
 	//fwrite(qf->blocks, qf->metadata->size, 1, fout);
 	fclose(fout);
-    blocks->flush();
+	if(pages!=NULL)
+		pages->flush(pagesFileId);
+	else
+		blocks->flush();
 	if(qf->metadata->labels_map!=NULL)
 	{
 		string labelsMapOutName=string(filename)+".labels_map";
@@ -2713,10 +3137,9 @@ void _onDiskMQF<bitsPerSlot>::serialize()
 
 
 template<uint64_t bitsPerSlot>
-_onDiskMQF<bitsPerSlot>::_onDiskMQF(const char *filename)
+_onDiskMQF<bitsPerSlot>::_onDiskMQF(const char *filename, pageCache* cache)
 {
 	using stxxl::file;
-	initializeDisk();
 
 	FILE *fin;
 	string metadataFile=string(filename)+".ondisk.metadata";
@@ -2742,8 +3165,21 @@ _onDiskMQF<bitsPerSlot>::_onDiskMQF(const char *filename)
 	stxxlBufferSize= (uint64_t)((double)(size)*0.2/(1024.0*1024.0));
 	stxxlBufferSize=max(stxxlBufferSize,(uint64_t)16);
 
-	OutputFile= new stxxl::syscall_file(filename, file::RDWR  | file::DIRECT );
-	blocks=new stxxlVector (OutputFile, metadata->nblocks,stxxlBufferSize/16);
+	this->filename=filename;
+	pinDepth=0;
+	npinnedGroups=0;
+	pages=NULL;
+	if(cache==NULL)
+		open_stxxl(filename,false);
+	else{
+		pagesFd=open(filename, O_RDWR);
+		if (pagesFd < 0) {
+			perror("Couldn't open file:\n");
+			exit(EXIT_FAILURE);
+		}
+		open_pages(cache);
+	}
+	unpin_all();
     //blocks=stxxlVector (&OutputFile);
 
 	//qf->blocks = (qfblock *)calloc(qf->metadata->size, 1);
@@ -2760,6 +3196,7 @@ _onDiskMQF<bitsPerSlot>::_onDiskMQF(const char *filename)
 template<uint64_t bitsPerSlot>
 uint64_t _onDiskMQF<bitsPerSlot>::add_label(uint64_t key, uint64_t label, bool lock, bool spin)
 {
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	if(qf->metadata->label_bits==0){
 		return 0;
@@ -2812,6 +3249,7 @@ uint64_t _onDiskMQF<bitsPerSlot>::add_label(uint64_t key, uint64_t label, bool l
 template<uint64_t bitsPerSlot>
 uint64_t _onDiskMQF<bitsPerSlot>::remove_label(uint64_t key ,bool lock, bool spin)
 {
+	pinScope scope(this);
 _onDiskMQF<bitsPerSlot>* qf=this;
 	if(qf->metadata->label_bits==0){
 		return 0;
@@ -2860,6 +3298,7 @@ _onDiskMQF<bitsPerSlot>* qf=this;
 template<uint64_t bitsPerSlot>
 uint64_t _onDiskMQF<bitsPerSlot>::get_label(uint64_t key)
 {
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	if(qf->metadata->label_bits==0){
 		return 0;
@@ -2898,10 +3337,12 @@ template<uint64_t bitsPerSlot>
 bool _onDiskMQF<bitsPerSlot>::insert(uint64_t key, uint64_t count, bool
 							 lock, bool spin)
 {
+	pinScope scope(this);
 	if(count==0)
 	{
 		return true;
 	}
+	summaryAdd(key);
 	/*uint64_t hash = (key << qf->metadata->label_bits) | (value & BITMASK(qf->metadata->label_bits));*/
 	if (count == 1)
 	 return insert1( key, lock, spin);
@@ -2912,13 +3353,24 @@ bool _onDiskMQF<bitsPerSlot>::insert(uint64_t key, uint64_t count, bool
 template<uint64_t bitsPerSlot>
 uint64_t _onDiskMQF<bitsPerSlot>::count_key(uint64_t key)
 {
+	if(!summary.empty()){
+		if(!summaryHas(key)){
+			summaryStats.negatives++;
+			return 0;
+		}
+		summaryStats.probes++;
+	}
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	__uint128_t hash = key;
 	uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
 	int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
 
-	if (!is_occupied( hash_bucket_index))
+	if (!is_occupied( hash_bucket_index)){
+		if(!summary.empty())
+			summaryStats.falsePositives++;
 		return 0;
+	}
 
 	int64_t runstart_index = hash_bucket_index == 0 ? 0 : run_end(
 																																hash_bucket_index-1)
@@ -2938,12 +3390,15 @@ uint64_t _onDiskMQF<bitsPerSlot>::count_key(uint64_t key)
 
 		runstart_index = current_end + 1;
 	} while (!is_runend( current_end));
+	if(!summary.empty())
+		summaryStats.falsePositives++;
 	return 0;
 }
 
 template<uint64_t bitsPerSlot>
 bool _onDiskMQF<bitsPerSlot>::findIterator(onDiskMQFIterator  *qfi, uint64_t key)
 {
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 		 __uint128_t hash = key;
 		 uint64_t hash_remainder   = hash & BITMASK(qf->metadata->key_remainder_bits);
@@ -2991,17 +3446,18 @@ bool _onDiskMQF<bitsPerSlot>::findIterator(onDiskMQFIterator  *qfi, uint64_t key
 template<uint64_t bitsPerSlot>
 bool _onDiskMQF<bitsPerSlot>::getIterator(onDiskMQFIterator *qfi, uint64_t position)
 {
+	pinScope scope(this);
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	if(position > qf->metadata->xnslots){
 		throw std::out_of_range("onDiskMQF_iterator is called with position out of range");
 	}
 	if (!is_occupied( position)) {
-		uint64_t block_index = position;
-		uint64_t idx = bitselect(qf->get_block( block_index)->occupieds[0], 0);
+		uint64_t block_index = position/SLOTS_PER_BLOCK;
+		uint64_t idx = bitselect(qf->get_block_const( block_index)->occupieds[0], 0);
 		if (idx == 64) {
-			while(idx == 64 && block_index < qf->metadata->nblocks) {
+			while(idx == 64 && block_index + 1 < qf->metadata->nblocks) {
 				block_index++;
-				idx = bitselect(qf->get_block( block_index)->occupieds[0], 0);
+				idx = bitselect(qf->get_block_const( block_index)->occupieds[0], 0);
 			}
 		}
 		position = block_index * SLOTS_PER_BLOCK + idx;
@@ -3024,6 +3480,7 @@ bool _onDiskMQF<bitsPerSlot>::getIterator(onDiskMQFIterator *qfi, uint64_t posit
 template<uint64_t bitsPerSlot>
 bool _onDiskMQF<bitsPerSlot>::getForIterator(onDiskMQFIterator* qfi,uint64_t *key, uint64_t *value, uint64_t *count)
 {
+	pinScope scope(this);
 	if(qfi->current > metadata->xnslots){
 		throw std::out_of_range("onDiskMQFIterator_get is called with hash index out of range");
 	}
@@ -3046,6 +3503,7 @@ int onDiskMQFIterator::next()
 template<uint64_t bitsPerSlot>
 int _onDiskMQF<bitsPerSlot>::nextForIterator(onDiskMQFIterator *qfi)
 {
+	pinScope scope(this);
 	if (qfi->end())
 		return 1;
 	else {
@@ -3064,15 +3522,17 @@ int _onDiskMQF<bitsPerSlot>::nextForIterator(onDiskMQFIterator *qfi)
 		else {
 
 			uint64_t block_index = qfi->run / SLOTS_PER_BLOCK;
-			uint64_t rank = bitrank(get_block(block_index)->occupieds[0],
+			uint64_t rank = bitrank(get_block_const(block_index)->occupieds[0],
 															qfi->run % SLOTS_PER_BLOCK);
-			uint64_t next_run = bitselect(get_block(block_index)->occupieds[0],
+			uint64_t next_run = bitselect(get_block_const(block_index)->occupieds[0],
 																		rank);
 			if (next_run == 64) {
 				rank = 0;
-				while (next_run == 64 && block_index < qfi->qf->metadata->nblocks) {
+				while (next_run == 64) {
 					block_index++;
-					next_run = bitselect(get_block(block_index)->occupieds[0],
+					if (block_index == qfi->qf->metadata->nblocks)
+						break;
+					next_run = bitselect(get_block_const(block_index)->occupieds[0],
 															 rank);
 				}
 			}
@@ -3704,36 +4164,467 @@ void _onDiskMQF<bitsPerSlot>::general_unlock(){
 	_onDiskMQF<bitsPerSlot>* qf=this;
 	onDiskMQF_spin_unlock(&qf->mem->general_lock);
 }
- void onDiskMQF::migrate(onDiskMQF* dest){
- 	onDiskMQFIterator source_i;
- 	if (getIterator(&source_i, 0)) {
- 		do {
- 			uint64_t key = 0, value = 0, count = 0;
- 			source_i.get(&key, &value, &count);
- 			dest->insert(key, count, true, true);
- 			dest->add_label(key,value);
- 		} while (!source_i.next());
- 	}
- }
+void onDiskMQF::enableSummary(uint64_t bitsPerSlot)
+{
+	if(bitsPerSlot!=0 && __builtin_popcountll(bitsPerSlot)!=1)
+		throw std::domain_error("Bits per slot of the summary must be 0 or a power of 2");
+	disableSummary();
+	if(bitsPerSlot==0)
+		return;
+	uint64_t key_bits=metadata->key_bits;
+	uint64_t bits=(uint64_t)log2((double)metadata->nslots*bitsPerSlot);
+	summaryShift= key_bits>bits ? key_bits-bits : 0;
+	summaryMask=BITMASK(key_bits);
+	summaryBitsPerSlot=bitsPerSlot;
+	std::vector<uint64_t> newSummary(((1ULL<<(key_bits-summaryShift))+63)/64,0);
+	for(onDiskMQFScanner it(this);!it.end();it.next()){
+		uint64_t i=summaryIndex(it.get().key);
+		newSummary[i/64]|=1ULL<<(i%64);
+	}
+	summary.swap(newSummary);
+}
+
+void onDiskMQF::disableSummary()
+{
+	std::vector<uint64_t>().swap(summary);
+	summaryShift=0;
+	summaryBitsPerSlot=0;
+}
+
+void onDiskMQF::migrate(onDiskMQF* dest, uint64_t nthreads, onDiskMQFProgress progress){
+	onDiskMQF* source=this;
+	dest->migrateFromDisk(&source,1,nthreads,progress);
+}
 
+/* The sources and the disk filter are all iterated in key order, so they are
+ * merged into a new file that is written front to back and then replaces the
+ * current one. The cost is one sequential pass over the disk filter instead
+ * of an insert, with its shifting, per item of the sources. The current file
+ * is left untouched if the merged filter does not fit.
+ */
 template<uint64_t bitsPerSlot>
-void onDiskMQF_Namespace::_onDiskMQF<bitsPerSlot>::migrateFromQF(QF* source){
-    if(source->metadata->noccupied_slots+ metadata->noccupied_slots >=
+void onDiskMQF_Namespace::_onDiskMQF<bitsPerSlot>::migrateFromQF(QF** sources, int nsources, const onDiskMQFLabels* labels){
+	pinScope scope(this);
+	uint64_t noccupied_slots=0;
+	for(int i=0;i<nsources;i++)
+		noccupied_slots+=sources[i]->metadata->noccupied_slots;
+    if(noccupied_slots+ metadata->noccupied_slots >=
        metadata->maximum_occupied_slots)
     {
         throw std::overflow_error("Buffered QF is 95% full, cannot insert more items.");
     }
-	QFi source_i;
-	if (qf_iterator(source, &source_i, 0)) {
-		do {
-			uint64_t key = 0, value = 0, count = 0;
-			qfi_get(&source_i, &key, &value, &count);
-			insert(key, count, true, true);
-			add_label(key,value);
-		} while (!qfi_next(&source_i));
+	// the sources with items left, smallest key and then smallest index first
+	typedef std::pair<uint64_t,int> sourceHead;
+	std::priority_queue<sourceHead,std::vector<sourceHead>,std::greater<sourceHead> > heads;
+	std::vector<QFi> source_i(nsources);
+	for(int i=0;i<nsources;i++){
+		if(qf_iterator(sources[i], &source_i[i], 0)){
+			uint64_t key, label, count;
+			qfi_get(&source_i[i], &key, &label, &count);
+			heads.push(sourceHead(key,i));
+		}
+	}
+	uint64_t nlabels= labels==NULL ? 0 : labels->size();
+	if(heads.empty() && nlabels==0)
+		return;
+	// a label update costs a write in place like an insert without shifting
+	if((noccupied_slots+nlabels)*MERGE_REWRITE_RATIO < metadata->noccupied_slots){
+		for(;!heads.empty();heads.pop()){
+			QFi* it=&source_i[heads.top().second];
+			do {
+				uint64_t key = 0, value = 0, count = 0;
+				qfi_get(it, &key, &value, &count);
+				insert(key, count, true, true);
+				if(value!=0)
+					add_label(key,value);
+			} while (!qfi_next(it));
+		}
+		for(uint64_t i=0;i<nlabels;i++)
+			add_label((*labels)[i].first,(*labels)[i].second);
+		return;
+	}
+	uint64_t nextLabel=0;
+	auto updateLabel=[&](uint64_t key, uint64_t* label){
+		while(nextLabel<nlabels && (*labels)[nextLabel].first<key)
+			nextLabel++;
+		if(nextLabel<nlabels && (*labels)[nextLabel].first==key)
+			*label=(*labels)[nextLabel].second;
+	};
+	onDiskMQFCursor disk_i;
+	onDiskMQFItem diskItem;
+	bool diskValid=next_merge_item(&disk_i, &diskItem.key, &diskItem.label, &diskItem.count);
+	rewrite([&](uint64_t* key,uint64_t* label,uint64_t* count){
+		if(heads.empty() && !diskValid)
+			return false;
+		if(heads.empty() || (diskValid && diskItem.key<heads.top().first)){
+			*key=diskItem.key;
+			*label=diskItem.label;
+			*count=diskItem.count;
+			diskValid=next_merge_item(&disk_i, &diskItem.key, &diskItem.label, &diskItem.count);
+			updateLabel(*key,label);
+			return true;
+		}
+		*key=heads.top().first;
+		*label=0;
+		*count=0;
+		while(!heads.empty() && heads.top().first==*key){
+			QFi* it=&source_i[heads.top().second];
+			uint64_t sourceKey, sourceLabel, sourceCount;
+			qfi_get(it, &sourceKey, &sourceLabel, &sourceCount);
+			if(*label==0)
+				*label=sourceLabel;
+			*count+=sourceCount;
+			sourceHead head=heads.top();
+			heads.pop();
+			if(!qfi_next(it)){
+				qfi_get(it, &sourceKey, &sourceLabel, &sourceCount);
+				heads.push(sourceHead(sourceKey,head.second));
+			}
+		}
+		if(diskValid && diskItem.key==*key){
+			*count+=diskItem.count;
+			if(*label==0)
+				*label=diskItem.label;
+			diskValid=next_merge_item(&disk_i, &diskItem.key, &diskItem.label, &diskItem.count);
+		}
+		updateLabel(*key,label);
+		return true;
+	});
+}
+
+/* Merge of the on disk sources with the current items. The number of sources
+ * is small, so the smallest key is found by comparing all of them. */
+template<uint64_t bitsPerSlot>
+void onDiskMQF_Namespace::_onDiskMQF<bitsPerSlot>::migrateFromDisk(onDiskMQF** sources, int nsources,
+	uint64_t nthreads, onDiskMQFProgress progress){
+	pinScope scope(this);
+	uint64_t noccupied_slots=0;
+	uint64_t totalItems=metadata->ndistinct_elts;
+	for(int i=0;i<nsources;i++){
+		if(sources[i]->metadata->key_bits!=metadata->key_bits)
+			throw std::domain_error("Filters with different key bits can't be merged");
+		if(sources[i]==this)
+			throw std::logic_error("A filter can't be merged with itself");
+		noccupied_slots+=sources[i]->metadata->noccupied_slots;
+		totalItems+=sources[i]->metadata->ndistinct_elts;
+	}
+	if(noccupied_slots+ metadata->noccupied_slots >= metadata->maximum_occupied_slots)
+	{
+		throw std::overflow_error("Buffered QF is 95% full, cannot insert more items.");
+	}
+	std::vector<onDiskMQFScanner*> scanners;
+	for(int i=0;i<nsources;i++)
+		scanners.push_back(new onDiskMQFScanner(sources[i],MIGRATE_RANGE_ITEMS));
+	try{
+		if(noccupied_slots*MERGE_REWRITE_RATIO < metadata->noccupied_slots){
+			onDiskMQFMigrateProgress state={0,totalItems,0,0};
+			for(int i=0;i<nsources;i++){
+				for(;!scanners[i]->end();scanners[i]->next()){
+					const onDiskMQFItem& item=scanners[i]->get();
+					insert(item.key, item.count, true, true);
+					if(item.label!=0)
+						add_label(item.key,item.label);
+					state.itemsRead++;
+					state.itemsWritten++;
+				}
+			}
+			state.slotsWritten=metadata->noccupied_slots;
+			if(progress)
+				progress(state);
+		}
+		else{
+			onDiskMQFCursor disk_i;
+			onDiskMQFItem diskItem;
+			uint64_t itemsRead=0;
+			bool diskValid=next_merge_item(&disk_i, &diskItem.key, &diskItem.label, &diskItem.count);
+			rewrite_pipelined([&](uint64_t* key,uint64_t* label,uint64_t* count){
+				int first=-1;
+				for(int i=0;i<nsources;i++)
+					if(!scanners[i]->end() && (first==-1 || scanners[i]->get().key<*key)){
+						first=i;
+						*key=scanners[i]->get().key;
+					}
+				if(first==-1 && !diskValid)
+					return false;
+				if(first==-1 || (diskValid && diskItem.key<*key)){
+					*key=diskItem.key;
+					*label=diskItem.label;
+					*count=diskItem.count;
+					diskValid=next_merge_item(&disk_i, &diskItem.key, &diskItem.label, &diskItem.count);
+					itemsRead++;
+					return true;
+				}
+				*label=0;
+				*count=0;
+				for(int i=first;i<nsources;i++)
+					if(!scanners[i]->end() && scanners[i]->get().key==*key){
+						if(*label==0)
+							*label=scanners[i]->get().label;
+						*count+=scanners[i]->get().count;
+						scanners[i]->next();
+						itemsRead++;
+					}
+				if(diskValid && diskItem.key==*key){
+					*count+=diskItem.count;
+					if(*label==0)
+						*label=diskItem.label;
+					diskValid=next_merge_item(&disk_i, &diskItem.key, &diskItem.label, &diskItem.count);
+					itemsRead++;
+				}
+				return true;
+			}, &itemsRead, totalItems, nthreads, progress);
+		}
+	}
+	catch(std::exception& e){
+		for(int i=0;i<nsources;i++)
+			delete scanners[i];
+		throw;
+	}
+	for(int i=0;i<nsources;i++)
+		delete scanners[i];
+}
+
+/* Write the items returned by next, which come in key order, to a new file
+ * and replace the current one with it. next(&key,&label,&count) returns false
+ * after the last item.
+ */
+template<uint64_t bitsPerSlot>
+template<class itemSource>
+void onDiskMQF_Namespace::_onDiskMQF<bitsPerSlot>::rewrite(itemSource next){
+	mergeWriter merged(this);
+	try{
+		uint64_t key, label, count, slots[67];
+		while(next(&key, &label, &count)){
+			uint64_t n=encode_item(key,label,count,slots);
+			if(n>0)
+				merged.add(key,slots,n);
+		}
+		merged.finish();
+	}
+	catch(std::exception& e){
+		merged.abort();
+		throw;
+	}
+	replace_file(merged);
+}
+
+/* Consecutive keys of rewrite_pipelined, and the slots of their items once
+ * the range is encoded. */
+typedef struct mergeRange {
+	std::vector<onDiskMQFItem> items;
+	std::vector<uint64_t> slots;
+	std::vector<uint8_t> lengths;
+	/* items read by the merge when the range was complete */
+	uint64_t itemsRead;
+	bool encoded;
+} mergeRange;
+
+/* Same as rewrite, as a pipeline of three stages. A reader thread calls next
+ * and cuts the merged items into ranges of MIGRATE_RANGE_ITEMS keys, so the
+ * sources are read ahead of the writes. nthreads threads encode the ranges
+ * in any order, and the calling thread places them in the merged file in key
+ * order, since where an item goes depends on the items before it. At most
+ * MIGRATE_READ_AHEAD*nthreads ranges are in memory.
+ */
+template<uint64_t bitsPerSlot>
+template<class itemSource>
+void onDiskMQF_Namespace::_onDiskMQF<bitsPerSlot>::rewrite_pipelined(itemSource next,
+	const uint64_t* itemsRead, uint64_t totalItems, uint64_t nthreads, onDiskMQFProgress progress){
+	nthreads=std::max(nthreads,(uint64_t)1);
+	const uint64_t maxRanges=MIGRATE_READ_AHEAD*nthreads;
+	std::mutex lock;
+	std::condition_variable changed;
+	// ranges read and not written yet, in key order. ranges[i] is range number nwritten+i
+	std::deque<mergeRange*> ranges;
+	uint64_t nwritten=0, nclaimed=0, nread=0;
+	bool readDone=false, stopped=false;
+	std::exception_ptr readError;
+
+	std::thread reader([&](){
+		try{
+			bool more=true;
+			while(more){
+				mergeRange* range=new mergeRange();
+				range->items.reserve(MIGRATE_RANGE_ITEMS);
+				onDiskMQFItem item;
+				while(range->items.size()<MIGRATE_RANGE_ITEMS &&
+						(more=next(&item.key,&item.label,&item.count)))
+					range->items.push_back(item);
+				if(range->items.empty()){
+					delete range;
+					break;
+				}
+				range->itemsRead=*itemsRead;
+				range->encoded=false;
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard,[&](){ return ranges.size()<maxRanges || stopped; });
+				if(stopped){
+					delete range;
+					return;
+				}
+				ranges.push_back(range);
+				nread++;
+				changed.notify_all();
+			}
+		}
+		catch(...){
+			std::lock_guard<std::mutex> guard(lock);
+			readError=std::current_exception();
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		readDone=true;
+		changed.notify_all();
+	});
+	std::vector<std::thread> encoders;
+	for(uint64_t t=0;t<nthreads;t++)
+		encoders.push_back(std::thread([&](){
+			uint64_t slots[67];
+			while(true){
+				mergeRange* range;
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					changed.wait(guard,[&](){ return nclaimed<nread || readDone || stopped; });
+					if(stopped || nclaimed==nread)
+						return;
+					range=ranges[nclaimed-nwritten];
+					nclaimed++;
+				}
+				range->slots.reserve(range->items.size());
+				range->lengths.resize(range->items.size());
+				for(uint64_t i=0;i<range->items.size();i++){
+					const onDiskMQFItem& item=range->items[i];
+					uint64_t n=encode_item(item.key,item.label,item.count,slots);
+					range->lengths[i]=(uint8_t)n;
+					range->slots.insert(range->slots.end(),slots,slots+n);
+				}
+				std::lock_guard<std::mutex> guard(lock);
+				range->encoded=true;
+				changed.notify_all();
+			}
+		}));
+	auto stop=[&](){
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopped=true;
+			changed.notify_all();
+		}
+		reader.join();
+		for(uint64_t t=0;t<nthreads;t++)
+			encoders[t].join();
+		for(uint64_t i=0;i<ranges.size();i++)
+			delete ranges[i];
+		ranges.clear();
+	};
+
+	mergeWriter merged(this);
+	onDiskMQFMigrateProgress state={0,totalItems,0,0};
+	try{
+		while(true){
+			mergeRange* range;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait(guard,[&](){
+					return (!ranges.empty() && ranges.front()->encoded) ||
+						(readDone && ranges.empty()); });
+				if(ranges.empty())
+					break;
+				range=ranges.front();
+				ranges.pop_front();
+				nwritten++;
+				changed.notify_all();
+			}
+			const uint64_t* slots=range->slots.data();
+			for(uint64_t i=0;i<range->items.size();i++){
+				if(range->lengths[i]>0)
+					merged.add(range->items[i].key,slots,range->lengths[i]);
+				slots+=range->lengths[i];
+			}
+			state.itemsRead=range->itemsRead;
+			state.itemsWritten=merged.ndistinct_elts;
+			state.slotsWritten=merged.noccupied_slots;
+			delete range;
+			if(progress)
+				progress(state);
+		}
+		if(readError)
+			std::rethrow_exception(readError);
+		merged.finish();
+	}
+	catch(...){
+		stop();
+		merged.abort();
+		throw;
+	}
+	stop();
+	replace_file(merged);
+	if(progress)
+		progress(state);
+}
+
+/* Swap the merged file in. The pages of the old file are not needed anymore.
+ * The old file is renamed over before its backend is closed, so a failed
+ * rename leaves the filter as it was and only drops the merged file. */
+template<uint64_t bitsPerSlot>
+void onDiskMQF_Namespace::_onDiskMQF<bitsPerSlot>::replace_file(mergeWriter& merged){
+	int fd=merged.fd;
+	if(rename(merged.filename.c_str(),filename.c_str())<0){
+		string message=strerror(errno);
+		merged.abort();
+		throw std::runtime_error("Couldn't replace the filter file " + filename + ": " + message);
 	}
+	// the old backend still has the old file open, its writes do not reach the new one
+	unpin_all();
+	if(pages!=NULL){
+		pages->removeFile(pagesFileId,false);
+		close(pagesFd);
+	}
+	else{
+		delete blocks;
+		delete OutputFile;
+		close(fd);
+	}
+	if(pages!=NULL){
+		pagesFd=fd;
+		open_pages(pages);
+	}
+	else
+		open_stxxl(filename.c_str(),false);
+	metadata->noccupied_slots=merged.noccupied_slots;
+	metadata->ndistinct_elts=merged.ndistinct_elts;
+	summary.swap(merged.summary);
+}
+
+template<uint64_t bitsPerSlot>
+uint64_t onDiskMQF_Namespace::_onDiskMQF<bitsPerSlot>::scan(onDiskMQFCursor* cursor, onDiskMQFItem* items, uint64_t n){
+	pinScope scope(this);
+	uint64_t i=0;
+	while(i<n && next_merge_item(cursor, &items[i].key, &items[i].label, &items[i].count))
+		i++;
+	return i;
+}
+
+onDiskMQFScanner::onDiskMQFScanner(onDiskMQF* qf, uint64_t batchSize):
+	qf(qf),batch(batchSize),nitems(0),pos(0){
+	fill();
+}
+
+void onDiskMQFScanner::fill(){
+	nitems=qf->scan(&cursor,&batch[0],batch.size());
+	pos=0;
+}
+
+bool onDiskMQFScanner::end(){
+	return pos==nitems;
 }
 
+const onDiskMQFItem& onDiskMQFScanner::get(){
+	return batch[pos];
+}
+
+void onDiskMQFScanner::next(){
+	if(++pos==nitems && nitems==batch.size())
+		fill();
+}
 };
 
 
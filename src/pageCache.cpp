@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdexcept>
+#include <algorithm>
+#include "pageCache.h"
+
+namespace onDiskMQF_Namespace{
+
+#define PAGE_KEY(fileId,pageNo) ((((uint64_t)(fileId))<<48) | (pageNo))
+#define MIN_SHARD_BUDGET (1ULL<<20)
+
+pageCache::pageCache(uint64_t memoryBudget, uint64_t nshards)
+{
+	this->memoryBudget=memoryBudget;
+	nshards=std::min(nshards,(uint64_t)(memoryBudget/MIN_SHARD_BUDGET));
+	if(nshards==0)
+		nshards=1;
+	this->nshards=nshards;
+	shards=new shard[nshards];
+	for(uint64_t i=0;i<nshards;i++){
+		shards[i].hand=0;
+		shards[i].bytesCached=0;
+		shards[i].budget=memoryBudget/nshards;
+		memset(&shards[i].stats,0,sizeof(pageCacheStats));
+	}
+}
+
+pageCache::~pageCache()
+{
+	flush();
+	for(uint64_t i=0;i<nshards;i++)
+		for(uint64_t j=0;j<shards[i].frames.size();j++)
+			free(shards[i].frames[j].data);
+	delete[] shards;
+}
+
+uint64_t pageCache::maxPageSize()
+{
+	return std::max(memoryBudget/nshards/8,(uint64_t)1);
+}
+
+int pageCache::addFile(int fd, uint64_t pageSize, uint64_t fileSize)
+{
+	if(pageSize>memoryBudget/nshards){
+		throw std::overflow_error("pageCache: page size is larger than the memory of a shard");
+	}
+	std::lock_guard<std::mutex> guard(filesLock);
+	cachedFile file;
+	file.fd=fd;
+	file.pageSize=pageSize;
+	file.fileSize=fileSize;
+	files.push_back(file);
+	return (int)files.size()-1;
+}
+
+pageCache::cachedFile pageCache::getFile(int fileId)
+{
+	std::lock_guard<std::mutex> guard(filesLock);
+	return files[fileId];
+}
+
+pageCache::shard* pageCache::getShard(int fileId, uint64_t pageNo)
+{
+	uint64_t h=PAGE_KEY(fileId,pageNo)*0x9E3779B97F4A7C15ULL;
+	return &shards[(h>>32)%nshards];
+}
+
+void pageCache::writeBack(shard* s, frame* f)
+{
+	if(!f->dirty)
+		return;
+	cachedFile file=getFile(f->fileId);
+	uint64_t offset=f->pageNo*file.pageSize;
+	uint64_t n=offset<file.fileSize ? std::min(f->size,file.fileSize-offset) : 0;
+	uint64_t written=0;
+	while(written<n){
+		ssize_t r=pwrite(file.fd,f->data+written,n-written,offset+written);
+		if(r<0){
+			if(errno==EINTR)
+				continue;
+			throw std::runtime_error("pageCache: pwrite failed");
+		}
+		written+=r;
+	}
+	s->stats.bytesWritten+=written;
+	f->dirty=false;
+}
+
+/* Evict unpinned pages with CLOCK until size more bytes fit in the shard
+ * budget, and return the index of a free frame. A victim of the same size
+ * hands its buffer to the new page. */
+uint64_t pageCache::evict(shard* s, uint64_t size)
+{
+	uint64_t reused=~0ULL;
+	uint64_t scanned=0;
+	while(s->bytesCached+size>s->budget){
+		if(scanned>2*s->frames.size()){
+			throw std::overflow_error("pageCache: memory budget is too small for the pinned pages");
+		}
+		if(s->hand>=s->frames.size())
+			s->hand=0;
+		frame* f=&s->frames[s->hand];
+		scanned++;
+		if(f->fileId>=0 && f->pinCount==0){
+			if(f->referenced)
+				f->referenced=false;
+			else{
+				writeBack(s,f);
+				s->index.erase(PAGE_KEY(f->fileId,f->pageNo));
+				s->bytesCached-=f->size;
+				s->stats.evictions++;
+				f->fileId=-1;
+				if(reused==~0ULL && f->size==size)
+					reused=s->hand;
+				else{
+					free(f->data);
+					f->data=NULL;
+					s->freeFrames.push_back(s->hand);
+				}
+			}
+		}
+		s->hand++;
+	}
+	uint64_t idx;
+	if(reused!=~0ULL)
+		idx=reused;
+	else if(!s->freeFrames.empty()){
+		idx=s->freeFrames.back();
+		s->freeFrames.pop_back();
+	}
+	else{
+		frame f;
+		f.fileId=-1;
+		f.data=NULL;
+		f.size=0;
+		s->frames.push_back(f);
+		idx=s->frames.size()-1;
+	}
+	if(s->frames[idx].data==NULL){
+		s->frames[idx].data=(char*)malloc(size);
+		s->frames[idx].size=size;
+	}
+	s->bytesCached+=size;
+	return idx;
+}
+
+char* pageCache::pin(int fileId, uint64_t pageNo, bool dirty)
+{
+	shard* s=getShard(fileId,pageNo);
+	std::lock_guard<std::mutex> guard(s->lock);
+	uint64_t key=PAGE_KEY(fileId,pageNo);
+	std::unordered_map<uint64_t, uint64_t>::iterator it=s->index.find(key);
+	frame* f;
+	if(it!=s->index.end()){
+		f=&s->frames[it->second];
+		s->stats.hits++;
+	}
+	else{
+		cachedFile file=getFile(fileId);
+		uint64_t idx=evict(s,file.pageSize);
+		f=&s->frames[idx];
+		f->fileId=fileId;
+		f->pageNo=pageNo;
+		f->pinCount=0;
+		f->dirty=false;
+		uint64_t offset=pageNo*file.pageSize;
+		uint64_t n=offset<file.fileSize ? std::min(file.pageSize,file.fileSize-offset) : 0;
+		uint64_t nread=0;
+		while(nread<n){
+			ssize_t r=pread(file.fd,f->data+nread,n-nread,offset+nread);
+			if(r<0 && errno==EINTR)
+				continue;
+			if(r<0){
+				f->fileId=-1;
+				s->bytesCached-=f->size;
+				free(f->data);
+				f->data=NULL;
+				s->freeFrames.push_back(idx);
+				throw std::runtime_error("pageCache: pread failed");
+			}
+			if(r==0)
+				break;
+			nread+=r;
+		}
+		memset(f->data+nread,0,file.pageSize-nread);
+		s->index[key]=idx;
+		s->stats.misses++;
+		s->stats.bytesRead+=nread;
+	}
+	f->pinCount++;
+	f->referenced=true;
+	f->dirty|=dirty;
+	return f->data;
+}
+
+void pageCache::unpin(int fileId, uint64_t pageNo)
+{
+	shard* s=getShard(fileId,pageNo);
+	std::lock_guard<std::mutex> guard(s->lock);
+	std::unordered_map<uint64_t, uint64_t>::iterator it=s->index.find(PAGE_KEY(fileId,pageNo));
+	if(it==s->index.end()){
+		throw std::logic_error("pageCache: unpinning a page that is not cached");
+	}
+	frame* f=&s->frames[it->second];
+	if(f->pinCount>0)
+		f->pinCount--;
+}
+
+void pageCache::markDirty(int fileId, uint64_t pageNo)
+{
+	shard* s=getShard(fileId,pageNo);
+	std::lock_guard<std::mutex> guard(s->lock);
+	std::unordered_map<uint64_t, uint64_t>::iterator it=s->index.find(PAGE_KEY(fileId,pageNo));
+	if(it==s->index.end()){
+		throw std::logic_error("pageCache: marking a page that is not cached");
+	}
+	s->frames[it->second].dirty=true;
+}
+
+void pageCache::flush(int fileId)
+{
+	for(uint64_t i=0;i<nshards;i++){
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		for(uint64_t j=0;j<shards[i].frames.size();j++){
+			frame* f=&shards[i].frames[j];
+			if(f->fileId>=0 && (fileId<0 || f->fileId==fileId))
+				writeBack(&shards[i],f);
+		}
+	}
+}
+
+void pageCache::removeFile(int fileId, bool writeBack)
+{
+	for(uint64_t i=0;i<nshards;i++){
+		shard* s=&shards[i];
+		std::lock_guard<std::mutex> guard(s->lock);
+		for(uint64_t j=0;j<s->frames.size();j++){
+			frame* f=&s->frames[j];
+			if(f->fileId!=fileId)
+				continue;
+			if(writeBack)
+				this->writeBack(s,f);
+			s->index.erase(PAGE_KEY(f->fileId,f->pageNo));
+			s->bytesCached-=f->size;
+			f->fileId=-1;
+			free(f->data);
+			f->data=NULL;
+			s->freeFrames.push_back(j);
+		}
+	}
+	std::lock_guard<std::mutex> guard(filesLock);
+	files[fileId].fd=-1;
+}
+
+pageCacheStats pageCache::getStats()
+{
+	pageCacheStats res;
+	memset(&res,0,sizeof(pageCacheStats));
+	for(uint64_t i=0;i<nshards;i++){
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		res.hits+=shards[i].stats.hits;
+		res.misses+=shards[i].stats.misses;
+		res.evictions+=shards[i].stats.evictions;
+		res.bytesRead+=shards[i].stats.bytesRead;
+		res.bytesWritten+=shards[i].stats.bytesWritten;
+		res.bytesCached+=shards[i].bytesCached;
+	}
+	return res;
+}
+
+double pageCache::hitRate()
+{
+	pageCacheStats stats=getStats();
+	if(stats.hits+stats.misses==0)
+		return 0;
+	return (double)stats.hits/(double)(stats.hits+stats.misses);
+}
+
+void pageCache::resetStats()
+{
+	for(uint64_t i=0;i<nshards;i++){
+		std::lock_guard<std::mutex> guard(shards[i].lock);
+		memset(&shards[i].stats,0,sizeof(pageCacheStats));
+	}
+}
+
+}
@@ -4,6 +4,8 @@
 #include <vector>
 #include "utils.h"
 #include <limits>
+#include <algorithm>
+#include <stdexcept>
 #include "math.h"
 
 using namespace std;
@@ -62,13 +64,31 @@ std::map<uint64_t, std::vector<int> >* MQF::load_labels_map(const char * fileNam
 }
 
 
-uint64_t MQF::estimateMemory(uint64_t nslots, uint64_t slotSize, uint64_t fcounter, uint64_t tagSize) {
+uint64_t MQF::counterSlots(uint64_t count, uint64_t fixedSizeCounter, uint64_t slotSize) {
+  if (count == 0)
+    return 0;
+  if (fixedSizeCounter == 0)
+    return 1;
+  const uint64_t fixedMax = ((1ULL) << fixedSizeCounter) - 1;
+  count--;
+  if (count < fixedMax)
+    return 1;
+  count -= fixedMax;
+  uint64_t usedSlots = 1;
+  do {
+    usedSlots++;
+    count = slotSize >= 64 ? 0 : count >> slotSize;
+  } while (count > fixedMax - 1);
+  return usedSlots;
+}
+
+uint64_t MQF::estimateMemory(uint64_t nslots, uint64_t slotSize, uint64_t fcounter, uint64_t tagSize, uint64_t blockLabelSize) {
   uint64_t SLOTS_PER_BLOCK_t = 64;
   uint64_t xnslots = nslots + 10 * sqrt((double) nslots);
   uint64_t nblocks = (xnslots + SLOTS_PER_BLOCK_t - 1) / SLOTS_PER_BLOCK_t;
   uint64_t blocksize = 17;
 
-  return ((nblocks) * (blocksize + 8 * (slotSize + fcounter + tagSize))) / 1024;
+  return ((nblocks) * (blocksize + 8 * (slotSize + fcounter + tagSize) + blockLabelSize)) / 1024;
 
 }
 
@@ -78,19 +98,8 @@ bool MQF::isEnough(vector<uint64_t>& histogram, uint64_t noSlots, uint64_t fixed
   //     <<"slot size= "<<numHashBits<<endl;
 
   noSlots = (uint64_t) ((double) noSlots * 0.95);
-  for (uint64_t i = 1; i < 1000; i++) {
-    uint64_t usedSlots = 1;
-
-    if (i > ((1ULL) << fixedSizeCounter) - 1) {
-      uint64_t nSlots2 = 0;
-      __uint128_t capacity;
-      do {
-        nSlots2++;
-        capacity = ((__uint128_t) (1ULL) << (nSlots2 * slotSize + fixedSizeCounter)) - 1;
-        //  cout<<"slots num "<<nSlots2<<" "<<capacity<<endl;
-      } while ((__uint128_t) i > capacity);
-      usedSlots += nSlots2;
-    }
+  for (uint64_t i = 1; i < histogram.size(); i++) {
+    uint64_t usedSlots = counterSlots(i, fixedSizeCounter, slotSize);
     //cout<<"i= "<<i<<"->"<<usedSlots<<" * "<<histogram[i]<<endl;
     if (noSlots >= (usedSlots * histogram[i])) {
       noSlots -= (usedSlots * histogram[i]);
@@ -105,9 +114,12 @@ bool MQF::isEnough(vector<uint64_t>& histogram, uint64_t noSlots, uint64_t fixed
 }
 void MQF::estimateMemRequirement(vector<uint64_t>& histogram,
                             uint64_t numHashBits, uint64_t tagSize,
-                            uint64_t *res_noSlots, uint64_t *res_fixedSizeCounter, uint64_t *res_memory) {
+                            uint64_t *res_noSlots, uint64_t *res_fixedSizeCounter, uint64_t *res_memory,
+                            uint64_t blockLabelSize) {
   uint64_t noDistinctKmers = 0, totalNumKmers=0;
   *res_memory = numeric_limits<uint64_t>::max();
+  for (uint64_t i = 1; i < histogram.size(); i++)
+    noDistinctKmers += histogram[i];
   for (int i = 8; i < 64; i++) {
     uint64_t noSlots = (1ULL) << i;
     if (noSlots < noDistinctKmers)
@@ -116,7 +128,7 @@ void MQF::estimateMemRequirement(vector<uint64_t>& histogram,
     uint64_t slotSize = numHashBits - log2((double) noSlots);
     for (uint64_t fixedSizeCounter = 1; fixedSizeCounter < slotSize; fixedSizeCounter++) {
       if (isEnough(histogram, noSlots, fixedSizeCounter, slotSize)) {
-        uint64_t tmpMem = estimateMemory(noSlots, slotSize, fixedSizeCounter, tagSize);
+        uint64_t tmpMem = estimateMemory(noSlots, slotSize, fixedSizeCounter, tagSize, blockLabelSize);
         if (*res_memory > tmpMem) {
           *res_memory = tmpMem;
           *res_fixedSizeCounter = fixedSizeCounter;
@@ -138,3 +150,177 @@ void MQF::estimateMemRequirement(vector<uint64_t>& histogram,
 
 
 }
+
+/* murmur3 finalizer, the keys are not assumed to be well mixed */
+static inline uint64_t mixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+MQF::abundanceSketch::abundanceSketch(uint64_t hllBits, uint64_t maxSamples) {
+  if (hllBits < 4 || hllBits > 20)
+    throw std::domain_error("hllBits must be between 4 and 20");
+  this->hllBits = hllBits;
+  this->maxSamples = maxSamples;
+  samplingLevel = 0;
+  totalCount = 0;
+  registers.resize(1ULL << hllBits, 0);
+}
+
+void MQF::abundanceSketch::add(uint64_t hash, uint64_t count) {
+  if (count == 0)
+    return;
+  totalCount += count;
+  uint64_t h = mixHash(hash);
+  uint64_t index = h >> (64 - hllBits);
+  uint64_t rest = (h << hllBits) | ((1ULL) << (hllBits - 1));
+  uint8_t rank = __builtin_clzll(rest) + 1;
+  if (registers[index] < rank)
+    registers[index] = rank;
+
+  uint64_t sampleHash = mixHash(hash ^ 0x9e3779b97f4a7c15ULL);
+  if ((sampleHash & ((1ULL << samplingLevel) - 1)) != 0)
+    return;
+  samples[hash] += count;
+  if (samples.size() > maxSamples)
+    prune();
+}
+
+void MQF::abundanceSketch::prune() {
+  while (samples.size() > maxSamples && samplingLevel < 63) {
+    samplingLevel++;
+    uint64_t mask = ((1ULL) << samplingLevel) - 1;
+    for (auto it = samples.begin(); it != samples.end();) {
+      if ((mixHash(it->first ^ 0x9e3779b97f4a7c15ULL) & mask) != 0)
+        it = samples.erase(it);
+      else
+        it++;
+    }
+  }
+}
+
+void MQF::abundanceSketch::merge(const abundanceSketch &other) {
+  if (other.hllBits != hllBits)
+    throw std::logic_error("Merging sketches with different hllBits");
+  for (uint64_t i = 0; i < registers.size(); i++)
+    registers[i] = std::max(registers[i], other.registers[i]);
+  totalCount += other.totalCount;
+  uint64_t level = std::max(samplingLevel, other.samplingLevel);
+  uint64_t mask = ((1ULL) << level) - 1;
+  samplingLevel = level;
+  for (auto it = samples.begin(); it != samples.end();) {
+    if ((mixHash(it->first ^ 0x9e3779b97f4a7c15ULL) & mask) != 0)
+      it = samples.erase(it);
+    else
+      it++;
+  }
+  for (auto it = other.samples.begin(); it != other.samples.end(); it++)
+    if ((mixHash(it->first ^ 0x9e3779b97f4a7c15ULL) & mask) == 0)
+      samples[it->first] += it->second;
+  prune();
+}
+
+uint64_t MQF::abundanceSketch::distinct() const {
+  // the sample is exact as long as it was never pruned
+  if (samplingLevel == 0)
+    return samples.size();
+  double m = registers.size();
+  double sum = 0;
+  uint64_t zeros = 0;
+  for (uint64_t i = 0; i < registers.size(); i++) {
+    sum += ldexp(1.0, -registers[i]);
+    zeros += registers[i] == 0;
+  }
+  double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log(m / zeros);
+  return (uint64_t) estimate;
+}
+
+uint64_t MQF::abundanceSketch::total() const {
+  return totalCount;
+}
+
+map<uint64_t, uint64_t> MQF::abundanceSketch::abundances() const {
+  map<uint64_t, uint64_t> sampled;
+  for (auto it = samples.begin(); it != samples.end(); it++)
+    sampled[it->second]++;
+  if (samplingLevel == 0)
+    return sampled;
+  // scale the sample to the estimated number of distinct keys
+  double scale = (double) distinct() / samples.size();
+  map<uint64_t, uint64_t> res;
+  for (auto it = sampled.begin(); it != sampled.end(); it++)
+    res[it->first] = (uint64_t) ceil(it->second * scale);
+  return res;
+}
+
+vector<uint64_t> MQF::abundanceSketch::histogram(uint64_t nbins) const {
+  vector<uint64_t> res(nbins, 0);
+  map<uint64_t, uint64_t> a = abundances();
+  for (auto it = a.begin(); it != a.end(); it++)
+    res[std::min(it->first, nbins - 1)] += it->second;
+  return res;
+}
+
+qfParameters MQF::optimizeParameters(const map<uint64_t, uint64_t> &abundances, double fpr,
+                                     uint64_t memoryCap, uint64_t label_bits, uint64_t blockLabelSize,
+                                     double headroom) {
+  uint64_t distinct = 0, maxAbundance = 0;
+  for (auto it = abundances.begin(); it != abundances.end(); it++) {
+    distinct += it->second;
+    if (it->second > 0)
+      maxAbundance = std::max(maxAbundance, it->first);
+  }
+  distinct = std::max(distinct, (uint64_t) 1);
+  // a query for an absent key is a false positive if its hash is one of the distinct keys
+  double keyBits = ceil(log2((double) distinct / fpr));
+  if (keyBits > 64)
+    throw std::domain_error("The false positive rate needs more than 64 hash bits");
+
+  qfParameters best;
+  best.memory = numeric_limits<uint64_t>::max();
+  best.label_bits = label_bits;
+  best.blockLabelSize = blockLabelSize;
+  best.key_bits = std::max(keyBits, 9.0);
+  best.fpr = (double) distinct / pow(2.0, (double) best.key_bits);
+  uint64_t minFixedCounter = maxAbundance <= 1 ? 0 : 1;
+  for (uint64_t qbits = 6; qbits < best.key_bits; qbits++) {
+    uint64_t nslots = (1ULL) << qbits;
+    uint64_t slotSize = best.key_bits - qbits;
+    uint64_t nblocks = (nslots + 10 * sqrt((double) nslots) + 63) / 64;
+    // the memory only grows with nslots once the smallest counters fit
+    if (nblocks * (17 + 8 * (slotSize + minFixedCounter + label_bits) + blockLabelSize) > best.memory)
+      break;
+    if (nslots * 0.95 < distinct * headroom)
+      continue;
+    for (uint64_t fixedSizeCounter = minFixedCounter; fixedSizeCounter <= slotSize; fixedSizeCounter++) {
+      double needed = 0;
+      for (auto it = abundances.begin(); it != abundances.end(); it++)
+        needed += (double) it->second * counterSlots(it->first, fixedSizeCounter, slotSize);
+      uint64_t memory = nblocks * (17 + 8 * (slotSize + fixedSizeCounter + label_bits) + blockLabelSize);
+      if (needed * headroom <= nslots * 0.95 && memory < best.memory) {
+        best.memory = memory;
+        best.nslots = nslots;
+        best.fixed_counter_size = fixedSizeCounter;
+        best.slotsNeeded = needed;
+      }
+    }
+  }
+  if (best.memory == numeric_limits<uint64_t>::max() || best.memory > memoryCap)
+    throw std::overflow_error("No filter configuration fits in the memory cap");
+  return best;
+}
+
+qfParameters MQF::autoConfigure(QF *qf, const abundanceSketch &sketch, double fpr, uint64_t memoryCap,
+                                uint64_t label_bits, bool mem, const char *path) {
+  // a pruned sample has a relative error of about 1/sqrt(maxSamples)
+  double headroom = sketch.samplingLevel == 0 ? 1.0 : 1.05 + 3.0 / sqrt((double) sketch.maxSamples);
+  qfParameters p = optimizeParameters(sketch.abundances(), fpr, memoryCap, label_bits, 0, headroom);
+  qf_init(qf, p.nslots, p.key_bits, p.label_bits, p.fixed_counter_size, p.blockLabelSize, mem, path, 2038074761);
+  return p;
+}
@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include<iostream>
 #include <unordered_map>
+#include <map>
+#include <random>
+#include <thread>
 #include "catch.hpp"
 using namespace std;
 
@@ -685,3 +688,430 @@ TEST_CASE( "Removing items from cqf(90% load factor )") {
   qf_destroy(&qf);
 
 }
+
+TEST_CASE( "Setting counters of probed keys" ) {
+  QF qf;
+  uint64_t qbits=12;
+  uint64_t num_hash_bits=qbits+8;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 4,2,0, true, "", 2038074761);
+  std::mt19937_64 rng(13);
+  map<uint64_t,uint64_t> gold;
+  vector<uint64_t> keys;
+  for(uint64_t i=0;i<(1ULL<<qbits)*3/4;i++){
+    uint64_t key=rng()%(1ULL<<num_hash_bits);
+    if(keys.size()>0 && rng()%3==0)
+      key=keys[rng()%keys.size()];
+    else
+      keys.push_back(key);
+    qf_prefetch(&qf,key);
+    qfprobe p;
+    REQUIRE(qf_probe(&qf,key,&p)==gold[key]);
+    // grow, shrink and remove counters of new and existing keys
+    uint64_t count;
+    switch(rng()%4){
+      case 0: count=0; break;
+      case 1: count=gold[key]/2; break;
+      case 2: count=gold[key]+(rng()%200)+1; break;
+      default: count=gold[key]+1;
+    }
+    REQUIRE(qf_set_probed(&qf,&p,count,rng()%2==0,true));
+    gold[key]=count;
+    REQUIRE(qf_count_key(&qf,key)==count);
+  }
+  uint64_t distinct=0;
+  for(auto it=gold.begin();it!=gold.end();it++){
+    REQUIRE(qf_count_key(&qf,it->first)==it->second);
+    distinct+= it->second>0;
+  }
+  CHECK(qf.metadata->ndistinct_elts==distinct);
+
+  // the label of a probed key is kept when its counter grows
+  qfprobe p;
+  qf_insert(&qf,keys[0],1);
+  qf_add_label(&qf,keys[0],9);
+  qf_probe(&qf,keys[0],&p);
+  CHECK(p.label==9);
+  qf_set_probed(&qf,&p,p.count+100);
+  CHECK(qf_get_label(&qf,keys[0])==9);
+  qf_destroy(&qf);
+}
+
+TEST_CASE( "Presence only filter (fixed counter size 0)" ) {
+  QF qf;
+  uint64_t qbits=14;
+  uint64_t num_hash_bits=qbits+9;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 3, 0,0, true, "", 2038074761);
+  CHECK(qf.metadata->bits_per_slot==9+3);
+  std::mt19937_64 rng(23);
+  map<uint64_t,uint64_t> gold;
+  vector<uint64_t> keys;
+  for(uint64_t i=0;i<(1ULL<<qbits)*3/4;i++){
+    uint64_t key=rng()%(1ULL<<num_hash_bits);
+    if(keys.size()>0 && rng()%3==0)
+      key=keys[rng()%keys.size()];
+    else
+      keys.push_back(key);
+    REQUIRE(qf_insert(&qf,key,(rng()%4)+1,rng()%2==0,true));
+    gold[key]=1;
+  }
+  // every key takes one slot
+  CHECK(qf.metadata->noccupied_slots==gold.size());
+  CHECK(qf.metadata->ndistinct_elts==gold.size());
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf_count_key(&qf,it->first)==1);
+  for(int i=0;i<1000;i++){
+    uint64_t key=rng()%(1ULL<<num_hash_bits);
+    REQUIRE(qf_count_key(&qf,key)==(gold.find(key)!=gold.end()));
+  }
+
+  for(uint64_t i=0;i<keys.size();i+=5)
+    qf_add_label(&qf,keys[i],(i%7)+1);
+  QFi qfi;
+  qf_iterator(&qf,&qfi,0);
+  auto it=gold.begin();
+  for(;!qfi_end(&qfi);qfi_next(&qfi)){
+    uint64_t key,label,count;
+    qfi_get(&qfi,&key,&label,&count);
+    REQUIRE(it!=gold.end());
+    REQUIRE(key==it->first);
+    REQUIRE(count==1);
+    REQUIRE(label==qf_get_label(&qf,key));
+    it++;
+  }
+  CHECK(it==gold.end());
+
+  for(uint64_t i=0;i<keys.size();i+=2){
+    REQUIRE(qf_remove(&qf,keys[i],1));
+    REQUIRE(qf_count_key(&qf,keys[i])==0);
+    gold.erase(keys[i]);
+  }
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf_count_key(&qf,it->first)==1);
+  CHECK(qf.metadata->noccupied_slots==gold.size());
+  qf_destroy(&qf);
+}
+
+TEST_CASE( "Runtime statistics" ) {
+  QF qf;
+  uint64_t qbits=14;
+  uint64_t num_hash_bits=qbits+8;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 0, 2,0, true, "", 2038074761);
+  std::mt19937_64 rng(41);
+  qf_runtime_stats stats;
+  for(int i=0;i<100;i++)
+    qf_insert(&qf,rng()%(1ULL<<num_hash_bits),1,true,true);
+  qf_get_runtime_stats(&qf,&stats);
+  CHECK(stats.inserts==0);
+  CHECK(stats.lock_acquisitions==0);
+
+  qf_enable_runtime_stats(&qf,true);
+  uint64_t nthreads=4,perThread=(1ULL<<qbits)/2/nthreads;
+  vector<thread> threads;
+  for(uint64_t t=0;t<nthreads;t++)
+    threads.push_back(thread([&,t](){
+      std::mt19937_64 threadRng(200+t);
+      for(uint64_t i=0;i<perThread;i++)
+        qf_insert(&qf,threadRng()%(1ULL<<num_hash_bits),1,true,true);
+    }));
+  for(auto &t:threads)
+    t.join();
+  qf_get_runtime_stats(&qf,&stats);
+  CHECK(stats.inserts==nthreads*perThread);
+  CHECK(stats.lock_acquisitions>=nthreads*perThread);
+  CHECK(stats.lock_single_attempt<=stats.lock_acquisitions);
+  CHECK(stats.lock_failures==0);
+  uint64_t runs=0,clusters=0,shifts=0;
+  for(int b=0;b<QF_STATS_BUCKETS;b++){
+    runs+=stats.run_length[b];
+    clusters+=stats.cluster_length[b];
+    shifts+=stats.shifted_slots[b];
+  }
+  CHECK(runs==stats.inserts);
+  CHECK(clusters==stats.inserts);
+  CHECK(shifts==stats.inserts);
+  // at half load some inserts land in a long cluster
+  uint64_t longClusters=0;
+  for(int b=4;b<QF_STATS_BUCKETS;b++)
+    longClusters+=stats.cluster_length[b];
+  CHECK(longClusters>0);
+
+  // a large count needs more than the remainder and its fixed counter
+  qf_insert(&qf,rng()%(1ULL<<num_hash_bits),100000,false,false);
+  qf_get_runtime_stats(&qf,&stats);
+  uint64_t longCounters=0;
+  for(int b=2;b<QF_STATS_BUCKETS;b++)
+    longCounters+=stats.counter_slots[b];
+  CHECK(longCounters>0);
+
+  REQUIRE(qf_general_lock(&qf,false));
+  CHECK_FALSE(qf_insert(&qf,1,1,true,false));
+  qf_general_unlock(&qf);
+  qf_get_runtime_stats(&qf,&stats);
+  CHECK(stats.general_lock_failures==1);
+
+  qf_enable_runtime_stats(&qf,false);
+  qf_insert(&qf,2,1,true,true);
+  qf_runtime_stats disabled;
+  qf_get_runtime_stats(&qf,&disabled);
+  CHECK(disabled.inserts==stats.inserts);
+
+  qf_reset(&qf);
+  qf_get_runtime_stats(&qf,&stats);
+  CHECK(stats.inserts==0);
+  CHECK(stats.lock_acquisitions==0);
+  qf_destroy(&qf);
+}
+
+TEST_CASE( "Structural statistics (qf_stats)" ) {
+  QF qf;
+  uint64_t qbits=14;
+  uint64_t num_hash_bits=qbits+6;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 0, 2,0, true, "", 2038074761);
+  std::mt19937_64 rng(43);
+  map<uint64_t,uint64_t> gold;
+  vector<uint64_t> keys;
+  for(uint64_t i=0;i<(1ULL<<qbits)/2;i++){
+    uint64_t key=rng()%(1ULL<<num_hash_bits);
+    if(keys.size()>0 && rng()%3==0)
+      key=keys[rng()%keys.size()];
+    else
+      keys.push_back(key);
+    uint64_t count= rng()%10==0 ? rng()%5000+1 : 1;
+    qf_insert(&qf,key,count);
+    gold[key]+=count;
+  }
+  for(int i=0;i<2000;i++){
+    uint64_t key=keys[rng()%keys.size()];
+    switch(rng()%3){
+      case 0:{
+        uint64_t removed=min(gold[key],rng()%4+1);
+        qf_remove(&qf,key,removed);
+        gold[key]-=removed;
+        break;
+      }
+      case 1:{
+        uint64_t count=rng()%300;
+        qf_setCounter(&qf,key,count);
+        gold[key]=count;
+        break;
+      }
+      default:{
+        qfprobe p;
+        qf_probe(&qf,key,&p);
+        uint64_t count=rng()%3000;
+        qf_set_probed(&qf,&p,count);
+        gold[key]=count;
+      }
+    }
+  }
+  uint64_t distinct=0,total=0;
+  vector<uint64_t> histogram(QF_COUNT_BUCKETS,0);
+  for(auto it=gold.begin();it!=gold.end();it++){
+    if(it->second==0)
+      continue;
+    distinct++;
+    total+=it->second;
+    histogram[63-__builtin_clzll(it->second)]++;
+  }
+
+  qf_stats_data stats;
+  qf_stats(&qf,&stats);
+  CHECK(stats.nslots==(1ULL<<qbits));
+  CHECK(stats.distinct_items==distinct);
+  CHECK(stats.total_count==total);
+  CHECK(stats.remainder_slots==distinct);
+  CHECK(stats.counter_slots>0);
+  CHECK(stats.occupied_slots==qf.metadata->noccupied_slots);
+  CHECK(stats.largest_cluster>1);
+  for(int b=0;b<QF_COUNT_BUCKETS;b++)
+    REQUIRE(stats.count_histogram[b]==histogram[b]);
+
+  // a loaded filter is counted by its first qf_stats
+  qf_serialize(&qf,"tmp.stats.ser");
+  QF loaded;
+  qf_deserialize(&loaded,"tmp.stats.ser");
+  qf_stats_data recounted;
+  qf_stats(&loaded,&recounted);
+  CHECK(recounted.distinct_items==distinct);
+  CHECK(recounted.total_count==total);
+  CHECK(recounted.occupied_slots==stats.occupied_slots);
+  CHECK(recounted.largest_cluster<=stats.largest_cluster);
+  for(int b=0;b<QF_COUNT_BUCKETS;b++)
+    REQUIRE(recounted.count_histogram[b]==histogram[b]);
+  qf_insert(&loaded,keys[0],1);
+  qf_stats(&loaded,&recounted);
+  CHECK(recounted.total_count==total+1);
+  qf_destroy(&loaded);
+
+  qf_reset(&qf);
+  qf_stats(&qf,&stats);
+  CHECK(stats.distinct_items==0);
+  CHECK(stats.occupied_slots==0);
+  qf_destroy(&qf);
+}
+
+TEST_CASE( "Structural statistics from several threads (qf_stats)" ) {
+  QF qf;
+  uint64_t qbits=14;
+  uint64_t num_hash_bits=qbits+8;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 0, 3,0, true, "", 2038074761);
+  uint64_t nthreads=4,perThread=(1ULL<<qbits)/2/nthreads;
+  vector<thread> threads;
+  for(uint64_t t=0;t<nthreads;t++)
+    threads.push_back(thread([&,t](){
+      std::mt19937_64 threadRng(300+t);
+      for(uint64_t i=0;i<perThread;i++)
+        qf_insert(&qf,threadRng()%(1ULL<<num_hash_bits),(i%4)+1,true,true);
+    }));
+  for(auto &t:threads)
+    t.join();
+  qf_stats_data stats;
+  qf_stats(&qf,&stats);
+  CHECK(stats.total_count==nthreads*(perThread/4)*10);
+  uint64_t distinct=0,total=0;
+  QFi qfi;
+  qf_iterator(&qf,&qfi,0);
+  for(;!qfi_end(&qfi);qfi_next(&qfi)){
+    uint64_t key,label,count;
+    qfi_get(&qfi,&key,&label,&count);
+    distinct++;
+    total+=count;
+  }
+  CHECK(stats.distinct_items==distinct);
+  CHECK(stats.total_count==total);
+  qf_destroy(&qf);
+}
+
+TEST_CASE( "qf_setCounter and qf_add_to_counter from several threads" ) {
+  QF qf;
+  uint64_t qbits=12;
+  uint64_t num_hash_bits=qbits+8;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 0, 2,0, true, "", 2038074761);
+  std::mt19937_64 rng(83);
+  vector<uint64_t> shared(200);
+  for(auto &key:shared)
+    key=(rng()%(1ULL<<(num_hash_bits-3))<<3)|7;
+  uint64_t nthreads=4,rounds=300;
+  vector<map<uint64_t,uint64_t>> owned(nthreads);
+  vector<thread> threads;
+  for(uint64_t t=0;t<nthreads;t++)
+    threads.push_back(thread([&,t](){
+      std::mt19937_64 threadRng(400+t);
+      for(uint64_t i=0;i<rounds;i++){
+        uint64_t key=shared[threadRng()%shared.size()];
+        qf_add_to_counter(&qf,key,5,true,true);
+        qf_add_to_counter(&qf,key,-2,true,true);
+        // keys of this thread only, set to counts of different lengths
+        uint64_t own=(threadRng()%(1ULL<<(num_hash_bits-3))<<3)|t;
+        uint64_t count=threadRng()%3==0 ? 0 : threadRng()%100000;
+        qf_setCounter(&qf,own,count,true,true);
+        owned[t][own]=count;
+      }
+    }));
+  for(auto &t:threads)
+    t.join();
+
+  map<uint64_t,uint64_t> gold;
+  for(uint64_t t=0;t<nthreads;t++)
+    for(auto it=owned[t].begin();it!=owned[t].end();it++)
+      gold[it->first]=it->second;
+  // replay the random draws of the threads to count the shared keys
+  for(uint64_t t=0;t<nthreads;t++){
+    std::mt19937_64 threadRng(400+t);
+    for(uint64_t i=0;i<rounds;i++){
+      gold[shared[threadRng()%shared.size()]]+=3;
+      threadRng();
+      if(threadRng()%3!=0)
+        threadRng();
+    }
+  }
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf_count_key(&qf,it->first)==it->second);
+  qf_destroy(&qf);
+}
+
+static void collectSlowOps(const qf_slow_op *op, void *arg)
+{
+  ((vector<qf_slow_op>*)arg)->push_back(*op);
+}
+
+TEST_CASE( "Latency histograms and slow operations" ) {
+  QF qf;
+  uint64_t qbits=12;
+  uint64_t num_hash_bits=qbits+8;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 4, 2,0, true, "", 2038074761);
+  std::mt19937_64 rng(47);
+  vector<uint64_t> keys;
+  for(uint64_t i=0;i<(1ULL<<qbits)/2;i++)
+    keys.push_back(rng()%(1ULL<<num_hash_bits));
+  qf_latency_histogram histogram;
+  qf_insert(&qf,keys[0],1);
+  qf_get_latency(&qf,QF_OP_INSERT,&histogram);
+  CHECK(histogram.count==0);
+
+  qf_enable_latency(&qf,true);
+  for(uint64_t i=0;i<keys.size();i++)
+    qf_insert(&qf,keys[i],(i%3)+1);
+  for(uint64_t i=0;i<keys.size();i++)
+    qf_count_key(&qf,keys[i]);
+  for(uint64_t i=0;i<100;i++){
+    qf_add_label(&qf,keys[i],1);
+    qf_get_label(&qf,keys[i]);
+  }
+  for(uint64_t i=0;i<50;i++)
+    qf_remove(&qf,keys[i],1);
+  QFi qfi;
+  qf_iterator(&qf,&qfi,0);
+  uint64_t nexts=0;
+  for(;!qfi_end(&qfi);qfi_next(&qfi))
+    nexts++;
+
+  qf_get_latency(&qf,QF_OP_INSERT,&histogram);
+  CHECK(histogram.count==keys.size());
+  uint64_t inBuckets=0;
+  for(int b=0;b<QF_LATENCY_BUCKETS;b++)
+    inBuckets+=histogram.buckets[b];
+  CHECK(inBuckets==histogram.count);
+  uint64_t p50=qf_latency_quantile(&histogram,0.5);
+  uint64_t p99=qf_latency_quantile(&histogram,0.99);
+  CHECK(p50<=p99);
+  CHECK(p99<=histogram.max_ns);
+  CHECK(histogram.total_ns<=histogram.max_ns*histogram.count);
+  qf_get_latency(&qf,QF_OP_COUNT,&histogram);
+  CHECK(histogram.count==keys.size());
+  qf_get_latency(&qf,QF_OP_LABEL,&histogram);
+  CHECK(histogram.count==200);
+  qf_get_latency(&qf,QF_OP_REMOVE,&histogram);
+  CHECK(histogram.count==50);
+  qf_get_latency(&qf,QF_OP_NEXT,&histogram);
+  CHECK(histogram.count==nexts);
+
+  qf_reset_latency(&qf);
+  qf_enable_latency(&qf,false);
+  qf_get_latency(&qf,QF_OP_INSERT,&histogram);
+  CHECK(histogram.count==0);
+
+  // every operation is slower than 0ns
+  vector<qf_slow_op> slow;
+  qf_set_slow_op_callback(&qf,0,collectSlowOps,&slow);
+  uint64_t shifted=0;
+  for(uint64_t i=0;i<200;i++){
+    uint64_t key=rng()%(1ULL<<num_hash_bits);
+    qf_insert(&qf,key,1);
+    REQUIRE(slow.size()==i+1);
+    CHECK(slow.back().op==QF_OP_INSERT);
+    CHECK(slow.back().key==key);
+    CHECK(slow.back().quotient==key>>8);
+    CHECK(slow.back().cluster_length>=1);
+    shifted+=slow.back().shifted_slots;
+  }
+  // at half load some inserts shift a part of their cluster
+  CHECK(shifted>0);
+  qf_set_slow_op_callback(&qf,1ULL<<40,collectSlowOps,&slow);
+  qf_count_key(&qf,keys[0]);
+  CHECK(slow.size()==200);
+  qf_set_slow_op_callback(&qf,0,NULL);
+  qf_count_key(&qf,keys[0]);
+  CHECK(slow.size()==200);
+  qf_destroy(&qf);
+}
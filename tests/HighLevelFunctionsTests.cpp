@@ -6,6 +6,7 @@
 #include <vector>
 #include <map>
 #include "utils.h"
+#include <random>
 using namespace std;
 
 
@@ -701,3 +702,75 @@ TEST_CASE( "hierarchical merge") {
     }
   } while(!qfi_next(&cfi));
 }
+
+TEST_CASE( "Auto configured mqf from a sketch") {
+  std::mt19937_64 rng(29);
+  MQF::abundanceSketch sketch(12,1<<12), exact(12,1<<30);
+  map<uint64_t,uint64_t> gold;
+  // mostly singletons, and a few very abundant keys
+  for(uint64_t i=0;i<100000;i++){
+    uint64_t key=rng();
+    uint64_t count=1;
+    if(i%5==0) count=(rng()%20)+2;
+    if(i%1000==0) count=(rng()%100000)+1;
+    gold[key]=count;
+    if(i%2==0)
+      sketch.add(key,count);
+    else{
+      // counts can arrive split
+      exact.add(key,count/2);
+      exact.add(key,count-count/2);
+    }
+  }
+  CHECK(exact.samplingLevel==0);
+  CHECK(sketch.samplingLevel>0);
+  sketch.merge(exact);
+  CHECK(sketch.samplingLevel>0);
+  uint64_t total=0;
+  map<uint64_t,uint64_t> goldAbundances;
+  for(auto it=gold.begin();it!=gold.end();it++){
+    total+=it->second;
+    goldAbundances[it->second]++;
+  }
+  CHECK(sketch.total()==total);
+  CHECK(fabs((double)sketch.distinct()-gold.size())<gold.size()*0.05);
+  vector<uint64_t> histogram=sketch.histogram();
+  CHECK(fabs((double)histogram[1]-goldAbundances[1])<goldAbundances[1]*0.1);
+
+  // the optimizer agrees with the exhaustive search on the exact histogram
+  uint64_t noSlots,fixedSizeCounter,memory;
+  vector<uint64_t> goldHistogram(1000,0);
+  for(auto it=goldAbundances.begin();it!=goldAbundances.end();it++)
+    goldHistogram[min(it->first,(uint64_t)999)]+=it->second;
+  MQF::qfParameters p=MQF::optimizeParameters(goldAbundances,1.0/(1ULL<<10),
+    numeric_limits<uint64_t>::max(),0,0,1.0);
+  MQF::estimateMemRequirement(goldHistogram,p.key_bits,0,&noSlots,&fixedSizeCounter,&memory);
+  CHECK((1ULL<<noSlots)==p.nslots);
+  CHECK(p.fpr<=1.0/(1ULL<<10));
+
+  QF qf;
+  p=MQF::autoConfigure(&qf,sketch,1.0/(1ULL<<10));
+  CHECK(qf.metadata->nslots==p.nslots);
+  CHECK(qf.metadata->key_bits==p.key_bits);
+  for(auto it=gold.begin();it!=gold.end();it++)
+    qf_insert(&qf,it->first&((1ULL<<p.key_bits)-1),it->second);
+  // sized for the data, not over provisioned
+  CHECK(qf.metadata->noccupied_slots>p.nslots/2);
+  CHECK(qf.metadata->noccupied_slots<=p.slotsNeeded*1.1);
+  uint64_t falsePositives=0;
+  for(int i=0;i<100000;i++){
+    uint64_t key=rng()&((1ULL<<p.key_bits)-1);
+    falsePositives+=qf_count_key(&qf,key)>0;
+  }
+  CHECK(falsePositives<100000*p.fpr*2);
+  qf_destroy(&qf);
+
+  CHECK_THROWS_AS(MQF::autoConfigure(&qf,sketch,1.0/(1ULL<<10),1024),std::overflow_error);
+
+  // keys seen once do not need counters
+  MQF::abundanceSketch singletons;
+  for(uint64_t i=0;i<10000;i++)
+    singletons.add(rng());
+  CHECK(MQF::autoConfigure(&qf,singletons,0.01).fixed_counter_size==0);
+  qf_destroy(&qf);
+}
@@ -1,10 +1,14 @@
-// #include "gqf.h"
-// #include "LayeredMQF.h"
-// #include <stdio.h>      /* printf, scanf, puts, NULL */
-// #include <stdlib.h>
-// #include<iostream>
-// #include "catch.hpp"
-// using namespace std;
+#include "gqf.h"
+#include "LayeredMQF.h"
+#include <stdio.h>      /* printf, scanf, puts, NULL */
+#include <stdlib.h>
+#include<iostream>
+#include "catch.hpp"
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+using namespace std;
 //
 //
 //
@@ -482,3 +486,208 @@
 // //   layeredMQF_destroy(&qf);
 // //
 // // }
+
+
+/* Fills qf with keys seen once, keys seen several times, and keys promoted
+ * from the singletons, half of them with the batched insert. */
+static void fillLayered(layeredMQF* qf, std::mt19937_64& rng, uint64_t n,
+  map<uint64_t,uint64_t>& gold, map<uint64_t,uint64_t>& tags)
+{
+  uint64_t range=qf->secondLayer->metadata->range;
+  vector<uint64_t> keys, batchKeys, batchCounts;
+  for(uint64_t i=0;i<n;i++){
+    uint64_t key=rng()%range;
+    if(keys.size()>0 && rng()%4==0)
+      key=keys[rng()%keys.size()];
+    else
+      keys.push_back(key);
+    uint64_t count= rng()%3==0 ? (rng()%100)+1 : 1;
+    gold[key]+=count;
+    if(i%2==0)
+      REQUIRE(layeredMQF_insert(qf,key,count,false,false));
+    else{
+      batchKeys.push_back(key);
+      batchCounts.push_back(count);
+    }
+  }
+  CHECK(layeredMQF_insert_batch(qf,&batchKeys[0],&batchCounts[0],batchKeys.size())==batchKeys.size());
+  for(uint64_t i=0;i<keys.size();i+=7){
+    uint64_t tag=(rng()%15)+1;
+    layeredMQF_add_tag(qf,keys[i],tag);
+    tags[keys[i]]=tag;
+  }
+}
+
+static void checkLayered(layeredMQF* qf, map<uint64_t,uint64_t>& gold, map<uint64_t,uint64_t>& tags)
+{
+  for(auto it=gold.begin();it!=gold.end();it++){
+    REQUIRE(layeredMQF_count_key(qf,it->first)==it->second);
+    REQUIRE(layeredMQF_get_tag(qf,it->first)==tags[it->first]);
+  }
+  layeredMQFIterator qfi;
+  REQUIRE(layeredMQF_qf_iterator(qf,&qfi,0));
+  auto expected=gold.begin();
+  for(;!layeredMQF_qfi_end(&qfi);layeredMQF_qfi_next(&qfi)){
+    uint64_t key, value, count;
+    layeredMQF_qfi_get(&qfi,&key,&value,&count);
+    REQUIRE(expected!=gold.end());
+    REQUIRE(key==expected->first);
+    REQUIRE(count==expected->second);
+    REQUIRE(value==tags[key]);
+    expected++;
+  }
+  CHECK(expected==gold.end());
+}
+
+TEST_CASE( "Counting and iterating over the layers(layered)","[layered]" ) {
+  layeredMQF qf;
+  uint64_t qbits=12;
+  uint64_t singleQbits=13;
+  uint64_t num_hash_bits=qbits+8;
+  std::mt19937_64 rng(17);
+  layeredMQF_init(&qf,(1ULL<<singleQbits) ,(1ULL<<qbits), num_hash_bits, 4,2, true, "", 2038074761);
+  map<uint64_t,uint64_t> gold, tags;
+  fillLayered(&qf,rng,(1ULL<<qbits),gold,tags);
+  CHECK(qf.firstLayer_singletons->metadata->fixed_counter_size==0);
+  // a key is never in both layers
+  for(auto it=gold.begin();it!=gold.end();it++){
+    uint64_t second=qf_count_key(qf.secondLayer,it->first);
+    uint64_t first=qf_count_key(qf.firstLayer_singletons,it->first);
+    REQUIRE((second==0 || first==0));
+    REQUIRE(first<=1);
+  }
+  CHECK(qf.firstLayer_singletons->metadata->ndistinct_elts>0);
+  checkLayered(&qf,gold,tags);
+
+  // iterating from a position skips the smaller keys
+  uint64_t position=(1ULL<<qbits)/2;
+  uint64_t startKey=position<<qf.secondLayer->metadata->key_remainder_bits;
+  layeredMQFIterator qfi;
+  layeredMQF_qf_iterator(&qf,&qfi,position);
+  uint64_t key, value, count;
+  layeredMQF_qfi_get(&qfi,&key,&value,&count);
+  CHECK(key==gold.lower_bound(startKey)->first);
+
+  layeredMQF_destroy(&qf);
+}
+
+TEST_CASE( "Serializing, merging and resizing(layered)","[layered]" ) {
+  uint64_t qbits=11;
+  uint64_t singleQbits=12;
+  uint64_t num_hash_bits=qbits+8;
+  std::mt19937_64 rng(19);
+  layeredMQF qf;
+  layeredMQF_init(&qf,(1ULL<<singleQbits) ,(1ULL<<qbits), num_hash_bits, 4,2, true, "", 2038074761);
+  map<uint64_t,uint64_t> gold, tags;
+  fillLayered(&qf,rng,(1ULL<<qbits),gold,tags);
+
+  layeredMQF_serialize(&qf,"tmp.layered");
+  {
+    layeredMQF copy;
+    layeredMQF_deserialize(&copy,"tmp.layered");
+    checkLayered(&copy,gold,tags);
+    layeredMQF_destroy(&copy);
+  }
+  {
+    layeredMQF mapped;
+    layeredMQF_read(&mapped,"tmp.layered");
+    checkLayered(&mapped,gold,tags);
+    // the mapped layers can be updated in place
+    layeredMQF_insert(&mapped,gold.begin()->first,1,false,false);
+    CHECK(layeredMQF_count_key(&mapped,gold.begin()->first)==gold.begin()->second+1);
+    layeredMQF_destroy(&mapped);
+  }
+  qf_serialize(qf.secondLayer,"tmp.notLayered");
+  {
+    layeredMQF bad;
+    CHECK_THROWS_AS(layeredMQF_deserialize(&bad,"tmp.notLayered"),std::runtime_error);
+  }
+
+  // merging with a filter that has some of the keys
+  layeredMQF other, merged;
+  layeredMQF_init(&other,(1ULL<<singleQbits) ,(1ULL<<qbits), num_hash_bits, 4,2, true, "", 2038074761);
+  layeredMQF_init(&merged,(1ULL<<(singleQbits+1)) ,(1ULL<<(qbits+1)), num_hash_bits, 4,2, true, "", 2038074761);
+  map<uint64_t,uint64_t> otherGold, otherTags;
+  fillLayered(&other,rng,(1ULL<<qbits)/2,otherGold,otherTags);
+  for(auto it=gold.begin();it!=gold.end();){
+    layeredMQF_insert(&other,it->first,2,false,false);
+    otherGold[it->first]+=2;
+    for(int i=0;i<5 && it!=gold.end();i++)
+      it++;
+  }
+  layeredMQF_merge(&qf,&other,&merged);
+  map<uint64_t,uint64_t> mergedGold=gold, mergedTags=tags;
+  for(auto it=otherGold.begin();it!=otherGold.end();it++){
+    mergedGold[it->first]+=it->second;
+    if(mergedTags[it->first]==0)
+      mergedTags[it->first]=otherTags[it->first];
+  }
+  checkLayered(&merged,mergedGold,mergedTags);
+
+  // the layers can grow and shrink
+  layeredMQF_resize(&qf,(1ULL<<(singleQbits+1)),(1ULL<<(qbits+2)));
+  CHECK(qf.secondLayer->metadata->nslots==(1ULL<<(qbits+2)));
+  checkLayered(&qf,gold,tags);
+  layeredMQF_resize(&qf,(1ULL<<singleQbits),(1ULL<<qbits));
+  checkLayered(&qf,gold,tags);
+  CHECK(qf.secondLayer->metadata->mem);
+
+  // resized into files, which keep the items after the filter is closed
+  layeredMQF_resize(&qf,(1ULL<<singleQbits),(1ULL<<(qbits+1)),"tmp.resized");
+  CHECK(!qf.secondLayer->metadata->mem);
+  CHECK(!qf.firstLayer_singletons->metadata->mem);
+  checkLayered(&qf,gold,tags);
+  layeredMQF_destroy(&qf);
+  qf_read(qf.firstLayer_singletons,"tmp.resized.singletons");
+  qf_read(qf.secondLayer,"tmp.resized");
+  checkLayered(&qf,gold,tags);
+
+  layeredMQF_destroy(&qf);
+  layeredMQF_destroy(&other);
+  layeredMQF_destroy(&merged);
+}
+
+TEST_CASE( "Inserting the same keys from several threads(layered)","[layered]" ) {
+  layeredMQF qf;
+  uint64_t qbits=12;
+  uint64_t singleQbits=12;
+  uint64_t num_hash_bits=qbits+8;
+  layeredMQF_init(&qf,(1ULL<<singleQbits) ,(1ULL<<qbits), num_hash_bits, 0,2, true, "", 2038074761);
+  std::mt19937_64 rng(87);
+  vector<uint64_t> shared(30);
+  for(auto &key:shared)
+    key=rng()%(1ULL<<num_hash_bits);
+  uint64_t nthreads=4,rounds=20000;
+  vector<thread> threads;
+  for(uint64_t t=0;t<nthreads;t++)
+    threads.push_back(thread([&,t](){
+      std::mt19937_64 threadRng(500+t);
+      for(uint64_t i=0;i<rounds;i++){
+        uint64_t key=shared[threadRng()%shared.size()];
+        // mostly singletons, so that keys move between the layers
+        uint64_t count=threadRng()%4==0 ? threadRng()%50+2 : 1;
+        layeredMQF_insert(&qf,key,count,true,true);
+      }
+    }));
+  for(auto &t:threads)
+    t.join();
+
+  // replay the random draws of the threads
+  map<uint64_t,uint64_t> gold;
+  for(uint64_t t=0;t<nthreads;t++){
+    std::mt19937_64 threadRng(500+t);
+    for(uint64_t i=0;i<rounds;i++){
+      uint64_t key=shared[threadRng()%shared.size()];
+      gold[key]+= threadRng()%4==0 ? threadRng()%50+2 : 1;
+    }
+  }
+  for(auto it=gold.begin();it!=gold.end();it++){
+    REQUIRE(layeredMQF_count_key(&qf,it->first)==it->second);
+    // a key is in one layer only
+    if(it->second>1)
+      REQUIRE(qf_count_key(qf.firstLayer_singletons,it->first)==0);
+    else
+      REQUIRE(qf_count_key(qf.secondLayer,it->first)==0);
+  }
+  layeredMQF_destroy(&qf);
+}
@@ -5,6 +5,10 @@
 #include<iostream>
 #include "catch.hpp"
 #include <unordered_map>
+#include <map>
+#include <iterator>
+#include <random>
+#include <thread>
 using namespace std;
 
 
@@ -922,6 +926,266 @@ TEST_CASE( "Inserting items( repeated 1-1000 times) in cqf(90% load factor ) and
 
 
 //
+TEST_CASE( "Counting while the buffer is flushed in the background(buffered)","[buffered]" ) {
+  bufferedMQF qf;
+  uint64_t qbits=10;
+  uint64_t diskQbits=16;
+  uint64_t num_hash_bits=diskQbits+8;
+  bufferedMQF_init(&qf ,(1ULL<<qbits),(1ULL<<diskQbits) , num_hash_bits, 0,2, "tmp.background");
+  std::mt19937_64 rng(11);
+  unordered_map<uint64_t,uint64_t> gold;
+  vector<uint64_t> keys;
+  uint64_t nflushes=0;
+  while(bufferedMQF_space(&qf)<60){
+    uint64_t key=rng()%(qf.disk->metadata->range);
+    uint64_t count=(rng()%20)+1;
+    if(keys.size()>0 && rng()%4==0)
+      key=keys[rng()%keys.size()];
+    else
+      keys.push_back(key);
+    bufferedMQF_insert(&qf,key,count,false,false);
+    gold[key]+=count;
+    if(qf.flushPending){
+      nflushes++;
+      // an item is counted once whether it is in a buffer, moving to disk or on disk
+      uint64_t probe=keys[rng()%keys.size()];
+      REQUIRE(bufferedMQF_count_key(&qf,probe)==gold[probe]);
+    }
+  }
+  CHECK(nflushes>0);
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(bufferedMQF_count_key(&qf,it->first)==it->second);
+
+  bufferedMQF_syncBuffer(&qf);
+  CHECK(!qf.flushPending);
+  CHECK(qf.memoryBuffer->metadata->noccupied_slots==0);
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf.disk->count_key(it->first)==it->second);
+}
+
+TEST_CASE( "Inserting from several threads(buffered)","[buffered]" ) {
+  bufferedMQF qf;
+  uint64_t qbits=12;
+  uint64_t diskQbits=16;
+  uint64_t num_hash_bits=diskQbits+8;
+  uint64_t nthreads=8;
+  bufferedMQF_init(&qf ,(1ULL<<qbits),(1ULL<<diskQbits) , num_hash_bits, 0,2, "tmp.threads",16);
+  uint64_t range=qf.disk->metadata->range;
+  uint64_t perThread=(1ULL<<diskQbits)/2/nthreads;
+  // half of the keys are shared by all the threads
+  vector<uint64_t> shared;
+  std::mt19937_64 rng(13);
+  for(uint64_t i=0;i<1000;i++)
+    shared.push_back(rng()%range);
+  vector<thread> threads;
+  for(uint64_t t=0;t<nthreads;t++)
+    threads.push_back(thread([&,t](){
+      std::mt19937_64 threadRng(100+t);
+      for(uint64_t i=0;i<perThread;i++){
+        uint64_t key= i%2 ? shared[threadRng()%shared.size()] : threadRng()%range;
+        bufferedMQF_insert(&qf,key,(threadRng()%3)+1,true,true);
+      }
+    }));
+  // queries run during the inserts
+  for(uint64_t i=0;i<1000;i++)
+    bufferedMQF_count_key(&qf,shared[i]);
+  for(uint64_t t=0;t<nthreads;t++)
+    threads[t].join();
+
+  unordered_map<uint64_t,uint64_t> gold;
+  for(uint64_t t=0;t<nthreads;t++){
+    std::mt19937_64 threadRng(100+t);
+    for(uint64_t i=0;i<perThread;i++){
+      uint64_t key= i%2 ? shared[threadRng()%shared.size()] : threadRng()%range;
+      gold[key]+=(threadRng()%3)+1;
+    }
+  }
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(bufferedMQF_count_key(&qf,it->first)==it->second);
+  uint64_t noccupied_slots=qf.disk->metadata->noccupied_slots;
+  bufferedMQF_waitForFlush(&qf);
+  for(uint64_t i=0;i<qf.memoryShards.size();i++){
+    noccupied_slots+=qf.memoryShards[i]->metadata->noccupied_slots;
+    noccupied_slots+=qf.flushShards[i]->metadata->noccupied_slots;
+  }
+  CHECK(qf.bufferSlots+qf.flushSlots+qf.diskSlots==noccupied_slots);
+
+  bufferedMQF_syncBuffer(&qf);
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf.disk->count_key(it->first)==it->second);
+}
+
+TEST_CASE( "Skipping the disk for absent keys(buffered)","[buffered]" ) {
+  bufferedMQF qf;
+  uint64_t qbits=10;
+  uint64_t diskQbits=16;
+  uint64_t num_hash_bits=diskQbits+8;
+  bufferedMQF_init(&qf ,(1ULL<<qbits),(1ULL<<diskQbits) , num_hash_bits, 0,2, "tmp.summary");
+  uint64_t range=qf.disk->metadata->range;
+  std::mt19937_64 rng(21);
+  unordered_map<uint64_t,uint64_t> gold;
+  for(uint64_t i=0;i<(1ULL<<diskQbits)/2;i++){
+    // the summary is built from the disk in the middle and then kept up to date by the flushes
+    if(i==(1ULL<<diskQbits)/4)
+      bufferedMQF_enableSummary(&qf,4);
+    uint64_t key=rng()%range;
+    uint64_t count=(rng()%3)+1;
+    bufferedMQF_insert(&qf,key,count,false,false);
+    gold[key]+=count;
+  }
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(bufferedMQF_count_key(&qf,it->first)==it->second);
+  bufferedMQF_syncBuffer(&qf);
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf.disk->count_key(it->first)==it->second);
+
+  qf.disk->resetSummaryStats();
+  uint64_t nabsent=0;
+  for(int i=0;i<10000;i++){
+    uint64_t key=rng()%range;
+    if(gold.find(key)!=gold.end())
+      continue;
+    nabsent++;
+    REQUIRE(bufferedMQF_count_key(&qf,key)==0);
+  }
+  onDiskMQF_Namespace::onDiskMQFSummaryStats stats=bufferedMQF_getSummaryStats(&qf);
+  CHECK(stats.negatives+stats.probes==nabsent);
+  CHECK(stats.falsePositives==stats.probes);
+  // at 4 bits per slot and about 50% load most of the misses stay in memory
+  CHECK(stats.negatives>nabsent/2);
+
+  bufferedMQF_enableSummary(&qf,0);
+  CHECK(qf.disk->summaryHas(0));
+}
+
+TEST_CASE( "Seeking and range scans without flushing(buffered)","[buffered]" ) {
+  bufferedMQF qf;
+  uint64_t qbits=12;
+  uint64_t diskQbits=14;
+  uint64_t num_hash_bits=diskQbits+8;
+  bufferedMQF_init(&qf ,(1ULL<<qbits),(1ULL<<diskQbits) , num_hash_bits, 0,2, "tmp.seek",4);
+  uint64_t range=qf.disk->metadata->range;
+  std::mt19937_64 rng(34);
+  map<uint64_t,uint64_t> gold;
+  // the first keys are on disk, the others only in the buffer shards
+  for(uint64_t i=0;i<3000;i++){
+    if(i==2000)
+      bufferedMQF_syncBuffer(&qf);
+    uint64_t key= i>=2000 && i%2 ? std::next(gold.begin(),rng()%gold.size())->first : rng()%range;
+    uint64_t count=(rng()%3)+1;
+    bufferedMQF_insert(&qf,key,count,false,false);
+    gold[key]+=count;
+  }
+  uint64_t bufferSlots=qf.bufferSlots;
+  REQUIRE(bufferSlots>0);
+
+  for(int i=0;i<2000;i++){
+    uint64_t key=rng()%range;
+    auto goldIt=gold.lower_bound(key);
+    bufferedMQFIterator it;
+    bool found=bufferedMQF_find(&qf,&it,key);
+    REQUIRE(found==(goldIt!=gold.end() && goldIt->first==key));
+    REQUIRE(it.end()==(goldIt==gold.end()));
+    if(goldIt!=gold.end()){
+      uint64_t ikey,value,count;
+      it.get(&ikey,&value,&count);
+      REQUIRE(ikey==goldIt->first);
+      REQUIRE(count==goldIt->second);
+    }
+  }
+  CHECK(qf.bufferSlots==bufferSlots);
+
+  for(int i=0;i<50;i++){
+    uint64_t start=rng()%range;
+    uint64_t end=start+(rng()%(range/50));
+    bufferedMQFIterator* it=bufferedMQF_rangeIterator(&qf,start,end);
+    auto goldIt=gold.lower_bound(start);
+    while(!it->end()){
+      uint64_t key,value,count;
+      it->get(&key,&value,&count);
+      REQUIRE(goldIt!=gold.end());
+      REQUIRE(key==goldIt->first);
+      REQUIRE(count==goldIt->second);
+      goldIt++;
+      it->next();
+    }
+    CHECK((goldIt==gold.end() || goldIt->first>end));
+    delete it;
+  }
+
+  bufferedMQFIterator* it=bufferedMQF_iterator(&qf,0);
+  auto goldIt=gold.begin();
+  while(!it->end()){
+    uint64_t key,value,count;
+    it->get(&key,&value,&count);
+    REQUIRE(goldIt!=gold.end());
+    REQUIRE(key==goldIt->first);
+    REQUIRE(count==goldIt->second);
+    goldIt++;
+    it->next();
+  }
+  CHECK(goldIt==gold.end());
+  delete it;
+  CHECK(qf.bufferSlots==bufferSlots);
+}
+
+TEST_CASE( "Buffered labels(buffered)","[buffered]" ) {
+  bufferedMQF qf;
+  uint64_t qbits=10;
+  uint64_t diskQbits=15;
+  uint64_t num_hash_bits=diskQbits+8;
+  uint64_t label_bits=8;
+  bufferedMQF_init(&qf ,(1ULL<<qbits),(1ULL<<diskQbits) , num_hash_bits, label_bits,2, "tmp.labels",2);
+  uint64_t range=qf.disk->metadata->range;
+  std::mt19937_64 rng(35);
+  map<uint64_t,uint64_t> gold;
+  map<uint64_t,uint64_t> goldLabels;
+  vector<uint64_t> keys;
+  for(uint64_t i=0;i<10000;i++){
+    uint64_t key= keys.size()>0 && rng()%3==0 ? keys[rng()%keys.size()] : rng()%range;
+    if(gold.find(key)==gold.end())
+      keys.push_back(key);
+    uint64_t count=(rng()%3)+1;
+    bufferedMQF_insert(&qf,key,count,false,false);
+    gold[key]+=count;
+    // labels of keys that can be on disk, in the flushing buffer or in the memory buffer
+    if(rng()%2){
+      uint64_t labeled=keys[rng()%keys.size()];
+      uint64_t label=rng()%(1ULL<<label_bits);
+      if(label==0)
+        bufferedMQF_remove_label(&qf,labeled);
+      else
+        bufferedMQF_add_label(&qf,labeled,label);
+      goldLabels[labeled]=label;
+      REQUIRE(bufferedMQF_get_label(&qf,labeled)==label);
+    }
+  }
+  for(auto it=goldLabels.begin();it!=goldLabels.end();it++)
+    REQUIRE(bufferedMQF_get_label(&qf,it->first)==it->second);
+
+  bufferedMQFIterator* it=bufferedMQF_iterator(&qf,0);
+  for(;!it->end();it->next()){
+    uint64_t key,value,count;
+    it->get(&key,&value,&count);
+    REQUIRE(count==gold[key]);
+    REQUIRE(value==goldLabels[key]);
+  }
+  delete it;
+
+  bufferedMQF_syncBuffer(&qf);
+  for(auto it=gold.begin();it!=gold.end();it++){
+    REQUIRE(qf.disk->count_key(it->first)==it->second);
+    REQUIRE(qf.disk->get_label(it->first)==goldLabels[it->first]);
+  }
+
+  bufferedMQF qf2;
+  bufferedMQF_init(&qf2 ,(1ULL<<qbits),(1ULL<<diskQbits) , num_hash_bits, label_bits,2, "tmp.labels2");
+  bufferedMQF_migrate(&qf,&qf2);
+  bufferedMQF_syncBuffer(&qf2);
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf2.disk->get_label(it->first)==goldLabels[it->first]);
+}
+
 // TEST_CASE( "Counting Big counters" ){
 //   bufferedMQF qf;
 //   int counter_size=2;
@@ -1053,3 +1317,21 @@ TEST_CASE( "Inserting items( repeated 1-1000 times) in cqf(90% load factor ) and
 //
 //
 // }
+
+TEST_CASE( "Space of a filter without a buffer(buffered)","[buffered]" ) {
+  bufferedMQF qf;
+  uint64_t diskQbits=12;
+  uint64_t num_hash_bits=diskQbits+8;
+  bufferedMQF_init(&qf ,0,(1ULL<<diskQbits) , num_hash_bits, 0,2, "tmp.unbuffered");
+  uint64_t range=qf.disk->metadata->range;
+  std::mt19937_64 rng(41);
+  CHECK(bufferedMQF_space(&qf)==0);
+  for(uint64_t i=0;i<(1ULL<<diskQbits)/2;i++)
+    bufferedMQF_insert(&qf,rng()%range,1,false,false);
+  // every insert went to the disk filter
+  int expected=(int)(((double)qf.disk->metadata->noccupied_slots/
+    (double)qf.disk->metadata->xnslots)*100.0);
+  CHECK(expected>40);
+  CHECK(bufferedMQF_space(&qf)==expected);
+  bufferedMQF_destroy(&qf);
+}
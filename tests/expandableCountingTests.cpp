@@ -0,0 +1,94 @@
+#include "gqf.h"
+#include "expandableMQF.h"
+#include <stdio.h>      /* printf, scanf, puts, NULL */
+#include <stdlib.h>
+#include<iostream>
+#include "catch.hpp"
+#include <map>
+#include <random>
+using namespace std;
+
+
+TEST_CASE( "Growing while counting(expandable)","[expandable]" ) {
+  uint64_t num_hash_bits=26;
+  expandableMQF qf;
+  expandableMQF_init(&qf,(1ULL<<8),num_hash_bits,4,2);
+  std::mt19937_64 rng(31);
+  map<uint64_t,uint64_t> gold, labels;
+  vector<uint64_t> keys;
+  for(int i=0;i<60000;i++){
+    uint64_t key=rng()%(1ULL<<num_hash_bits);
+    if(keys.size()>0 && rng()%4==0)
+      key=keys[rng()%keys.size()];
+    else
+      keys.push_back(key);
+    uint64_t count= rng()%8==0 ? (rng()%1000)+1 : 1;
+    uint64_t nslots=expandableMQF_nslots(&qf);
+    uint64_t occupied=qf.current->metadata->noccupied_slots;
+    REQUIRE(expandableMQF_insert(&qf,key,count));
+    gold[key]+=count;
+    // an insert moves at most migrationStep items, of at most 3 slots here
+    if(expandableMQF_nslots(&qf)==nslots)
+      REQUIRE(qf.current->metadata->noccupied_slots-occupied<=(qf.migrationStep+1)*3);
+    if(i%7==0){
+      uint64_t label=(rng()%15)+1;
+      if(expandableMQF_get_label(&qf,key)==0){
+        expandableMQF_add_label(&qf,key,label);
+        labels[key]=label;
+      }
+    }
+    if(qf.old!=NULL && i%16==0){
+      // keys on both sides of the migration
+      uint64_t probe=keys[rng()%keys.size()];
+      REQUIRE(expandableMQF_count_key(&qf,probe)==gold[probe]);
+      REQUIRE(expandableMQF_get_label(&qf,probe)==labels[probe]);
+    }
+    if(qf.old!=NULL && i%5==0){
+      uint64_t probe=keys[rng()%keys.size()];
+      uint64_t removed=min(gold[probe],(uint64_t)2);
+      if(removed>0){
+        expandableMQF_remove(&qf,probe,removed);
+        gold[probe]-=removed;
+        if(gold[probe]==0)
+          labels[probe]=0;
+      }
+    }
+  }
+  CHECK(qf.nexpansions>=6);
+  CHECK(expandableMQF_nslots(&qf)>=(1ULL<<14));
+  for(auto it=gold.begin();it!=gold.end();it++){
+    REQUIRE(expandableMQF_count_key(&qf,it->first)==it->second);
+    REQUIRE(expandableMQF_get_label(&qf,it->first)==labels[it->first]);
+  }
+
+  expandableMQF_finishExpansion(&qf);
+  CHECK(qf.old==NULL);
+  QFi qfi;
+  qf_iterator(qf.current,&qfi,0);
+  auto expected=gold.begin();
+  for(;!qfi_end(&qfi);qfi_next(&qfi)){
+    uint64_t key,label,count;
+    qfi_get(&qfi,&key,&label,&count);
+    while(expected!=gold.end() && expected->second==0)
+      expected++;
+    REQUIRE(expected!=gold.end());
+    REQUIRE(key==expected->first);
+    REQUIRE(count==expected->second);
+    expected++;
+  }
+}
+
+TEST_CASE( "Growing until no remainder bit is left(expandable)","[expandable]" ) {
+  expandableMQF qf;
+  expandableMQF_init(&qf,(1ULL<<6),10,0,1);
+  std::mt19937_64 rng(37);
+  auto fill=[&](){
+    uint64_t key=0;
+    while(true){
+      expandableMQF_insert(&qf,key,1);
+      key=(key+rng()%3+1)%(1ULL<<10);
+    }
+  };
+  CHECK_THROWS_AS(fill(),std::overflow_error);
+  CHECK(expandableMQF_nslots(&qf)==(1ULL<<8));
+}
@@ -0,0 +1,498 @@
+
+#include "catch.hpp"
+#include <random>
+#include <vector>
+#include <map>
+
+/* Differential tests of the low level kernels against simple reference
+ * implementations. Like lowLevelTests.hpp, this file is compiled inside
+ * gqf.cpp with -DTEST so that it sees the static functions. */
+
+static uint64_t refRank(uint64_t val, int pos)
+{
+  uint64_t res=0;
+  for(int i=0;i<=pos;i++)
+    res+=(val>>i)&1;
+  return res;
+}
+
+static uint64_t refSelect(uint64_t val, int rank)
+{
+  for(int i=0;i<64;i++)
+    if((val>>i)&1){
+      if(rank==0)
+        return i;
+      rank--;
+    }
+  return 64;
+}
+
+static uint64_t randomWord(std::mt19937_64 &rng)
+{
+  switch(rng()%4){
+    case 0: return rng()&rng()&rng();
+    case 1: return rng()|rng();
+    case 2: return rng()&(rng()%64==0 ? 0 : ~0ULL<<(rng()%64));
+    default: return rng();
+  }
+}
+
+TEST_CASE( "bitrank and bitselect against a reference","[kernels]" ) {
+  std::mt19937_64 rng(51);
+  for(int i=0;i<2000;i++){
+    uint64_t val=randomWord(rng);
+    for(int pos=0;pos<64;pos++)
+      REQUIRE(bitrank(val,pos)==refRank(val,pos));
+    for(int rank=0;rank<64;rank++){
+      uint64_t expected=refSelect(val,rank);
+      REQUIRE(bitselect(val,rank)==expected);
+      REQUIRE(_select64(val,rank)==expected);
+    }
+  }
+}
+
+/* Check the run and cluster kernels against prefix counts of the occupieds
+ * and runends bits. */
+static void checkRunKernels(QF *qf)
+{
+  QF &q=*qf;
+  uint64_t xnslots=q.metadata->xnslots;
+  // slot i is used iff more runs started at or before it than ended before it
+  std::vector<uint64_t> runendPositions;
+  std::vector<uint64_t> occupiedsUpTo(xnslots);
+  std::vector<bool> empty(xnslots);
+  uint64_t occupieds=0,runends=0;
+  for(uint64_t i=0;i<xnslots;i++){
+    occupieds+=is_occupied(qf,i)!=0;
+    occupiedsUpTo[i]=occupieds;
+    empty[i]= occupieds==runends;
+    if(is_runend(qf,i)){
+      runendPositions.push_back(i);
+      runends++;
+    }
+  }
+  std::vector<uint64_t> nextEmpty(xnslots+1,xnslots);
+  for(int64_t i=xnslots-1;i>=0;i--)
+    nextEmpty[i]= empty[i] ? i : nextEmpty[i+1];
+
+  // offset of a block: end of the last run of the buckets before it
+  for(uint64_t block=1;block<q.metadata->nblocks;block++){
+    uint64_t first=block*SLOTS_PER_BLOCK, expected=0;
+    if(occupiedsUpTo[first-1]>0 && runendPositions[occupiedsUpTo[first-1]-1]>=first)
+      expected=runendPositions[occupiedsUpTo[first-1]-1]-first+1;
+    INFO("block "<<block);
+    REQUIRE(get_block(qf,block)->offset==std::min(expected,(uint64_t)BITMASK(8)));
+  }
+  for(uint64_t b=0;b<q.metadata->nslots;b++){
+    uint64_t expected=b;
+    if(occupiedsUpTo[b]>0)
+      expected=std::max(b,runendPositions[occupiedsUpTo[b]-1]);
+    INFO("bucket "<<b);
+    REQUIRE(run_end(qf,b)==expected);
+  }
+  for(uint64_t i=0;i<q.metadata->nslots;i++){
+    INFO("slot "<<i);
+    int t=offset_lower_bound(qf,i);
+    REQUIRE(t>=0);
+    REQUIRE((t==0)==empty[i]);
+    // a lower bound of the used slots from i
+    REQUIRE(nextEmpty[i]>=i+t);
+    REQUIRE(find_first_empty_slot(qf,i)==nextEmpty[i]);
+  }
+}
+
+TEST_CASE( "run_end, offset_lower_bound and find_first_empty_slot against a reference","[kernels]" ) {
+  std::mt19937_64 rng(53);
+  double loads[]={0.1,0.5,0.8,0.93};
+  for(double load: loads){
+    INFO("load "<<load);
+    QF qf;
+    uint64_t qbits=12, num_hash_bits=qbits+8;
+    qf_init(&qf, (1ULL<<qbits), num_hash_bits, 0, 2,0, true, "", 2038074761);
+    while(qf.metadata->noccupied_slots < load*qf.metadata->nslots)
+      qf_insert(&qf,rng()%(1ULL<<num_hash_bits),rng()%8==0 ? rng()%100+1 : 1);
+    checkRunKernels(&qf);
+    qf_destroy(&qf);
+  }
+}
+
+/* Counters of several slots are shifted by several slots on insert and on
+ * remove, which must keep the runends and the block offsets exact. */
+TEST_CASE( "Inserting and removing multi-slot counters keeps the metadata exact","[kernels]" ) {
+  std::mt19937_64 rng(63);
+  uint64_t labelBits[]={0,5};
+  for(uint64_t label_bits: labelBits){
+    INFO("label bits "<<label_bits);
+    QF qf;
+    uint64_t qbits=10, num_hash_bits=qbits+6;
+    qf_init(&qf, (1ULL<<qbits), num_hash_bits, label_bits, 1,0, true, "", 2038074761);
+    std::map<uint64_t,uint64_t> gold;
+    std::vector<uint64_t> keys;
+    for(int round=0;round<30;round++){
+      while(qf.metadata->noccupied_slots < 0.9*qf.metadata->nslots){
+        // few quotients, so the clusters span several blocks
+        uint64_t key=(rng()%(1ULL<<(num_hash_bits-2)))<<2;
+        uint64_t count= rng()%4==0 ? 1 : 1+(rng()>>(rng()%64));
+        count=std::min(count,(uint64_t)1<<40);
+        qf_insert(&qf,key,count);
+        if(gold[key]==0)
+          keys.push_back(key);
+        gold[key]+=count;
+        if(label_bits>0)
+          qf_add_label(&qf,key,key%31);
+      }
+      checkRunKernels(&qf);
+      while(qf.metadata->noccupied_slots > 0.5*qf.metadata->nslots){
+        uint64_t key=keys[rng()%keys.size()];
+        if(gold[key]==0)
+          continue;
+        uint64_t count= rng()%2==0 ? gold[key] : 1+rng()%gold[key];
+        qf_remove(&qf,key,count);
+        gold[key]-=count;
+      }
+      checkRunKernels(&qf);
+      for(auto it=gold.begin();it!=gold.end();it++){
+        REQUIRE(qf_count_key(&qf,it->first)==it->second);
+        if(label_bits>0 && it->second>0)
+          REQUIRE(qf_get_label(&qf,it->first)==it->first%31);
+      }
+    }
+    qf_destroy(&qf);
+  }
+}
+
+static std::vector<uint64_t> metadataWords(const QF *qf)
+{
+  std::vector<uint64_t> words;
+  for(uint64_t block=0;block<qf->metadata->nblocks;block++){
+    words.push_back(get_block(qf,block)->offset);
+    words.push_back(get_block(qf,block)->occupieds[0]);
+    words.push_back(get_block(qf,block)->runends[0]);
+  }
+  return words;
+}
+
+static uint64_t encodedLength(QF *qf, uint64_t key, uint64_t count)
+{
+  uint64_t values[67], fcounters[67];
+  return &values[67]-encode_counter(qf,key&BITMASK(qf->metadata->key_remainder_bits),
+    count,&values[67],&fcounters[67]);
+}
+
+/* Insert, remove, qf_setCounter and qf_add_to_counter rewrite a counter that
+ * keeps its number of slots in place, so the metadata does not change. */
+TEST_CASE( "Counter updates of the same length are done in place","[kernels]" ) {
+  std::mt19937_64 rng(69);
+  QF qf;
+  uint64_t qbits=10, num_hash_bits=qbits+8;
+  qf_init(&qf, (1ULL<<qbits), num_hash_bits, 4, 2,0, true, "", 2038074761);
+  std::map<uint64_t,uint64_t> gold;
+  std::vector<uint64_t> keys;
+  while(qf.metadata->noccupied_slots < 0.8*qf.metadata->nslots){
+    uint64_t key=rng()%(1ULL<<num_hash_bits);
+    uint64_t count=std::min(1+(rng()>>(rng()%64)),(uint64_t)1<<30);
+    qf_insert(&qf,key,count);
+    if(gold[key]==0)
+      keys.push_back(key);
+    gold[key]+=count;
+    qf_add_label(&qf,key,key%13);
+  }
+
+  std::vector<uint64_t> metadata=metadataWords(&qf);
+  uint64_t occupied=qf.metadata->noccupied_slots;
+  int inPlace=0;
+  for(int i=0;i<20000;i++){
+    uint64_t key=keys[rng()%keys.size()];
+    uint64_t current=gold[key];
+    int64_t delta=(int64_t)(rng()%7)-3;
+    if(delta==0 || (int64_t)current+delta<1 ||
+       encodedLength(&qf,key,current+delta)!=encodedLength(&qf,key,current))
+      continue;
+    uint64_t count=current+delta;
+    switch(rng()%4){
+      case 0:
+        if(delta>0) qf_insert(&qf,key,delta);
+        else qf_remove(&qf,key,-delta);
+        break;
+      case 1:
+        qf_setCounter(&qf,key,count);
+        break;
+      case 2:
+        qf_add_to_counter(&qf,key,delta,true,true);
+        break;
+      default:{
+        qfprobe p;
+        qf_probe(&qf,key,&p);
+        qf_set_probed(&qf,&p,count);
+      }
+    }
+    gold[key]=count;
+    inPlace++;
+    INFO("key "<<key<<" from "<<current<<" to "<<count);
+    REQUIRE(qf_count_key(&qf,key)==count);
+    REQUIRE(qf_get_label(&qf,key)==key%13);
+    REQUIRE(qf.metadata->noccupied_slots==occupied);
+    REQUIRE(metadataWords(&qf)==metadata);
+  }
+  CHECK(inPlace>5000);
+
+  // counters that change length, and counters set to 0 or to new keys
+  for(int i=0;i<5000;i++){
+    uint64_t key= rng()%4==0 ? rng()%(1ULL<<num_hash_bits) : keys[rng()%keys.size()];
+    if(rng()%2==0){
+      uint64_t count= rng()%4==0 ? 0 : 1+(rng()>>(rng()%64))%(1ULL<<30);
+      qf_setCounter(&qf,key,count,true,true);
+      gold[key]=count;
+    }
+    else{
+      int64_t delta=(int64_t)(rng()%2001)-1000;
+      qf_add_to_counter(&qf,key,delta);
+      gold[key]= delta<0 && (uint64_t)-delta>gold[key] ? 0 : gold[key]+delta;
+    }
+    if(qf.metadata->noccupied_slots > 0.9*qf.metadata->nslots)
+      break;
+  }
+  checkRunKernels(&qf);
+  for(auto it=gold.begin();it!=gold.end();it++)
+    REQUIRE(qf_count_key(&qf,it->first)==it->second);
+  qf_destroy(&qf);
+}
+
+/* Filter with bits_per_slot slots and no fixed counter bits left unused. */
+static void initWithSlotSize(QF *qf, uint64_t bits_per_slot)
+{
+  uint64_t qbits=8;
+  uint64_t remainder_bits=std::min(bits_per_slot-1,(uint64_t)56);
+  uint64_t label_bits=bits_per_slot-1-remainder_bits;
+  qf_init(qf, (1ULL<<qbits), qbits+remainder_bits, label_bits, 1,0, true, "", 2038074761);
+  REQUIRE(qf->metadata->bits_per_slot==bits_per_slot);
+}
+
+TEST_CASE( "get/set slots at every slot size against a reference","[kernels]" ) {
+  std::mt19937_64 rng(57);
+  for(uint64_t bits=2;bits<=64;bits++){
+    INFO("bits_per_slot "<<bits);
+    QF qf;
+    initWithSlotSize(&qf,bits);
+    uint64_t mask= bits==64 ? ~0ULL : (1ULL<<bits)-1;
+    uint64_t xnslots=qf.metadata->xnslots;
+    std::vector<uint64_t> model(xnslots,0);
+    for(int i=0;i<4000;i++){
+      uint64_t index=rng()%xnslots;
+      uint64_t value=rng()&mask;
+      _set_slot(&qf,index,value);
+      model[index]=value;
+    }
+    for(uint64_t i=0;i<xnslots;i++)
+      REQUIRE(_get_slot(&qf,i)==model[i]);
+    qf_destroy(&qf);
+  }
+}
+
+TEST_CASE( "shift_remainders and shift_runends against a reference","[kernels]" ) {
+  std::mt19937_64 rng(59);
+  uint64_t sizes[]={3,8,13,16,21,32,45,64};
+  for(uint64_t bits: sizes){
+    INFO("bits_per_slot "<<bits);
+    QF qf;
+    initWithSlotSize(&qf,bits);
+    uint64_t mask= bits==64 ? ~0ULL : (1ULL<<bits)-1;
+    uint64_t xnslots=qf.metadata->xnslots;
+    std::vector<uint64_t> model(xnslots);
+    for(uint64_t i=0;i<xnslots;i++){
+      model[i]=rng()&mask;
+      _set_slot(&qf,i,model[i]);
+    }
+    for(int i=0;i<500;i++){
+      uint64_t start=rng()%(xnslots-1);
+      uint64_t empty=start+1+rng()%std::min((uint64_t)300,xnslots-1-start);
+      INFO("start "<<start<<" empty "<<empty);
+      shift_remainders(&qf,start,empty);
+      for(uint64_t j=empty;j>start;j--)
+        model[j]=model[j-1];
+      // slot start is left for the caller to set
+      model[start]=_get_slot(&qf,start);
+      for(uint64_t j=0;j<xnslots;j++)
+        REQUIRE(_get_slot(&qf,j)==model[j]);
+    }
+    qf_destroy(&qf);
+  }
+
+  QF qf;
+  initWithSlotSize(&qf,10);
+  uint64_t xnslots=qf.metadata->xnslots;
+  std::vector<bool> runends(xnslots);
+  for(uint64_t i=0;i<xnslots;i++){
+    runends[i]=rng()%3==0;
+    if(runends[i])
+      METADATA_WORD(&qf, runends, i) |= 1ULL << (i%64);
+    else
+      METADATA_WORD(&qf, runends, i) &= ~(1ULL << (i%64));
+  }
+  for(int i=0;i<1000;i++){
+    uint64_t distance=1+rng()%63;
+    uint64_t first=rng()%(xnslots-distance-1);
+    uint64_t last=first+rng()%std::min((uint64_t)400,xnslots-distance-first);
+    INFO("first "<<first<<" last "<<last<<" distance "<<distance);
+    shift_runends(&qf,first,last,distance);
+    for(int64_t j=last;j>=(int64_t)first;j--)
+      runends[j+distance]=runends[j];
+    // the distance bits from first are left for the caller to set
+    for(uint64_t j=first;j<first+distance;j++)
+      runends[j]=is_runend(&qf,j)!=0;
+    for(uint64_t j=0;j<xnslots;j++)
+      REQUIRE((is_runend(&qf,j)!=0)==runends[j]);
+  }
+  qf_destroy(&qf);
+}
+
+/* Count of the counter written in slots from index, following the
+ * definition of the encoding instead of decode_counter's loop. */
+static uint64_t refDecode(const QF *qf, uint64_t index, uint64_t *length)
+{
+  uint64_t r=qf->metadata->key_remainder_bits;
+  uint64_t fixed_max=(1ULL<<qf->metadata->fixed_counter_size)-1;
+  uint64_t slot,fcounter;
+  super_get(qf,index,&slot,&fcounter);
+  *length=1;
+  if(fcounter<fixed_max)
+    return fcounter+1;
+  // digits of a base 2^r number, the most significant first, ended by the
+  // first slot whose fixed counter is not full
+  uint64_t digits=0,ndigits=0;
+  do{
+    super_get(qf,index+*length,&slot,&fcounter);
+    (*length)++;
+    digits=(digits<<r)+slot;
+    ndigits++;
+  }while(fcounter==fixed_max);
+  return fixed_max+1+digits+(fcounter<<(ndigits*r));
+}
+
+TEST_CASE( "encode_counter and decode_counter against a reference","[kernels]" ) {
+  std::mt19937_64 rng(61);
+  for(uint64_t fcs=1;fcs<=4;fcs++){
+    for(uint64_t r=2;r<=12;r+=5){
+      INFO("fixed counter size "<<fcs<<" remainder bits "<<r);
+      QF qf;
+      qf_init(&qf, (1ULL<<8), 8+r, 0, fcs,0, true, "", 2038074761);
+      uint64_t fixed_max=(1ULL<<fcs)-1;
+      std::vector<uint64_t> counts={1,fixed_max,fixed_max+1,fixed_max+2,
+        fixed_max+(1ULL<<r),fixed_max+(1ULL<<r)+1,~0ULL>>1};
+      for(int i=0;i<3000;i++)
+        counts.push_back(1+(rng()>>(rng()%64)));
+      for(uint64_t count: counts){
+        INFO("count "<<count);
+        uint64_t remainder=rng()&((1ULL<<r)-1);
+        uint64_t values[67],fcounters[67];
+        uint64_t *p=encode_counter(&qf,remainder,count,&values[67],&fcounters[67]);
+        uint64_t length=&values[67]-p;
+        REQUIRE(length>0);
+        REQUIRE(length<=66);
+        uint64_t index=10;
+        for(uint64_t j=0;j<length;j++)
+          super_set(&qf,index+j,p[j],fcounters[67-length+j]);
+        uint64_t refLength;
+        REQUIRE(refDecode(&qf,index,&refLength)==count);
+        REQUIRE(refLength==length);
+        uint64_t decodedRemainder,decodedCount;
+        uint64_t end=decode_counter(&qf,index,&decodedRemainder,&decodedCount);
+        REQUIRE(decodedRemainder==remainder);
+        REQUIRE(decodedCount==count);
+        REQUIRE(end==index+length-1);
+      }
+      qf_destroy(&qf);
+    }
+  }
+}
+
+/* First counter of the run from index with a remainder >= remainder,
+ * walking the counters with refDecode. */
+static uint64_t refFindRemainder(const QF *qf, uint64_t index, uint64_t runend,
+  uint64_t remainder)
+{
+  while(index<=runend){
+    uint64_t length=1;
+    if(qf->metadata->fixed_counter_size>0)
+      refDecode(qf,index,&length);
+    if(get_slot(qf,index)>=remainder)
+      return index;
+    index+=length;
+  }
+  return runend+1;
+}
+
+TEST_CASE( "Remainder search kernels against a reference","[kernels]" ) {
+  std::mt19937_64 rng(89);
+  std::vector<find_remainder_kernel> kernels={find_remainder_scalar};
+#ifdef QF_X86_SIMD
+  if(__builtin_cpu_supports("avx2"))
+    kernels.push_back(find_remainder_avx2);
+  if(__builtin_cpu_supports("avx512f"))
+    kernels.push_back(find_remainder_avx512);
+#endif
+  uint64_t remainderBits[]={3,8,13,30,50,55,61};
+  for(uint64_t r: remainderBits)
+  for(uint64_t fcs=0;fcs<=3;fcs++){
+    uint64_t label_bits= r+fcs<=60 ? rng()%4 : 0;
+    INFO("remainder bits "<<r<<" fixed counter size "<<fcs<<" label bits "<<label_bits);
+    QF qf;
+    uint64_t qbits=10;
+    qf_init(&qf, (1ULL<<qbits), qbits+r, label_bits, fcs,0, true, "", 2038074761);
+    // few quotients, so that the runs are long
+    while(qf.metadata->noccupied_slots < 0.9*qf.metadata->nslots){
+      uint64_t key=((rng()%(1ULL<<(qbits-3)))<<(r+3))|(rng()&BITMASK(r));
+      qf_insert(&qf,key,rng()%3==0 ? 1+(rng()>>(rng()%64))%(1ULL<<20) : 1);
+    }
+    bool simd=qf.metadata->bits_per_slot<=57;
+    for(uint64_t bucket=0;bucket<qf.metadata->nslots;bucket++){
+      if(!is_occupied(&qf,bucket))
+        continue;
+      uint64_t runstart= bucket==0 ? 0 : std::max(bucket,run_end(&qf,bucket-1)+1);
+      uint64_t runend=run_end(&qf,bucket);
+      // from every counter of the run, for its remainder and its neighbours
+      for(uint64_t index=runstart;index<=runend;){
+        uint64_t remainder=get_slot(&qf,index);
+        uint64_t targets[]={0,remainder,remainder+1,remainder-1,BITMASK(r),rng()&BITMASK(r)};
+        for(uint64_t target: targets){
+          target&=BITMASK(r);
+          uint64_t expected=refFindRemainder(&qf,index,runend,target);
+          INFO("run "<<runstart<<"-"<<runend<<" from "<<index<<" target "<<target);
+          REQUIRE(find_remainder(&qf,index,runend,target)==expected);
+          for(size_t k=0;k<kernels.size() && (k==0 || simd);k++)
+            REQUIRE(kernels[k](&qf,index,runend,target)==expected);
+        }
+        uint64_t length=1;
+        if(fcs>0)
+          refDecode(&qf,index,&length);
+        index+=length;
+      }
+    }
+    qf_destroy(&qf);
+  }
+}
+
+TEST_CASE( "Latency buckets at the top of the range","[kernels]" ) {
+  // 8 buckets per power of two up to 2^40ns, then the overflow bucket
+  REQUIRE(latency_bucket(15)==15);
+  REQUIRE(latency_bucket(16)==16);
+  REQUIRE(latency_bucket((1ULL<<39)-1)==QF_LATENCY_BUCKETS-10);
+  REQUIRE(latency_bucket(1ULL<<39)==QF_LATENCY_BUCKETS-9);
+  REQUIRE(latency_bucket((1ULL<<40)-1)==QF_LATENCY_BUCKETS-2);
+  REQUIRE(latency_bucket(1ULL<<40)==QF_LATENCY_BUCKETS-1);
+  REQUIRE(latency_bucket(~0ULL)==QF_LATENCY_BUCKETS-1);
+
+  // the quantile of a bucket is its upper bound, and the overflow bucket
+  // reports the maximum
+  qf_latency_histogram histogram;
+  memset(&histogram,0,sizeof(histogram));
+  uint64_t latencies[]={(1ULL<<39)-1,(1ULL<<40)-1,1ULL<<41};
+  for(uint64_t ns: latencies){
+    histogram.buckets[latency_bucket(ns)]++;
+    histogram.count++;
+    histogram.max_ns=std::max(histogram.max_ns,ns);
+  }
+  REQUIRE(qf_latency_quantile(&histogram,0.3)==(1ULL<<39)-1);
+  REQUIRE(qf_latency_quantile(&histogram,0.6)==(1ULL<<40)-1);
+  REQUIRE(qf_latency_quantile(&histogram,1)==1ULL<<41);
+}
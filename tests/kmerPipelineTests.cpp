@@ -0,0 +1,195 @@
+#include "gqf.h"
+#include "bufferedMQF.h"
+#include "kmerPipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include <iostream>
+#include <fstream>
+#include "catch.hpp"
+#include <map>
+#include <random>
+#include <stdexcept>
+using namespace std;
+using namespace MQF;
+
+static string randomSequence(std::mt19937_64 &rng, uint64_t length)
+{
+  string res;
+  for(uint64_t i=0;i<length;i++){
+    uint64_t r=rng()%100;
+    if(r==0)
+      res.push_back('N');
+    else if(r<5)
+      res.push_back("acgt"[rng()%4]);
+    else
+      res.push_back("ACGT"[rng()%4]);
+  }
+  return res;
+}
+
+/* Canonical k-mer hashes of the sequences, counted the slow way. */
+static void countReference(const vector<string> &sequences, uint64_t k,
+  uint64_t keyMask, map<uint64_t,uint64_t> &gold)
+{
+  for(const string &sequence: sequences){
+    for(size_t i=0;i+k<=sequence.size();i++){
+      string kmer=sequence.substr(i,k);
+      if(kmer.find_first_not_of("ACGTacgt")!=string::npos)
+        continue;
+      gold[kmerHash(canonicalKmer(encodeKmer(kmer),k),k)&keyMask]++;
+    }
+  }
+}
+
+/* FASTA records of random lengths, from shorter than k to over many chunks,
+ * with lines of 60 bases. */
+static void writeFasta(const char *path, std::mt19937_64 &rng, uint64_t nrecords,
+  vector<string> &sequences)
+{
+  ofstream out(path);
+  for(uint64_t i=0;i<nrecords;i++){
+    string sequence=randomSequence(rng, i==0 ? 5000 : rng()%300+1);
+    sequences.push_back(sequence);
+    out<<">read"<<i<<" some description\n";
+    for(size_t j=0;j<sequence.size();j+=60)
+      out<<sequence.substr(j,60)<<(i%3==0 ? "\r\n" : "\n");
+  }
+}
+
+static void writeFastq(const char *path, std::mt19937_64 &rng, uint64_t nrecords,
+  vector<string> &sequences)
+{
+  gzFile out=gzopen(path,"wb");
+  for(uint64_t i=0;i<nrecords;i++){
+    string sequence=randomSequence(rng,rng()%150+10);
+    sequences.push_back(sequence);
+    string record="@read"+to_string(i)+"\n"+sequence+"\n+\n"+string(sequence.size(),'@')+"\n";
+    gzwrite(out,record.data(),record.size());
+  }
+  gzclose(out);
+}
+
+static kmerPipelineOptions smallChunks(uint64_t k)
+{
+  kmerPipelineOptions options(k);
+  options.readers=2;
+  options.parsers=3;
+  options.inserters=2;
+  options.chunkSize=1000;
+  options.batchSize=200;
+  options.queueSize=4;
+  return options;
+}
+
+TEST_CASE( "k-mer encoding and invertible hashing","[kmers]" ) {
+  std::mt19937_64 rng(67);
+  REQUIRE(encodeKmer("ACGT")==0x1b);
+  REQUIRE(decodeKmer(0x1b,4)=="ACGT");
+  // the reverse complement of AAGT is ACTT
+  REQUIRE(canonicalKmer(encodeKmer("AAGT"),4)==encodeKmer("AAGT"));
+  REQUIRE(canonicalKmer(encodeKmer("ACTT"),4)==encodeKmer("AAGT"));
+  for(uint64_t k=1;k<=32;k++){
+    uint64_t mask= k==32 ? ~0ULL : (1ULL<<(2*k))-1;
+    for(int i=0;i<1000;i++){
+      uint64_t kmer=rng()&mask;
+      REQUIRE(encodeKmer(decodeKmer(kmer,k))==kmer);
+      uint64_t hash=kmerHash(kmer,k);
+      REQUIRE(hash<=mask);
+      REQUIRE(kmerHashInverse(hash,k)==kmer);
+    }
+  }
+}
+
+TEST_CASE( "Counting the k-mers of FASTA and gzipped FASTQ files","[kmers]" ) {
+  std::mt19937_64 rng(71);
+  uint64_t k=21;
+  vector<string> sequences;
+  writeFasta("tmp.kmers.fa",rng,200,sequences);
+  writeFastq("tmp.kmers.fq.gz",rng,300,sequences);
+  vector<string> files={"tmp.kmers.fa","tmp.kmers.fq.gz"};
+
+  QF qf;
+  qf_init(&qf, (1ULL<<16), 2*k, 0, 2,0, true, "", 2038074761);
+  kmerPipelineStats stats=countKmers(files,&qf,smallChunks(k));
+  map<uint64_t,uint64_t> gold;
+  countReference(sequences,k,(1ULL<<(2*k))-1,gold);
+
+  uint64_t total=0;
+  for(auto it=gold.begin();it!=gold.end();it++){
+    REQUIRE(qf_count_key(&qf,it->first)==it->second);
+    total+=it->second;
+    // the hashes keep every bit of the k-mers
+    uint64_t kmer=kmerHashInverse(it->first,k);
+    REQUIRE(canonicalKmer(kmer,k)==kmer);
+  }
+  QFi qfi;
+  uint64_t distinct=0;
+  qf_iterator(&qf,&qfi,0);
+  for(;!qfi_end(&qfi);qfi_next(&qfi))
+    distinct++;
+  CHECK(distinct==gold.size());
+  CHECK(stats.files==2);
+  CHECK(stats.records==500);
+  CHECK(stats.kmers==total);
+  CHECK(stats.inserts<=total);
+  CHECK(stats.chunks>2);
+  qf_destroy(&qf);
+  remove("tmp.kmers.fa");
+  remove("tmp.kmers.fq.gz");
+}
+
+TEST_CASE( "Counting k-mers in shards and in a buffered filter","[kmers]" ) {
+  std::mt19937_64 rng(73);
+  uint64_t k=15;
+  vector<string> sequences;
+  writeFasta("tmp.kmers.fa",rng,100,sequences);
+  vector<string> files={"tmp.kmers.fa"};
+  map<uint64_t,uint64_t> gold;
+  countReference(sequences,k,(1ULL<<(2*k))-1,gold);
+
+  vector<QF*> shards;
+  for(int i=0;i<4;i++){
+    shards.push_back(new QF());
+    qf_init(shards[i], (1ULL<<12), 2*k, 0, 1,0, true, "", 2038074761);
+  }
+  countKmers(files,shards,smallChunks(k));
+  for(auto it=gold.begin();it!=gold.end();it++)
+    for(uint64_t i=0;i<4;i++)
+      REQUIRE(qf_count_key(shards[i],it->first)==(i==(it->first&3) ? it->second : 0));
+  for(int i=0;i<4;i++){
+    qf_destroy(shards[i]);
+    delete shards[i];
+  }
+
+  {
+    bufferedMQF buffered;
+    bufferedMQF_init(&buffered,(1ULL<<10),(1ULL<<15),2*k,0,2,"tmp.kmers.ser",2);
+    countKmers(files,&buffered,smallChunks(k));
+    for(auto it=gold.begin();it!=gold.end();it++)
+      REQUIRE(bufferedMQF_count_key(&buffered,it->first)==it->second);
+  }
+  remove("tmp.kmers.fa");
+  remove("tmp.kmers.ser");
+}
+
+TEST_CASE( "Filling the filter stops the k-mer pipeline","[kmers]" ) {
+  std::mt19937_64 rng(79);
+  vector<string> sequences;
+  writeFasta("tmp.kmers.fa",rng,200,sequences);
+  vector<string> files={"tmp.kmers.fa"};
+  QF qf;
+  qf_init(&qf, (1ULL<<6), 6+20, 0, 1,0, true, "", 2038074761);
+  CHECK_THROWS_AS(countKmers(files,&qf,smallChunks(21)),std::overflow_error);
+  CHECK_THROWS_AS(countKmers(files,&qf,kmerPipelineOptions(33)),std::domain_error);
+  vector<string> missing={"tmp.kmers.fa","tmp.kmers.missing.fa"};
+  string message;
+  try{
+    countKmers(missing,&qf,smallChunks(21));
+  }catch(const std::runtime_error &e){
+    message=e.what();
+  }
+  CHECK(message.find("tmp.kmers.missing.fa")!=string::npos);
+  qf_destroy(&qf);
+  remove("tmp.kmers.fa");
+}
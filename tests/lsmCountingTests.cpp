@@ -0,0 +1,79 @@
+#include "gqf.h"
+#include "lsmMQF.h"
+#include <stdio.h>      /* printf, scanf, puts, NULL */
+#include <stdlib.h>
+#include<iostream>
+#include "catch.hpp"
+#include <map>
+#include <random>
+using namespace std;
+
+
+TEST_CASE( "Counting and iterating over the levels(lsm)","[lsm]" ) {
+  uint64_t qbits=10;
+  uint64_t num_hash_bits=24;
+  uint64_t fanout=4;
+  onDiskMQF_Namespace::pageCache* cache=NULL;
+  SECTION("stxxl runs"){
+  }
+  SECTION("pread/pwrite runs"){
+    cache=new onDiskMQF_Namespace::pageCache(4*1024*1024,1);
+  }
+  {
+    lsmMQF qf;
+    lsmMQF_init(&qf,(1ULL<<qbits),num_hash_bits,0,2,"tmp.lsm",fanout,4,cache);
+    std::mt19937_64 rng(5);
+    map<uint64_t,uint64_t> gold;
+    vector<uint64_t> keys;
+    for(int i=0;i<40000;i++){
+      uint64_t key=rng()%(1ULL<<num_hash_bits);
+      uint64_t count=(rng()%5)+1;
+      if(keys.size()>0 && rng()%4==0)
+        key=keys[rng()%keys.size()];
+      else
+        keys.push_back(key);
+      lsmMQF_insert(&qf,key,count);
+      gold[key]+=count;
+      if(qf.flushPending && i%16==0){
+        uint64_t probe=keys[rng()%keys.size()];
+        REQUIRE(lsmMQF_count_key(&qf,probe)==gold[probe]);
+      }
+    }
+    lsmMQF_syncBuffer(&qf);
+    CHECK(qf.memoryBuffer->metadata->noccupied_slots==0);
+    CHECK(qf.levels.size()>2);
+    CHECK(qf.levels[0].size()<fanout);
+    for(uint64_t i=1;i<qf.levels.size();i++)
+      CHECK(qf.levels[i].size()<=1);
+    for(auto it=gold.begin();it!=gold.end();it++)
+      REQUIRE(lsmMQF_count_key(&qf,it->first)==it->second);
+
+    lsmMQFStats stats=lsmMQF_getStats(&qf);
+    CHECK(stats.ncompactions>0);
+    // every slot is rewritten at most about fanout times per level
+    CHECK(lsmMQF_writeAmplification(&qf)<=1+fanout*(qf.levels.size()-1));
+
+    uint64_t negatives=stats.summaryNegatives;
+    for(int i=0;i<1000;i++){
+      uint64_t key=rng()%(1ULL<<num_hash_bits);
+      if(gold.find(key)==gold.end())
+        REQUIRE(lsmMQF_count_key(&qf,key)==0);
+    }
+    CHECK(lsmMQF_getStats(&qf).summaryNegatives>negatives);
+
+    lsmMQFIterator* it=lsmMQF_iterator(&qf);
+    auto goldIt=gold.begin();
+    while(!it->end()){
+      uint64_t key,value,count;
+      it->get(&key,&value,&count);
+      REQUIRE(goldIt!=gold.end());
+      REQUIRE(key==goldIt->first);
+      REQUIRE(count==goldIt->second);
+      goldIt++;
+      it->next();
+    }
+    CHECK(goldIt==gold.end());
+    delete it;
+  }
+  delete cache;
+}
@@ -3,6 +3,9 @@
 #include <stdio.h>      /* printf, scanf, puts, NULL */
 #include <stdlib.h>
 #include<iostream>
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "catch.hpp"
 #include <stxxl/io>
 #include <stxxl/vector>
@@ -706,4 +709,342 @@ TEST_CASE( "Writing and Reading to/from Disk (onDisk)","[onDisk]" ) {
 
 
 
-}
\ No newline at end of file
+}
+TEST_CASE( "Pinned blocks survive page eviction(onDisk)","[onDisk]" ) {
+    // the filter spans more stxxl pages than the pager keeps in memory
+    onDiskMQF* qf;
+    int counter_size=3;
+    uint64_t qbits=22;
+    uint64_t num_hash_bits=qbits+8;
+    onDiskMQF::init(qf, (1ULL<<qbits), num_hash_bits, 0,counter_size, "tmp.ser3");
+
+    uint64_t nvals = 100000;
+    std::map<uint64_t,uint64_t> inserted;
+    while(inserted.size()<nvals)
+    {
+        uint64_t newvalue=rand();
+        newvalue=(newvalue<<32)|rand();
+        newvalue=newvalue%(qf->metadata->range);
+        inserted[newvalue]=(newvalue%7==0) ? 1000 : 1+(newvalue%5);
+    }
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+        qf->insert(it->first,it->second,false,false);
+
+    for(uint64_t i=0;i<2000;i++)
+    {
+        auto it=inserted.lower_bound((((uint64_t)rand()<<32)|rand())%(qf->metadata->range));
+        if(it==inserted.end())
+            continue;
+        INFO("key = "<<it->first);
+        REQUIRE(qf->count_key(it->first)==it->second);
+    }
+
+    onDiskMQFIterator qfi;
+    REQUIRE(qf->getIterator(&qfi,0));
+    uint64_t key,value,count,nitems=0;
+    auto expected=inserted.begin();
+    do{
+        qfi.get(&key,&value,&count);
+        REQUIRE(key==expected->first);
+        REQUIRE(count==expected->second);
+        expected++;
+        nitems++;
+    }while(!qfi.next());
+    CHECK(nitems==nvals);
+    delete qf;
+}
+
+TEST_CASE( "Paged backend with a shared memory budget(onDisk)","[onDisk]" ) {
+    uint64_t budget=64*1024;
+    pageCache* cache=new pageCache(budget);
+    onDiskMQF* qf1;
+    onDiskMQF* qf2;
+    uint64_t qbits=16;
+    uint64_t num_hash_bits=qbits+8;
+    onDiskMQF::init(qf1, (1ULL<<qbits), num_hash_bits, 0,2, "tmp.paged1",cache);
+    onDiskMQF::init(qf2, (1ULL<<qbits), num_hash_bits, 0,2, "tmp.paged2",cache);
+
+    std::map<uint64_t,uint64_t> inserted;
+    uint64_t nvals=(1ULL<<qbits)/4;
+    while(inserted.size()<nvals)
+    {
+        uint64_t newvalue=rand();
+        newvalue=(newvalue<<32)|rand();
+        newvalue=newvalue%(qf1->metadata->range);
+        inserted[newvalue]=(rand()%100)+1;
+    }
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+    {
+        qf1->insert(it->first,it->second,false,false);
+        qf2->insert(it->first,1,false,false);
+    }
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+    {
+        REQUIRE(qf1->count_key(it->first)==it->second);
+        REQUIRE(qf2->count_key(it->first)==1);
+    }
+    pageCacheStats stats=cache->getStats();
+    CHECK(stats.bytesCached<=budget);
+    CHECK(stats.misses>0);
+    CHECK(stats.evictions>0);
+    CHECK(stats.bytesWritten>0);
+    CHECK(cache->hitRate()>0);
+
+    // same file format as the stxxl backend
+    qf1->serialize();
+    delete qf1;
+    onDiskMQF::load(qf1,"tmp.paged1");
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+        REQUIRE(qf1->count_key(it->first)==it->second);
+    qf1->serialize();
+    delete qf1;
+    onDiskMQF::load(qf1,"tmp.paged1",cache);
+    onDiskMQFIterator qfi;
+    REQUIRE(qf1->getIterator(&qfi,0));
+    uint64_t key,value,count;
+    auto expected=inserted.begin();
+    do{
+        qfi.get(&key,&value,&count);
+        REQUIRE(key==expected->first);
+        REQUIRE(count==expected->second);
+        expected++;
+    }while(!qfi.next());
+    CHECK(expected==inserted.end());
+
+    delete qf1;
+    delete qf2;
+    delete cache;
+}
+
+TEST_CASE( "Merging a memory QF into the disk filter(onDisk)","[onDisk]" ) {
+    uint64_t qbits=14;
+    uint64_t num_hash_bits=qbits+8;
+    pageCache* cache=NULL;
+    SECTION("stxxl backend"){
+    }
+    SECTION("paged backend"){
+        cache=new pageCache(64*1024);
+    }
+    // own generator, so the keys of the other tests don't depend on this one
+    std::mt19937_64 rng(7);
+    onDiskMQF* qf;
+    onDiskMQF::init(qf, (1ULL<<qbits), num_hash_bits, 0,2, "tmp.merge",cache);
+    QF buffer;
+    qf_init(&buffer, (1ULL<<(qbits-2)), num_hash_bits, 0,2,0,true,"",2038074761);
+
+    std::map<uint64_t,uint64_t> inserted;
+    uint64_t nvals=(1ULL<<qbits)/8;
+    while(inserted.size()<nvals)
+    {
+        uint64_t newvalue=rng()%(qf->metadata->range);
+        uint64_t count=(rng()%4==0)?(rng()%100000)+1:1;
+        inserted[newvalue]+=count;
+        qf->insert(newvalue,count,false,false);
+    }
+    // half of the buffer is new keys, the other half increments keys on disk
+    std::map<uint64_t,uint64_t>::iterator old=inserted.begin();
+    for(uint64_t i=0;i<(1ULL<<(qbits-2))/4;i++)
+    {
+        uint64_t key;
+        if(i%2==0){
+            key=old->first;
+            old++;
+            old++;
+        }
+        else{
+            key=rng()%(qf->metadata->range);
+        }
+        uint64_t count=(rng()%100)+1;
+        qf_insert(&buffer,key,count,false,false);
+        inserted[key]+=count;
+    }
+
+    qf->migrateFromQF(&buffer);
+    CHECK(qf->metadata->ndistinct_elts==inserted.size());
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+        REQUIRE(qf->count_key(it->first)==it->second);
+
+    // the merged blocks keep working with the regular insert path
+    for(uint64_t i=0;i<nvals/2;i++)
+    {
+        uint64_t newvalue=rng()%(qf->metadata->range);
+        inserted[newvalue]+=3;
+        qf->insert(newvalue,3,false,false);
+    }
+    onDiskMQFIterator qfi;
+    REQUIRE(qf->getIterator(&qfi,0));
+    uint64_t key,value,count;
+    auto expected=inserted.begin();
+    do{
+        qfi.get(&key,&value,&count);
+        REQUIRE(key==expected->first);
+        REQUIRE(count==expected->second);
+        expected++;
+    }while(!qfi.next());
+    CHECK(expected==inserted.end());
+
+    qf_destroy(&buffer);
+    delete qf;
+    if(cache!=NULL)
+        delete cache;
+}
+
+TEST_CASE( "A failed merge leaves the disk filter usable(onDisk)","[onDisk]" ) {
+    uint64_t qbits=12;
+    uint64_t num_hash_bits=qbits+8;
+    pageCache* cache=NULL;
+    SECTION("stxxl backend"){
+    }
+    SECTION("paged backend"){
+        cache=new pageCache(64*1024);
+    }
+    std::mt19937_64 rng(11);
+    onDiskMQF* qf;
+    onDiskMQF::init(qf, (1ULL<<qbits), num_hash_bits, 0,2, "tmp.failedmerge",cache);
+    QF buffer;
+    qf_init(&buffer, (1ULL<<(qbits-2)), num_hash_bits, 0,2,0,true,"",2038074761);
+    std::map<uint64_t,uint64_t> inserted;
+    for(uint64_t i=0;i<(1ULL<<qbits)/8;i++)
+    {
+        uint64_t newvalue=rng()%(qf->metadata->range);
+        inserted[newvalue]+=2;
+        qf->insert(newvalue,2,false,false);
+    }
+    for(uint64_t i=0;i<(1ULL<<(qbits-2))/4;i++)
+        qf_insert(&buffer,rng()%(qf->metadata->range),1,false,false);
+
+    // the merged file cannot be created where a directory is
+    REQUIRE(mkdir("tmp.failedmerge.merge",S_IRWXU)==0);
+    CHECK_THROWS_AS(qf->migrateFromQF(&buffer),std::runtime_error);
+    rmdir("tmp.failedmerge.merge");
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+        REQUIRE(qf->count_key(it->first)==it->second);
+
+    qf->migrateFromQF(&buffer);
+    QFi qfi;
+    qf_iterator(&buffer,&qfi,0);
+    do{
+        uint64_t key,value,count;
+        qfi_get(&qfi,&key,&value,&count);
+        inserted[key]+=count;
+    }while(!qfi_next(&qfi));
+    CHECK(qf->metadata->ndistinct_elts==inserted.size());
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+        REQUIRE(qf->count_key(it->first)==it->second);
+
+    qf_destroy(&buffer);
+    delete qf;
+    if(cache!=NULL)
+        delete cache;
+}
+
+TEST_CASE( "Merging disk filters of different sizes(onDisk)","[onDisk]" ) {
+    uint64_t qbits=14;
+    uint64_t num_hash_bits=qbits+8;
+    std::mt19937_64 rng(9);
+    onDiskMQF* qf;
+    onDiskMQF* sources[2];
+    onDiskMQF::init(qf, (1ULL<<qbits), num_hash_bits, 0,2, "tmp.diskmerge");
+    onDiskMQF::init(sources[0], (1ULL<<(qbits-2)), num_hash_bits, 0,2, "tmp.diskmerge.0");
+    onDiskMQF::init(sources[1], (1ULL<<(qbits-1)), num_hash_bits, 0,2, "tmp.diskmerge.1");
+    std::map<uint64_t,uint64_t> inserted;
+    std::vector<uint64_t> keys;
+    onDiskMQF* filters[3]={qf,sources[0],sources[1]};
+    for(int f=0;f<3;f++){
+        for(uint64_t i=0;i<(filters[f]->metadata->nslots)/4;i++){
+            uint64_t key=rng()%(qf->metadata->range);
+            // some keys are in several filters
+            if(keys.size()>0 && rng()%3==0)
+                key=keys[rng()%keys.size()];
+            else
+                keys.push_back(key);
+            uint64_t count=(rng()%4==0)?(rng()%1000)+1:1;
+            filters[f]->insert(key,count,false,false);
+            inserted[key]+=count;
+        }
+    }
+    qf->migrateFromDisk(sources,2);
+    CHECK(qf->metadata->ndistinct_elts==inserted.size());
+    for(auto it=inserted.begin();it!=inserted.end();it++)
+        REQUIRE(qf->count_key(it->first)==it->second);
+
+    auto expected=inserted.begin();
+    for(onDiskMQFScanner it(qf,100);!it.end();it.next()){
+        REQUIRE(expected!=inserted.end());
+        REQUIRE(it.get().key==expected->first);
+        REQUIRE(it.get().count==expected->second);
+        expected++;
+    }
+    CHECK(expected==inserted.end());
+    delete qf;
+    delete sources[0];
+    delete sources[1];
+}
+
+TEST_CASE( "Pipelined migrate of a larger filter(onDisk)","[onDisk]" ) {
+    uint64_t qbits=14;
+    uint64_t num_hash_bits=qbits+8;
+    uint64_t nthreads=1;
+    std::mt19937_64 rng(11);
+    pageCache* cache=NULL;
+    SECTION("stxxl, one encoding thread"){
+    }
+    SECTION("pread/pwrite, three encoding threads"){
+        cache=new pageCache(1024*1024);
+        nthreads=3;
+    }
+    onDiskMQF *source,*dest;
+    // the source is twice as large as the destination but holds fewer items
+    onDiskMQF::init(source, (1ULL<<(qbits+1)), num_hash_bits, 4,2, "tmp.pipeline.source",cache);
+    onDiskMQF::init(dest, (1ULL<<qbits), num_hash_bits, 4,2, "tmp.pipeline.dest",cache);
+    std::map<uint64_t,uint64_t> inserted,labels;
+    onDiskMQF* filters[2]={dest,source};
+    for(int f=0;f<2;f++){
+        for(uint64_t i=0;i<(1ULL<<qbits)/4;i++){
+            uint64_t key=rng()%(dest->metadata->range);
+            uint64_t count=(rng()%4==0)?(rng()%1000)+1:1;
+            filters[f]->insert(key,count,false,false);
+            filters[f]->add_label(key,rng()%16);
+            inserted[key]+=count;
+        }
+    }
+    // a label of the source replaces the label of the destination
+    for(auto it=inserted.begin();it!=inserted.end();it++){
+        labels[it->first]=source->get_label(it->first);
+        if(labels[it->first]==0)
+            labels[it->first]=dest->get_label(it->first);
+    }
+    uint64_t totalItems=source->metadata->ndistinct_elts+dest->metadata->ndistinct_elts;
+    uint64_t nitems=0;
+    for(int f=0;f<2;f++)
+        for(onDiskMQFScanner it(filters[f]);!it.end();it.next())
+            nitems++;
+    std::vector<onDiskMQFMigrateProgress> reports;
+    source->migrate(dest,nthreads,[&](const onDiskMQFMigrateProgress& p){
+        reports.push_back(p);
+    });
+    CHECK(dest->metadata->ndistinct_elts==inserted.size());
+    for(auto it=inserted.begin();it!=inserted.end();it++){
+        REQUIRE(dest->count_key(it->first)==it->second);
+        REQUIRE(dest->get_label(it->first)==labels[it->first]);
+    }
+    // the source is not modified
+    for(onDiskMQFScanner it(source);!it.end();it.next())
+        REQUIRE(it.get().count<=inserted[it.get().key]);
+
+    REQUIRE(reports.size()>2);
+    for(uint64_t i=1;i<reports.size();i++){
+        REQUIRE(reports[i].itemsRead>=reports[i-1].itemsRead);
+        REQUIRE(reports[i].itemsWritten>=reports[i-1].itemsWritten);
+        REQUIRE(reports[i].totalItems==totalItems);
+    }
+    CHECK(reports.back().itemsRead==nitems);
+    CHECK(reports.back().itemsWritten==inserted.size());
+    CHECK(reports.back().slotsWritten==dest->metadata->noccupied_slots);
+
+    CHECK_THROWS_AS(dest->migrateFromDisk(&dest,1),std::logic_error);
+    delete source;
+    delete dest;
+    if(cache!=NULL)
+        delete cache;
+}
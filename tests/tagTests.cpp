@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include<iostream>
 #include <unordered_map>
+#include <map>
+#include <random>
 #include "catch.hpp"
 using namespace std;
 
@@ -513,3 +515,84 @@ TEST_CASE( "Removing items from cqf with labels(90% load factor )") {
   qf_destroy(&qf);
 
 }
+
+TEST_CASE( "Separate label layout behaves like packed labels") {
+  std::mt19937_64 rng(91);
+  for(uint64_t label_size=8;label_size<=32;label_size*=2){
+    QF packed,separate;
+    uint64_t qbits=12;
+    uint64_t num_hash_bits=qbits+8;
+    uint64_t maximum_label=(1ULL<<label_size)-1;
+    INFO("Label size = "<<label_size);
+    qf_init(&packed, (1ULL<<qbits), num_hash_bits, label_size,2,4, true, "", 2038074761);
+    qf_init_separate_labels(&separate, (1ULL<<qbits), num_hash_bits, label_size,2,4, true, "", 2038074761);
+    REQUIRE(separate.metadata->bits_per_slot+label_size==packed.metadata->bits_per_slot);
+
+    uint64_t nvals = (1ULL<<qbits)*3/4;
+    uint64_t *vals = (uint64_t*)malloc(nvals*sizeof(vals[0]));
+    for(uint64_t i=0;i<nvals;i++)
+    {
+      vals[i]=rng()%(packed.metadata->range);
+    }
+    double loadFactor=0;
+    uint64_t insertedItems=0;
+    while(loadFactor<0.8 && insertedItems<nvals){
+      uint64_t count=1+(vals[insertedItems]%300);
+      qf_insert(&packed,vals[insertedItems],count,false,false);
+      qf_insert(&separate,vals[insertedItems],count,false,false);
+      qf_add_label(&packed,vals[insertedItems],vals[insertedItems]&maximum_label);
+      qf_add_label(&separate,vals[insertedItems],vals[insertedItems]&maximum_label);
+      insertedItems++;
+      loadFactor=(double)separate.metadata->noccupied_slots/(double)separate.metadata->nslots;
+    }
+    for(uint64_t i=0;i<insertedItems;i+=3){
+      qf_remove(&packed,vals[i],1,false,false);
+      qf_remove(&separate,vals[i],1,false,false);
+      if(i%2==0){
+        qf_remove_label(&packed,vals[i],false,false);
+        qf_remove_label(&separate,vals[i],false,false);
+      }
+    }
+    for(uint64_t i=0;i<insertedItems;i++)
+    {
+      REQUIRE(qf_count_key(&separate,vals[i])==qf_count_key(&packed,vals[i]));
+      REQUIRE(qf_get_label(&separate,vals[i])==qf_get_label(&packed,vals[i]));
+    }
+    REQUIRE(qf_equals(&packed,&separate));
+
+    char* ptr=qf_getBlockLabel_pointer_byBlock(&separate,1);
+    for(int i=0;i<4;i++)
+      ptr[i]=(char)((int)'a'+i);
+    CHECK(qf_get_label(&separate,vals[0])==qf_get_label(&packed,vals[0]));
+    CHECK(qf_count_key(&separate,vals[0])==qf_count_key(&packed,vals[0]));
+
+    free(vals);
+    qf_destroy(&packed);
+    qf_destroy(&separate);
+  }
+}
+
+TEST_CASE( "Separate labels up to 64 bits, up to the end of the filter") {
+  std::mt19937_64 rng(97);
+  uint64_t labelSizes[]={32,57,58,63,64};
+  for(uint64_t label_size: labelSizes){
+    INFO("Label size = "<<label_size);
+    QF qf;
+    uint64_t qbits=8;
+    uint64_t num_hash_bits=qbits+8;
+    qf_init_separate_labels(&qf, (1ULL<<qbits), num_hash_bits, label_size,2,0, true, "", 2038074761);
+    uint64_t maximum_label= label_size==64 ? ~0ULL : (1ULL<<label_size)-1;
+    map<uint64_t,uint64_t> labels;
+    // the last quotients, so that the labels of the last slots are used
+    while(qf.metadata->noccupied_slots < 0.7*qf.metadata->nslots){
+      uint64_t key=((qf.metadata->nslots-1-rng()%128)<<8)|(rng()%256);
+      qf_insert(&qf,key,1+rng()%3);
+      uint64_t label=rng()&maximum_label;
+      qf_add_label(&qf,key,label);
+      labels[key]=label;
+    }
+    for(auto it=labels.begin();it!=labels.end();it++)
+      REQUIRE(qf_get_label(&qf,it->first)==it->second);
+    qf_destroy(&qf);
+  }
+}